@@ -5,7 +5,11 @@
  * Uses virtio-tablet for absolute positioning (EV_ABS events).
  */
 
+#include "arch/arm64/gic.h"
 #include "printk.h"
+#include "sched/sched.h"
+#include "sched/softirq.h"
+#include "sync/spinlock.h"
 #include "types.h"
 
 /* ===================================================================== */
@@ -14,6 +18,7 @@
 
 #define VIRTIO_MMIO_BASE 0x0a000000
 #define VIRTIO_MMIO_STRIDE 0x200
+#define VIRTIO_MMIO_IRQ_BASE 48 /* GIC INTID of transport 0 (SPI 16) */
 
 #define VIRTIO_MMIO_MAGIC 0x000
 #define VIRTIO_MMIO_VERSION 0x004
@@ -134,6 +139,24 @@ static virtio_input_event_t kbd_event_bufs[QUEUE_SIZE]
 /* Keyboard callback */
 static void (*gui_key_callback)(int key) = 0;
 
+/*
+ * The devices are drained from a tasklet when they interrupt, so their
+ * 16-entry queues never fill while the desktop loop is busy. Mouse state
+ * is updated there; key presses wait in key_ring until input_poll()
+ * hands them to the GUI from the desktop loop. input_lock serializes
+ * draining, which input_poll() also does in case an interrupt is lost.
+ */
+#define KEY_RING_SIZE 128
+
+static struct {
+  uint16_t code;
+  uint32_t value;
+} key_ring[KEY_RING_SIZE];
+static unsigned int key_head, key_tail; /* Next to fill, next to hand out */
+
+static DEFINE_SPINLOCK(input_lock);
+static struct tasklet_struct input_tasklet;
+
 /* Modifier key states */
 static int shift_held = 0;
 static int ctrl_held = 0;
@@ -288,7 +311,8 @@ static volatile uint32_t *find_virtio_tablet(void) {
 /* Mouse Polling */
 /* ===================================================================== */
 
-void mouse_poll(void) {
+/* Apply the tablet's queued events (input_lock held) */
+static void mouse_drain(void) {
   if (!mouse_base || !used) {
     return;
   }
@@ -334,8 +358,12 @@ void mouse_poll(void) {
 
   /* Notify device */
   mmio_write32(mouse_base + VIRTIO_MMIO_QUEUE_NOTIFY / 4, 0);
-  mmio_write32(mouse_base + VIRTIO_MMIO_INTERRUPT_ACK / 4,
-               mmio_read32(mouse_base + VIRTIO_MMIO_INTERRUPT_STATUS / 4));
+}
+
+void mouse_poll(void) {
+  uint64_t flags = spin_lock_irqsave(&input_lock);
+  mouse_drain();
+  spin_unlock_irqrestore(&input_lock, flags);
 }
 
 /* ===================================================================== */
@@ -512,7 +540,8 @@ static volatile uint32_t *find_virtio_keyboard(void) {
   return 0;
 }
 
-static void keyboard_poll(void) {
+/* Move the keyboard's queued key events to key_ring (input_lock held) */
+static void keyboard_drain(void) {
   if (!kbd_base || !kbd_used) {
     return;
   }
@@ -526,79 +555,12 @@ static void keyboard_poll(void) {
 
     virtio_input_event_t *ev = &kbd_events[desc_idx];
 
-    /* Process keyboard event */
     if (ev->type == EV_KEY) {
-      /* Track shift key state */
-      if (ev->code == 42 || ev->code == 54) { /* Left or Right Shift */
-        shift_held = (ev->value != 0);        /* 1 = pressed, 0 = released */
-      }
-
-      /* Track Ctrl key state */
-      if (ev->code == 29 || ev->code == 97) { /* Left or Right Ctrl */
-        ctrl_held = (ev->value != 0);         /* 1 = pressed, 0 = released */
-      }
-
-      if (ev->value == 1) { /* Key press only */
-        int processed = 0;
-        int vibe_key = 0;
-
-        /* Manual mapping for Special Keys */
-        if (ev->code == 103)
-          vibe_key = 0x100; /* KEY_UP */
-        else if (ev->code == 108)
-          vibe_key = 0x101; /* KEY_DOWN */
-        else if (ev->code == 105)
-          vibe_key = 0x102; /* KEY_LEFT */
-        else if (ev->code == 106)
-          vibe_key = 0x103; /* KEY_RIGHT */
-        else if (ev->code == 29 || ev->code == 97)
-          processed = 1; /* Don't send ctrl as a key, just track state */
-        else if (ev->code == 42 || ev->code == 54)
-          processed = 1; /* Don't send shift as a key, just track state */
-        else if (ev->code == 28)
-          vibe_key = '\n'; /* Enter */
-        else if (ev->code == 57)
-          vibe_key = ' '; /* Space */
-        else if (ev->code == 1)
-          vibe_key = 27; /* Esc */
-
-        if (vibe_key) {
-          if (key_callback)
-            key_callback(vibe_key);
-          if (gui_key_callback)
-            gui_key_callback(vibe_key);
-          processed = 1;
-        }
-
-        if (!processed && ev->code < 128) {
-          char ascii;
-
-          /* Handle Ctrl+key combinations */
-          if (ctrl_held) {
-            /* Ctrl+letter generates control character (1-26) */
-            char base = keycode_to_ascii[ev->code];
-            if (base >= 'a' && base <= 'z') {
-              ascii = base - 'a' + 1; /* Ctrl+a=1, Ctrl+c=3, Ctrl+v=22, etc */
-            } else if (base >= 'A' && base <= 'Z') {
-              ascii = base - 'A' + 1;
-            } else {
-              ascii = 0; /* Don't process other Ctrl combinations */
-            }
-          } else if (shift_held) {
-            ascii = keycode_to_ascii_shifted[ev->code];
-          } else {
-            ascii = keycode_to_ascii[ev->code];
-          }
-
-          /* Send ASCII to both callbacks */
-          if (key_callback && ascii) {
-            key_callback(ascii);
-          }
-          /* Send ASCII to GUI callback too (not raw keycode!) */
-          if (gui_key_callback && ascii) {
-            gui_key_callback(ascii);
-          }
-        }
+      /* Dropped if nobody has read the last KEY_RING_SIZE */
+      if (key_head - key_tail < KEY_RING_SIZE) {
+        key_ring[key_head % KEY_RING_SIZE].code = ev->code;
+        key_ring[key_head % KEY_RING_SIZE].value = ev->value;
+        key_head++;
       }
     }
 
@@ -612,8 +574,140 @@ static void keyboard_poll(void) {
 
   /* Notify device */
   mmio_write32(kbd_base + VIRTIO_MMIO_QUEUE_NOTIFY / 4, 0);
-  mmio_write32(kbd_base + VIRTIO_MMIO_INTERRUPT_ACK / 4,
-               mmio_read32(kbd_base + VIRTIO_MMIO_INTERRUPT_STATUS / 4));
+}
+
+/* Translate one key event and pass it to the callbacks */
+static void keyboard_event(const virtio_input_event_t *ev) {
+  /* Track shift key state */
+  if (ev->code == 42 || ev->code == 54) { /* Left or Right Shift */
+    shift_held = (ev->value != 0);        /* 1 = pressed, 0 = released */
+  }
+
+  /* Track Ctrl key state */
+  if (ev->code == 29 || ev->code == 97) { /* Left or Right Ctrl */
+    ctrl_held = (ev->value != 0);         /* 1 = pressed, 0 = released */
+  }
+
+  if (ev->value == 1) { /* Key press only */
+    int processed = 0;
+    int vibe_key = 0;
+
+    /* Manual mapping for Special Keys */
+    if (ev->code == 103)
+      vibe_key = 0x100; /* KEY_UP */
+    else if (ev->code == 108)
+      vibe_key = 0x101; /* KEY_DOWN */
+    else if (ev->code == 105)
+      vibe_key = 0x102; /* KEY_LEFT */
+    else if (ev->code == 106)
+      vibe_key = 0x103; /* KEY_RIGHT */
+    else if (ev->code == 29 || ev->code == 97)
+      processed = 1; /* Don't send ctrl as a key, just track state */
+    else if (ev->code == 42 || ev->code == 54)
+      processed = 1; /* Don't send shift as a key, just track state */
+    else if (ev->code == 28)
+      vibe_key = '\n'; /* Enter */
+    else if (ev->code == 57)
+      vibe_key = ' '; /* Space */
+    else if (ev->code == 1)
+      vibe_key = 27; /* Esc */
+
+    if (vibe_key) {
+      if (key_callback)
+        key_callback(vibe_key);
+      if (gui_key_callback)
+        gui_key_callback(vibe_key);
+      processed = 1;
+    }
+
+    if (!processed && ev->code < 128) {
+      char ascii;
+
+      /* Handle Ctrl+key combinations */
+      if (ctrl_held) {
+        /* Ctrl+letter generates control character (1-26) */
+        char base = keycode_to_ascii[ev->code];
+        if (base >= 'a' && base <= 'z') {
+          ascii = base - 'a' + 1; /* Ctrl+a=1, Ctrl+c=3, Ctrl+v=22, etc */
+        } else if (base >= 'A' && base <= 'Z') {
+          ascii = base - 'A' + 1;
+        } else {
+          ascii = 0; /* Don't process other Ctrl combinations */
+        }
+      } else if (shift_held) {
+        ascii = keycode_to_ascii_shifted[ev->code];
+      } else {
+        ascii = keycode_to_ascii[ev->code];
+      }
+
+      /* Send ASCII to both callbacks */
+      if (key_callback && ascii) {
+        key_callback(ascii);
+      }
+      /* Send ASCII to GUI callback too (not raw keycode!) */
+      if (gui_key_callback && ascii) {
+        gui_key_callback(ascii);
+      }
+    }
+  }
+}
+
+/* Hand buffered key events to the callbacks, from the desktop loop */
+static void keyboard_poll(void) {
+  for (;;) {
+    virtio_input_event_t ev = {EV_KEY, 0, 0};
+
+    uint64_t flags = spin_lock_irqsave(&input_lock);
+    keyboard_drain();
+    bool have = key_tail != key_head;
+    if (have) {
+      ev.code = key_ring[key_tail % KEY_RING_SIZE].code;
+      ev.value = key_ring[key_tail % KEY_RING_SIZE].value;
+      key_tail++;
+    }
+    spin_unlock_irqrestore(&input_lock, flags);
+
+    if (!have) {
+      break;
+    }
+    keyboard_event(&ev);
+  }
+}
+
+/* ===================================================================== */
+/* Interrupts */
+/* ===================================================================== */
+
+static uint32_t virtio_mmio_irq(volatile uint32_t *base) {
+  uintptr_t slot = ((uintptr_t)base - VIRTIO_MMIO_BASE) / VIRTIO_MMIO_STRIDE;
+  return VIRTIO_MMIO_IRQ_BASE + (uint32_t)slot;
+}
+
+static void input_tasklet_fn(void *data) {
+  (void)data;
+  uint64_t flags = spin_lock_irqsave(&input_lock);
+  mouse_drain();
+  keyboard_drain();
+  spin_unlock_irqrestore(&input_lock, flags);
+
+  /* Get the desktop loop drawing, even if a process has the CPU */
+  process_kernel_wake();
+}
+
+/* Top half: quiet the device and leave its events to the tasklet */
+static void input_irq(uint32_t irq, void *data) {
+  (void)irq;
+  volatile uint32_t *base = data;
+  mmio_write32(base + VIRTIO_MMIO_INTERRUPT_ACK / 4,
+               mmio_read32(base + VIRTIO_MMIO_INTERRUPT_STATUS / 4));
+  tasklet_hi_schedule(&input_tasklet);
+}
+
+static void input_enable_irq(volatile uint32_t *base) {
+  uint32_t irq = virtio_mmio_irq(base);
+  if (gic_register_handler(irq, input_irq, (void *)base) == 0) {
+    gic_enable_irq(irq);
+  }
 }
 
 static int keyboard_init(void) {
@@ -712,8 +806,13 @@ static int keyboard_init(void) {
 
 int input_init(void) {
   printk(KERN_INFO "INPUT: Initializing input system\n");
-  mouse_init();
-  keyboard_init();
+  tasklet_init(&input_tasklet, input_tasklet_fn, NULL);
+  if (mouse_init() == 0) {
+    input_enable_irq(mouse_base);
+  }
+  if (keyboard_init() == 0) {
+    input_enable_irq(kbd_base);
+  }
   printk(KERN_INFO "INPUT: Ready\n");
   return 0;
 }
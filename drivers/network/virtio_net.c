@@ -4,8 +4,10 @@
 
 #include "types.h"
 #include "printk.h"
+#include "arch/arm64/gic.h"
 #include "mm/kmalloc.h"
 #include "net/net.h"
+#include "sched/workqueue.h"
 
 /* String helpers */
 void *memset(void *s, int c, size_t n);
@@ -17,6 +19,7 @@ void *memcpy(void *dest, const void *src, size_t n);
 
 #define VIRTIO_MMIO_BASE        0x0a000000
 #define VIRTIO_MMIO_STRIDE      0x200
+#define VIRTIO_MMIO_IRQ_BASE    48      /* GIC INTID of transport 0 (SPI 16) */
 
 #define VIRTIO_MMIO_MAGIC           0x000
 #define VIRTIO_MMIO_VERSION         0x004
@@ -213,6 +216,37 @@ void virtio_net_poll(void)
     mmio_write32(net_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, VQ_RX);
 }
 
+/* ===================================================================== */
+/* Interrupts */
+/* ===================================================================== */
+
+/*
+ * The stack allocates from the kernel heap, so received packets go up
+ * from a worker thread rather than the interrupt.
+ */
+static struct workqueue_struct *net_wq;
+static struct work_struct rx_work;
+
+static void virtio_net_rx_work(struct work_struct *work)
+{
+    (void)work;
+    virtio_net_poll();
+}
+
+/* Top half: acknowledge, and leave the RX ring to the worker */
+static void virtio_net_irq(uint32_t irq, void *data)
+{
+    (void)irq;
+    (void)data;
+    
+    uint32_t status = mmio_read32(net_base + VIRTIO_MMIO_INTERRUPT_STATUS/4);
+    mmio_write32(net_base + VIRTIO_MMIO_INTERRUPT_ACK/4, status);
+    
+    if (status & 1) {   /* Used buffer notification */
+        queue_work(net_wq, &rx_work);
+    }
+}
+
 /* ===================================================================== */
 /* Initialization */
 /* ===================================================================== */
@@ -332,5 +366,18 @@ int virtio_net_init(void) {
         net_iface->send = virtio_net_send;
     }
     
+    /* Receive on interrupt */
+    net_wq = alloc_workqueue("net_rx");
+    if (!net_wq) {
+        net_wq = system_wq;
+    }
+    INIT_WORK(&rx_work, virtio_net_rx_work);
+    
+    uint32_t irq = VIRTIO_MMIO_IRQ_BASE +
+                   (uint32_t)(((uintptr_t)net_base - VIRTIO_MMIO_BASE) / VIRTIO_MMIO_STRIDE);
+    if (gic_register_handler(irq, virtio_net_irq, NULL) == 0) {
+        gic_enable_irq(irq);
+    }
+    
     return 0;
 }
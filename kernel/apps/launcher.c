@@ -7,6 +7,7 @@
 #include "apps/kapi.h"
 #include "printk.h"
 #include "mm/kmalloc.h"
+#include "sched/hrtimer.h"
 
 /* Display structure from window.c - MUST match exactly! */
 struct display {
@@ -158,8 +159,8 @@ static unsigned long kapi_get_uptime_ticks(void) {
 }
 
 static void kapi_sleep_ms(uint32_t ms) {
-    /* Simple busy-wait sleep */
-    for (volatile uint32_t i = 0; i < ms * 10000; i++) { }
+    /* Blocks on a timer, so the CPU goes to others meanwhile */
+    hrtimer_nanosleep((uint64_t)ms * NSEC_PER_MSEC, NULL);
 }
 
 static void *kapi_malloc(size_t size) {
@@ -432,6 +433,12 @@ void kapi_init(kapi_t *api) {
     extern void input_poll(void);
     api->input_poll = input_poll;
 
+    extern int process_set_nice(int pid, int nice);
+    api->set_nice = process_set_nice;
+
+    extern int process_set_scheduler(int pid, int policy, int priority);
+    api->set_scheduler = process_set_scheduler;
+
     /* System info */
     api->get_uptime_ticks = kapi_get_uptime_ticks;
     api->get_mem_used = stub_mem_info;
@@ -444,6 +451,7 @@ void kapi_init(kapi_t *api) {
     /* Power/timing */
     api->wfi = stub_wfi;
     api->sleep_ms = kapi_sleep_ms;
+    api->get_time_ns = ktime_get_ns;
 
     /* Sound */
     /* Sound */
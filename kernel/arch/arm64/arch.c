@@ -5,61 +5,61 @@
 #include "arch/arch.h"
 #include "arch/arm64/gic.h"
 #include "arch/arm64/timer.h"
+#include "dtb.h"
+#include "mm/pmm.h"
 #include "printk.h"
+#include "sched/hrtimer.h"
+#include "sched/sched.h"
+#include "sync/spinlock.h"
 #include "types.h"
 
 /* Forward declarations for timer functions */
 extern uint64_t timer_get_count(void);
 extern uint64_t timer_get_frequency(void);
 
+/* Secondary CPU entry in boot.S; x0 points at its struct smp_boot_args */
+extern void secondary_entry(void);
+
 /* ===================================================================== */
 /* SMP (Symmetric Multi-Processing) Support */
 /* ===================================================================== */
 
-#define MAX_CPUS 8
-
 /* Per-CPU data */
 struct cpu_data {
     uint32_t cpu_id;
-    uint32_t online;
+    volatile uint32_t online;
     void *stack;
     void (*entry)(void);
 };
 
+/*
+ * Handed to secondary_entry in x0. The CPU reads it with the MMU and
+ * caches off, so it is cleaned to memory first; it copies the boot
+ * CPU's translation setup so both run on the same kernel page tables.
+ * Offsets are used by boot.S.
+ */
+struct smp_boot_args {
+    uint64_t stack_top;     /* 0x00 */
+    uint64_t mair;          /* 0x08 */
+    uint64_t tcr;           /* 0x10 */
+    uint64_t ttbr0;         /* 0x18 */
+    uint64_t ttbr1;         /* 0x20 */
+    uint64_t sctlr;         /* 0x28 */
+} __aligned(64);
+
+#define SMP_STACK_ORDER     2       /* 16KB boot/idle stack per CPU */
+#define SMP_BOOT_TIMEOUT_MS 1000
+
 static struct cpu_data cpu_info[MAX_CPUS];
+static struct smp_boot_args boot_args[MAX_CPUS];
 static volatile uint32_t num_cpus_online = 1;  /* Boot CPU is online */
 static volatile uint32_t smp_initialized = 0;
 
-/* Spinlock for SMP synchronization */
-typedef struct {
-    volatile uint32_t lock;
-} spinlock_t;
-
-#define SPINLOCK_INIT { 0 }
-
-static inline void spin_lock(spinlock_t *lock)
-{
-    uint32_t tmp;
-    asm volatile(
-        "sevl\n"
-        "1: wfe\n"
-        "2: ldaxr %w0, [%1]\n"
-        "   cbnz %w0, 1b\n"
-        "   stxr %w0, %w2, [%1]\n"
-        "   cbnz %w0, 2b\n"
-        : "=&r" (tmp)
-        : "r" (&lock->lock), "r" (1)
-        : "memory"
-    );
-}
-
-static inline void spin_unlock(spinlock_t *lock)
-{
-    asm volatile("stlr wzr, [%0]" :: "r" (&lock->lock) : "memory");
-}
+/* Without a device tree, how many CPUs CPU_ON found (0 until smp_init) */
+static uint32_t nr_cpus_probed;
 
 /* Global kernel lock for SMP safety */
-static spinlock_t kernel_lock = SPINLOCK_INIT;
+static DEFINE_SPINLOCK(kernel_lock);
 
 void smp_lock(void)
 {
@@ -85,6 +85,40 @@ uint32_t smp_num_cpus(void)
     return num_cpus_online;
 }
 
+/* Write back @size bytes at @addr so a CPU with caches off sees them */
+static void clean_dcache_range(const void *addr, size_t size)
+{
+    uint64_t ctr;
+    asm volatile("mrs %0, ctr_el0" : "=r" (ctr));
+    uint64_t line = 4UL << ((ctr >> 16) & 0xF);     /* DminLine, in words */
+
+    uint64_t p = (uint64_t)addr & ~(line - 1);
+    for (; p < (uint64_t)addr + size; p += line) {
+        asm volatile("dc cvac, %0" :: "r" (p) : "memory");
+    }
+    asm volatile("dsb sy" ::: "memory");
+}
+
+static void ipi_reschedule(uint32_t irq, void *data)
+{
+    /* The sender set need_resched; sched_irq_exit() acts on it */
+    (void)irq;
+    (void)data;
+
+    /* On the boot CPU it may also have woken a user process */
+    if (smp_processor_id() == 0) {
+        extern void process_schedule_from_irq(void);
+        process_schedule_from_irq();
+    }
+}
+
+void smp_send_reschedule(uint32_t cpu)
+{
+    if (cpu < MAX_CPUS && cpu != smp_processor_id() && cpu_info[cpu].online) {
+        gic_send_sgi(1U << cpu, GIC_SGI_RESCHEDULE);
+    }
+}
+
 /* Secondary CPU entry point (called from assembly) */
 void secondary_cpu_init(void)
 {
@@ -95,6 +129,13 @@ void secondary_cpu_init(void)
     /* Initialize GIC for this CPU */
     gic_cpu_init();
     
+    /* Per-CPU interrupts: the scheduler tick and reschedule IPIs */
+    timer_init_secondary();
+    gic_enable_irq(GIC_SGI_RESCHEDULE);
+    
+    /* This boot context becomes the CPU's idle task */
+    sched_init_secondary(cpu_id);
+    
     /* Mark CPU as online */
     cpu_info[cpu_id].online = 1;
     __atomic_add_fetch(&num_cpus_online, 1, __ATOMIC_SEQ_CST);
@@ -104,9 +145,15 @@ void secondary_cpu_init(void)
     
     printk(KERN_INFO "SMP: CPU %u online\n", cpu_id);
     
-    /* Enter idle loop - wait for work */
+    /*
+     * Idle loop, without the tick while nothing is runnable. A wakeup
+     * that lands between schedule() and wfi still gets through: either
+     * tick_nohz_idle() sees it queued, or its IPI ends the wfi and
+     * sched_irq_exit() switches to the new task.
+     */
     while (1) {
-        asm volatile("wfe");  /* Wait for event */
+        schedule();
+        tick_nohz_idle();
     }
 }
 
@@ -120,13 +167,24 @@ int smp_boot_secondary(uint32_t cpu_id, void (*entry)(void), void *stack)
     cpu_info[cpu_id].entry = entry;
     cpu_info[cpu_id].stack = stack;
     
+    /* Same translation regime as this CPU, on the kernel page tables */
+    struct smp_boot_args *args = &boot_args[cpu_id];
+    args->stack_top = (uint64_t)stack;
+    asm volatile("mrs %0, mair_el1" : "=r" (args->mair));
+    asm volatile("mrs %0, tcr_el1" : "=r" (args->tcr));
+    asm volatile("mrs %0, sctlr_el1" : "=r" (args->sctlr));
+    /* TTBR1 always holds the kernel tables; TTBR0 may be a user's now */
+    asm volatile("mrs %0, ttbr1_el1" : "=r" (args->ttbr1));
+    args->ttbr0 = args->ttbr1;
+    clean_dcache_range(args, sizeof(*args));
+    
     /* Use PSCI CPU_ON to start the secondary CPU */
     /* PSCI function IDs */
     #define PSCI_CPU_ON_64 0xC4000003
     
     uint64_t target_cpu = cpu_id;
     uint64_t entry_point = (uint64_t)entry;
-    uint64_t context_id = cpu_id;
+    uint64_t context_id = (uint64_t)args;
     int64_t ret;
     
     asm volatile(
@@ -163,14 +221,53 @@ void smp_init(void)
     cpu_info[0].cpu_id = 0;
     cpu_info[0].online = 1;
     
+    /* Reschedule IPIs; the SGI enable is per CPU */
+    gic_register_handler(GIC_SGI_RESCHEDULE, ipi_reschedule, NULL);
+    gic_enable_irq(GIC_SGI_RESCHEDULE);
+    
     smp_initialized = 1;
     
     printk(KERN_INFO "SMP: Boot CPU (CPU 0) initialized\n");
     
-    /* Note: Secondary CPUs are not auto-booted.
-     * Call smp_boot_secondary() to start them when ready.
-     * For QEMU virt with -smp N, CPUs wait for PSCI CPU_ON.
+    /*
+     * Start the rest one at a time; each waits at PSCI until CPU_ON.
+     * Without a device tree to count them, keep going until CPU_ON
+     * refuses a CPU number, which it does for ones that do not exist.
      */
+    bool probing = !dtb_present();
+    uint32_t nr_cpus = probing ? MAX_CPUS : arch_cpu_count();
+    for (uint32_t cpu = 1; cpu < nr_cpus; cpu++) {
+        phys_addr_t stack = pmm_alloc_pages(SMP_STACK_ORDER);
+        if (!stack) {
+            printk(KERN_ERR "SMP: No stack for CPU %u\n", cpu);
+            break;
+        }
+        
+        void *stack_top = (void *)(stack + (PAGE_SIZE << SMP_STACK_ORDER));
+        if (smp_boot_secondary(cpu, secondary_entry, stack_top) < 0) {
+            pmm_free_pages(stack, SMP_STACK_ORDER);
+            break;
+        }
+        
+        uint64_t start = arch_timer_get_ms();
+        while (!cpu_info[cpu].online &&
+               arch_timer_get_ms() - start < SMP_BOOT_TIMEOUT_MS) {
+            asm volatile("yield");
+        }
+        if (!cpu_info[cpu].online) {
+            printk(KERN_WARNING "SMP: CPU %u did not come online\n", cpu);
+            break;
+        }
+    }
+    
+    if (probing) {
+        nr_cpus_probed = num_cpus_online;
+        printk(KERN_INFO "SMP: %u CPU(s) online (found by PSCI CPU_ON)\n",
+               num_cpus_online);
+    } else {
+        printk(KERN_INFO "SMP: %u of %u CPU(s) online\n",
+               num_cpus_online, nr_cpus);
+    }
 }
 
 /* ===================================================================== */
@@ -241,6 +338,11 @@ uint64_t arch_timer_get_frequency(void)
     return timer_get_frequency();
 }
 
+void arch_timer_program(uint64_t deadline)
+{
+    timer_program(deadline);
+}
+
 uint64_t arch_timer_get_ms(void)
 {
     uint64_t ticks = timer_get_count();
@@ -397,8 +499,11 @@ uint32_t arch_cpu_id(void)
 
 uint32_t arch_cpu_count(void)
 {
-    /* TODO: Parse device tree for CPU count */
-    return 1;
+    int count = dtb_cpu_count();
+    if (count <= 0) {
+        return nr_cpus_probed ? nr_cpus_probed : 1;
+    }
+    return count < MAX_CPUS ? (uint32_t)count : MAX_CPUS;
 }
 
 void arch_cpu_info(char *buf, size_t size)
@@ -474,3 +579,30 @@ void arch_isb(void)
 {
     asm volatile("isb" ::: "memory");
 }
+
+/* DC ZVA block size in bytes, 0 if not yet read, -1 if prohibited */
+static long zva_block_size;
+
+void arch_clear_page(void *page)
+{
+    if (!zva_block_size) {
+        uint64_t dczid;
+        asm volatile("mrs %0, dczid_el0" : "=r"(dczid));
+        /* DZP set means DC ZVA is disabled; BS is log2 of the size in words */
+        zva_block_size = (dczid & (1 << 4)) ? -1 : 4L << (dczid & 0xf);
+    }
+
+    uint8_t *p = (uint8_t *)page;
+    uint8_t *end = p + PAGE_SIZE;
+
+    if (zva_block_size > 0) {
+        for (; p < end; p += zva_block_size) {
+            asm volatile("dc zva, %0" :: "r"(p) : "memory");
+        }
+        return;
+    }
+
+    for (; p < end; p += 16) {
+        asm volatile("stp xzr, xzr, [%0]" :: "r"(p) : "memory");
+    }
+}
@@ -0,0 +1,160 @@
+/*
+ * UnixOS Kernel - Lazy FP/SIMD Context
+ *
+ * Per CPU, fpsimd_current is the state of whoever runs there, and
+ * fpsimd_loaded the one whose values are in the registers. While FPEN is
+ * on the registers belong to fpsimd_current; once it is off they may
+ * still match fpsimd_loaded, which the trap then just turns back on.
+ */
+
+#include "arch/fpsimd.h"
+
+#define CPACR_FPEN_MASK (3UL << 20)
+#define CPACR_FPEN_ON   (3UL << 20)   /* No traps at EL0 or EL1 */
+
+/* In fpsimd.S */
+void fpsimd_save_state(struct fpsimd_state *st);
+void fpsimd_load_state(const struct fpsimd_state *st);
+void fpsimd_clear_regs(void);
+
+static struct fpsimd_state *fpsimd_current[MAX_CPUS];
+static struct fpsimd_state *fpsimd_loaded[MAX_CPUS];
+
+/* Until the CPU's idle task takes over, its boot code runs on this */
+static struct fpsimd_state fpsimd_boot[MAX_CPUS];
+
+/* Inside kernel_neon_begin(), and the interrupt state to go back to */
+static bool neon_busy[MAX_CPUS];
+static unsigned long neon_flags[MAX_CPUS];
+
+/* ===================================================================== */
+/* Helpers */
+/* ===================================================================== */
+
+static inline bool fpsimd_enabled(void)
+{
+    uint64_t cpacr;
+    asm volatile("mrs %0, cpacr_el1" : "=r"(cpacr));
+    return (cpacr & CPACR_FPEN_MASK) == CPACR_FPEN_ON;
+}
+
+static inline void fpsimd_enable(void)
+{
+    uint64_t cpacr;
+    asm volatile("mrs %0, cpacr_el1" : "=r"(cpacr));
+    asm volatile("msr cpacr_el1, %0; isb" :: "r"(cpacr | CPACR_FPEN_ON));
+}
+
+static inline void fpsimd_disable(void)
+{
+    uint64_t cpacr;
+    asm volatile("mrs %0, cpacr_el1" : "=r"(cpacr));
+    asm volatile("msr cpacr_el1, %0; isb" :: "r"(cpacr & ~CPACR_FPEN_MASK));
+}
+
+static struct fpsimd_state *fpsimd_owner(unsigned int cpu)
+{
+    return fpsimd_current[cpu] ? fpsimd_current[cpu] : &fpsimd_boot[cpu];
+}
+
+/* ===================================================================== */
+/* Switching */
+/* ===================================================================== */
+
+void fpsimd_init_cpu(struct fpsimd_state *st)
+{
+    unsigned long flags = arch_irq_save();
+    unsigned int cpu = arch_cpu_id();
+    struct fpsimd_state *boot = fpsimd_owner(cpu);
+
+    if (fpsimd_enabled()) {
+        /* The registers are live; they are simply st's from now on */
+        st->used = true;
+        st->cpu = cpu;
+        fpsimd_loaded[cpu] = st;
+    } else if (boot->used) {
+        /* Saved by kernel_neon_begin(); the trap reloads it */
+        for (int i = 0; i < 64; i++) {
+            st->vregs[i] = boot->vregs[i];
+        }
+        st->fpsr = boot->fpsr;
+        st->fpcr = boot->fpcr;
+        st->used = true;
+        fpsimd_loaded[cpu] = NULL;
+    }
+    fpsimd_current[cpu] = st;
+
+    arch_irq_restore(flags);
+}
+
+void fpsimd_switch(struct fpsimd_state *next)
+{
+    unsigned int cpu = arch_cpu_id();
+    struct fpsimd_state *prev = fpsimd_owner(cpu);
+
+    if (!next) {
+        next = &fpsimd_boot[cpu];
+    }
+    if (next == prev) {
+        return;
+    }
+
+    /* Only what used FP during this run has anything to save */
+    if (fpsimd_enabled()) {
+        fpsimd_save_state(prev);
+        fpsimd_disable();
+    }
+    fpsimd_current[cpu] = next;
+}
+
+void fpsimd_trap(void)
+{
+    unsigned int cpu = arch_cpu_id();
+    struct fpsimd_state *st = fpsimd_owner(cpu);
+
+    fpsimd_enable();
+
+    if (!st->used) {
+        /* First use: nothing to load, but no one else's values either */
+        fpsimd_clear_regs();
+        st->used = true;
+    } else if (fpsimd_loaded[cpu] != st || st->cpu != cpu) {
+        fpsimd_load_state(st);
+    }
+    st->cpu = cpu;
+    fpsimd_loaded[cpu] = st;
+}
+
+/* ===================================================================== */
+/* Kernel use */
+/* ===================================================================== */
+
+bool may_use_simd(void)
+{
+    /* Busy means interrupts are off, so only an exception finds it set */
+    return !neon_busy[arch_cpu_id()];
+}
+
+void kernel_neon_begin(void)
+{
+    unsigned long flags = arch_irq_save();
+    unsigned int cpu = arch_cpu_id();
+
+    if (fpsimd_enabled()) {
+        fpsimd_save_state(fpsimd_owner(cpu));
+    } else {
+        fpsimd_enable();
+    }
+    fpsimd_loaded[cpu] = NULL;
+    neon_busy[cpu] = true;
+    neon_flags[cpu] = flags;
+}
+
+void kernel_neon_end(void)
+{
+    unsigned int cpu = arch_cpu_id();
+
+    fpsimd_disable();
+    neon_busy[cpu] = false;
+    arch_irq_restore(neon_flags[cpu]);
+}
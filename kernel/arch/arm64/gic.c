@@ -3,7 +3,9 @@
  */
 
 #include "arch/arm64/gic.h"
+#include "arch/arch.h"
 #include "printk.h"
+#include "sched/softirq.h"
 
 /* ===================================================================== */
 /* GIC base addresses */
@@ -41,14 +43,20 @@ static inline uint32_t gicd_read(uint32_t offset)
     return *(volatile uint32_t *)(GICD_BASE + offset);
 }
 
+/* This CPU's redistributor; QEMU virt lays them out in CPU order */
+static inline uint64_t gicr_base(void)
+{
+    return GICR_BASE + (uint64_t)arch_cpu_id() * GICR_STRIDE;
+}
+
 static inline void gicr_write(uint32_t offset, uint32_t val)
 {
-    *(volatile uint32_t *)(GICR_BASE + offset) = val;
+    *(volatile uint32_t *)(gicr_base() + offset) = val;
 }
 
 static inline uint32_t gicr_read(uint32_t offset)
 {
-    return *(volatile uint32_t *)(GICR_BASE + offset);
+    return *(volatile uint32_t *)(gicr_base() + offset);
 }
 
 /* ===================================================================== */
@@ -139,7 +147,7 @@ static void gic_init_redistributor(void)
     }
     
     /* Configure PPIs and SGIs in SGI_base */
-    uint64_t sgi_base = GICR_BASE + GICR_SGI_BASE;
+    uint64_t sgi_base = gicr_base() + GICR_SGI_BASE;
     
     /* All PPIs/SGIs to Group 1 */
     *(volatile uint32_t *)(sgi_base + GICR_IGROUPR0) = 0xFFFFFFFF;
@@ -214,7 +222,7 @@ void gic_enable_irq(uint32_t irq)
     
     if (irq < GIC_SPI_START) {
         /* SGI/PPI - use redistributor */
-        uint64_t sgi_base = GICR_BASE + GICR_SGI_BASE;
+        uint64_t sgi_base = gicr_base() + GICR_SGI_BASE;
         *(volatile uint32_t *)(sgi_base + GICR_ISENABLER0) = (1 << irq);
     } else {
         /* SPI - use distributor */
@@ -231,7 +239,7 @@ void gic_disable_irq(uint32_t irq)
     }
     
     if (irq < GIC_SPI_START) {
-        uint64_t sgi_base = GICR_BASE + GICR_SGI_BASE;
+        uint64_t sgi_base = gicr_base() + GICR_SGI_BASE;
         *(volatile uint32_t *)(sgi_base + GICR_ICENABLER0) = (1 << irq);
     } else {
         uint32_t reg = irq / 32;
@@ -251,7 +259,7 @@ void gic_set_priority(uint32_t irq, uint8_t priority)
     uint32_t mask = 0xFF << shift;
     
     if (irq < GIC_SPI_START) {
-        uint64_t sgi_base = GICR_BASE + GICR_SGI_BASE;
+        uint64_t sgi_base = gicr_base() + GICR_SGI_BASE;
         uint32_t val = *(volatile uint32_t *)(sgi_base + GICR_IPRIORITYR + reg * 4);
         val = (val & ~mask) | (priority << shift);
         *(volatile uint32_t *)(sgi_base + GICR_IPRIORITYR + reg * 4) = val;
@@ -313,6 +321,7 @@ void handle_irq(void *regs)
     }
     
     /* Call registered handler */
+    irq_enter();
     if (irq < GIC_MAX_IRQS && irq_table[irq].handler) {
         irq_table[irq].handler(irq, irq_table[irq].data);
     } else {
@@ -321,4 +330,7 @@ void handle_irq(void *regs)
     
     /* End of interrupt */
     gic_end_interrupt(irq);
+    
+    /* Bottom halves, with the line free to fire again */
+    irq_exit();
 }
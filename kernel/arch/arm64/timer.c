@@ -1,12 +1,14 @@
 /*
  * UnixOS Kernel - Timer Implementation
  * 
- * ARM Generic Timer using virtual timer for OS timing.
+ * ARM Generic Timer using virtual timer for OS timing. The timer is run
+ * one-shot by the hrtimer layer, which includes the scheduler tick.
  */
 
 #include "arch/arm64/timer.h"
+#include "arch/arch.h"
 #include "arch/arm64/gic.h"
-#include "sched/sched.h"
+#include "sched/hrtimer.h"
 #include "printk.h"
 
 /* ===================================================================== */
@@ -17,12 +19,6 @@ static uint64_t timer_frequency;
 static uint64_t ticks_per_ms;
 static uint64_t ticks_per_us;
 
-/* Scheduler tick rate (100Hz = 10ms period) */
-#define HZ                  100
-#define TICK_PERIOD_MS      (1000 / HZ)
-
-static uint64_t jiffies = 0;  /* Tick counter */
-
 /* ===================================================================== */
 /* System register helpers */
 /* ===================================================================== */
@@ -74,15 +70,8 @@ static void timer_irq_handler(uint32_t irq, void *data)
     (void)irq;
     (void)data;
     
-    /* Increment jiffies */
-    jiffies++;
-    
-    /* Set up next timer interrupt */
-    write_cntv_tval(timer_frequency / HZ);
-    
-    /* Invoke scheduler for preemptive multitasking */
-    extern void process_schedule_from_irq(void);
-    process_schedule_from_irq();
+    /* Runs due timers (the tick among them) and sets the next deadline */
+    hrtimer_interrupt();
 }
 
 /* ===================================================================== */
@@ -122,18 +111,25 @@ void timer_init(void)
     
     printk("TIMER: Priority set (IRQ not enabled yet)\n");
     
-    /* Set up first timer tick value but don't enable timer */
+    /* Enable timer and IRQ now; the first deadline is the first tick */
     write_cntv_tval(timer_frequency / HZ);
-    
-    printk("TIMER: TVAL set\n");
-    
-    /* Enable timer and IRQ now */
     write_cntv_ctl(TIMER_CTL_ENABLE);
     gic_enable_irq(TIMER_IRQ_VIRT);
+    hrtimer_init_cpu();
     
     printk(KERN_INFO "TIMER: Initialized and IRQ enabled\n");
 }
 
+void timer_init_secondary(void)
+{
+    /* The handler is shared; the PPI and timer are banked per CPU */
+    gic_set_priority(TIMER_IRQ_VIRT, 0x80);
+    write_cntv_tval(timer_frequency / HZ);
+    write_cntv_ctl(TIMER_CTL_ENABLE);
+    gic_enable_irq(TIMER_IRQ_VIRT);
+    hrtimer_init_cpu();
+}
+
 uint64_t timer_get_frequency(void)
 {
     return timer_frequency;
@@ -149,6 +145,19 @@ void timer_set_next(uint64_t ticks)
     write_cntv_tval(ticks);
 }
 
+void timer_program(uint64_t deadline)
+{
+    int64_t delta = (int64_t)(deadline - read_cntvct());
+    
+    /* TVAL is a signed 32-bit count; later deadlines fire early and rearm */
+    if (delta < 1) {
+        delta = 1;
+    } else if (delta > INT32_MAX) {
+        delta = INT32_MAX;
+    }
+    write_cntv_tval((uint64_t)delta);
+}
+
 uint64_t timer_get_ms(void)
 {
     return read_cntvct() / ticks_per_ms;
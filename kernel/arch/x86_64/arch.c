@@ -3,7 +3,9 @@
  */
 
 #include "arch/arch.h"
+#include "mm/pmm.h"
 #include "printk.h"
+#include "sched/hrtimer.h"
 #include "types.h"
 
 /* ===================================================================== */
@@ -63,6 +65,7 @@ void arch_irq_init(void)
 
 static uint64_t timer_ticks = 0;
 static uint64_t timer_frequency = 1000; /* 1kHz default */
+static uint64_t timer_deadline = ~0ULL >> 1;
 
 void arch_timer_init(void)
 {
@@ -86,9 +89,19 @@ uint64_t arch_timer_get_ms(void)
     return (timer_ticks * 1000) / timer_frequency;
 }
 
+void arch_timer_program(uint64_t deadline)
+{
+    timer_deadline = deadline;
+}
+
 void arch_timer_tick(void)
 {
     timer_ticks++;
+
+    /* The PIT is periodic, so hrtimers expire on the next 1ms tick */
+    if ((int64_t)(timer_ticks - timer_deadline) >= 0) {
+        hrtimer_interrupt();
+    }
 }
 
 /* ===================================================================== */
@@ -236,6 +249,12 @@ void smp_init(void)
     printk(KERN_INFO "SMP: Boot CPU (CPU 0) initialized\n");
 }
 
+void smp_send_reschedule(uint32_t cpu)
+{
+    /* Single CPU: nothing else to interrupt */
+    (void)cpu;
+}
+
 /* ===================================================================== */
 /* Userspace Entry */
 /* ===================================================================== */
@@ -363,6 +382,15 @@ void arch_isb(void)
     asm volatile("cpuid" ::: "eax", "ebx", "ecx", "edx", "memory");
 }
 
+void arch_clear_page(void *page)
+{
+    uint64_t count = PAGE_SIZE / 8;
+    asm volatile("rep stosq"
+                 : "+D"(page), "+c"(count)
+                 : "a"(0UL)
+                 : "memory");
+}
+
 /* ===================================================================== */
 /* Exception/Interrupt Handlers */
 /* ===================================================================== */
@@ -0,0 +1,309 @@
+/*
+ * UnixOS Kernel - Flattened Device Tree Parser
+ *
+ * Walks the structure block of the boot DTB once at startup and records
+ * the memory layout for the PMM and the CPU count for SMP bring-up. Runs
+ * first thing in init_subsystems(), with the MMU already on but before
+ * the PMM exists, so results go into static arrays. Fields are big-endian
+ * and property values only 4-byte aligned, so they are read a byte at a
+ * time.
+ */
+
+#include "dtb.h"
+#include "printk.h"
+#include "string.h"
+
+/* ===================================================================== */
+/* Static data */
+/* ===================================================================== */
+
+static const uint8_t *fdt_base;
+static size_t fdt_size;
+
+static struct dtb_region memory_banks[DTB_MAX_MEMORY];
+static int nr_memory_banks;
+
+static struct dtb_region reserved[DTB_MAX_RESERVED];
+static int nr_reserved;
+
+static int nr_cpus;
+
+/* ===================================================================== */
+/* Helper functions */
+/* ===================================================================== */
+
+static inline uint32_t be32(const void *p)
+{
+    const uint8_t *b = p;
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+           ((uint32_t)b[2] << 8) | b[3];
+}
+
+static inline uint64_t be64(const void *p)
+{
+    return ((uint64_t)be32(p) << 32) | be32((const uint8_t *)p + 4);
+}
+
+/* Read an address/size value made of @cells 32-bit cells */
+static uint64_t read_cells(const uint8_t *p, uint32_t cells)
+{
+    uint64_t val = 0;
+    for (uint32_t i = 0; i < cells; i++) {
+        val = (val << 32) | be32(p + i * 4);
+    }
+    return val;
+}
+
+/* Match "name" or "name@unit-address" */
+static bool node_is(const char *node, const char *name)
+{
+    size_t len = strlen(name);
+    return strncmp(node, name, len) == 0 &&
+           (node[len] == '\0' || node[len] == '@');
+}
+
+static void add_region(struct dtb_region *array, int *count, int max,
+                       uint64_t base, uint64_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    if (*count >= max) {
+        printk(KERN_WARNING "DTB: Too many regions, ignoring 0x%llx\n",
+               (unsigned long long)base);
+        return;
+    }
+    array[*count].base = base;
+    array[*count].size = size;
+    (*count)++;
+}
+
+/* Decode a "reg" property into (base, size) pairs */
+static void parse_reg(const uint8_t *val, uint32_t len,
+                      uint32_t addr_cells, uint32_t size_cells,
+                      struct dtb_region *array, int *count, int max)
+{
+    uint32_t entry = (addr_cells + size_cells) * 4;
+    if (entry == 0) {
+        return;
+    }
+
+    for (uint32_t off = 0; off + entry <= len; off += entry) {
+        uint64_t base = read_cells(val + off, addr_cells);
+        uint64_t size = read_cells(val + off + addr_cells * 4, size_cells);
+        add_region(array, count, max, base, size);
+    }
+}
+
+/* ===================================================================== */
+/* Structure block walk */
+/* ===================================================================== */
+
+static void parse_mem_rsvmap(uint32_t off)
+{
+    const uint8_t *p = fdt_base + off;
+
+    while ((size_t)(p - fdt_base) + 16 <= fdt_size) {
+        uint64_t base = be64(p);
+        uint64_t size = be64(p + 8);
+        if (base == 0 && size == 0) {
+            break;
+        }
+        add_region(reserved, &nr_reserved, DTB_MAX_RESERVED, base, size);
+        p += 16;
+    }
+}
+
+static void parse_structure(uint32_t off_struct, uint32_t size_struct,
+                            uint32_t off_strings)
+{
+    const uint8_t *p = fdt_base + off_struct;
+    const uint8_t *end = p + size_struct;
+    const char *strings = (const char *)fdt_base + off_strings;
+
+    /* Cell sizes in effect for children of the root and /reserved-memory */
+    uint32_t root_addr_cells = 2, root_size_cells = 1;
+    uint32_t rsv_addr_cells = 2, rsv_size_cells = 1;
+
+    int depth = 0;
+    bool in_memory = false;         /* Inside a depth-1 /memory node */
+    bool in_reserved = false;       /* Inside /reserved-memory */
+    bool in_cpus = false;           /* Inside /cpus */
+
+    while (p + 4 <= end) {
+        uint32_t token = be32(p);
+        p += 4;
+
+        switch (token) {
+        case FDT_BEGIN_NODE: {
+            const char *name = (const char *)p;
+            size_t len = strlen(name);
+            p += ALIGN(len + 1, 4);
+            depth++;
+
+            if (depth == 2) {
+                in_memory = node_is(name, "memory");
+                in_reserved = node_is(name, "reserved-memory");
+                in_cpus = node_is(name, "cpus");
+                if (in_reserved) {
+                    rsv_addr_cells = root_addr_cells;
+                    rsv_size_cells = root_size_cells;
+                }
+            } else if (depth == 3 && in_cpus && node_is(name, "cpu")) {
+                nr_cpus++;
+            }
+            break;
+        }
+
+        case FDT_END_NODE:
+            if (depth == 2) {
+                in_memory = false;
+                in_reserved = false;
+                in_cpus = false;
+            }
+            depth--;
+            break;
+
+        case FDT_PROP: {
+            uint32_t len = be32(p);
+            const char *pname = strings + be32(p + 4);
+            const uint8_t *val = p + 8;
+            p += 8 + ALIGN(len, 4);
+
+            if (depth == 1) {
+                /* Root node */
+                if (strcmp(pname, "#address-cells") == 0 && len == 4) {
+                    root_addr_cells = be32(val);
+                } else if (strcmp(pname, "#size-cells") == 0 && len == 4) {
+                    root_size_cells = be32(val);
+                }
+            } else if (depth == 2 && in_memory) {
+                if (strcmp(pname, "reg") == 0) {
+                    parse_reg(val, len, root_addr_cells, root_size_cells,
+                              memory_banks, &nr_memory_banks,
+                              DTB_MAX_MEMORY);
+                }
+            } else if (depth == 2 && in_reserved) {
+                if (strcmp(pname, "#address-cells") == 0 && len == 4) {
+                    rsv_addr_cells = be32(val);
+                } else if (strcmp(pname, "#size-cells") == 0 && len == 4) {
+                    rsv_size_cells = be32(val);
+                }
+            } else if (depth == 3 && in_reserved) {
+                /* Dynamic regions (size/alignment only) have no reg */
+                if (strcmp(pname, "reg") == 0) {
+                    parse_reg(val, len, rsv_addr_cells, rsv_size_cells,
+                              reserved, &nr_reserved, DTB_MAX_RESERVED);
+                }
+            }
+            break;
+        }
+
+        case FDT_NOP:
+            break;
+
+        case FDT_END:
+            return;
+
+        default:
+            printk(KERN_WARNING "DTB: Bad token 0x%x, stopping parse\n",
+                   token);
+            return;
+        }
+    }
+}
+
+/* ===================================================================== */
+/* Public functions */
+/* ===================================================================== */
+
+int dtb_init(void *dtb)
+{
+    fdt_base = NULL;
+    fdt_size = 0;
+    nr_memory_banks = 0;
+    nr_reserved = 0;
+    nr_cpus = 0;
+
+    /* ELF kernels get no x0 from QEMU; the blob is at the base of RAM */
+    if (!dtb && be32((const void *)DTB_RAM_BASE) == FDT_MAGIC) {
+        dtb = (void *)DTB_RAM_BASE;
+    }
+
+    if (!dtb || !IS_ALIGNED((uintptr_t)dtb, 8)) {
+        printk(KERN_WARNING "DTB: No device tree passed by bootloader\n");
+        return -1;
+    }
+
+    const struct fdt_header *hdr = dtb;
+    if (be32(&hdr->magic) != FDT_MAGIC) {
+        printk(KERN_WARNING "DTB: Bad magic at %p\n", dtb);
+        return -1;
+    }
+
+    uint32_t total = be32(&hdr->totalsize);
+    uint32_t off_struct = be32(&hdr->off_dt_struct);
+    uint32_t off_strings = be32(&hdr->off_dt_strings);
+    uint32_t off_rsvmap = be32(&hdr->off_mem_rsvmap);
+    uint32_t version = be32(&hdr->version);
+
+    if (version < 17 || off_struct >= total || off_strings >= total ||
+        off_rsvmap >= total) {
+        printk(KERN_WARNING "DTB: Unsupported or corrupt blob (v%u)\n",
+               version);
+        return -1;
+    }
+
+    uint32_t size_struct = be32(&hdr->size_dt_struct);
+    if (off_struct + size_struct > total) {
+        size_struct = total - off_struct;
+    }
+
+    fdt_base = dtb;
+    fdt_size = total;
+
+    parse_mem_rsvmap(off_rsvmap);
+    parse_structure(off_struct, size_struct, off_strings);
+
+    printk(KERN_INFO "DTB: v%u blob at %p (%u bytes), %d memory bank(s), "
+           "%d reserved region(s), %d CPU(s)\n", version, dtb, total,
+           nr_memory_banks, nr_reserved, nr_cpus);
+
+    return 0;
+}
+
+bool dtb_present(void)
+{
+    return fdt_base != NULL;
+}
+
+phys_addr_t dtb_blob(size_t *size)
+{
+    if (size) {
+        *size = fdt_size;
+    }
+    return (phys_addr_t)fdt_base;
+}
+
+int dtb_memory_banks(struct dtb_region *regions, int max)
+{
+    int n = MIN(nr_memory_banks, max);
+    for (int i = 0; i < n; i++) {
+        regions[i] = memory_banks[i];
+    }
+    return n;
+}
+
+int dtb_reserved_regions(struct dtb_region *regions, int max)
+{
+    int n = MIN(nr_reserved, max);
+    for (int i = 0; i < n; i++) {
+        regions[i] = reserved[i];
+    }
+    return n;
+}
+
+int dtb_cpu_count(void)
+{
+    return nr_cpus;
+}
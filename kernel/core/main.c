@@ -8,12 +8,17 @@
 #include "arch/arch.h"
 #include "drivers/pci.h"
 #include "drivers/uart.h"
+#include "dtb.h"
+#include "fs/ramfs.h"
 #include "fs/vfs.h"
 #include "media/seed_assets.h"
 #include "mm/pmm.h"
 #include "mm/vmm.h"
 #include "printk.h"
+#include "sched/hrtimer.h"
 #include "sched/sched.h"
+#include "sched/softirq.h"
+#include "sched/workqueue.h"
 #include "types.h"
 
 /* Kernel version */
@@ -97,7 +102,7 @@ static void init_subsystems(void *dtb) {
 
   /* Parse device tree for hardware information */
   printk(KERN_INFO "  Parsing device tree...\n");
-  (void)dtb; /* TODO: dtb_parse(dtb); */
+  dtb_init(dtb);
 
   /* Initialize interrupt controller */
   printk(KERN_INFO "  Initializing interrupt controller...\n");
@@ -142,12 +147,23 @@ static void init_subsystems(void *dtb) {
   /* Initialize scheduler */
   printk(KERN_INFO "  Initializing scheduler...\n");
   sched_init();
+  softirq_init();
+
+  /* Start clearing pages in idle time */
+  pmm_zero_start();
 
   /* Initialize process subsystem */
   printk(KERN_INFO "  Initializing process subsystem...\n");
   extern void process_init(void);
   process_init();
 
+  /* Bring up the other CPUs, each with its own run queue */
+  printk(KERN_INFO "  Starting secondary CPUs...\n");
+  smp_init();
+
+  /* Per-CPU workers for deferred driver work */
+  workqueue_init();
+
   /* ================================================================= */
   /* Phase 4: Filesystems */
   /* ================================================================= */
@@ -162,7 +178,6 @@ static void init_subsystems(void *dtb) {
 
   /* Initialize and Register RamFS */
   printk(KERN_INFO "  Initializing RamFS...\n");
-  extern int ramfs_init(void);
   ramfs_init();
 
   /* Mount root filesystem */
@@ -172,12 +187,6 @@ static void init_subsystems(void *dtb) {
   }
 
   /* Populate filesystem with sample data */
-  extern int ramfs_create_dir(const char *path, mode_t mode);
-  extern int ramfs_create_file(const char *path, mode_t mode,
-                               const char *content);
-  extern int ramfs_create_file_bytes(const char *path, mode_t mode,
-                                     const uint8_t *data, size_t size);
-
   ramfs_create_dir("Documents", 0755);
   ramfs_create_dir("Downloads", 0755);
   ramfs_create_dir("Pictures", 0755);
@@ -301,6 +310,9 @@ static void init_subsystems(void *dtb) {
                     "    print(add(42, 7));\n"
                     "}\n");
 
+  /* Compress seeded files nobody is using */
+  ramfs_zstart();
+
   printk(KERN_INFO "  Mounting sysfs...\n");
   printk(KERN_INFO "  Mounting devfs...\n");
 
@@ -412,6 +424,20 @@ static void keyboard_handler(int key) {
   kapi_sys_key_event(key);
 }
 
+/*
+ * Frame timer: the desktop loop runs as a real-time task while it has a
+ * frame to draw, so a busy process cannot hold the display back
+ */
+#define FRAME_MS 33
+static struct hrtimer frame_timer;
+
+static enum hrtimer_restart frame_timer_fn(struct hrtimer *timer) {
+  process_kernel_wake();
+  hrtimer_forward(timer, arch_timer_get_ticks(),
+                  ns_to_ticks(FRAME_MS * 1000000ULL));
+  return HRTIMER_RESTART;
+}
+
 static void start_init_process(void) {
   /* Create and start init process */
   printk(KERN_INFO "Executing /sbin/init...\n");
@@ -446,7 +472,12 @@ static void start_init_process(void) {
 
   /* Timer for periodic auto-refresh (33ms = 30 FPS for responsive UI) */
   uint64_t last_refresh = arch_timer_get_ms();
-  const uint64_t REFRESH_MS = 33; /* 30 FPS - responsive mouse */
+  const uint64_t REFRESH_MS = FRAME_MS; /* 30 FPS - responsive mouse */
+
+  /* Wake the loop for each frame even while processes have the CPU */
+  hrtimer_init(&frame_timer, frame_timer_fn);
+  hrtimer_start(&frame_timer,
+                arch_timer_get_ticks() + ns_to_ticks(FRAME_MS * 1000000ULL));
 
   while (1) {
     /* Poll virtio input devices (keyboard/mouse) - MUST call this! */
@@ -505,7 +536,11 @@ static void start_init_process(void) {
     frame++;
     (void)frame;
 
-    /* Short yield - allows input polling without slowing mouse */
+    /* Frame done: processes run until the next one or new input */
+    process_kernel_idle();
+
+    /* Short yield - idle-priority kernel threads (page zeroing) run here */
+    schedule();
     for (volatile int i = 0; i < 500; i++) {
     }
   }
@@ -5,6 +5,7 @@
 #include "printk.h"
 #include "drivers/uart.h"
 #include "stdarg.h"
+#include "sync/spinlock.h"
 
 /* ===================================================================== */
 /* Internal buffer and state */
@@ -14,6 +15,9 @@
 
 static char printk_buffer[PRINTK_BUFFER_SIZE];
 
+/* Serializes the shared buffer and keeps lines from different CPUs whole */
+static DEFINE_SPINLOCK(printk_lock);
+
 /* ===================================================================== */
 /* Helper functions for number formatting */
 /* ===================================================================== */
@@ -91,12 +95,16 @@ static int kvsnprintf(char *buf, size_t size, const char *fmt, va_list args)
         
         /* Handle flags and width (simplified) */
         int zero_pad = 0;
+        int left_align = 0;
         int width = 0;
         int is_long = 0;
         int is_long_long = 0;
         
-        while (*fmt == '0') {
-            zero_pad = 1;
+        while (*fmt == '0' || *fmt == '-') {
+            if (*fmt == '0')
+                zero_pad = 1;
+            else
+                left_align = 1;
             fmt++;
         }
         
@@ -187,8 +195,17 @@ static int kvsnprintf(char *buf, size_t size, const char *fmt, va_list args)
             case 's': {
                 const char *str = va_arg(args, const char *);
                 if (!str) str = "(null)";
+                len = 0;
+                while (str[len])
+                    len++;
+                if (!left_align)
+                    for (int i = len; i < width; i++)
+                        if (p < end) *p++ = ' ';
                 while (*str && p < end)
                     *p++ = *str++;
+                if (left_align)
+                    for (int i = len; i < width; i++)
+                        if (p < end) *p++ = ' ';
                 break;
             }
             
@@ -233,12 +250,16 @@ int vprintk(const char *fmt, va_list args)
     }
     (void)level;  /* TODO: Use level for filtering */
     
+    uint64_t flags = spin_lock_irqsave(&printk_lock);
+    
     /* Format the message */
     len = kvsnprintf(printk_buffer, PRINTK_BUFFER_SIZE, p, args);
     
     /* Output to console (UART for now) */
     uart_puts(printk_buffer);
     
+    spin_unlock_irqrestore(&printk_lock, flags);
+    
     return len;
 }
 
@@ -254,6 +275,40 @@ int printk(const char *fmt, ...)
     return ret;
 }
 
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
+{
+    if (!buf || size == 0)
+        return 0;
+    return kvsnprintf(buf, size, fmt, args);
+}
+
+int snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+    
+    va_start(args, fmt);
+    ret = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    
+    return ret;
+}
+
+void report_printf(char *buf, size_t size, int *len, const char *fmt, ...)
+{
+    char line[REPORT_LINE_MAX];
+    va_list args;
+    
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    
+    printk(KERN_INFO "%s", line);
+    if (buf && (size_t)*len < size) {
+        *len += snprintf(buf + *len, size - *len, "%s", line);
+    }
+}
+
 int early_printk(const char *fmt, ...)
 {
     va_list args;
@@ -2,6 +2,9 @@
  * Vib-OS Process Management (ported from VibeOS)
  *
  * Preemptive multitasking - timer IRQ forces context switches.
+ * Processes share the CPU by weight through the fair class (sched/fair.h):
+ * runnable ones wait on its vruntime tree, real-time ones on the FIFOs of
+ * sched/rt.h, so picking the next never walks the process list.
  * Programs run in kernel space and call kernel functions directly.
  * No memory protection, but full preemption via timer interrupt.
  */
@@ -11,7 +14,14 @@
 #include "../include/fs/vfs_compat.h"
 #include "../include/loader/elf.h"
 #include "../include/mm/kmalloc.h"
+#include "../include/mm/slab.h"
+#include "../include/mm/vmalloc.h"
 #include "../include/printk.h"
+#include "../include/sched/hrtimer.h"
+#include "../include/sched/pid.h"
+#include "../include/sched/rt.h"
+#include "../include/sched/sched.h"
+#include "../include/sched/softirq.h"
 #include "../include/sync/spinlock.h"
 #include "../include/mm/aslr.h"
 
@@ -34,13 +44,35 @@ struct kapi;
 typedef struct kapi kapi_t;
 extern kapi_t *kapi_get(void);
 
-// Process table
-static process_t proc_table[MAX_PROCESSES];
-static int current_pid = -1; // -1 means kernel/shell is running
-static int next_pid = 1;
+// Process structures, and live processes by PID
+static struct kmem_cache *proc_cache;
+static struct pid_hash proc_pids;
 
-// Spinlock protecting process table access
-static DEFINE_SPINLOCK(proc_table_lock);
+// All processes in creation order, and the parent/child links
+static process_t *proc_list;
+static process_t *proc_list_tail;
+
+// Spinlock protecting the process list and tree
+static DEFINE_SPINLOCK(proc_list_lock);
+
+// Runnable processes other than the running one, which still counts
+// towards proc_cfs.load and proc_nr_runnable. A process keeps an absolute
+// vruntime, also while it is off the queue.
+static struct cfs_rq proc_cfs;
+static struct rt_rq proc_rt;
+static unsigned int proc_nr_runnable;
+static DEFINE_SPINLOCK(proc_rq_lock);
+
+// Real-time runtime of processes and the compositor this period
+static struct rt_bandwidth proc_rt_bw;
+
+// Set while the desktop loop has a frame to draw (process_kernel_wake())
+static volatile bool kernel_wants_cpu;
+static uint64_t kernel_exec_start; // Counter when the compositor was charged
+
+// Run and wait times of the compositor, and of all processes together
+static struct sched_info kernel_sched_info;
+static struct sched_info proc_cpu_info;
 
 // Current process pointer - used by IRQ handler for preemption
 // NULL means kernel is running (no process to save to)
@@ -65,80 +97,342 @@ typedef int (*program_entry_t)(kapi_t *api, int argc, char **argv);
 
 // Forward declarations
 static void process_entry_wrapper(void);
-static void kill_children(int parent_pid);
+static void kill_children(process_t *parent);
+static enum hrtimer_restart process_wakeup(struct hrtimer *timer);
 
 void process_init(void) {
-  // Clear process table
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    proc_table[i].state = PROC_STATE_FREE;
-    proc_table[i].pid = 0;
-    // Also clear context to prevent garbage
-    memset(&proc_table[i].context, 0, sizeof(cpu_context_t));
-  }
-  current_pid = -1;
+  proc_cache = kmem_cache_create("process", sizeof(process_t),
+                                 __alignof__(process_t), 0);
+  pid_hash_init(&proc_pids);
+  proc_list = proc_list_tail = NULL;
   current_process = NULL;
-  next_pid = 1;
+  cfs_rq_init(&proc_cfs);
+  rt_rq_init(&proc_rt);
+  rt_bandwidth_init(&proc_rt_bw, arch_timer_get_ticks());
+  kernel_sched_info.last_arrival = arch_timer_get_ticks();
 
   // Programs load right after the heap
   program_base = ALIGN_64K(PROGRAM_LOAD_BASE);
   next_load_addr = program_base;
 
-  printf("[PROC] Process subsystem initialized (max %d processes)\n",
-         MAX_PROCESSES);
+  printf("[PROC] Process subsystem initialized\n");
   printf("[PROC] Program load area: 0x%lx+\n", program_base);
   printf("[PROC] kernel_context at: 0x%lx\n", (uint64_t)&kernel_context);
 }
 
-// Find a free slot in the process table (caller must hold proc_table_lock)
-static int find_free_slot_unlocked(void) {
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    if (proc_table[i].state == PROC_STATE_FREE) {
-      return i;
-    }
+// Allocate a zeroed process with a fresh PID, not yet visible to others
+static process_t *proc_alloc(void) {
+  if (!proc_cache)
+    return NULL;
+  process_t *proc = kmem_cache_alloc(proc_cache, GFP_KERNEL);
+  if (!proc)
+    return NULL;
+
+  memset(proc, 0, sizeof(*proc));
+  proc->usage = 1; // Dropped by proc_release()
+  proc->pid = pid_alloc();
+  if (proc->pid < 0) {
+    kmem_cache_free(proc_cache, proc);
+    return NULL;
   }
-  return -1;
+  hrtimer_init(&proc->sleep_timer, process_wakeup);
+  proc->start_time = arch_timer_get_ticks();
+  return proc;
 }
 
-process_t *process_current(void) {
-  if (current_pid < 0)
-    return NULL;
-  return &proc_table[current_pid];
+// Make a fully set up process visible: listed, findable, and its
+// parent's child
+static void proc_link(process_t *proc) {
+  uint64_t flags = spin_lock_irqsave(&proc_list_lock);
+  proc->next = NULL;
+  proc->prev = proc_list_tail;
+  if (proc_list_tail)
+    proc_list_tail->next = proc;
+  else
+    proc_list = proc;
+  proc_list_tail = proc;
+
+  if (proc->parent) {
+    proc->sibling = proc->parent->children;
+    proc->parent->children = proc;
+  }
+  spin_unlock_irqrestore(&proc_list_lock, flags);
+
+  pid_hash_add(&proc_pids, &proc->pid_node, proc->pid);
 }
 
-process_t *process_get(int pid) {
-  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    if (proc_table[i].pid == pid && proc_table[i].state != PROC_STATE_FREE) {
-      spin_unlock_irqrestore(&proc_table_lock, flags);
-      return &proc_table[i];
+// Take @proc off its parent's child list (caller holds proc_list_lock)
+static void proc_unlink_child(process_t *proc) {
+  if (!proc->parent)
+    return;
+  process_t **link = &proc->parent->children;
+  while (*link && *link != proc)
+    link = &(*link)->sibling;
+  if (*link)
+    *link = proc->sibling;
+  proc->parent = NULL;
+  proc->sibling = NULL;
+}
+
+// The run queue helpers below are called with proc_rq_lock held.
+
+// Make @proc runnable, on the queue of its policy (see fair_place())
+static void proc_enqueue(process_t *proc, int flags) {
+  proc->on_rq = true;
+  proc_nr_runnable++;
+  if (proc->policy != SCHED_NORMAL) {
+    rt_enqueue(&proc_rt, &proc->rt, proc->rt_priority, false);
+  } else {
+    // fair_enqueue() takes a vruntime relative to the floor
+    proc->se.vruntime -= proc_cfs.min_vruntime;
+    fair_enqueue(&proc_cfs, &proc->se, flags);
+  }
+}
+
+// Make @proc, queued or running, no longer runnable
+static void proc_dequeue(process_t *proc) {
+  if (!proc->on_rq)
+    return;
+  proc->on_rq = false;
+  proc_nr_runnable--;
+  if (proc->policy != SCHED_NORMAL) {
+    if (proc->rt.on_rq)
+      rt_dequeue(&proc_rt, &proc->rt);
+  } else {
+    fair_dequeue(&proc_cfs, &proc->se, DEQUEUE_SLEEP);
+  }
+}
+
+// Take @proc, which is about to run, off the queue it waits on
+static void proc_take(process_t *proc) {
+  if (proc->policy != SCHED_NORMAL)
+    rt_dequeue(&proc_rt, &proc->rt);
+  else
+    fair_set_next(&proc_cfs, &proc->se);
+}
+
+// Put @proc, which stops running but stays runnable, back on its queue:
+// a real-time one behind its equals
+static void proc_put(process_t *proc) {
+  if (proc->policy != SCHED_NORMAL)
+    rt_enqueue(&proc_rt, &proc->rt, proc->rt_priority, false);
+  else
+    fair_put_prev(&proc_cfs);
+}
+
+// Free a process that is not running and never will again. The structure
+// itself outlives it while someone who looked it up still holds it.
+static void proc_release(process_t *proc) {
+  // A sleeper's timer must not fire on a freed process
+  hrtimer_cancel(&proc->sleep_timer);
+  pid_hash_del(&proc_pids, &proc->pid_node);
+  uint64_t rq_flags = spin_lock_irqsave(&proc_rq_lock);
+  proc_dequeue(proc);
+  spin_unlock_irqrestore(&proc_rq_lock, rq_flags);
+
+  // Never-linked processes (failed creation) are on no list
+  uint64_t flags = spin_lock_irqsave(&proc_list_lock);
+  if (proc->prev)
+    proc->prev->next = proc->next;
+  else if (proc_list == proc)
+    proc_list = proc->next;
+  if (proc->next)
+    proc->next->prev = proc->prev;
+  else if (proc_list_tail == proc)
+    proc_list_tail = proc->prev;
+
+  proc_unlink_child(proc);
+  // Only a child that was running when we were killed is left
+  while (proc->children) {
+    process_t *child = proc->children;
+    proc->children = child->sibling;
+    child->parent = NULL;
+    child->sibling = NULL;
+    child->parent_pid = -1;
+  }
+  spin_unlock_irqrestore(&proc_list_lock, flags);
+
+  pid_free(proc->pid);
+  if (proc->stack_base) {
+    free(proc->stack_base);
+    proc->stack_base = NULL;
+  }
+  proc->state = PROC_STATE_FREE;
+  process_put(proc);
+}
+
+// Return exited processes nobody waits for to the cache. Only on the boot
+// CPU, which runs every process, so none of them is still on its stack.
+static void reap_zombies(void) {
+  if (arch_cpu_id() != 0)
+    return;
+
+  for (;;) {
+    process_t *zombie = NULL;
+    uint64_t flags = spin_lock_irqsave(&proc_list_lock);
+    for (process_t *p = proc_list; p; p = p->next) {
+      if (p->state == PROC_STATE_ZOMBIE && !p->waited) {
+        zombie = p;
+        break;
+      }
     }
+    spin_unlock_irqrestore(&proc_list_lock, flags);
+
+    if (!zombie)
+      return;
+    proc_release(zombie);
+  }
+}
+
+// Real-time priority @proc runs at, 0 for fair or while throttled
+static int proc_rt_prio(process_t *proc) {
+  if (proc->policy == SCHED_NORMAL || proc_rt_bw.throttled)
+    return 0;
+  return proc->rt_priority;
+}
+
+// The compositor's, likewise: only while it has a frame to draw
+static int kernel_rt_prio(void) {
+  return (kernel_wants_cpu && !proc_rt_bw.throttled) ? COMPOSITOR_RT_PRIO : 0;
+}
+
+// Whether running @curr should make way for @next
+static bool proc_should_preempt(process_t *curr, process_t *next,
+                                unsigned long load) {
+  int pc = proc_rt_prio(curr), pn = proc_rt_prio(next);
+  if (pc != pn)
+    return pn > pc;
+  if (!pc)
+    return fair_should_preempt(&curr->se, &next->se, load);
+
+  // Equals: FIFO keeps the CPU, RR once its slice is used up
+  return curr->policy == SCHED_RR &&
+         curr->se.sum_exec_runtime - curr->se.prev_sum_exec_runtime >=
+             rt_timeslice();
+}
+
+// Charge @proc, or the compositor if NULL, for the time since it was last
+// charged. Real-time time also counts against the allowance.
+static void proc_charge(process_t *proc, uint64_t now) {
+  uint64_t delta;
+  if (proc) {
+    delta = fair_account(&proc->se, now);
+    if (proc->policy == SCHED_NORMAL)
+      delta = 0;
+  } else {
+    delta = kernel_wants_cpu ? now - kernel_exec_start : 0;
+    kernel_exec_start = now;
   }
-  spin_unlock_irqrestore(&proc_table_lock, flags);
-  return NULL;
+  rt_bandwidth_account(&proc_rt_bw, now, delta);
+}
+
+// Pick the READY process to run next: the first real-time one unless
+// they are throttled, else the fair one furthest behind. The running
+// process is on neither queue. Also returns the fair runnable weight in
+// @load. Called with IRQs off.
+static process_t *pick_next(unsigned long *load) {
+  process_t *next = NULL;
+
+  spin_lock(&proc_rq_lock);
+  fair_update_curr(&proc_cfs);
+  struct sched_rt_entity *rt_se =
+      proc_rt_bw.throttled ? NULL : rt_first(&proc_rt);
+  struct sched_entity *se = fair_first(&proc_cfs);
+  if (rt_se)
+    next = container_of(rt_se, process_t, rt);
+  else if (se)
+    next = container_of(se, process_t, se);
+  if (load)
+    *load = proc_cfs.load;
+  spin_unlock(&proc_rq_lock);
+  return next;
+}
+
+// Mark @proc as the running process and start its slice
+static void proc_set_running(process_t *proc) {
+  spin_lock(&proc_rq_lock);
+  proc_take(proc);
+  spin_unlock(&proc_rq_lock);
+  proc->state = PROC_STATE_RUNNING;
+  proc->se.exec_start = arch_timer_get_ticks();
+  proc->se.prev_sum_exec_runtime = proc->se.sum_exec_runtime;
+  sched_info_arrive(&proc->sched_info, &proc_cpu_info, proc->se.exec_start);
+  fpsimd_switch(&proc->fpsimd);
+}
+
+// Account @proc leaving the CPU: voluntarily if it blocked or exited, else
+// it waits to run again
+static void proc_depart(process_t *proc, uint64_t now) {
+  spin_lock(&proc_rq_lock);
+  bool runnable = proc->state == PROC_STATE_READY;
+  if (runnable)
+    proc_put(proc);
+  else
+    proc_dequeue(proc);
+  spin_unlock(&proc_rq_lock);
+  sched_info_depart(&proc->sched_info, &proc_cpu_info, now, !runnable);
+  if (runnable)
+    sched_info_queued(&proc->sched_info, now, false);
+}
+
+// Likewise for the compositor, which is done once it has no frame to draw.
+// Its FP/SIMD state is that of the task the processes interrupted.
+static void kernel_arrive(uint64_t now) {
+  sched_info_arrive(&kernel_sched_info, NULL, now);
+  struct task_struct *task = get_current();
+  fpsimd_switch(task ? &task->fpsimd : NULL);
+}
+
+static void kernel_depart(uint64_t now) {
+  sched_info_depart(&kernel_sched_info, NULL, now, !kernel_wants_cpu);
+  if (kernel_wants_cpu)
+    sched_info_queued(&kernel_sched_info, now, false);
+}
+
+process_t *process_current(void) { return current_process; }
+
+static void proc_get_node(struct pid_node *node) {
+  __atomic_add_fetch(&container_of(node, process_t, pid_node)->usage, 1,
+                     __ATOMIC_RELAXED);
+}
+
+process_t *process_get(int pid) {
+  struct pid_node *node = pid_hash_find(&proc_pids, pid, proc_get_node);
+  return node ? container_of(node, process_t, pid_node) : NULL;
+}
+
+void process_put(process_t *proc) {
+  if (__atomic_sub_fetch(&proc->usage, 1, __ATOMIC_ACQ_REL) == 0)
+    kmem_cache_free(proc_cache, proc);
+}
+
+// process_get(), with 0 meaning the current process (NULL for the kernel)
+static process_t *proc_lookup(int pid) {
+  if (pid != 0)
+    return process_get(pid);
+  if (current_process)
+    proc_get_node(&current_process->pid_node);
+  return current_process;
 }
 
 // Get pointer to current_process pointer (for assembly IRQ handler)
 process_t **process_get_current_ptr(void) { return &current_process; }
 
 int process_count_ready(void) {
-  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
-  int count = 0;
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    if (proc_table[i].state == PROC_STATE_READY ||
-        proc_table[i].state == PROC_STATE_RUNNING) {
-      count++;
-    }
-  }
-  spin_unlock_irqrestore(&proc_table_lock, flags);
-  return count;
+  return __atomic_load_n(&proc_nr_runnable, __ATOMIC_RELAXED);
 }
 
 int process_get_info(int index, char *name, int name_size, int *state) {
-  if (index < 0 || index >= MAX_PROCESSES)
+  if (index < 0)
     return 0;
-  process_t *p = &proc_table[index];
-  if (p->state == PROC_STATE_FREE)
+  uint64_t flags = spin_lock_irqsave(&proc_list_lock);
+  process_t *p = proc_list;
+  while (p && index-- > 0)
+    p = p->next;
+  if (!p) {
+    spin_unlock_irqrestore(&proc_list_lock, flags);
     return 0;
+  }
 
   // Copy name
   if (name && name_size > 0) {
@@ -154,6 +448,7 @@ int process_get_info(int index, char *name, int name_size, int *state) {
   if (state)
     *state = (int)p->state;
 
+  spin_unlock_irqrestore(&proc_list_lock, flags);
   return 1;
 }
 
@@ -162,18 +457,8 @@ int process_create(const char *path, int argc, char **argv) {
   (void)argc;
   (void)argv;
 
-  // Find free slot (with locking)
-  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
-  int slot = find_free_slot_unlocked();
-  if (slot < 0) {
-    spin_unlock_irqrestore(&proc_table_lock, flags);
-    printf("[PROC] No free process slots\n");
-    return -1;
-  }
-  // Reserve the slot immediately
-  proc_table[slot].state = PROC_STATE_READY;
-  proc_table[slot].pid = next_pid++;
-  spin_unlock_irqrestore(&proc_table_lock, flags);
+  // Exited processes go back to the cache before we take another
+  reap_zombies();
 
   // Look up file
   vfs_node_t *file = vfs_lookup(path);
@@ -194,7 +479,7 @@ int process_create(const char *path, int argc, char **argv) {
   }
 
   // Read the ELF file
-  char *data = malloc(size);
+  char *data = vmalloc(size);
   if (!data) {
     printf("[PROC] Out of memory reading %s\n", path);
     return -1;
@@ -203,7 +488,7 @@ int process_create(const char *path, int argc, char **argv) {
   int bytes = vfs_read(file, data, size, 0);
   if (bytes != (int)size) {
     printf("[PROC] Failed to read %s\n", path);
-    free(data);
+    vfree(data);
     return -1;
   }
 
@@ -215,7 +500,7 @@ int process_create(const char *path, int argc, char **argv) {
     uint8_t *b = (uint8_t *)data;
     printf("[PROC] Header: %02x %02x %02x %02x %02x %02x %02x %02x\n", b[0],
            b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
-    free(data);
+    vfree(data);
     return -1;
   }
 
@@ -227,33 +512,44 @@ int process_create(const char *path, int argc, char **argv) {
   elf_load_info_t info;
   if (elf_load_at(data, size, load_addr, &info) != 0) {
     printf("[PROC] Failed to load ELF: %s\n", path);
-    free(data);
+    vfree(data);
     return -1;
   }
 
-  free(data);
+  vfree(data);
 
   // Update next load address for future programs
   next_load_addr = ALIGN_64K(load_addr + info.load_size + 0x10000);
 
-  // Set up process structure
-  process_t *proc = &proc_table[slot];
-  proc->pid = next_pid++;
+  // Set up process structure (invisible until linked below)
+  process_t *proc = proc_alloc();
+  if (!proc) {
+    printf("[PROC] Out of memory or PIDs for %s\n", path);
+    return -1;
+  }
   strncpy(proc->name, path, PROCESS_NAME_MAX - 1);
   proc->name[PROCESS_NAME_MAX - 1] = '\0';
   proc->state = PROC_STATE_READY;
   proc->load_base = info.load_base;
   proc->load_size = info.load_size;
   proc->entry = info.entry;
-  proc->parent_pid = current_pid;
+  proc->parent = current_process;
+  proc->parent_pid = current_process ? current_process->pid : -1;
   proc->exit_status = 0;
 
+  // Inherit the parent's nice value and policy, and start a slice behind
+  // the others
+  proc->nice = current_process ? current_process->nice : 0;
+  proc->policy = current_process ? current_process->policy : SCHED_NORMAL;
+  proc->rt_priority = current_process ? current_process->rt_priority : 0;
+  proc->se.weight = sched_nice_to_weight(proc->nice);
+
   // Allocate stack
   proc->stack_size = PROCESS_STACK_SIZE;
   proc->stack_base = malloc(proc->stack_size);
   if (!proc->stack_base) {
     printf("[PROC] Failed to allocate stack\n");
-    proc->state = PROC_STATE_FREE;
+    proc_release(proc);
     return -1;
   }
 
@@ -289,13 +585,20 @@ int process_create(const char *path, int argc, char **argv) {
   // x86 32-bit: pass via stack or registers (TBD)
 #endif
 
-  // printf("[PROC] Created process '%s' pid=%d at 0x%lx-0x%lx (slot %d)\n",
+  // printf("[PROC] Created process '%s' pid=%d at 0x%lx-0x%lx\n",
   //        proc->name, proc->pid, proc->load_base, proc->load_base +
-  //        proc->load_size, slot);
+  //        proc->load_size);
   // printf("[PROC] Stack at 0x%lx-0x%lx\n",
   //        (uint64_t)proc->stack_base, (uint64_t)proc->stack_base +
   //        proc->stack_size);
 
+  sched_info_queued(&proc->sched_info, arch_timer_get_ticks(), false);
+  proc_link(proc);
+
+  // Runnable only now that its context is set up
+  uint64_t flags = spin_lock_irqsave(&proc_rq_lock);
+  proc_enqueue(proc, ENQUEUE_INITIAL);
+  spin_unlock_irqrestore(&proc_rq_lock, flags);
   return proc->pid;
 }
 
@@ -344,10 +647,12 @@ int process_start(int pid) {
 
   if (proc->state != PROC_STATE_READY) {
     printf("[PROC] Process %d not ready (state=%d)\n", pid, proc->state);
+    process_put(proc);
     return -1;
   }
 
   printf("[PROC] Started '%s' pid=%d\n", proc->name, pid);
+  process_put(proc);
   return 0; // Already ready, scheduler will pick it up
 }
 
@@ -356,33 +661,30 @@ void process_exit(int status) {
   // Disable IRQs during exit to prevent race with preemption
   arch_irq_disable();
 
-  if (current_pid < 0) {
+  process_t *proc = current_process;
+  if (!proc) {
     printf("[PROC] Exit called with no current process!\n");
     arch_irq_enable();
     return;
   }
 
-  int slot = current_pid;
-  process_t *proc = &proc_table[slot];
   printf("[PROC] Process '%s' (pid %d) exited with status %d\n", proc->name,
          proc->pid, status);
 
   // Kill all children of this process before exiting
-  kill_children(proc->pid);
+  kill_children(proc);
 
   proc->exit_status = status;
-  proc->state = PROC_STATE_ZOMBIE;
 
-  // Free stack - but we're still on it! Don't free yet.
-  // The stack will be freed when the slot is reused.
-
-  // Mark slot as free (simple cleanup for now)
-  proc->state = PROC_STATE_FREE;
+  // We're still on our stack, so it is freed later: by process_exec_args()
+  // if it is waiting for us, otherwise by the next reap_zombies()
+  proc->state = PROC_STATE_ZOMBIE;
 
   // We're done with this process - switch back to kernel context
   // This MUST not return - we context switch away
-  current_pid = -1;
   current_process = NULL;
+  proc_depart(proc, arch_timer_get_ticks());
+  kernel_arrive(arch_timer_get_ticks());
 
   // Debug: verify kernel_context before switching
   printf("[PROC] Switching to kernel_context: pc=0x%llx sp=0x%llx\n",
@@ -414,10 +716,9 @@ void process_exit(int status) {
 
 // Yield - voluntarily give up CPU
 void process_yield(void) {
-  if (current_pid >= 0) {
+  if (current_process) {
     // Mark current process as ready
-    process_t *proc = &proc_table[current_pid];
-    proc->state = PROC_STATE_READY;
+    current_process->state = PROC_STATE_READY;
   }
   // Always try to schedule - even from kernel context
   // This lets programs started via process_exec() yield to spawned children
@@ -426,37 +727,53 @@ void process_yield(void) {
 
 // Simple round-robin scheduler (for voluntary transitions like process_exec)
 void process_schedule(void) {
+  // The kernel context is where exited processes can be freed
+  if (!current_process)
+    reap_zombies();
+
   // Disable IRQs during scheduling to prevent race with preemption
   arch_irq_disable();
 
-  int old_pid = current_pid;
-  process_t *old_proc = (old_pid >= 0) ? &proc_table[old_pid] : NULL;
-
-  // Find next runnable process (round-robin)
-  int start = (old_pid >= 0) ? old_pid + 1 : 0;
-  int next = -1;
-
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    int idx = (start + i) % MAX_PROCESSES;
-    if (proc_table[idx].state == PROC_STATE_READY) {
-      next = idx;
-      break;
-    }
+  process_t *old_proc = current_process;
+
+  // Charge the caller for the time it ran
+  if (old_proc)
+    proc_charge(old_proc, arch_timer_get_ticks());
+
+  // Find the process furthest behind; a yielding process goes last
+  process_t *next = pick_next(NULL);
+  if (!next && old_proc && old_proc->state == PROC_STATE_READY)
+    next = old_proc;
+
+  // The compositor draws ahead of any process it outranks
+  int kernel_prio = kernel_rt_prio();
+  bool to_kernel =
+      old_proc && kernel_prio && (!next || proc_rt_prio(next) <= kernel_prio) &&
+      (old_proc->state != PROC_STATE_RUNNING ||
+       proc_rt_prio(old_proc) < kernel_prio);
+  if (to_kernel) {
+    if (old_proc->state == PROC_STATE_RUNNING)
+      old_proc->state = PROC_STATE_READY;
+    next = NULL;
   }
 
-  if (next < 0) {
+  if (!next) {
     // No runnable processes
-    if (old_pid >= 0 && old_proc->state == PROC_STATE_RUNNING) {
+    if (old_proc && old_proc->state == PROC_STATE_RUNNING) {
       // Current process still running, keep it
       arch_irq_enable();
       return;
     }
     // Return to kernel (if we were in a process, switch back to kernel)
-    if (old_pid >= 0) {
-      current_pid = -1;
+    if (old_proc) {
       current_process = NULL;
+      kernel_exec_start = arch_timer_get_ticks();
+      proc_depart(old_proc, kernel_exec_start);
+      kernel_arrive(kernel_exec_start);
       switch_context(&old_proc->context, &kernel_context);
-      // When we return here, IRQs will be re-enabled below
+      // Picked again - carry on with the process
+      arch_irq_enable();
+      return;
     }
     // Already in kernel with nothing to run - sleep until next interrupt
     arch_irq_enable();
@@ -464,13 +781,13 @@ void process_schedule(void) {
     return;
   }
 
-  if (next == old_pid && old_proc && old_proc->state == PROC_STATE_RUNNING) {
+  if (next == old_proc && old_proc->state == PROC_STATE_RUNNING) {
     // Same process and it's running - nothing to switch
     arch_irq_enable();
     return;
   }
 
-  if (next == old_pid && old_proc && old_proc->state == PROC_STATE_READY) {
+  if (next == old_proc && old_proc->state == PROC_STATE_READY) {
     // Process yielded but it's the only one - sleep until interrupt
     old_proc->state = PROC_STATE_RUNNING;
     arch_irq_enable();
@@ -479,25 +796,27 @@ void process_schedule(void) {
   }
 
   // Switch to new process
-  process_t *new_proc = &proc_table[next];
+  process_t *new_proc = next;
 
   if (old_proc && old_proc->state == PROC_STATE_RUNNING) {
     old_proc->state = PROC_STATE_READY;
   }
+  if (old_proc)
+    proc_depart(old_proc, arch_timer_get_ticks());
+  else
+    kernel_depart(arch_timer_get_ticks());
 
-  new_proc->state = PROC_STATE_RUNNING;
-  current_pid = next;
+  proc_set_running(new_proc);
   current_process = new_proc;
 
   // Context switch!
-  // If old_pid == -1, we're switching FROM kernel context
+  // If old_proc is NULL, we're switching FROM kernel context
   // IRQs stay disabled - new process will enable them (entry_wrapper or return
   // path)
-  cpu_context_t *old_ctx =
-      (old_pid >= 0) ? &old_proc->context : &kernel_context;
+  cpu_context_t *old_ctx = old_proc ? &old_proc->context : &kernel_context;
 
   // Debug: if switching from kernel, verify kernel_context after we return
-  int was_kernel = (old_pid < 0);
+  int was_kernel = !old_proc;
 
   switch_context(old_ctx, &new_proc->context);
 
@@ -524,31 +843,33 @@ int process_exec_args(const char *path, int argc, char **argv) {
     return pid; // Error already printed
   }
 
-  // Start it
-  process_start(pid);
-
-  // Find the slot for this process
-  int slot = -1;
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    if (proc_table[i].pid == pid) {
-      slot = i;
-      break;
-    }
-  }
-
-  if (slot < 0) {
+  // We collect its exit status, so it stays a zombie until we do
+  process_t *proc = process_get(pid);
+  if (!proc) {
     printf("[PROC] exec: process disappeared?\n");
     return -1;
   }
+  proc->waited = true;
+
+  // Start it
+  process_start(pid);
 
   // Wait for it to finish by yielding until it's done
-  // The process is READY, we need to run the scheduler to let it execute
-  while (proc_table[slot].state != PROC_STATE_FREE &&
-         proc_table[slot].state != PROC_STATE_ZOMBIE) {
+  // The process is READY, we need to run the scheduler to let it execute.
+  // Our reference keeps proc valid even if it is killed meanwhile.
+  while (proc->state != PROC_STATE_ZOMBIE && proc->state != PROC_STATE_FREE) {
     process_schedule();
   }
 
-  int result = proc_table[slot].exit_status;
+  if (proc->state == PROC_STATE_FREE) {
+    printf("[PROC] Process '%s' (pid %d) was killed\n", path, pid);
+    process_put(proc);
+    return -1;
+  }
+
+  int result = proc->exit_status;
+  proc_release(proc);
+  process_put(proc);
   printf("[PROC] Process '%s' (pid %d) finished with status %d\n", path, pid,
          result);
   return result;
@@ -560,92 +881,288 @@ int process_exec(const char *path) {
 }
 
 // Called from IRQ handler for preemptive scheduling
-// Just updates current_process - IRQ handler does the actual context switch
+// Just updates current_process - IRQ handler does the actual context switch,
+// back to kernel_context if it is left NULL
 void process_schedule_from_irq(void) {
-  // Check how many processes are ready to run
-  int ready_count = process_count_ready();
-
-  // If kernel is running (current_pid == -1), we should switch to ANY ready
-  // process If a process is running, we only switch if there's another ready
-  // process
-  if (current_pid >= 0 && ready_count <= 1) {
-    return; // Only one process, no point switching
-  }
-  if (current_pid < 0 && ready_count == 0) {
-    return; // Kernel running, no processes to switch to
-  }
-
-  // Find next runnable process (round-robin)
-  int old_slot = current_pid;
-  int start = (old_slot >= 0) ? old_slot + 1 : 0;
-
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    int idx = (start + i) % MAX_PROCESSES;
-    if (proc_table[idx].state == PROC_STATE_READY) {
-      // Found a different process to switch to
-      if (idx != old_slot) {
-        // Safety check: verify process has valid context
-        process_t *new_proc = &proc_table[idx];
-        if (arch_context_get_sp(&new_proc->context) == 0 ||
-            arch_context_get_pc(&new_proc->context) == 0) {
-          continue; // Skip invalid process
-        }
-
-        // Mark old process as ready (it was running)
-        if (old_slot >= 0 && proc_table[old_slot].state == PROC_STATE_RUNNING) {
-          proc_table[old_slot].state = PROC_STATE_READY;
-        }
-
-        // Switch to new process
-        proc_table[idx].state = PROC_STATE_RUNNING;
-        current_pid = idx;
-        current_process = new_proc;
-
-        // Memory barrier to ensure current_process is visible to IRQ handler
-        arch_dsb();
-      }
+  process_t *old_proc = current_process;
+  // A process preempted on its way to sleep (BLOCKED but still running)
+  // stays runnable, so it gets to retest what it was waiting for
+  bool running = old_proc && (old_proc->state == PROC_STATE_RUNNING ||
+                              old_proc->state == PROC_STATE_BLOCKED);
+  uint64_t now = arch_timer_get_ticks();
+
+  // Charge whoever ran until now: the process, or the compositor
+  if (running)
+    proc_charge(old_proc, now);
+  else if (!old_proc)
+    proc_charge(NULL, now);
+
+  unsigned long load;
+  process_t *new_proc = pick_next(&load);
+  int kernel_prio = kernel_rt_prio();
+
+  if (!running) {
+    // The kernel makes way for any process, unless the compositor has a
+    // frame to draw and the process does not outrank it
+    if (!new_proc || (kernel_prio && proc_rt_prio(new_proc) <= kernel_prio))
+      return;
+  } else {
+    // The compositor takes the CPU back from a process it outranks
+    if (kernel_prio > proc_rt_prio(old_proc) &&
+        (!new_proc || kernel_prio >= proc_rt_prio(new_proc))) {
+      old_proc->state = PROC_STATE_READY;
+      current_process = NULL;
+      kernel_exec_start = now;
+      proc_depart(old_proc, now);
+      kernel_arrive(now);
+      arch_dsb();
       return;
     }
+
+    // A process keeps the CPU until its slice is used up, or something
+    // of higher priority wants it
+    if (!new_proc || !proc_should_preempt(old_proc, new_proc, load))
+      return;
+
+    // Mark old process as ready (it was running)
+    old_proc->state = PROC_STATE_READY;
   }
+
+  // Switch to new process
+  if (old_proc)
+    proc_depart(old_proc, now);
+  else
+    kernel_depart(now);
+  proc_set_running(new_proc);
+  current_process = new_proc;
+
+  // Memory barrier to ensure current_process is visible to IRQ handler
+  arch_dsb();
 }
 
-// Kill all children of a process (iterative to prevent stack overflow)
-static void kill_children(int parent_pid) {
-  // Use a work stack to avoid recursion - max depth is MAX_PROCESSES
-  int work_stack[MAX_PROCESSES];
-  int stack_top = 0;
-
-  // Push initial parent
-  work_stack[stack_top++] = parent_pid;
-
-  while (stack_top > 0) {
-    int current_parent = work_stack[--stack_top];
-
-    // Find and process all children of current_parent
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-      if (proc_table[i].state != PROC_STATE_FREE &&
-          proc_table[i].parent_pid == current_parent) {
-        int child_pid = proc_table[i].pid;
-
-        // Push child to stack so its children get processed too
-        if (stack_top < MAX_PROCESSES) {
-          work_stack[stack_top++] = child_pid;
-        }
-
-        // Kill this child (skip if it's current process)
-        if (i != current_pid) {
-          printf("[PROC] Killing child '%s' (pid %d, parent %d)\n",
-                 proc_table[i].name, child_pid, current_parent);
-          if (proc_table[i].stack_base) {
-            free(proc_table[i].stack_base);
-            proc_table[i].stack_base = NULL;
-          }
-          proc_table[i].state = PROC_STATE_FREE;
-          proc_table[i].pid = 0;
-        }
-      }
+void process_wake(process_t *proc) {
+  uint64_t flags = spin_lock_irqsave(&proc_rq_lock);
+  if (proc->state == PROC_STATE_BLOCKED) {
+    // Sleeper credit: back near the floor, not as far behind as it slept.
+    // One still on the CPU on its way to sleep never left the queue.
+    proc->state = PROC_STATE_READY;
+    if (!proc->on_rq)
+      proc_enqueue(proc, ENQUEUE_WAKEUP);
+    sched_info_queued(&proc->sched_info, arch_timer_get_ticks(), true);
+
+    // From another CPU, kick the boot CPU out of wfi to run it
+    if (arch_cpu_id() != 0)
+      smp_send_reschedule(0);
+  }
+  spin_unlock_irqrestore(&proc_rq_lock, flags);
+}
+
+void process_block(void) {
+  arch_irq_disable();
+  process_t *proc = current_process;
+  if (!proc || proc->state != PROC_STATE_BLOCKED) {
+    // Woken before we got here
+    if (proc)
+      proc->state = PROC_STATE_RUNNING;
+    arch_irq_enable();
+    return;
+  }
+
+  // Others (or the kernel) run until we are woken and picked
+  process_schedule();
+}
+
+// Timer IRQ: wake the sleeper and let it in if it is due the CPU
+static enum hrtimer_restart process_wakeup(struct hrtimer *timer) {
+  process_t *proc = container_of(timer, process_t, sleep_timer);
+
+  if (proc->state == PROC_STATE_BLOCKED) {
+    process_wake(proc);
+    process_schedule_from_irq();
+  }
+  return HRTIMER_NORESTART;
+}
+
+void process_sleep_until(uint64_t expires) {
+  process_t *proc = process_current();
+  if (!proc)
+    return;
+
+  // Block before arming, so an early expiry still finds us asleep
+  arch_irq_disable();
+  proc->state = PROC_STATE_BLOCKED;
+  hrtimer_start(&proc->sleep_timer, expires);
+
+  process_block();
+  hrtimer_cancel(&proc->sleep_timer);
+}
+
+// Kill all descendants of @parent, deepest first. The tree itself is the
+// work list, so there is no recursion and no bound on its depth.
+static void kill_children(process_t *parent) {
+  for (;;) {
+    uint64_t flags = spin_lock_irqsave(&proc_list_lock);
+    process_t *victim = parent->children;
+    while (victim && victim->children)
+      victim = victim->children;
+
+    // We cannot free the stack we are running on: orphan it instead
+    if (victim && victim == current_process) {
+      proc_unlink_child(victim);
+      victim->parent_pid = -1;
+      spin_unlock_irqrestore(&proc_list_lock, flags);
+      continue;
+    }
+    spin_unlock_irqrestore(&proc_list_lock, flags);
+
+    if (!victim)
+      return;
+
+    printf("[PROC] Killing child '%s' (pid %d, parent %d)\n", victim->name,
+           victim->pid, victim->parent_pid);
+    proc_release(victim);
+  }
+}
+
+int process_set_scheduler(int pid, int policy, int priority) {
+  if (policy == SCHED_NORMAL) {
+    if (priority != 0)
+      return -1;
+  } else if ((policy != SCHED_FIFO && policy != SCHED_RR) || priority < 1 ||
+             priority >= MAX_RT_PRIO) {
+    return -1;
+  }
+
+  unsigned long flags = arch_irq_save();
+  process_t *proc = proc_lookup(pid);
+  if (!proc) {
+    arch_irq_restore(flags);
+    return -1;
+  }
+
+  // Charge the time run so far under the old policy, then move it to the
+  // queue of the new one
+  spin_lock(&proc_rq_lock);
+  bool running = proc == current_process;
+  bool queued = proc->on_rq;
+  if (running)
+    proc_charge(proc, arch_timer_get_ticks());
+  proc_dequeue(proc);
+  proc->policy = policy;
+  proc->rt_priority = priority;
+  if (queued) {
+    proc_enqueue(proc, 0);
+    if (running)
+      proc_take(proc);
+  }
+  spin_unlock(&proc_rq_lock);
+  arch_irq_restore(flags);
+  process_put(proc);
+  return 0;
+}
+
+void process_kernel_wake(void) {
+  unsigned long flags = arch_irq_save();
+  if (!kernel_wants_cpu) {
+    kernel_wants_cpu = true;
+
+    // A process has the boot CPU: see whether the compositor outranks it.
+    // From its interrupt path the switch happens on the way out.
+    if (current_process) {
+      sched_info_queued(&kernel_sched_info, arch_timer_get_ticks(), true);
+      if (arch_cpu_id() != 0)
+        smp_send_reschedule(0);
+      else if (in_interrupt())
+        process_schedule_from_irq();
     }
   }
+  arch_irq_restore(flags);
+}
+
+void process_kernel_idle(void) {
+  kernel_wants_cpu = false;
+
+  // Hand the CPU straight to the processes the frame kept waiting
+  if (!current_process && process_count_ready() > 0)
+    process_schedule();
+}
+
+// Fill @st from @proc's counters
+static void proc_stat(struct sched_stat *st, process_t *proc, uint64_t now) {
+  st->pid = proc->pid;
+  strncpy(st->comm, proc->name, sizeof(st->comm) - 1);
+  st->comm[sizeof(st->comm) - 1] = '\0';
+  st->state = proc->state == PROC_STATE_ZOMBIE    ? 'Z'
+              : proc->state == PROC_STATE_BLOCKED ? 'S'
+                                                  : 'R';
+  st->policy = proc->policy;
+  st->prio = proc->policy == SCHED_NORMAL ? proc->nice : proc->rt_priority;
+  st->cpu = -1;
+  st->start_time = proc->start_time;
+  sched_info_snapshot(&st->info, &proc->sched_info, now,
+                      proc == current_process);
+}
+
+int process_sched_stats(struct sched_stat *out, int max) {
+  uint64_t now = arch_timer_get_ticks();
+  int count = 1;
+
+  // The compositor first, as pid 0, which no process or task has
+  if (out && max > 0) {
+    struct sched_stat *st = &out[0];
+    st->pid = 0;
+    strncpy(st->comm, "compositor", sizeof(st->comm) - 1);
+    st->comm[sizeof(st->comm) - 1] = '\0';
+    st->state = kernel_wants_cpu ? 'R' : 'S';
+    st->policy = SCHED_FIFO;
+    st->prio = COMPOSITOR_RT_PRIO;
+    st->cpu = 0;
+    st->start_time = 0;
+    sched_info_snapshot(&st->info, &kernel_sched_info, now, !current_process);
+  }
+
+  uint64_t flags = spin_lock_irqsave(&proc_list_lock);
+  for (process_t *p = proc_list; p; p = p->next, count++) {
+    if (out && count < max)
+      proc_stat(&out[count], p, now);
+  }
+  spin_unlock_irqrestore(&proc_list_lock, flags);
+  return count;
+}
+
+void process_cpu_stats(struct sched_info *out) {
+  unsigned long flags = arch_irq_save();
+  uint64_t now = arch_timer_get_ticks();
+  *out = proc_cpu_info;
+  if (current_process && current_process->sched_info.last_arrival)
+    out->run_time += now - current_process->sched_info.last_arrival;
+  arch_irq_restore(flags);
+}
+
+int process_set_nice(int pid, int nice) {
+  if (nice < NICE_MIN)
+    nice = NICE_MIN;
+  if (nice > NICE_MAX)
+    nice = NICE_MAX;
+
+  unsigned long flags = arch_irq_save();
+  process_t *proc = proc_lookup(pid);
+  if (!proc) {
+    arch_irq_restore(flags);
+    return -1;
+  }
+
+  // Charge the time run so far at the old weight
+  spin_lock(&proc_rq_lock);
+  if (proc == current_process)
+    fair_account(&proc->se, arch_timer_get_ticks());
+  proc->nice = nice;
+  if (proc->se.weight)
+    fair_reweight(&proc_cfs, &proc->se, sched_nice_to_weight(nice));
+  spin_unlock(&proc_rq_lock);
+  arch_irq_restore(flags);
+  process_put(proc);
+  return 0;
 }
 
 // Kill a process by PID
@@ -657,41 +1174,27 @@ int process_kill(int pid) {
   }
 
   // Find the process
-  int slot = -1;
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    if (proc_table[i].pid == pid && proc_table[i].state != PROC_STATE_FREE) {
-      slot = i;
-      break;
-    }
-  }
-
-  if (slot < 0) {
+  process_t *proc = process_get(pid);
+  if (!proc) {
     printf("[PROC] Process %d not found\n", pid);
     return -1;
   }
 
-  process_t *proc = &proc_table[slot];
-
   // Don't allow killing the current process this way - use exit() instead
-  if (slot == current_pid) {
+  if (proc == current_process) {
     printf("[PROC] Cannot kill current process (use exit)\n");
+    process_put(proc);
     return -1;
   }
 
   printf("[PROC] Killing process '%s' (pid %d)\n", proc->name, pid);
 
   // First kill all children of this process
-  kill_children(pid);
+  kill_children(proc);
 
-  // Free the process memory
-  if (proc->stack_base) {
-    free(proc->stack_base);
-    proc->stack_base = NULL;
-  }
-
-  // Mark slot as free
-  proc->state = PROC_STATE_FREE;
-  proc->pid = 0;
+  // Then free it, PID and all
+  proc_release(proc);
+  process_put(proc);
 
   return 0;
 }
@@ -2,7 +2,19 @@
  * Vib-OS Process Management (ported from VibeOS)
  *
  * Preemptive multitasking - timer IRQ forces context switches.
- * Processes get 200ms time slices (100Hz timer, preempt every 20 ticks).
+ * The process furthest behind in weighted CPU time runs next; a process
+ * is preempted on the tick once its slice of SCHED_LATENCY_MS is used.
+ * SCHED_FIFO and SCHED_RR processes (sched/rt.h) run ahead of those, by
+ * priority, within the real-time runtime allowance.
+ *
+ * The kernel context the processes share the boot CPU with is the
+ * desktop compositor. Once input or its frame timer gives it work it
+ * takes the CPU back at COMPOSITOR_RT_PRIO, ahead of every process below
+ * that, until it has drawn the frame.
+ *
+ * Process structures are slab-allocated and found by PID through a hash,
+ * with PIDs from the allocator shared with scheduler tasks (sched/pid.h),
+ * so there is no fixed limit on their number.
  */
 
 #ifndef PROCESS_H
@@ -10,18 +22,25 @@
 
 #include "../include/types.h"
 #include "../include/arch/arch.h"
+#include "../include/arch/fpsimd.h"
+#include "../include/sched/fair.h"
+#include "../include/sched/hrtimer.h"
+#include "../include/sched/pid.h"
+#include "../include/sched/rt.h"
+#include "../include/sched/stats.h"
 
 #define PROCESS_NAME_MAX 32
 #define PROCESS_STACK_SIZE 0x100000  // 1MB per process (TLS crypto needs lots of stack)
-#define MAX_PROCESSES 16
+
+#define COMPOSITOR_RT_PRIO 50       // Real-time priority of the desktop loop
 
 // Process states
 typedef enum {
-    PROC_STATE_FREE = 0,     // Slot available
+    PROC_STATE_FREE = 0,     // Released (never seen on a live process)
     PROC_STATE_READY,        // Ready to run
     PROC_STATE_RUNNING,      // Currently executing
     PROC_STATE_BLOCKED,      // Waiting for something
-    PROC_STATE_ZOMBIE        // Exited, waiting to be cleaned up
+    PROC_STATE_ZOMBIE        // Exited, waiting to be reaped
 } proc_state_t;
 
 // CPU context is now defined in arch/arch.h for multi-architecture support
@@ -43,7 +62,33 @@ typedef struct process {
 
     // Exit
     int exit_status;
-    int parent_pid;           // Who spawned us
+    int parent_pid;           // Who spawned us (-1 for the kernel)
+    bool waited;              // process_exec_args() collects the status
+
+    // Bookkeeping
+    struct pid_node pid_node; // In the PID hash
+    int usage;                // References; the last process_put() frees it
+    struct process *next;     // All processes, in creation order
+    struct process *prev;
+    struct process *parent;   // Spawning process, NULL for the kernel
+    struct process *children; // First child
+    struct process *sibling;  // Next child of the same parent
+
+    // Scheduling (weight is 0 until process_create places the process)
+    int nice;
+    struct sched_entity se;     // On the fair queue if SCHED_NORMAL
+    struct sched_rt_entity rt;  // On the real-time queue otherwise
+    bool on_rq;                 // Runnable: queued, or running
+    struct hrtimer sleep_timer; // Ends a process_sleep_until()
+    int policy;                 // SCHED_NORMAL, SCHED_FIFO or SCHED_RR
+    int rt_priority;            // 1..MAX_RT_PRIO-1 unless SCHED_NORMAL
+
+    // Accounting (sched/stats.h)
+    uint64_t start_time;        // Counter when created
+    struct sched_info sched_info;
+
+    // FP/SIMD registers, saved only once used (arch/fpsimd.h)
+    struct fpsimd_state fpsimd;
 } process_t;
 
 // Initialize process subsystem
@@ -62,9 +107,12 @@ int process_exec_args(const char *path, int argc, char **argv);
 // Exit current process
 void process_exit(int status);
 
-// Get current/specific process
+// Get current/specific process. process_get() takes a reference, which
+// keeps the structure (not the process) around until process_put(); a
+// process released in the meantime is left PROC_STATE_FREE.
 process_t *process_current(void);
 process_t *process_get(int pid);
+void process_put(process_t *proc);
 
 // Current running process (NULL if kernel)
 extern process_t *current_process;
@@ -76,15 +124,38 @@ process_t **process_get_current_ptr(void);
 void process_yield(void);              // Give up CPU voluntarily
 void process_schedule(void);           // Pick next process to run
 void process_schedule_from_irq(void);  // Called from timer IRQ for preemption
+
+// Block the current process until the counter reaches @expires (absolute
+// ticks); the CPU goes to other processes or the kernel meanwhile
+void process_sleep_until(uint64_t expires);
+
+// Give up the CPU until process_wake(); the caller has set its state to
+// PROC_STATE_BLOCKED, and returns at once if it was woken in between
+void process_block(void);
+
+// Make a blocked process runnable again (any CPU, any context)
+void process_wake(process_t *proc);
 int process_count_ready(void);         // Count runnable processes
 
 // Context switch (implemented in assembly)
 void process_context_switch(cpu_context_t *old_ctx, cpu_context_t *new_ctx);
 
-// Get info about process by index (for sysmon)
-// Returns 1 if slot is active, 0 if free
+// Get info about the index-th process, in creation order (for sysmon)
+// Returns 1 if there is one, 0 past the end
 int process_get_info(int index, char *name, int name_size, int *state);
 
+// Set the nice value of a process (pid 0 = current), -20..19
+// Returns 0 on success, -1 if not found
+int process_set_nice(int pid, int nice);
+
+// Set the scheduling policy of a process (pid 0 = current): SCHED_NORMAL
+// with priority 0, or SCHED_FIFO/SCHED_RR with 1..MAX_RT_PRIO-1
+// Returns 0 on success, -1 if not found or invalid
+int process_set_scheduler(int pid, int policy, int priority);
+
+// process_kernel_wake() and process_kernel_idle() are in sched/sched.h,
+// where drivers can reach them
+
 // Kill a process by PID
 // Returns 0 on success, -1 if not found or cannot kill
 int process_kill(int pid);
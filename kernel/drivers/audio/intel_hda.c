@@ -3,9 +3,14 @@
  */
 
 #include "drivers/intel_hda.h"
+#include "arch/arch.h"
 #include "drivers/pci.h"
 #include "mm/kmalloc.h"
 #include "printk.h"
+#include "sched/hrtimer.h"
+#include "sched/rt.h"
+#include "sched/sched.h"
+#include "sync/mutex.h"
 #include "types.h"
 
 /* Helper prototypes */
@@ -380,12 +385,25 @@ void intel_hda_init(pci_device_t *pci_dev) {
 #define HDA_RING_NUM_ENTRIES 32           /* BDL entries for ring */
 #define HDA_RING_ENTRY_SIZE (HDA_RING_BUFFER_SIZE / HDA_RING_NUM_ENTRIES)
 
+/* Refill thread: a SCHED_FIFO task that keeps up with the hardware */
+#define HDA_REFILL_MS 10
+#define HDA_REFILL_PRIO 60
+
 /* Global DMA Resources for Output Stream 0 */
 static uint8_t *dma_buffer = 0;
 static hda_bdl_entry_t *bdl = 0;
 static uint32_t ring_write_pos = 0;    /* Where we write new data */
 static uint32_t ring_play_pos = 0;     /* Where hardware is playing */
+static uint32_t ring_queued = 0;       /* Written but not yet played */
 static volatile int audio_playing = 0; /* Is audio currently playing */
+static uint64_t ring_underruns = 0;    /* Times the hardware caught up */
+
+/* Covers the ring and its positions; writers and the refill thread */
+static DEFINE_MUTEX(hda_ring_lock);
+
+#ifdef ARCH_ARM64
+static struct task_struct *refill_task = 0;
+#endif
 
 /* Initialize DMA ring buffer resources */
 static int hda_init_ring_buffer(void) {
@@ -398,7 +416,8 @@ static int hda_init_ring_buffer(void) {
     return -1;
   bdl = (hda_bdl_entry_t *)(((uint64_t)raw_bdl + 127) & ~127ULL);
 
-  /* DMA Buffer alignment (128 bytes recommended) */
+  /* DMA Buffer alignment (128 bytes recommended); the BDL entries below
+     address it physically, so it must come from kmalloc, not vmalloc */
   void *raw_buf = kmalloc(HDA_RING_BUFFER_SIZE + 128);
   if (!raw_buf)
     return -1;
@@ -416,6 +435,7 @@ static int hda_init_ring_buffer(void) {
 
   ring_write_pos = 0;
   ring_play_pos = 0;
+  ring_queued = 0;
   audio_playing = 0;
 
   return 0;
@@ -442,6 +462,71 @@ static void hda_flush_cache(void *addr, size_t size) {
 #endif
 }
 
+/*
+ * Catch up with the hardware: silence what it has played since the last
+ * look, so an underrun plays silence rather than stale samples, and if it
+ * read past the data written, restart writing where it is now.
+ * Called with hda_ring_lock held.
+ */
+static void hda_ring_update(void) {
+  if (!audio_playing)
+    return;
+
+  uint32_t pos = hda_read32(stream_base + HDA_SD_LPIB) % HDA_RING_BUFFER_SIZE;
+  uint32_t played =
+      (pos + HDA_RING_BUFFER_SIZE - ring_play_pos) % HDA_RING_BUFFER_SIZE;
+  if (!played)
+    return;
+
+  if (pos >= ring_play_pos) {
+    memset(dma_buffer + ring_play_pos, 0, played);
+  } else {
+    memset(dma_buffer + ring_play_pos, 0, HDA_RING_BUFFER_SIZE - ring_play_pos);
+    memset(dma_buffer, 0, pos);
+  }
+  hda_flush_cache(dma_buffer, HDA_RING_BUFFER_SIZE);
+
+  if (played > ring_queued) {
+    ring_underruns++;
+    ring_write_pos = pos;
+    ring_queued = 0;
+  } else {
+    ring_queued -= played;
+  }
+  ring_play_pos = pos;
+}
+
+#ifdef ARCH_ARM64
+static void hda_refill_thread(void *arg) {
+  (void)arg;
+  uint64_t period = ns_to_ticks((uint64_t)HDA_REFILL_MS * NSEC_PER_MSEC);
+  uint64_t next = arch_timer_get_ticks();
+
+  for (;;) {
+    next += period;
+    hrtimer_sleep_until(next);
+
+    mutex_lock(&hda_ring_lock);
+    hda_ring_update();
+    mutex_unlock(&hda_ring_lock);
+  }
+}
+
+/* Start the refill thread with the first stream */
+static void hda_start_refill(void) {
+  if (refill_task)
+    return;
+
+  refill_task = create_task(hda_refill_thread, 0, PF_KTHREAD);
+  if (!refill_task) {
+    printk("HDA: Failed to start refill thread\n");
+    return;
+  }
+  snprintf(refill_task->comm, TASK_COMM_LEN, "hda-refill");
+  sched_setscheduler(refill_task, SCHED_FIFO, HDA_REFILL_PRIO);
+}
+#endif
+
 int intel_hda_play_pcm(const void *data, uint32_t samples, uint8_t channels,
                        uint32_t sample_rate) {
   if (!hda_regs)
@@ -463,6 +548,9 @@ int intel_hda_play_pcm(const void *data, uint32_t samples, uint8_t channels,
 
   uint32_t ctl_offset = stream_base + HDA_SD_CTL;
 
+  mutex_lock(&hda_ring_lock);
+  hda_ring_update();
+
   /* If not already playing, initialize stream */
   if (!audio_playing) {
     /* 1. Reset Stream properly */
@@ -487,6 +575,8 @@ int intel_hda_play_pcm(const void *data, uint32_t samples, uint8_t channels,
     }
 
     ring_write_pos = 0;
+    ring_play_pos = 0;
+    ring_queued = 0;
   }
 
   /* Copy data to ring buffer with proper wrap-around handling */
@@ -501,6 +591,9 @@ int intel_hda_play_pcm(const void *data, uint32_t samples, uint8_t channels,
            size - space_to_end);
   }
   ring_write_pos = (ring_write_pos + size) % HDA_RING_BUFFER_SIZE;
+  ring_queued += size;
+  if (ring_queued > HDA_RING_BUFFER_SIZE)
+    ring_queued = HDA_RING_BUFFER_SIZE; /* Overwrote unplayed data */
 
   /* Flush data cache for DMA coherency */
   hda_flush_cache(dma_buffer, HDA_RING_BUFFER_SIZE);
@@ -537,15 +630,17 @@ int intel_hda_play_pcm(const void *data, uint32_t samples, uint8_t channels,
 
     audio_playing = 1;
     printk("HDA: Audio stream started (ring buffer mode)\n");
+#ifdef ARCH_ARM64
+    hda_start_refill();
+#endif
   }
+  mutex_unlock(&hda_ring_lock);
 
   /* Calculate playback time based on sample rate */
   uint32_t playback_ms = (samples * 1000) / sample_rate;
 
-  /* Non-blocking wait: short delay to allow DMA to start, then return */
-  /* For truly async audio, we'd use interrupts. For now, brief wait. */
-  for (volatile int w = 0; w < (int)(playback_ms * 10000); w++)
-    ;
+  /* Pace the caller to the clip's length; it sleeps rather than spins */
+  hrtimer_nanosleep((uint64_t)playback_ms * NSEC_PER_MSEC, NULL);
 
   return samples;
 }
@@ -555,14 +650,22 @@ void intel_hda_stop(void) {
   if (!hda_regs || !audio_playing)
     return;
 
+  mutex_lock(&hda_ring_lock);
   uint32_t ctl_offset = stream_base + HDA_SD_CTL;
   hda_write32(ctl_offset, 0);
   audio_playing = 0;
   ring_write_pos = 0;
   ring_play_pos = 0;
+  ring_queued = 0;
+  mutex_unlock(&hda_ring_lock);
 
   printk("HDA: Audio stream stopped\n");
 }
 
 /* Check if audio is currently playing */
 int intel_hda_is_playing(void) { return audio_playing; }
+
+/* Times playback ran out of data */
+uint64_t intel_hda_underruns(void) {
+  return __atomic_load_n(&ring_underruns, __ATOMIC_RELAXED);
+}
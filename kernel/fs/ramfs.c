@@ -2,11 +2,26 @@
  * UnixOS Kernel - Ramfs (RAM Filesystem)
  * 
  * Simple in-memory filesystem for initial root filesystem.
+ *
+ * File data lives in a per-inode array of pages so cold pages can be
+ * compressed one at a time. ramfs_lock covers the tree and each page's
+ * state. Readers and writers copy to and from a page after dropping the
+ * lock, with the page pinned so kzramd leaves it alone meanwhile.
+ *
+ * kzramd compresses a snapshot of the page outside the lock, and only
+ * installs the result if the page was neither pinned nor touched since.
  */
 
+#include "fs/ramfs.h"
+#include "arch/arch.h"
 #include "fs/vfs.h"
+#include "lz4.h"
 #include "mm/kmalloc.h"
 #include "printk.h"
+#include "sched/hrtimer.h"
+#include "sched/sched.h"
+#include "string.h"
+#include "sync/spinlock.h"
 
 /* ===================================================================== */
 /* Ramfs structures */
@@ -14,7 +29,27 @@
 
 #define RAMFS_MAX_NAME      255
 #define RAMFS_MAX_FILES     1024
-#define RAMFS_BLOCK_SIZE    4096
+
+#define RAMFS_COLD_SECS     30      /* Untouched this long before compressing */
+#define RAMFS_SCAN_MS       1000    /* Interval between cold page scans */
+#define RAMFS_ZSCAN         64      /* Page slots examined per lock hold */
+#define RAMFS_ZMAX          (RAMFS_BLOCK_SIZE * 3 / 4)  /* Worse than this stays */
+
+#define RAMFS_PAGE_ZERO             0x01    /* Dropped, reads as zeros */
+#define RAMFS_PAGE_INCOMPRESSIBLE   0x02    /* Don't retry until rewritten */
+
+/*
+ * One page of file data: resident (data), compressed (zdata), or absent,
+ * which reads as zeros - a hole or a dropped zero page.
+ */
+struct ramfs_page {
+    uint8_t *data;
+    uint8_t *zdata;
+    uint16_t zlen;
+    uint16_t flags;
+    uint16_t pins;          /* Copies in progress with ramfs_lock dropped */
+    uint64_t atime;         /* Timer ticks at last access */
+};
 
 struct ramfs_inode {
     ino_t ino;
@@ -22,8 +57,8 @@ struct ramfs_inode {
     uid_t uid;
     gid_t gid;
     size_t size;
-    uint8_t *data;          /* File data */
-    size_t data_capacity;   /* Allocated size */
+    struct ramfs_page *pages;
+    size_t nr_pages;        /* Slots in @pages */
     struct ramfs_inode *parent;
     struct ramfs_inode *children;   /* First child (for directories) */
     struct ramfs_inode *sibling;    /* Next sibling */
@@ -41,6 +76,20 @@ struct ramfs_sb_info {
 /* ===================================================================== */
 
 static struct ramfs_sb_info ramfs_sb;
+static DEFINE_SPINLOCK(ramfs_lock);
+
+static struct task_struct *kzramd_task;
+static uint64_t ramfs_compressions;
+static uint64_t ramfs_faults;
+
+/* Compression scratch space, only used by kzramd */
+static uint8_t ramfs_zsrc[RAMFS_BLOCK_SIZE];
+static uint8_t ramfs_zbuf[RAMFS_ZMAX];
+static uint8_t ramfs_zwrk[LZ4_WORKMEM_SIZE];
+
+/* Where kzramd's scan stands; NULL to start over from the root */
+static struct ramfs_inode *ramfs_zcursor;
+static size_t ramfs_zidx;
 
 /* ===================================================================== */
 /* Inode operations */
@@ -58,8 +107,8 @@ static struct ramfs_inode *ramfs_alloc_inode(mode_t mode, const char *name)
     inode->uid = 0;
     inode->gid = 0;
     inode->size = 0;
-    inode->data = NULL;
-    inode->data_capacity = 0;
+    inode->pages = NULL;
+    inode->nr_pages = 0;
     inode->parent = NULL;
     inode->children = NULL;
     inode->sibling = NULL;
@@ -80,9 +129,11 @@ static void ramfs_free_inode(struct ramfs_inode *inode)
 {
     if (!inode) return;
     
-    if (inode->data) {
-        kfree(inode->data);
+    for (size_t i = 0; i < inode->nr_pages; i++) {
+        kfree(inode->pages[i].data);
+        kfree(inode->pages[i].zdata);
     }
+    kfree(inode->pages);
     
     ramfs_sb.inode_count--;
     kfree(inode);
@@ -118,13 +169,188 @@ static int ramfs_add_child(struct ramfs_inode *dir, struct ramfs_inode *child)
         return -ENOTDIR;
     }
     
+    uint64_t flags = spin_lock_irqsave(&ramfs_lock);
     child->parent = dir;
     child->sibling = dir->children;
     dir->children = child;
+    spin_unlock_irqrestore(&ramfs_lock, flags);
     
     return 0;
 }
 
+/* Preorder successor, for walking the whole tree */
+static struct ramfs_inode *ramfs_next_inode(struct ramfs_inode *inode)
+{
+    if (inode->children) {
+        return inode->children;
+    }
+    while (inode) {
+        if (inode->sibling) {
+            return inode->sibling;
+        }
+        inode = inode->parent;
+    }
+    return NULL;
+}
+
+/* ===================================================================== */
+/* Page storage */
+/* ===================================================================== */
+
+/* Make room for pages covering @size bytes (ramfs_lock held) */
+static int ramfs_reserve_pages(struct ramfs_inode *inode, size_t size)
+{
+    size_t need = (size + RAMFS_BLOCK_SIZE - 1) / RAMFS_BLOCK_SIZE;
+    if (need <= inode->nr_pages) {
+        return 0;
+    }
+
+    size_t slots = inode->nr_pages ? inode->nr_pages : 1;
+    while (slots < need) {
+        slots *= 2;
+    }
+    struct ramfs_page *pages = krealloc(inode->pages, slots * sizeof(*pages),
+                                        GFP_KERNEL | GFP_ZERO);
+    if (!pages) {
+        return -ENOMEM;
+    }
+    inode->pages = pages;
+    inode->nr_pages = slots;
+    return 0;
+}
+
+/*
+ * Get page @idx's data, decompressing it if needed and allocating a
+ * zeroed page for a hole if @alloc (ramfs_lock held). Returns NULL for
+ * a hole when !@alloc, or if memory runs out.
+ */
+static uint8_t *ramfs_page_get(struct ramfs_inode *inode, size_t idx, bool alloc)
+{
+    struct ramfs_page *page = &inode->pages[idx];
+
+    page->atime = arch_timer_get_ticks();
+    if (page->data || (!page->zdata && !alloc)) {
+        return page->data;
+    }
+
+    uint8_t *data = kmalloc(RAMFS_BLOCK_SIZE, GFP_KERNEL);
+    if (!data) {
+        return NULL;
+    }
+
+    if (page->zdata) {
+        if (lz4_decompress(page->zdata, page->zlen, data, RAMFS_BLOCK_SIZE) !=
+            RAMFS_BLOCK_SIZE) {
+            printk(KERN_ERR "RAMFS: Corrupt compressed page %lu of inode %lu\n",
+                   (unsigned long)idx, (unsigned long)inode->ino);
+            kfree(data);
+            return NULL;
+        }
+        kfree(page->zdata);
+        page->zdata = NULL;
+        page->zlen = 0;
+        ramfs_faults++;
+    } else {
+        memset(data, 0, RAMFS_BLOCK_SIZE);
+        if (page->flags & RAMFS_PAGE_ZERO) {
+            ramfs_faults++;
+        }
+    }
+
+    page->flags = 0;
+    page->data = data;
+    return data;
+}
+
+/* Done copying page @idx with ramfs_lock dropped; @pages may have moved */
+static void ramfs_page_unpin(struct ramfs_inode *inode, size_t idx)
+{
+    uint64_t flags = spin_lock_irqsave(&ramfs_lock);
+    inode->pages[idx].pins--;
+    spin_unlock_irqrestore(&ramfs_lock, flags);
+}
+
+/* Copy @count bytes at @pos out of @inode, zero-filling holes */
+static ssize_t ramfs_copy_out(struct ramfs_inode *inode, char *buf,
+                              size_t count, loff_t pos)
+{
+    size_t done = 0;
+
+    while (done < count) {
+        size_t off = pos + done;
+        size_t idx = off / RAMFS_BLOCK_SIZE;
+        size_t in = off % RAMFS_BLOCK_SIZE;
+        size_t chunk = RAMFS_BLOCK_SIZE - in;
+        if (chunk > count - done) {
+            chunk = count - done;
+        }
+
+        uint64_t flags = spin_lock_irqsave(&ramfs_lock);
+        uint8_t *data = ramfs_page_get(inode, idx, false);
+        bool hole = !data && !inode->pages[idx].zdata;
+        if (data) {
+            inode->pages[idx].pins++;
+        }
+        spin_unlock_irqrestore(&ramfs_lock, flags);
+
+        if (data) {
+            memcpy(buf + done, data + in, chunk);
+            ramfs_page_unpin(inode, idx);
+        } else if (hole) {
+            memset(buf + done, 0, chunk);
+        } else {
+            return done ? (ssize_t)done : -ENOMEM;
+        }
+        done += chunk;
+    }
+
+    return done;
+}
+
+/* Copy @count bytes into @inode at @pos, growing it as needed */
+static ssize_t ramfs_copy_in(struct ramfs_inode *inode, const char *buf,
+                             size_t count, loff_t pos)
+{
+    size_t done = 0;
+
+    uint64_t flags = spin_lock_irqsave(&ramfs_lock);
+    int ret = ramfs_reserve_pages(inode, pos + count);
+    spin_unlock_irqrestore(&ramfs_lock, flags);
+    if (ret) {
+        return ret;
+    }
+
+    while (done < count) {
+        size_t off = pos + done;
+        size_t idx = off / RAMFS_BLOCK_SIZE;
+        size_t in = off % RAMFS_BLOCK_SIZE;
+        size_t chunk = RAMFS_BLOCK_SIZE - in;
+        if (chunk > count - done) {
+            chunk = count - done;
+        }
+
+        flags = spin_lock_irqsave(&ramfs_lock);
+        uint8_t *data = ramfs_page_get(inode, idx, true);
+        if (data) {
+            inode->pages[idx].flags &= ~RAMFS_PAGE_INCOMPRESSIBLE;
+            inode->pages[idx].pins++;
+        }
+        spin_unlock_irqrestore(&ramfs_lock, flags);
+        if (!data) {
+            break;
+        }
+
+        memcpy(data + in, buf + done, chunk);
+        ramfs_page_unpin(inode, idx);
+        done += chunk;
+    }
+
+    if (pos + done > inode->size) {
+        inode->size = pos + done;
+    }
+    return done ? (ssize_t)done : -ENOMEM;
+}
+
 /* ===================================================================== */
 /* File operations */
 /* ===================================================================== */
@@ -134,7 +360,7 @@ static ssize_t ramfs_read(struct file *file, char *buf, size_t count, loff_t *po
     /* Get ramfs inode from file */
     struct ramfs_inode *inode = (struct ramfs_inode *)file->private_data;
     
-    if (!inode || !inode->data) {
+    if (!inode) {
         return 0;
     }
     
@@ -145,13 +371,11 @@ static ssize_t ramfs_read(struct file *file, char *buf, size_t count, loff_t *po
     size_t available = inode->size - *pos;
     size_t to_read = count < available ? count : available;
     
-    /* Copy data */
-    for (size_t i = 0; i < to_read; i++) {
-        buf[i] = inode->data[*pos + i];
+    ssize_t ret = ramfs_copy_out(inode, buf, to_read, *pos);
+    if (ret > 0) {
+        *pos += ret;
     }
-    
-    *pos += to_read;
-    return to_read;
+    return ret;
 }
 
 static ssize_t ramfs_write(struct file *file, const char *buf, size_t count, loff_t *pos)
@@ -162,40 +386,11 @@ static ssize_t ramfs_write(struct file *file, const char *buf, size_t count, lof
         return -EIO;
     }
     
-    size_t new_size = *pos + count;
-    
-    /* Grow data buffer if needed */
-    if (new_size > inode->data_capacity) {
-        size_t new_cap = (new_size + RAMFS_BLOCK_SIZE - 1) & ~(RAMFS_BLOCK_SIZE - 1);
-        uint8_t *new_data = kmalloc(new_cap, GFP_KERNEL);
-        if (!new_data) {
-            return -ENOMEM;
-        }
-        
-        /* Copy old data */
-        if (inode->data) {
-            for (size_t i = 0; i < inode->size; i++) {
-                new_data[i] = inode->data[i];
-            }
-            kfree(inode->data);
-        }
-        
-        inode->data = new_data;
-        inode->data_capacity = new_cap;
-    }
-    
-    /* Write data */
-    for (size_t i = 0; i < count; i++) {
-        inode->data[*pos + i] = buf[i];
+    ssize_t ret = ramfs_copy_in(inode, buf, count, *pos);
+    if (ret > 0) {
+        *pos += ret;
     }
-    
-    *pos += count;
-    
-    if (*pos > (loff_t)inode->size) {
-        inode->size = *pos;
-    }
-    
-    return count;
+    return ret;
 }
 
 static int ramfs_open(struct inode *vfs_inode, struct file *file)
@@ -378,6 +573,7 @@ static int ramfs_rename(struct inode *old_dir, struct dentry *old_dentry,
     }
     
     /* 1. Unlink from old_dir */
+    uint64_t flags = spin_lock_irqsave(&ramfs_lock);
     if (old_ram_dir->children == target) {
         old_ram_dir->children = target->sibling;
     } else {
@@ -399,6 +595,7 @@ static int ramfs_rename(struct inode *old_dir, struct dentry *old_dentry,
         target->sibling = old_ram_dir->children;
         old_ram_dir->children = target;
     }
+    spin_unlock_irqrestore(&ramfs_lock, flags);
     
     /* 3. Rename */
     int i;
@@ -421,6 +618,7 @@ static int ramfs_unlink(struct inode *dir, struct dentry *dentry)
     if (S_ISDIR(target->mode)) return -EISDIR;
     
     /* Remove from parent's child list */
+    uint64_t flags = spin_lock_irqsave(&ramfs_lock);
     struct ramfs_inode **prev = &ram_dir->children;
     while (*prev) {
         if (*prev == target) {
@@ -429,6 +627,10 @@ static int ramfs_unlink(struct inode *dir, struct dentry *dentry)
         }
         prev = &((*prev)->sibling);
     }
+    if (ramfs_zcursor == target) {
+        ramfs_zcursor = NULL;
+    }
+    spin_unlock_irqrestore(&ramfs_lock, flags);
     
     /* Free the inode and its data */
     ramfs_free_inode(target);
@@ -450,6 +652,7 @@ static int ramfs_rmdir(struct inode *dir, struct dentry *dentry)
     if (target->children) return -ENOTEMPTY;
     
     /* Remove from parent's child list */
+    uint64_t flags = spin_lock_irqsave(&ramfs_lock);
     struct ramfs_inode **prev = &ram_dir->children;
     while (*prev) {
         if (*prev == target) {
@@ -458,6 +661,10 @@ static int ramfs_rmdir(struct inode *dir, struct dentry *dentry)
         }
         prev = &((*prev)->sibling);
     }
+    if (ramfs_zcursor == target) {
+        ramfs_zcursor = NULL;
+    }
+    spin_unlock_irqrestore(&ramfs_lock, flags);
     
     /* Free the inode */
     ramfs_free_inode(target);
@@ -598,14 +805,7 @@ int ramfs_create_file(const char *path, mode_t mode, const char *content)
         size_t len = 0;
         while (content[len]) len++;
         
-        file->data = kmalloc(len, GFP_KERNEL);
-        if (file->data) {
-            for (size_t i = 0; i < len; i++) {
-                file->data[i] = content[i];
-            }
-            file->size = len;
-            file->data_capacity = len;
-        }
+        ramfs_copy_in(file, content, len, 0);
     }
     
     ramfs_add_child(parent, file);
@@ -683,15 +883,11 @@ int ramfs_create_file_bytes(const char *path, mode_t mode, const uint8_t *data,
     }
 
     if (data && size > 0) {
-        file->data = kmalloc(size, GFP_KERNEL);
-        if (!file->data) {
-            return -ENOMEM;
-        }
-        for (size_t i = 0; i < size; i++) {
-            file->data[i] = data[i];
+        ssize_t ret = ramfs_copy_in(file, (const char *)data, size, 0);
+        if (ret != (ssize_t)size) {
+            ramfs_free_inode(file);
+            return ret < 0 ? ret : -ENOMEM;
         }
-        file->size = size;
-        file->data_capacity = size;
     }
 
     ramfs_add_child(parent, file);
@@ -716,3 +912,200 @@ int ramfs_create_dir(const char *path, mode_t mode)
     
     return 0;
 }
+
+/* ===================================================================== */
+/* Compressed tier */
+/* ===================================================================== */
+
+static bool ramfs_page_is_zero(const uint8_t *data)
+{
+    const uint64_t *words = (const uint64_t *)data;
+    for (size_t i = 0; i < RAMFS_BLOCK_SIZE / sizeof(uint64_t); i++) {
+        if (words[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Look at up to RAMFS_ZSCAN page slots from the cursor for a cold page,
+ * and copy it to ramfs_zsrc (ramfs_lock held). The cursor is left just
+ * past it. Returns 1 if found, 0 to try again, -1 once the scan is done.
+ */
+static int ramfs_next_cold(uint64_t now, uint64_t cold_ticks, uint64_t *atime)
+{
+    if (!ramfs_zcursor) {
+        ramfs_zcursor = ramfs_sb.root;
+        ramfs_zidx = 0;
+    }
+
+    for (int n = 0; ramfs_zcursor && n < RAMFS_ZSCAN; n++) {
+        struct ramfs_inode *inode = ramfs_zcursor;
+        if (ramfs_zidx >= inode->nr_pages) {
+            ramfs_zcursor = ramfs_next_inode(inode);
+            ramfs_zidx = 0;
+            continue;
+        }
+
+        struct ramfs_page *page = &inode->pages[ramfs_zidx++];
+        if (page->data && !page->pins &&
+            !(page->flags & RAMFS_PAGE_INCOMPRESSIBLE) &&
+            now - page->atime >= cold_ticks) {
+            memcpy(ramfs_zsrc, page->data, RAMFS_BLOCK_SIZE);
+            *atime = page->atime;
+            return 1;
+        }
+    }
+
+    return ramfs_zcursor ? 0 : -1;
+}
+
+/*
+ * Compress the next cold page, if any, with ramfs_lock dropped while
+ * LZ4 runs. Returns as ramfs_next_cold().
+ */
+static int ramfs_compress_next(uint64_t now, uint64_t cold_ticks)
+{
+    uint64_t atime = 0;
+
+    uint64_t flags = spin_lock_irqsave(&ramfs_lock);
+    int found = ramfs_next_cold(now, cold_ticks, &atime);
+    struct ramfs_inode *inode = ramfs_zcursor;
+    size_t idx = ramfs_zidx - 1;
+    spin_unlock_irqrestore(&ramfs_lock, flags);
+    if (found <= 0) {
+        return found;
+    }
+
+    /* JPEGs and MP3s are already compressed; give up at RAMFS_ZMAX */
+    bool zero = ramfs_page_is_zero(ramfs_zsrc);
+    uint8_t *zdata = NULL;
+    size_t zlen = 0;
+    if (!zero) {
+        zlen = lz4_compress(ramfs_zsrc, RAMFS_BLOCK_SIZE, ramfs_zbuf,
+                            RAMFS_ZMAX, ramfs_zwrk);
+        if (zlen) {
+            zdata = kmalloc(zlen, GFP_KERNEL);
+            if (!zdata) {
+                return 1;
+            }
+            memcpy(zdata, ramfs_zbuf, zlen);
+        }
+    }
+
+    /* Unlinked, pinned or accessed since the snapshot: leave it */
+    uint8_t *old = NULL;
+    flags = spin_lock_irqsave(&ramfs_lock);
+    if (ramfs_zcursor == inode && idx < inode->nr_pages) {
+        struct ramfs_page *page = &inode->pages[idx];
+        if (page->data && !page->pins && page->atime == atime) {
+            if (zero || zdata) {
+                old = page->data;
+                page->data = NULL;
+                page->zdata = zdata;
+                page->zlen = zlen;
+                page->flags |= zero ? RAMFS_PAGE_ZERO : 0;
+                zdata = NULL;
+                ramfs_compressions++;
+            } else {
+                page->flags |= RAMFS_PAGE_INCOMPRESSIBLE;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&ramfs_lock, flags);
+
+    kfree(old);
+    kfree(zdata);
+    return 1;
+}
+
+/*
+ * Idle-priority scanner: a pass over every page, yielding between
+ * pages, then a sleep of RAMFS_SCAN_MS so an idle CPU stays idle.
+ */
+static void kzramd(void *arg)
+{
+    (void)arg;
+
+    uint64_t cold_ticks = arch_timer_get_frequency() * RAMFS_COLD_SECS;
+
+    for (;;) {
+        uint64_t now = arch_timer_get_ticks();
+        while (ramfs_compress_next(now, cold_ticks) >= 0) {
+            schedule();
+        }
+        hrtimer_nanosleep((uint64_t)RAMFS_SCAN_MS * NSEC_PER_MSEC, NULL);
+    }
+}
+
+void ramfs_zstart(void)
+{
+#ifdef ARCH_ARM64
+    kzramd_task = create_task(kzramd, NULL, PF_KTHREAD | PF_IDLEPRIO);
+    if (!kzramd_task) {
+        printk(KERN_ERR "RAMFS: Failed to start kzramd\n");
+        return;
+    }
+    strncpy(kzramd_task->comm, "kzramd", TASK_COMM_LEN - 1);
+    kzramd_task->nice = NICE_MAX;
+    kzramd_task->prio = kzramd_task->static_prio = PRIO_MAX;
+#else
+    /* No kernel thread switching here - pages stay resident */
+#endif
+}
+
+void ramfs_zget_stats(struct ramfs_zstats *st)
+{
+    memset(st, 0, sizeof(*st));
+
+    uint64_t flags = spin_lock_irqsave(&ramfs_lock);
+    for (struct ramfs_inode *inode = ramfs_sb.root; inode;
+         inode = ramfs_next_inode(inode)) {
+        for (size_t i = 0; i < inode->nr_pages; i++) {
+            struct ramfs_page *page = &inode->pages[i];
+            if (page->data) {
+                st->resident++;
+                if (page->flags & RAMFS_PAGE_INCOMPRESSIBLE) {
+                    st->incompressible++;
+                }
+            } else if (page->zdata) {
+                st->compressed++;
+                st->stored_bytes += page->zlen;
+            } else if (page->flags & RAMFS_PAGE_ZERO) {
+                st->zero++;
+            }
+        }
+    }
+    st->compressions = ramfs_compressions;
+    st->faults = ramfs_faults;
+    spin_unlock_irqrestore(&ramfs_lock, flags);
+}
+
+int ramfs_zreport(char *buf, size_t size)
+{
+    int len = 0;
+    struct ramfs_zstats st;
+
+    ramfs_zget_stats(&st);
+
+    size_t orig_kb = st.compressed * (RAMFS_BLOCK_SIZE / 1024);
+    size_t stored_kb = st.stored_bytes >> 10;
+    size_t ratio = st.stored_bytes ?
+                   st.compressed * RAMFS_BLOCK_SIZE * 100 / st.stored_bytes : 0;
+
+    REPORT_OUT("ramfs pages: %lu resident (%lu incompressible), "
+               "%lu compressed, %lu zero\n",
+               (unsigned long)st.resident, (unsigned long)st.incompressible,
+               (unsigned long)st.compressed, (unsigned long)st.zero);
+    REPORT_OUT("compressed: %lu KB -> %lu KB, ratio %lu.%02lu\n",
+               (unsigned long)orig_kb, (unsigned long)stored_kb,
+               (unsigned long)(ratio / 100), (unsigned long)(ratio % 100));
+    REPORT_OUT("saved: %lu KB; %llu compressions, %llu faults\n",
+               (unsigned long)(orig_kb + st.zero * (RAMFS_BLOCK_SIZE / 1024) -
+                               stored_kb),
+               (unsigned long long)st.compressions,
+               (unsigned long long)st.faults);
+
+    return len;
+}
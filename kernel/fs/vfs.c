@@ -3,6 +3,7 @@
  */
 
 #include "fs/vfs.h"
+#include "mm/filemap.h"
 #include "printk.h"
 
 /* ===================================================================== */
@@ -391,16 +392,21 @@ int vfs_readdir(struct file *file, void *ctx,
 int vfs_close(struct file *file) {
   if (!file)
     return -EBADF;
+  if (!atomic_dec_and_test(&file->f_count))
+    return 0; /* Still referenced, e.g. by a mapping */
   if (file->f_op && file->f_op->release && file->f_dentry) {
     file->f_op->release(file->f_dentry->d_inode, file);
   }
-  file->f_count.counter--;
-  if (file->f_count.counter <= 0) {
-    kfree(file);
-  }
+  kfree(file);
   return 0;
 }
 
+struct file *vfs_file_get(struct file *file) {
+  if (file)
+    atomic_inc(&file->f_count);
+  return file;
+}
+
 ssize_t vfs_read(struct file *file, char *buf, size_t count) {
   if (!file)
     return -EBADF;
@@ -418,7 +424,14 @@ ssize_t vfs_write(struct file *file, const char *buf, size_t count) {
     return -EFAULT;
   if (!file->f_op || !file->f_op->write)
     return -EINVAL;
-  return file->f_op->write(file, buf, count, &file->f_pos);
+
+  loff_t pos = file->f_pos;
+  ssize_t ret = file->f_op->write(file, buf, count, &file->f_pos);
+
+  /* Keep cached pages (and so existing mappings) in step with the file */
+  if (ret > 0 && file->f_dentry && file->f_dentry->d_inode)
+    filemap_update(file->f_dentry->d_inode, pos, buf, ret);
+  return ret;
 }
 
 loff_t vfs_lseek(struct file *file, loff_t offset, int whence) {
@@ -528,6 +541,8 @@ int vfs_unlink(const char *path) {
   }
 
   int ret = parent->d_inode->i_op->unlink(parent->d_inode, child);
+  if (ret == 0)
+    filemap_invalidate(child->d_inode);
   kfree(child);
   return ret;
 }
@@ -4,9 +4,23 @@
  * VT100-compatible terminal emulator for the GUI.
  */
 
+#include "drivers/intel_hda.h"
+#include "fs/ramfs.h"
+#include "ipc/pipe.h"
 #include "media/media.h"
+#include "mm/allocprof.h"
+#include "mm/asid.h"
 #include "mm/kmalloc.h"
+#include "mm/mmap.h"
+#include "mm/pmm.h"
+#include "mm/slab.h"
 #include "printk.h"
+#include "sched/fork.h"
+#include "sched/sched.h"
+#include "sched/softirq.h"
+#include "sched/stats.h"
+#include "sched/workqueue.h"
+#include "sync/spinlock.h"
 #include "types.h"
 
 /* Forward declare window type */
@@ -465,6 +479,41 @@ static int ls_callback(void *ctx, const char *name, int len, loff_t offset,
   return 0;
 }
 
+/* Output of a report command: fills @buf, returning the length written */
+typedef int (*term_report_fn)(char *buf, size_t size);
+
+/* Run a report into a buffer of @size and print it */
+static void term_report(struct terminal *term, term_report_fn fn,
+                        size_t size) {
+  char *buf = kmalloc(size);
+  if (!buf) {
+    term_puts(term, "Out of memory\n");
+    return;
+  }
+  fn(buf, size);
+  term_puts(term, buf);
+  kfree(buf);
+}
+
+/* softirqs: softirq counts, then the workqueues */
+static int softirqs_report(char *buf, size_t size) {
+  int len = softirq_report(buf, size);
+  if (len < (int)size) {
+    len += workqueue_report(buf + len, size - len);
+  }
+  return len;
+}
+
+/* cyclictest: wakeup latencies, then audio underruns they caused */
+static int cyclictest_report(char *buf, size_t size) {
+  int len = cyclictest(buf, size);
+  if (len < (int)size) {
+    len += snprintf(buf + len, size - len, "HDA underruns: %llu\n",
+                    (unsigned long long)intel_hda_underruns());
+  }
+  return len;
+}
+
 void term_execute_command(struct terminal *term, const char *cmd) {
   /* Skip leading whitespace */
   while (*cmd == ' ')
@@ -507,6 +556,20 @@ void term_execute_command(struct terminal *term, const char *cmd) {
     term_puts(term, "  history   - Show command history\n");
     term_puts(term, "  free      - Memory usage\n");
     term_puts(term, "  ps        - Process list\n");
+    term_puts(term, "  slabinfo  - Kernel object cache usage\n");
+    term_puts(term, "  pmm_bench - Page allocator throughput\n");
+    term_puts(term, "  fork_bench - Fork/exit latency vs RSS\n");
+    term_puts(term, "  vma_bench - VMA tree ops vs mapping count\n");
+    term_puts(term, "  asid_bench - Address space switch ping-pong\n");
+    term_puts(term, "  smp_bench - CPU-bound throughput across CPUs\n");
+    term_puts(term, "  pipe_bench - Pipe ping-pong wakeup latency\n");
+    term_puts(term, "  allocprof - Memory by call site, fragmentation\n");
+    term_puts(term, "  zram      - Ramfs compression ratio, faults\n");
+    term_puts(term, "  softirqs  - Deferred work counts and latency\n");
+    term_puts(term, "  cyclictest - Real-time wakeup latency under load\n");
+    term_puts(term, "  top       - CPU use and run delay per task\n");
+    term_puts(term, "  schedstat <pid> - Run/wait times (0 = compositor)\n");
+    term_puts(term, "  lockstat [reset] - Spinlock contention\n");
     term_puts(term, "  clear     - Clear screen\n");
     term_puts(term, "  help      - This help message\n");
     term_puts(term, "\033[33mNetwork:\033[0m\n");
@@ -601,6 +664,57 @@ void term_execute_command(struct terminal *term, const char *cmd) {
     term_puts(term, "              total        used        free\n");
     term_puts(term, "Mem:         252 MB       12 MB      240 MB\n");
     term_puts(term, "Swap:          0 MB        0 MB        0 MB\n");
+  } else if (str_starts_with(cmd, "slabinfo")) {
+    term_report(term, kmem_cache_info, 4096);
+    kmem_cache_dump();
+  } else if (str_starts_with(cmd, "pmm_bench")) {
+    term_report(term, pmm_bench, 2048);
+  } else if (str_starts_with(cmd, "fork_bench")) {
+    term_report(term, fork_bench, 2048);
+  } else if (str_starts_with(cmd, "vma_bench")) {
+    term_report(term, vma_bench, 2048);
+  } else if (str_starts_with(cmd, "asid_bench")) {
+    term_report(term, asid_bench, 2048);
+  } else if (str_starts_with(cmd, "smp_bench")) {
+    term_report(term, smp_bench, 1024);
+  } else if (str_starts_with(cmd, "pipe_bench")) {
+    term_report(term, pipe_bench, 512);
+  } else if (str_starts_with(cmd, "allocprof")) {
+    term_report(term, allocprof_report, 4096);
+  } else if (str_starts_with(cmd, "zram")) {
+    term_report(term, ramfs_zreport, 512);
+  } else if (str_starts_with(cmd, "softirqs")) {
+    term_report(term, softirqs_report, 1024);
+  } else if (str_starts_with(cmd, "cyclictest")) {
+    term_report(term, cyclictest_report, 1024);
+  } else if (str_starts_with(cmd, "top")) {
+    term_report(term, sched_top, 4096);
+  } else if (str_starts_with(cmd, "schedstat")) {
+    const char *arg = cmd + 9;
+    int pid = 0;
+    while (*arg == ' ')
+      arg++;
+    while (*arg >= '0' && *arg <= '9')
+      pid = pid * 10 + (*arg++ - '0');
+
+    char *buf = kmalloc(1024);
+    if (buf) {
+      if (schedstat_read(pid, buf, 1024) < 0)
+        term_puts(term, "schedstat: no such pid\n");
+      else
+        term_puts(term, buf);
+      kfree(buf);
+    }
+  } else if (str_starts_with(cmd, "lockstat")) {
+    const char *arg = cmd + 8;
+    while (*arg == ' ')
+      arg++;
+    if (str_starts_with(arg, "reset")) {
+      lockstat_reset();
+      term_puts(term, "lockstat: counts reset\n");
+    } else {
+      term_report(term, lockstat_report, 2048);
+    }
   } else if (str_starts_with(cmd, "ps")) {
     term_puts(term, "  PID TTY          TIME CMD\n");
     term_puts(term, "    1 ?        00:00:00 init\n");
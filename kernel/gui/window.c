@@ -12,6 +12,7 @@
 #include "media/media.h"
 #include "mm/kmalloc.h"
 #include "printk.h"
+#include "string.h"
 #include "toolbar_icons.h" /* Toolbar icons for image viewer */
 #include "types.h"
 
@@ -3102,21 +3103,9 @@ void compositor_mark_full_redraw(void) {
   g_dirty_count = 0;
 }
 
-/* Optimized memcpy for scanlines */
+/* Scanline copy: memcpy takes wide rows through NEON */
 static inline void fast_memcpy_line(uint32_t *dst, uint32_t *src, int width) {
-  /* Use 64-bit copies for better performance */
-  uint64_t *d64 = (uint64_t *)dst;
-  uint64_t *s64 = (uint64_t *)src;
-  int count = width / 2;
-
-  for (int i = 0; i < count; i++) {
-    d64[i] = s64[i];
-  }
-
-  /* Handle odd pixel */
-  if (width & 1) {
-    dst[width - 1] = src[width - 1];
-  }
+  memcpy(dst, src, (size_t)width * sizeof(uint32_t));
 }
 
 /* Copy a specific region from backbuffer to framebuffer */
@@ -202,6 +202,16 @@ typedef struct kapi {
     
     /* Input Polling (Direct) */
     void (*input_poll)(void);
+
+    /* Scheduling: nice -20..19 for a process (pid 0 = caller) */
+    int (*set_nice)(int pid, int nice);
+
+    /* Monotonic time since boot, at timer counter resolution */
+    uint64_t (*get_time_ns)(void);
+
+    /* Scheduling: SCHED_NORMAL with priority 0, or SCHED_FIFO/SCHED_RR
+     * with 1..99 (pid 0 = caller) */
+    int (*set_scheduler)(int pid, int policy, int priority);
 } kapi_t;
 
 /* Initialize the kernel API */
@@ -140,6 +140,14 @@ uint64_t arch_timer_get_ticks(void);
  */
 uint64_t arch_timer_get_frequency(void);
 
+/**
+ * arch_timer_program - Fire this CPU's timer interrupt at a given time
+ * @deadline: Absolute value of arch_timer_get_ticks()
+ *
+ * The interrupt handler must call hrtimer_interrupt().
+ */
+void arch_timer_program(uint64_t deadline);
+
 /**
  * arch_timer_get_ms - Get current time in milliseconds
  * @return: Time in milliseconds since boot
@@ -288,6 +296,9 @@ static inline void arch_context_set_flags(cpu_context_t *ctx, uint64_t flags) {
 /* CPU Information */
 /* ===================================================================== */
 
+/* Maximum number of CPUs supported */
+#define MAX_CPUS 8
+
 /**
  * arch_cpu_id - Get current CPU ID
  * @return: CPU ID (0 for single-core systems)
@@ -307,6 +318,24 @@ uint32_t arch_cpu_count(void);
  */
 void arch_cpu_info(char *buf, size_t size);
 
+/* ===================================================================== */
+/* SMP */
+/* ===================================================================== */
+
+/**
+ * smp_init - Bring up the secondary CPUs
+ *
+ * Call once the scheduler is initialized. Each secondary joins the
+ * scheduler with its own run queue and idle task before this returns.
+ */
+void smp_init(void);
+
+/**
+ * smp_send_reschedule - Make another CPU run its scheduler
+ * @cpu: Target CPU
+ */
+void smp_send_reschedule(uint32_t cpu);
+
 /* ===================================================================== */
 /* Low-Level Utilities */
 /* ===================================================================== */
@@ -336,6 +365,15 @@ void arch_dsb(void);
  */
 void arch_isb(void);
 
+/**
+ * arch_clear_page - Zero one page with the fastest stores available
+ * @page: Page-aligned address of the page
+ *
+ * Uses DC ZVA cache-line zeroing on ARM64, which allocates the lines
+ * without reading them from memory first.
+ */
+void arch_clear_page(void *page);
+
 /* ===================================================================== */
 /* Port I/O (x86 only) */
 /* ===================================================================== */
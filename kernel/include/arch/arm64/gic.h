@@ -18,6 +18,9 @@
 #define GIC_PPI_START       16      /* Private Peripheral Interrupts */
 #define GIC_SGI_START       0       /* Software Generated Interrupts */
 
+/* SGIs used by the kernel */
+#define GIC_SGI_RESCHEDULE  1       /* Run the scheduler on the target */
+
 /* Maximum interrupts */
 #define GIC_MAX_IRQS        1020
 
@@ -31,6 +31,13 @@
  */
 void timer_init(void);
 
+/**
+ * timer_init_secondary - Start the scheduler tick on a secondary CPU
+ *
+ * Called on the CPU itself after timer_init() has run on the boot CPU.
+ */
+void timer_init_secondary(void);
+
 /**
  * timer_get_frequency - Get timer frequency in Hz
  * 
@@ -51,6 +58,12 @@ uint64_t timer_get_count(void);
  */
 void timer_set_next(uint64_t ticks);
 
+/**
+ * timer_program - Set the next timer interrupt at an absolute count
+ * @deadline: Counter value; a past value fires at once
+ */
+void timer_program(uint64_t deadline);
+
 /**
  * timer_get_ms - Get milliseconds since boot
  * 
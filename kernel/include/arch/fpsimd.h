@@ -0,0 +1,118 @@
+/*
+ * UnixOS Kernel - Lazy FP/SIMD Context
+ *
+ * The kernel is built without FP/SIMD; user programs and the media
+ * decoders use v0-v31. Rather than move 512 bytes on every switch, a
+ * switch leaves FP/SIMD disabled in CPACR_EL1 and the next FP instruction
+ * traps, which loads the registers of whoever is running then. A switch
+ * saves them only if that happened, so tasks and processes that never
+ * touch FP pay nothing for it.
+ *
+ * Processes run at EL1 beside the kernel, so FPEN is either fully on or
+ * trapping EL1 as well; the trap comes to handle_sync_exception() as
+ * exception class 0x07.
+ *
+ * Kernel code may use SIMD between kernel_neon_begin() and
+ * kernel_neon_end(), with interrupts off, so each section must be short.
+ */
+
+#ifndef _ARCH_FPSIMD_H
+#define _ARCH_FPSIMD_H
+
+#include "arch/arch.h"
+#include "types.h"
+
+/* Copies shorter than this are not worth a kernel_neon_begin() */
+#define NEON_COPY_MIN 1024
+
+/* Most a copy moves per kernel_neon_begin(), bounding time with IRQs off */
+#define NEON_COPY_CHUNK 8192
+
+#ifdef ARCH_ARM64
+
+/* Saved FP/SIMD registers; the layout is known to fpsimd.S */
+struct fpsimd_state {
+  uint64_t vregs[64] __attribute__((aligned(16))); /* q0-q31 */
+  uint32_t fpsr;                                   /* Offset 512 */
+  uint32_t fpcr;                                   /* Offset 516 */
+  bool used;        /* Has used FP; a zeroed state has not */
+  unsigned int cpu; /* CPU whose registers it was last loaded into */
+};
+
+/**
+ * fpsimd_init_cpu - Give the code running on this CPU its state
+ * @st: State of the CPU's idle task, which the boot code becomes
+ *
+ * Anything the boot code had in the registers carries over.
+ */
+void fpsimd_init_cpu(struct fpsimd_state *st);
+
+/**
+ * fpsimd_switch - Hand this CPU's FP/SIMD to another task or process
+ * @next: State of what runs next, or NULL for the CPU's boot code
+ *
+ * Called with interrupts off, before the switch itself. Saves the
+ * registers if the outgoing one used them since it last got the CPU,
+ * and leaves FP/SIMD trapping for @next.
+ */
+void fpsimd_switch(struct fpsimd_state *next);
+
+/**
+ * fpsimd_trap - Handle an FP/SIMD access while disabled
+ *
+ * Enables FP/SIMD and loads the running state into the registers, or
+ * clears them on its first use. Nothing is loaded if the registers still
+ * hold it from the last time it ran here.
+ */
+void fpsimd_trap(void);
+
+/**
+ * may_use_simd - Check that kernel_neon_begin() may be called
+ *
+ * Return: False inside a kernel_neon_begin() section, as when it takes a
+ * page fault
+ */
+bool may_use_simd(void);
+
+/**
+ * kernel_neon_begin - Let kernel code use the FP/SIMD registers
+ *
+ * Saves the registers of whoever owns them and disables interrupts until
+ * kernel_neon_end(). Does not nest; see may_use_simd().
+ */
+void kernel_neon_begin(void);
+
+/**
+ * kernel_neon_end - Give the FP/SIMD registers back
+ *
+ * The owner reloads them on its next FP instruction.
+ */
+void kernel_neon_end(void);
+
+/**
+ * neon_copy - Copy memory through the SIMD registers
+ * @dst: Destination
+ * @src: Source, not overlapping @dst
+ * @n: Bytes
+ *
+ * Only between kernel_neon_begin() and kernel_neon_end().
+ */
+void neon_copy(void *dst, const void *src, size_t n);
+
+#else /* !ARCH_ARM64 */
+
+/* x86 FPU state is not switched at all yet */
+struct fpsimd_state {
+  bool used;
+};
+
+static inline void fpsimd_init_cpu(struct fpsimd_state *st) { (void)st; }
+static inline void fpsimd_switch(struct fpsimd_state *next) { (void)next; }
+static inline void fpsimd_trap(void) {}
+static inline bool may_use_simd(void) { return false; }
+static inline void kernel_neon_begin(void) {}
+static inline void kernel_neon_end(void) {}
+
+#endif /* ARCH_ARM64 */
+
+#endif /* _ARCH_FPSIMD_H */
@@ -76,5 +76,6 @@ typedef struct {
 
 void intel_hda_init(pci_device_t *pci_dev);
 int intel_hda_play_pcm(const void *data, uint32_t samples, uint8_t channels, uint32_t sample_rate);
+uint64_t intel_hda_underruns(void);
 
 #endif
@@ -0,0 +1,110 @@
+/*
+ * UnixOS Kernel - Flattened Device Tree Header
+ *
+ * Minimal read-only parser for the DTB passed by the bootloader in x0.
+ * QEMU passes nothing in x0 when it boots an ELF kernel, but leaves the
+ * DTB at the start of RAM (DTB_RAM_BASE), where dtb_init() looks next.
+ * Only what early boot needs is extracted: RAM banks from /memory nodes
+ * and reserved regions from the memory reservation block and
+ * /reserved-memory.
+ */
+
+#ifndef _DTB_H
+#define _DTB_H
+
+#include "types.h"
+
+/* ===================================================================== */
+/* FDT format */
+/* ===================================================================== */
+
+#define FDT_MAGIC           0xD00DFEED
+
+#define FDT_BEGIN_NODE      0x00000001
+#define FDT_END_NODE        0x00000002
+#define FDT_PROP            0x00000003
+#define FDT_NOP             0x00000004
+#define FDT_END             0x00000009
+
+/* Header - all fields big-endian */
+struct fdt_header {
+    uint32_t magic;
+    uint32_t totalsize;
+    uint32_t off_dt_struct;
+    uint32_t off_dt_strings;
+    uint32_t off_mem_rsvmap;
+    uint32_t version;
+    uint32_t last_comp_version;
+    uint32_t boot_cpuid_phys;
+    uint32_t size_dt_strings;
+    uint32_t size_dt_struct;
+};
+
+/* Where QEMU virt puts the DTB for an ELF kernel loaded above it */
+#define DTB_RAM_BASE        0x40000000UL
+
+/* Limits on what we record */
+#define DTB_MAX_MEMORY      8
+#define DTB_MAX_RESERVED    16
+
+/* A physical address range */
+struct dtb_region {
+    phys_addr_t base;
+    uint64_t size;
+};
+
+/* ===================================================================== */
+/* Function declarations */
+/* ===================================================================== */
+
+/**
+ * dtb_init - Validate and parse the boot device tree
+ * @dtb: Physical address of the blob (from x0 at entry), may be NULL
+ *
+ * With no @dtb, a blob at DTB_RAM_BASE is used if there is one.
+ *
+ * Return: 0 on success, negative if no valid device tree was found
+ */
+int dtb_init(void *dtb);
+
+/**
+ * dtb_present - Check whether a valid device tree was parsed
+ */
+bool dtb_present(void);
+
+/**
+ * dtb_blob - Get the location of the device tree blob itself
+ * @size: Filled with the blob size in bytes (may be NULL)
+ *
+ * Return: Physical address of the blob, or 0 if none
+ */
+phys_addr_t dtb_blob(size_t *size);
+
+/**
+ * dtb_memory_banks - Get RAM banks from /memory nodes
+ * @regions: Output array
+ * @max: Capacity of @regions
+ *
+ * Return: Number of banks written
+ */
+int dtb_memory_banks(struct dtb_region *regions, int max);
+
+/**
+ * dtb_cpu_count - Get the number of /cpus/cpu nodes
+ *
+ * Return: Number of CPUs described, or 0 if none (or no device tree)
+ */
+int dtb_cpu_count(void);
+
+/**
+ * dtb_reserved_regions - Get reserved memory ranges
+ * @regions: Output array
+ * @max: Capacity of @regions
+ *
+ * Covers both the /memreserve/ block and /reserved-memory children.
+ *
+ * Return: Number of regions written
+ */
+int dtb_reserved_regions(struct dtb_region *regions, int max);
+
+#endif /* _DTB_H */
@@ -0,0 +1,85 @@
+/*
+ * UnixOS Kernel - Ramfs Header
+ *
+ * File data is held in RAMFS_BLOCK_SIZE pages. Pages nobody has touched
+ * for a while are LZ4-compressed in the background and all-zero pages
+ * are dropped; the next read or write of such a page decompresses it
+ * transparently (a "fault").
+ */
+
+#ifndef _FS_RAMFS_H
+#define _FS_RAMFS_H
+
+#include "types.h"
+
+#define RAMFS_BLOCK_SIZE    4096
+
+/* Compressed tier state, gathered by ramfs_zget_stats() */
+struct ramfs_zstats {
+    size_t resident;            /* Uncompressed pages */
+    size_t compressed;          /* Pages held compressed */
+    size_t zero;                /* All-zero pages dropped entirely */
+    size_t incompressible;      /* Cold pages kept because LZ4 saved too little */
+    size_t stored_bytes;        /* Size of the compressed data */
+    uint64_t compressions;      /* Pages moved to the compressed tier */
+    uint64_t faults;            /* Accesses that brought a page back */
+};
+
+int ramfs_init(void);
+
+/**
+ * ramfs_create_dir - Create a directory under the ramfs root
+ * @path: Directory name
+ * @mode: Permission bits
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int ramfs_create_dir(const char *path, mode_t mode);
+
+/**
+ * ramfs_create_file - Create a file from a string
+ * @path: Path, at most one directory deep
+ * @mode: Permission bits
+ * @content: NUL-terminated contents, or NULL for an empty file
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int ramfs_create_file(const char *path, mode_t mode, const char *content);
+
+/**
+ * ramfs_create_file_bytes - Create a file from a buffer
+ * @path: Path, at most one directory deep
+ * @mode: Permission bits
+ * @data: Contents
+ * @size: Length of @data
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int ramfs_create_file_bytes(const char *path, mode_t mode, const uint8_t *data,
+                            size_t size);
+
+/**
+ * ramfs_zstart - Start compressing cold pages in idle time
+ *
+ * Call once the scheduler is up. Without it pages simply stay resident.
+ */
+void ramfs_zstart(void);
+
+/**
+ * ramfs_zget_stats - Get compressed tier statistics
+ * @st: Output
+ */
+void ramfs_zget_stats(struct ramfs_zstats *st);
+
+/**
+ * ramfs_zreport - Report compression ratio and fault counts
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ *
+ * The report is also printed to the kernel console.
+ *
+ * Return: Number of bytes written to @buf
+ */
+int ramfs_zreport(char *buf, size_t size);
+
+#endif /* _FS_RAMFS_H */
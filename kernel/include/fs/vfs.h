@@ -122,6 +122,7 @@
 #define EPIPE           32
 #define ENOSYS          38
 #define ENOTEMPTY       39
+#define ETIMEDOUT       110
 
 /* ===================================================================== */
 /* Forward declarations */
@@ -296,9 +297,19 @@ struct file *vfs_open(const char *path, int flags, mode_t mode);
 
 /**
  * vfs_close - Close a file
+ *
+ * Drops one reference; the file is released when the last one goes.
  */
 int vfs_close(struct file *file);
 
+/**
+ * vfs_file_get - Take an extra reference to an open file
+ *
+ * Used by mappings that must outlive the descriptor they were made from.
+ * Return: @file
+ */
+struct file *vfs_file_get(struct file *file);
+
 /**
  * vfs_readdir - Read directory entries
  */
@@ -0,0 +1,68 @@
+/*
+ * UnixOS Kernel - Fast Userspace Mutexes
+ *
+ * A futex is a 32-bit word in user memory. Locks built on one take and
+ * release it with atomic instructions alone while uncontended, and only
+ * enter the kernel to sleep until the word changes or to wake sleepers.
+ * Waiters are keyed by the word's physical address, so processes sharing
+ * the memory share the futex.
+ */
+
+#ifndef _IPC_FUTEX_H
+#define _IPC_FUTEX_H
+
+#include "types.h"
+
+/* Operations (Linux numbering, as C libraries issue them) */
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 3
+#define FUTEX_CMP_REQUEUE 4
+#define FUTEX_WAKE_OP 5
+
+#define FUTEX_PRIVATE_FLAG 128 /* Accepted; keys are physical either way */
+#define FUTEX_CLOCK_REALTIME 256
+#define FUTEX_CMD_MASK (~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME))
+
+/* FUTEX_WAKE_OP: val3 = op << 28 | cmp << 24 | oparg << 12 | cmparg */
+#define FUTEX_OP_SET 0
+#define FUTEX_OP_ADD 1
+#define FUTEX_OP_OR 2
+#define FUTEX_OP_ANDN 3
+#define FUTEX_OP_XOR 4
+#define FUTEX_OP_OPARG_SHIFT 8 /* oparg is a shift count: use 1 << oparg */
+
+#define FUTEX_OP_CMP_EQ 0
+#define FUTEX_OP_CMP_NE 1
+#define FUTEX_OP_CMP_LT 2
+#define FUTEX_OP_CMP_LE 3
+#define FUTEX_OP_CMP_GT 4
+#define FUTEX_OP_CMP_GE 5
+
+/**
+ * futex_init - Set up the futex hash table
+ */
+void futex_init(void);
+
+/**
+ * do_futex - Futex operation
+ * @uaddr: Futex word, 4-byte aligned
+ * @op: FUTEX_* operation, optionally with FUTEX_PRIVATE_FLAG
+ * @val: WAIT: expected value; WAKE, REQUEUE, WAKE_OP: waiters to wake
+ * @expires: WAIT: absolute timeout in counter ticks, 0 for none
+ * @uaddr2: Second futex for REQUEUE, CMP_REQUEUE and WAKE_OP
+ * @val2: REQUEUE: waiters to move to @uaddr2; WAKE_OP: waiters to wake
+ *        on @uaddr2
+ * @val3: CMP_REQUEUE: expected value of @uaddr; WAKE_OP: encoded op
+ *
+ * FUTEX_WAIT sleeps only if *@uaddr still holds @val, checked after the
+ * caller is queued, so a wake issued after the word changed is not lost.
+ *
+ * Return: WAIT: 0 when woken, -EAGAIN if the word differed, -ETIMEDOUT,
+ * or -EINTR. The others: number of waiters woken (and, for the requeues,
+ * moved). -EINVAL or -EFAULT for a bad address, -ENOSYS for other ops.
+ */
+long do_futex(uint32_t *uaddr, int op, uint32_t val, uint64_t expires,
+              uint32_t *uaddr2, uint32_t val2, uint32_t val3);
+
+#endif /* _IPC_FUTEX_H */
@@ -0,0 +1,35 @@
+/*
+ * UnixOS Kernel - Pipes
+ */
+
+#ifndef _IPC_PIPE_H
+#define _IPC_PIPE_H
+
+#include "types.h"
+
+struct file;
+
+/**
+ * do_pipe - Create a pipe
+ * @read_file: Set to the read end
+ * @write_file: Set to the write end
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int do_pipe(struct file **read_file, struct file **write_file);
+
+/**
+ * pipe_bench - One-byte ping-pong latency between two tasks
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ *
+ * Two tasks bounce a byte over a pair of pipes. Each side sleeps until
+ * the other writes, so a round trip costs two wakeups and their context
+ * switches rather than spinning. The report is also printed to the
+ * kernel console.
+ *
+ * Return: Number of bytes written to @buf
+ */
+int pipe_bench(char *buf, size_t size);
+
+#endif /* _IPC_PIPE_H */
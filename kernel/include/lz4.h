@@ -0,0 +1,54 @@
+/*
+ * Vib-OS - LZ4 Block Compression
+ *
+ * Compressor and decompressor for the LZ4 block format: a token byte
+ * holding a literal run length and a match length, the literals, then a
+ * 16-bit back-reference. Compression is a single greedy pass over a hash
+ * of the last position each 4-byte sequence was seen at, which trades
+ * some ratio for speed - it is meant for paging data in and out of RAM,
+ * not for archives.
+ */
+
+#ifndef _KERNEL_LZ4_H
+#define _KERNEL_LZ4_H
+
+#include "types.h"
+
+#define LZ4_HASH_LOG        12
+#define LZ4_WORKMEM_SIZE    ((1 << LZ4_HASH_LOG) * sizeof(uint32_t))
+
+/* Worst-case compressed size of @n input bytes */
+#define LZ4_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+/**
+ * lz4_compress - Compress a buffer
+ * @src: Input
+ * @src_len: Input length in bytes
+ * @dst: Output buffer
+ * @dst_cap: Size of @dst
+ * @wrkmem: Scratch space of LZ4_WORKMEM_SIZE bytes
+ *
+ * Return: Compressed length, or 0 if the result does not fit in @dst.
+ * Passing a @dst_cap smaller than @src_len is a cheap way to give up
+ * early on data that does not compress.
+ */
+size_t lz4_compress(const uint8_t *src, size_t src_len, uint8_t *dst,
+                    size_t dst_cap, void *wrkmem);
+
+/**
+ * lz4_decompress - Decompress a buffer
+ * @src: Compressed input
+ * @src_len: Compressed length
+ * @dst: Output buffer
+ * @dst_cap: Size of @dst
+ *
+ * Every length and offset is checked against both buffers, so corrupt
+ * input fails instead of writing out of bounds.
+ *
+ * Return: Decompressed length, or -1 if the input is malformed or does
+ * not fit in @dst
+ */
+int lz4_decompress(const uint8_t *src, size_t src_len, uint8_t *dst,
+                   size_t dst_cap);
+
+#endif /* _KERNEL_LZ4_H */
@@ -0,0 +1,75 @@
+/*
+ * UnixOS Kernel - Allocation Profiler Header
+ *
+ * Built with DEBUG_ALLOC_PROFILE (make ALLOC_PROFILE=1), kmalloc and the
+ * PMM record the caller, size and time of every live allocation, so a
+ * report can attribute heap and page usage to call sites. Without it
+ * the hooks compile away and the report only shows free-space
+ * fragmentation.
+ */
+
+#ifndef _MM_ALLOCPROF_H
+#define _MM_ALLOCPROF_H
+
+#include "types.h"
+
+/* Allocator an entry belongs to */
+#define ALLOCPROF_KMALLOC   0
+#define ALLOCPROF_PAGES     1
+
+#ifdef DEBUG_ALLOC_PROFILE
+
+/**
+ * allocprof_alloc - Record an allocation
+ * @kind: ALLOCPROF_KMALLOC or ALLOCPROF_PAGES
+ * @addr: Address returned, or 0 if the allocation failed
+ * @size: Requested size in bytes
+ * @caller: Return address of the allocator's caller
+ *
+ * Recording an address that is already live updates its entry, e.g.
+ * when krealloc() resizes in place.
+ */
+void allocprof_alloc(int kind, uintptr_t addr, size_t size, void *caller);
+
+/**
+ * allocprof_free - Forget an allocation
+ * @kind: Allocator the address came from
+ * @addr: Address being freed
+ */
+void allocprof_free(int kind, uintptr_t addr);
+
+#else
+
+static inline void allocprof_alloc(int kind, uintptr_t addr, size_t size,
+                                   void *caller)
+{
+    (void)kind;
+    (void)addr;
+    (void)size;
+    (void)caller;
+}
+
+static inline void allocprof_free(int kind, uintptr_t addr)
+{
+    (void)kind;
+    (void)addr;
+}
+
+#endif /* DEBUG_ALLOC_PROFILE */
+
+/**
+ * allocprof_report - Report live allocations by call site
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ *
+ * Lists the call sites holding the most memory, with the age of their
+ * oldest live allocation (old entries from a hot site suggest a leak),
+ * a histogram of live kmalloc request sizes for sizing slab caches, and
+ * histograms of free heap blocks and free buddy blocks. The report is
+ * also printed to the kernel console.
+ *
+ * Return: Number of bytes written to @buf
+ */
+int allocprof_report(char *buf, size_t size);
+
+#endif /* _MM_ALLOCPROF_H */
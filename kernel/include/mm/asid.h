@@ -0,0 +1,81 @@
+/*
+ * UnixOS Kernel - Address Space ID Header
+ *
+ * Tags TLB entries with a per-mm ID (the ARM64 ASID, or the x86_64 PCID)
+ * so switching address spaces no longer flushes the TLB. IDs are handed
+ * out from a bitmap; when it runs dry the generation is bumped, every
+ * CPU flushes its TLB once, and live address spaces pick up a fresh ID
+ * lazily on their next switch. ID 0 belongs to the kernel's own mm.
+ */
+
+#ifndef _MM_ASID_H
+#define _MM_ASID_H
+
+#include "types.h"
+
+struct mm_struct;
+
+/**
+ * asid_init - Detect the number of ASID/PCID bits and enable tagging
+ *
+ * Return: Number of ID bits (8 or 16 on ARM64, 12 with x86_64 PCID),
+ * 0 if untagged, in which case every switch flushes the TLB
+ */
+unsigned int asid_init(void);
+
+/**
+ * asid_switch_mm - Load an address space on this CPU
+ * @mm: Address space to switch to
+ *
+ * Allocates an ID on first use or after a rollover, then loads the page
+ * table root together with the ID. No TLB maintenance is needed unless
+ * a rollover happened since this CPU last switched.
+ */
+void asid_switch_mm(struct mm_struct *mm);
+
+/**
+ * asid_release_mm - Prepare an address space for freeing
+ * @mm: Address space being destroyed
+ *
+ * Moves this CPU off @mm if it is still loaded and drops its TLB
+ * entries, which may reference page tables about to be freed. The ID
+ * itself is reclaimed at the next rollover.
+ */
+void asid_release_mm(struct mm_struct *mm);
+
+/**
+ * asid_flush_mm - Invalidate every TLB entry of one address space
+ * @mm: Address space
+ */
+void asid_flush_mm(struct mm_struct *mm);
+
+/**
+ * asid_flush_page - Invalidate one user page of one address space
+ * @mm: Address space
+ * @vaddr: User virtual address
+ */
+void asid_flush_page(struct mm_struct *mm, virt_addr_t vaddr);
+
+/**
+ * asid_get_stats - Get ASID allocator counters
+ * @allocs: Output for IDs allocated
+ * @rollovers: Output for generation rollovers
+ * @fast: Output for switches that reused a current ID without locking
+ */
+void asid_get_stats(uint64_t *allocs, uint64_t *rollovers, uint64_t *fast);
+
+/**
+ * asid_bench - Address space switch ping-pong benchmark
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ *
+ * Switches between two address spaces, touching a working set in each,
+ * with ASID-tagged switches and with a full flush per switch, then
+ * churns through more address spaces than there are IDs. The report is
+ * also printed to the kernel console.
+ *
+ * Return: Number of bytes written to @buf
+ */
+int asid_bench(char *buf, size_t size);
+
+#endif /* _MM_ASID_H */
@@ -0,0 +1,77 @@
+/*
+ * UnixOS Kernel - Page Cache Header
+ *
+ * File pages shared between mmap() mappings. Pages are keyed by
+ * (superblock, inode number, page index), filled on first use through
+ * the filesystem's read operation, and held by the cache with one page
+ * reference. Mappings take their own references, so a page stays valid
+ * for as long as anything maps it.
+ */
+
+#ifndef _MM_FILEMAP_H
+#define _MM_FILEMAP_H
+
+#include "types.h"
+
+struct file;
+struct inode;
+
+/**
+ * filemap_get_page - Get a file page, reading it in on a miss
+ * @file: Open file to read through
+ * @index: Page index within the file
+ *
+ * Bytes past end of file read as zero.
+ *
+ * Return: Physical address with a reference held for the caller, or 0
+ */
+phys_addr_t filemap_get_page(struct file *file, uint64_t index);
+
+/**
+ * filemap_update - Copy data written through write() into cached pages
+ * @inode: Inode that was written
+ * @pos: File offset of the write
+ * @buf: Data written
+ * @len: Number of bytes written
+ */
+void filemap_update(struct inode *inode, loff_t pos, const char *buf, size_t len);
+
+/**
+ * filemap_writeback - Write cached pages back to the file
+ * @file: Open file to write through
+ * @first: First page index
+ * @last: Page index to stop at (exclusive)
+ *
+ * Used for MAP_SHARED mappings, whose stores land in the cached page.
+ * Only the part of each page that was backed by the file is written,
+ * so the file never grows.
+ *
+ * Return: 0 on success, negative if a write failed
+ */
+int filemap_writeback(struct file *file, uint64_t first, uint64_t last);
+
+/**
+ * filemap_invalidate - Drop every cached page of an inode
+ * @inode: Inode being removed
+ *
+ * Pages still mapped stay alive until their last mapping goes away.
+ */
+void filemap_invalidate(struct inode *inode);
+
+/**
+ * filemap_shrink - Evict cached pages that nothing maps
+ * @nr: Maximum number of pages to evict
+ *
+ * Return: Number of pages freed
+ */
+size_t filemap_shrink(size_t nr);
+
+/**
+ * filemap_get_stats - Get page cache counters
+ * @pages: Output for pages currently cached
+ * @hits: Output for lookups served from the cache
+ * @misses: Output for lookups that read from the filesystem
+ */
+void filemap_get_stats(size_t *pages, uint64_t *hits, uint64_t *misses);
+
+#endif /* _MM_FILEMAP_H */
@@ -58,6 +58,10 @@ void kfree(void *ptr);
  * @new_size: New size
  * @flags: Allocation flags
  * 
+ * With GFP_ZERO the block is zeroed from @new_size to its end. A buffer
+ * always allocated and resized with GFP_ZERO therefore reads as zero past
+ * the size last asked for.
+ * 
  * Return: Pointer to reallocated memory
  */
 void *krealloc(void *ptr, size_t new_size, uint32_t flags);
@@ -70,4 +74,14 @@ void *krealloc(void *ptr, size_t new_size, uint32_t flags);
  */
 void kmalloc_get_stats(size_t *total, size_t *used, size_t *free);
 
+/**
+ * kmalloc_free_histogram - Count free heap blocks by size
+ * @counts: Output, @nbuckets entries; bucket i counts blocks smaller than
+ *          64 << i bytes, the last bucket every larger block
+ * @nbuckets: Number of buckets
+ * 
+ * Return: Size of the largest free block in bytes
+ */
+size_t kmalloc_free_histogram(size_t *counts, int nbuckets);
+
 #endif /* _MM_KMALLOC_H */
@@ -0,0 +1,115 @@
+/*
+ * UnixOS Kernel - Memory Mapping Header
+ *
+ * mmap/munmap/mprotect on top of the VMA tree and the page cache.
+ * Nothing is mapped up front: pages are faulted in on first access,
+ * anonymous memory as zero pages and file mappings from the page cache.
+ */
+
+#ifndef _MM_MMAP_H
+#define _MM_MMAP_H
+
+#include "mm/vmm.h"
+#include "types.h"
+
+struct file;
+
+/* ===================================================================== */
+/* mmap() flags (Linux values) */
+/* ===================================================================== */
+
+#define PROT_NONE           0x0
+#define PROT_READ           0x1
+#define PROT_WRITE          0x2
+#define PROT_EXEC           0x4
+
+#define MAP_SHARED          0x01
+#define MAP_PRIVATE         0x02
+#define MAP_TYPE            0x0F
+#define MAP_FIXED           0x10
+#define MAP_ANONYMOUS       0x20
+#define MAP_POPULATE        0x8000
+
+#define MAP_FAILED          ((void *)-1)
+
+/* ===================================================================== */
+/* Function declarations */
+/* ===================================================================== */
+
+/**
+ * do_mmap - Create a mapping in an address space
+ * @mm: Target address space
+ * @addr: Placement hint, or exact address with MAP_FIXED
+ * @len: Length in bytes
+ * @prot: PROT_* protection
+ * @flags: MAP_* flags; exactly one of MAP_SHARED or MAP_PRIVATE
+ * @file: File to map (ignored with MAP_ANONYMOUS)
+ * @offset: Page-aligned offset into @file
+ *
+ * Return: Start address of the mapping, or negative errno
+ */
+long do_mmap(struct mm_struct *mm, virt_addr_t addr, size_t len, int prot,
+             int flags, struct file *file, uint64_t offset);
+
+/**
+ * do_munmap - Remove mappings from an address space
+ * @mm: Target address space
+ * @addr: Page-aligned start address
+ * @len: Length in bytes
+ *
+ * Shared file pages are written back first, then the pages are unmapped
+ * and their references dropped.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int do_munmap(struct mm_struct *mm, virt_addr_t addr, size_t len);
+
+/**
+ * do_msync - Write shared file mappings in a range back to their files
+ * @mm: Address space
+ * @addr: Page-aligned start address
+ * @len: Length in bytes
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int do_msync(struct mm_struct *mm, virt_addr_t addr, size_t len);
+
+/**
+ * do_mprotect - Change the protection of mapped memory
+ * @mm: Target address space
+ * @addr: Page-aligned start address
+ * @len: Length in bytes
+ * @prot: New PROT_* protection
+ *
+ * Return: 0 on success, -ENOMEM if part of the range is unmapped,
+ * -EACCES if a shared file mapping cannot be made writable
+ */
+int do_mprotect(struct mm_struct *mm, virt_addr_t addr, size_t len, int prot);
+
+/**
+ * handle_mm_fault - Resolve a page fault in a mapped area
+ * @mm: Address space that faulted
+ * @vaddr: Faulting address
+ * @write: True for a write access
+ *
+ * Handles demand-zero anonymous pages, page cache pages for file
+ * mappings and copy-on-write.
+ *
+ * Return: 0 if the access can be retried, negative for a genuine fault
+ */
+int handle_mm_fault(struct mm_struct *mm, virt_addr_t vaddr, bool write);
+
+/**
+ * vma_bench - Measure VMA operations as the number of areas grows
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ *
+ * Times mmap(NULL), lookup, munmap, hole refill and mprotect on a
+ * scratch address space holding thousands of areas. The report is also
+ * printed to the kernel console.
+ *
+ * Return: Number of bytes written to @buf
+ */
+int vma_bench(char *buf, size_t size);
+
+#endif /* _MM_MMAP_H */
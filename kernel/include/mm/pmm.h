@@ -18,6 +18,8 @@
 #define LARGE_PAGE_SHIFT    21
 #define LARGE_PAGE_SIZE     (1UL << LARGE_PAGE_SHIFT)   /* 2MB */
 
+#define PMM_MAX_ORDER       11      /* Largest block: 2^11 pages = 8MB */
+
 /* ===================================================================== */
 /* Address conversion macros */
 /* ===================================================================== */
@@ -49,6 +51,7 @@ typedef enum {
 #define PAGE_FLAG_LOCKED        (1 << 2)
 #define PAGE_FLAG_RESERVED      (1 << 3)
 #define PAGE_FLAG_SLAB          (1 << 4)
+#define PAGE_FLAG_BUDDY         (1 << 5)    /* Head of a free buddy block */
 
 /* ===================================================================== */
 /* Page structure */
@@ -58,8 +61,9 @@ struct page {
     uint32_t flags;
     uint32_t order;         /* For buddy allocator */
     struct page *next;      /* Free list link */
+    struct page *prev;
     void *slab;             /* For slab allocator */
-    atomic_t refcount;
+    atomic_t refcount;      /* Mappings/owners of an allocated page */
 };
 
 /* ===================================================================== */
@@ -69,8 +73,9 @@ struct page {
 /**
  * pmm_init - Initialize physical memory manager
  * 
- * Discovers available memory from device tree or UEFI memory map.
- * Sets up the buddy allocator.
+ * Discovers RAM banks from the device tree (dtb_init must have run),
+ * builds the page arrays and sparse section map, and releases all
+ * unreserved memory to the buddy allocator.
  * 
  * Return: 0 on success, negative on error
  */
@@ -83,6 +88,43 @@ int pmm_init(void);
  */
 phys_addr_t pmm_alloc_page(void);
 
+/**
+ * pmm_alloc_page_cold - Allocate a page the caller will not touch soon
+ * 
+ * Prefers the per-CPU cold list, leaving cache-hot pages for callers
+ * that will write to them immediately.
+ * 
+ * Return: Physical address of allocated page, or 0 on failure
+ */
+phys_addr_t pmm_alloc_page_cold(void);
+
+/**
+ * pmm_alloc_page_zeroed - Allocate a page filled with zeroes
+ * 
+ * Takes a page cleared ahead of time by the kzerod thread when one is
+ * pooled, so the caller does not pay for clearing it. Falls back to
+ * clearing a fresh page with arch_clear_page().
+ * 
+ * Return: Physical address of allocated page, or 0 on failure
+ */
+phys_addr_t pmm_alloc_page_zeroed(void);
+
+/**
+ * pmm_zero_start - Start the idle-priority page zeroing thread
+ * 
+ * Called once the scheduler is up. Until then, and on architectures
+ * without kernel thread switching, zeroed pages are cleared on demand.
+ */
+void pmm_zero_start(void);
+
+/**
+ * pmm_zero_get_stats - Get pre-zeroed pool counters
+ * @hits: Output for zeroed allocations served from the pool
+ * @misses: Output for zeroed allocations cleared on demand
+ * @pooled: Output for pages currently in the pool
+ */
+void pmm_zero_get_stats(uint64_t *hits, uint64_t *misses, size_t *pooled);
+
 /**
  * pmm_alloc_pages - Allocate contiguous pages
  * @order: Power of 2 number of pages (0=1, 1=2, 2=4, etc.)
@@ -97,6 +139,12 @@ phys_addr_t pmm_alloc_pages(unsigned int order);
  */
 void pmm_free_page(phys_addr_t addr);
 
+/**
+ * pmm_free_page_cold - Free a page whose contents are not in cache
+ * @addr: Physical address of page to free
+ */
+void pmm_free_page_cold(phys_addr_t addr);
+
 /**
  * pmm_free_pages - Free contiguous pages
  * @addr: Physical address of first page
@@ -104,6 +152,15 @@ void pmm_free_page(phys_addr_t addr);
  */
 void pmm_free_pages(phys_addr_t addr, unsigned int order);
 
+/**
+ * pmm_reserve_range - Mark a physical range as in use
+ * @start: Physical start address
+ * @size: Size in bytes (rounded out to whole pages)
+ * 
+ * Used for regions owned by other allocators, e.g. the fixed kernel heap.
+ */
+void pmm_reserve_range(phys_addr_t start, size_t size);
+
 /**
  * pmm_get_free_memory - Get total free physical memory
  * 
@@ -118,6 +175,49 @@ size_t pmm_get_free_memory(void);
  */
 size_t pmm_get_total_memory(void);
 
+/**
+ * pmm_get_free_blocks - Get the number of free buddy blocks of one order
+ * @order: Block order, 0 to PMM_MAX_ORDER
+ * 
+ * Pages parked on the per-CPU lists are not counted.
+ * 
+ * Return: Number of free blocks of exactly @order
+ */
+size_t pmm_get_free_blocks(unsigned int order);
+
+/**
+ * pmm_get_bank - Get the extent of a RAM bank
+ * @index: Bank number, starting at 0
+ * @start: Filled with the bank's physical start address
+ * @size: Filled with the bank's size in bytes
+ * 
+ * Return: 0 on success, -1 if @index is past the last bank
+ */
+int pmm_get_bank(unsigned int index, phys_addr_t *start, size_t *size);
+
+/**
+ * pmm_page_get - Take an extra reference on an allocated page
+ * @addr: Physical address of the page
+ * 
+ * Pages come out of the allocator with a reference count of one. Pages
+ * shared between address spaces (copy-on-write) hold one per mapping.
+ */
+void pmm_page_get(phys_addr_t addr);
+
+/**
+ * pmm_page_put - Drop a page reference, freeing the page on the last one
+ * @addr: Physical address of the page
+ */
+void pmm_page_put(phys_addr_t addr);
+
+/**
+ * pmm_page_refcount - Get the number of references held on a page
+ * @addr: Physical address of the page
+ * 
+ * Return: Reference count, or 0 for addresses outside managed RAM
+ */
+int pmm_page_refcount(phys_addr_t addr);
+
 /**
  * pmm_page_to_phys - Convert page struct to physical address
  */
@@ -128,4 +228,15 @@ phys_addr_t pmm_page_to_phys(struct page *page);
  */
 struct page *pmm_phys_to_page(phys_addr_t addr);
 
+/**
+ * pmm_bench - Measure allocation and free throughput for every order
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ * 
+ * The report is also printed to the kernel console.
+ * 
+ * Return: Number of bytes written to @buf
+ */
+int pmm_bench(char *buf, size_t size);
+
 #endif /* _MM_PMM_H */
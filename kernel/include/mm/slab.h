@@ -0,0 +1,213 @@
+/*
+ * UnixOS Kernel - Slab Allocator Header
+ *
+ * Object caches carved from physical pages. Each cache hands out
+ * fixed-size objects in O(1) from per-slab free lists; kmalloc routes
+ * small requests to a set of power-of-two size-class caches.
+ *
+ * In front of the slab layer every cache has per-CPU magazines (Bonwick &
+ * Adams, "Magazines and Vmem"): a loaded and a previous magazine per CPU
+ * plus a shared depot of full and empty magazines. The common alloc/free
+ * path only touches the local CPU's magazines.
+ */
+
+#ifndef _MM_SLAB_H
+#define _MM_SLAB_H
+
+#include "types.h"
+#include "arch/arch.h"
+#include "sync/spinlock.h"
+
+/* ===================================================================== */
+/* Configuration */
+/* ===================================================================== */
+
+#define SLAB_ORDER          2                           /* 4 pages per slab */
+#define SLAB_SIZE           (4096UL << SLAB_ORDER)      /* 16KB */
+
+#define KMALLOC_MIN_SHIFT   5                           /* 32 bytes */
+#define KMALLOC_MAX_SHIFT   11                          /* 2048 bytes */
+#define KMALLOC_MIN_SIZE    (1UL << KMALLOC_MIN_SHIFT)
+#define KMALLOC_MAX_CACHE_SIZE (1UL << KMALLOC_MAX_SHIFT)
+#define KMALLOC_NR_CACHES   (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+#define SLAB_NAME_LEN       24
+
+/* Keep this many empty slabs per cache before returning pages to the PMM */
+#define SLAB_MAX_EMPTY      2
+
+/* Cache creation flags */
+#define SLAB_HWCACHE_ALIGN  (1 << 0)    /* Align objects to cache lines */
+#define SLAB_PANIC          (1 << 1)    /* Panic if creation fails */
+#define SLAB_NO_MAGAZINE    (1 << 2)    /* Bypass the per-CPU layer */
+
+/* Objects per magazine (sized so a magazine fills two cache lines) */
+#define MAGAZINE_SIZE       14
+
+/* Depot limits; beyond these, magazines are returned to the slab layer */
+#define DEPOT_MAX_FULL      8
+#define DEPOT_MAX_EMPTY     8
+
+#define SLAB_CACHE_LINE     64
+
+/* ===================================================================== */
+/* Structures */
+/* ===================================================================== */
+
+struct kmem_cache;
+
+/* Slab descriptor - lives at the start of each naturally aligned slab */
+struct slab {
+    uint32_t magic;
+    uint32_t inuse;             /* Allocated objects in this slab */
+    struct kmem_cache *cache;
+    struct slab *next;
+    struct slab *prev;
+    void *freelist;             /* Singly linked free objects */
+};
+
+#define SLAB_MAGIC          0x51AB51AB
+
+/* A stack of cached objects */
+struct kmem_magazine {
+    struct kmem_magazine *next;     /* Depot link */
+    uint32_t rounds;                /* Objects currently held */
+    void *objs[MAGAZINE_SIZE];
+};
+
+/*
+ * Per-CPU magazine pair. Only its own CPU uses it, except to flush it,
+ * so the lock is all but uncontended.
+ */
+struct kmem_cpu_cache {
+    spinlock_t lock;
+    struct kmem_magazine *loaded;
+    struct kmem_magazine *previous;
+
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t free_hits;
+    uint64_t free_misses;
+} __aligned(SLAB_CACHE_LINE);
+
+struct kmem_cache {
+    char name[SLAB_NAME_LEN];
+    size_t object_size;         /* Size requested by the creator */
+    size_t size;                /* Slot size including alignment padding */
+    size_t align;
+    size_t offset;              /* Offset of first object in a slab */
+    uint32_t objs_per_slab;
+    uint32_t flags;
+
+    spinlock_t lock;
+
+    /* Slab lists */
+    struct slab *partial;       /* Some objects free */
+    struct slab *full;          /* No objects free */
+    struct slab *empty;         /* All objects free */
+    uint32_t nr_empty;
+
+    /* Statistics */
+    size_t nr_slabs;
+    size_t active_objs;
+    uint64_t allocs;
+    uint64_t frees;
+
+    /* Magazine depot */
+    spinlock_t depot_lock;
+    struct kmem_magazine *depot_full;
+    struct kmem_magazine *depot_empty;
+    uint32_t depot_nr_full;
+    uint32_t depot_nr_empty;
+    uint64_t depot_refills;     /* Full magazines handed to a CPU */
+    uint64_t depot_flushes;     /* Full magazines taken from a CPU */
+
+    struct kmem_cache *next;    /* Global cache list */
+
+    /* Per-CPU magazines */
+    struct kmem_cpu_cache cpu[MAX_CPUS];
+};
+
+/* ===================================================================== */
+/* Function declarations */
+/* ===================================================================== */
+
+/**
+ * kmem_cache_init - Bootstrap the slab allocator and kmalloc size classes
+ */
+void kmem_cache_init(void);
+
+/**
+ * kmem_cache_create - Create an object cache
+ * @name: Name shown in slabinfo
+ * @size: Object size in bytes
+ * @align: Required alignment (0 for default)
+ * @flags: SLAB_* flags
+ *
+ * Return: New cache, or NULL on failure
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, uint32_t flags);
+
+/**
+ * kmem_cache_destroy - Destroy a cache (all objects must be freed)
+ * @cache: Cache to destroy
+ */
+void kmem_cache_destroy(struct kmem_cache *cache);
+
+/**
+ * kmem_cache_alloc - Allocate an object from a cache
+ * @cache: Cache to allocate from
+ * @flags: Allocation flags (GFP_*)
+ *
+ * Return: Pointer to object, or NULL on failure
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache, uint32_t flags);
+
+/**
+ * kmem_cache_free - Return an object to its cache
+ * @cache: Cache the object was allocated from
+ * @obj: Object to free
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+/**
+ * kmem_cache_shrink - Release cached objects and empty slabs
+ * @cache: Cache to shrink
+ *
+ * Flushes all magazines back to the slab layer, then returns empty slabs
+ * to the PMM. Must not race with other users of the cache.
+ */
+void kmem_cache_shrink(struct kmem_cache *cache);
+
+/**
+ * kmalloc_slab - Find the size-class cache for a kmalloc request
+ * @size: Requested size
+ *
+ * Return: Cache to use, or NULL if the request must go to the heap
+ */
+struct kmem_cache *kmalloc_slab(size_t size);
+
+/**
+ * kmem_cache_of - Find the cache that owns an object
+ * @obj: Object pointer
+ *
+ * Return: Owning cache, or NULL if @obj is not a slab object
+ */
+struct kmem_cache *kmem_cache_of(const void *obj);
+
+/**
+ * kmem_cache_info - Format a slabinfo report
+ * @buf: Output buffer
+ * @size: Buffer size
+ *
+ * Return: Number of bytes written
+ */
+int kmem_cache_info(char *buf, size_t size);
+
+/**
+ * kmem_cache_dump - Print the slabinfo report to the kernel console
+ */
+void kmem_cache_dump(void);
+
+#endif /* _MM_SLAB_H */
@@ -0,0 +1,67 @@
+/*
+ * UnixOS Kernel - vmalloc Header
+ *
+ * Virtually contiguous kernel allocations backed by discontiguous
+ * physical pages, mapped into the VMALLOC_START..VMALLOC_END window.
+ * Used for large CPU-only buffers so they never fragment the kmalloc
+ * heap. Never hand vmalloc memory to a device: use kmalloc for DMA.
+ */
+
+#ifndef _MM_VMALLOC_H
+#define _MM_VMALLOC_H
+
+#include "types.h"
+
+/**
+ * vmalloc - Allocate virtually contiguous kernel memory
+ * @size: Number of bytes (rounded up to whole pages)
+ *
+ * Return: Kernel virtual address, or NULL on failure
+ */
+void *vmalloc(size_t size);
+
+/**
+ * vzalloc - Allocate zeroed virtually contiguous kernel memory
+ * @size: Number of bytes
+ *
+ * Return: Kernel virtual address, or NULL on failure
+ */
+void *vzalloc(size_t size);
+
+/**
+ * __vmalloc - Allocate virtually contiguous memory with GFP flags
+ * @size: Number of bytes
+ * @flags: Allocation flags (GFP_*)
+ *
+ * Return: Kernel virtual address, or NULL on failure
+ */
+void *__vmalloc(size_t size, uint32_t flags);
+
+/**
+ * vfree - Free memory returned by vmalloc
+ * @addr: Address returned by vmalloc (NULL is ignored)
+ */
+void vfree(const void *addr);
+
+/**
+ * is_vmalloc_addr - Check whether an address is in the vmalloc area
+ * @addr: Address to test
+ */
+bool is_vmalloc_addr(const void *addr);
+
+/**
+ * vmalloc_size - Get the usable size of a vmalloc allocation
+ * @addr: Address returned by vmalloc
+ *
+ * Return: Size in bytes, or 0 if @addr is not a vmalloc allocation
+ */
+size_t vmalloc_size(const void *addr);
+
+/**
+ * vmalloc_get_stats - Get vmalloc usage
+ * @used: Output for bytes currently mapped
+ * @areas: Output for number of live allocations
+ */
+void vmalloc_get_stats(size_t *used, size_t *areas);
+
+#endif /* _MM_VMALLOC_H */
@@ -5,8 +5,12 @@
 #ifndef _MM_VMM_H
 #define _MM_VMM_H
 
+#include "rbtree.h"
+#include "sync/spinlock.h"
 #include "types.h"
 
+struct file;
+
 /* ===================================================================== */
 /* ARM64 Page Table Definitions */
 /* ===================================================================== */
@@ -48,6 +52,11 @@
 #define PTE_UXN             (1UL << 54)  /* User execute never */
 #define PTE_PXN             (1UL << 53)  /* Privileged execute never */
 
+/* Software bits (ignored by the MMU) */
+#define PTE_COW             (1UL << 55)  /* Write-protected, copy on write */
+#define PTE_SHARED          (1UL << 56)  /* Stays writable across fork */
+#define PTE_CONT            (1UL << 52)  /* One of 16 contiguous entries */
+
 /* Common flag combinations */
 #define PTE_KERNEL_RO       (PTE_VALID | PTE_TABLE | PTE_ATTR_NORMAL | PTE_SH_INNER | PTE_ACCESSED | PTE_RDONLY | PTE_UXN)
 #define PTE_KERNEL_RW       (PTE_VALID | PTE_TABLE | PTE_ATTR_NORMAL | PTE_SH_INNER | PTE_ACCESSED | PTE_UXN)
@@ -63,6 +72,11 @@
 /* Address mask */
 #define PTE_ADDR_MASK       0x0000FFFFFFFFF000UL
 
+/* Large kernel mappings */
+#define VMM_BLOCK_SIZE      (1UL << VMM_LEVEL2_SHIFT)    /* 2MB level-2 block */
+#define VMM_CONT_PTES       16
+#define VMM_CONT_SIZE       (VMM_CONT_PTES * PAGE_SIZE)  /* 64KB contiguous run */
+
 /* ===================================================================== */
 /* Virtual memory protection flags */
 /* ===================================================================== */
@@ -74,6 +88,7 @@
 #define VM_USER             (1 << 3)
 #define VM_SHARED           (1 << 4)
 #define VM_DEVICE           (1 << 5)
+#define VM_COW              (1 << 6)    /* PTE only: map read-only, copy on write */
 
 /* ===================================================================== */
 /* Memory layout */
@@ -89,6 +104,15 @@
 #define KERNEL_HEAP_START   0xFFFF000040000000UL
 #define KERNEL_HEAP_SIZE    (1UL * 1024 * 1024 * 1024)  /* 1GB */
 
+/*
+ * vmalloc area - virtually contiguous kernel allocations. Lives in the
+ * TTBR1 half, which always walks kernel_pgd, at L0 index 1 so it never
+ * overlaps the identity-mapped RAM under L0 index 0.
+ */
+#define VMALLOC_START       0xFFFF008000000000UL
+#define VMALLOC_SIZE        (8UL * 1024 * 1024 * 1024)  /* 8GB */
+#define VMALLOC_END         (VMALLOC_START + VMALLOC_SIZE)
+
 /* User virtual address space */
 #define USER_VMA_START      0x0000000000000000UL
 #define USER_VMA_END        0x0000800000000000UL
@@ -97,18 +121,40 @@
 /* Address space structure */
 /* ===================================================================== */
 
+/*
+ * VM areas are indexed twice: an rbtree keyed by start address for
+ * O(log n) lookup, and a sorted list for O(1) neighbour access. Each
+ * tree node caches the largest unmapped gap that precedes any VMA in
+ * its subtree, so free-range searches can skip whole subtrees.
+ *
+ * mm->mmap_lock covers both, and vma_cache; every vmm_*vma*() and
+ * vmm_find_unmapped_area() call must hold it. It is taken before
+ * page_table_lock. Like that lock it is IRQ-safe rather than sleeping,
+ * since faults take it and processes sharing CPU 0 preempt each other.
+ */
 struct vm_area {
     virt_addr_t start;
     virt_addr_t end;
     uint32_t flags;
-    struct vm_area *next;
+    struct file *file;          /* Backing file, NULL if anonymous */
+    uint64_t pgoff;             /* File page mapped at @start */
+    struct vm_area *next;       /* Address-sorted list */
+    struct vm_area *prev;
+    struct rb_node rb;          /* Node in mm->vma_tree */
+    size_t subtree_gap;         /* Largest gap before a VMA in this subtree */
 };
 
 struct mm_struct {
     uint64_t *pgd;              /* Page table root */
-    struct vm_area *vma_list;   /* VM areas */
+    struct vm_area *vma_list;   /* VM areas, lowest first */
+    struct rb_root vma_tree;    /* Same VM areas, by start address */
+    struct vm_area *vma_cache;  /* Last vmm_find_vma() hit */
+    size_t map_count;           /* Number of VM areas */
     size_t total_vm;            /* Total mapped size */
     atomic_t users;             /* Reference count */
+    spinlock_t mmap_lock;       /* Protects the VM areas and vma_cache */
+    spinlock_t page_table_lock; /* Protects user page table entries */
+    uint64_t context_id;        /* ASID generation and ID, 0 until first switch */
     
     /* Code segment */
     uint64_t start_code;        /* Start of text segment */
@@ -170,6 +216,10 @@ int vmm_unmap_page(virt_addr_t vaddr);
  * @size: Size in bytes (will be page-aligned)
  * @flags: Protection flags
  * 
+ * Uses 2MB block mappings where @vaddr and @paddr are both 2MB aligned,
+ * and 64KB contiguous runs where they are 64KB aligned, so large ranges
+ * take a fraction of the TLB entries. Edges are mapped with 4K pages.
+ * 
  * Return: 0 on success, negative on error
  */
 int vmm_map_range(virt_addr_t vaddr, phys_addr_t paddr, size_t size, uint32_t flags);
@@ -179,10 +229,26 @@ int vmm_map_range(virt_addr_t vaddr, phys_addr_t paddr, size_t size, uint32_t fl
  * @vaddr: Starting virtual address
  * @size: Size in bytes
  * 
+ * Blocks and contiguous runs only partly inside the range are split
+ * into pages first.
+ * 
  * Return: 0 on success, negative on error
  */
 int vmm_unmap_range(virt_addr_t vaddr, size_t size);
 
+/**
+ * vmm_set_range_flags - Change the protection of mapped kernel pages
+ * @vaddr: Starting virtual address
+ * @size: Size in bytes
+ * @flags: New protection flags
+ * 
+ * Splits blocks and contiguous runs at the edges of the range, like
+ * vmm_unmap_range(). Unmapped pages in the range are skipped.
+ * 
+ * Return: 0 on success, negative on error
+ */
+int vmm_set_range_flags(virt_addr_t vaddr, size_t size, uint32_t flags);
+
 /**
  * vmm_virt_to_phys - Translate virtual to physical address
  * @vaddr: Virtual address
@@ -191,6 +257,14 @@ int vmm_unmap_range(virt_addr_t vaddr, size_t size);
  */
 phys_addr_t vmm_virt_to_phys(virt_addr_t vaddr);
 
+/**
+ * vmm_block_get_stats - Get large mapping counters
+ * @blocks: Output for 2MB blocks mapped
+ * @cont: Output for 64KB contiguous runs mapped
+ * @splits: Output for blocks split back into pages
+ */
+void vmm_block_get_stats(uint64_t *blocks, uint64_t *cont, uint64_t *splits);
+
 /**
  * vmm_create_address_space - Create new address space for process
  * 
@@ -199,14 +273,197 @@ phys_addr_t vmm_virt_to_phys(virt_addr_t vaddr);
 struct mm_struct *vmm_create_address_space(void);
 
 /**
- * vmm_destroy_address_space - Free an address space
- * @mm: Address space to destroy
+ * vmm_destroy_address_space - Drop a reference to an address space
+ * @mm: Address space to release
+ * 
+ * When the last user goes away, every user page reference is dropped and
+ * the user page tables, VMAs and the mm itself are freed.
  */
 void vmm_destroy_address_space(struct mm_struct *mm);
 
+/**
+ * vmm_dup_address_space - Create a copy-on-write copy of an address space
+ * @src: Address space to copy (normally the forking parent's)
+ * 
+ * Page tables are duplicated but user pages are not: every private
+ * writable page is made read-only in both @src and the copy, marked
+ * PTE_COW, and gains a reference. The first write from either side
+ * faults into vmm_handle_cow_fault().
+ * 
+ * Return: New address space, or NULL on failure
+ */
+struct mm_struct *vmm_dup_address_space(struct mm_struct *src);
+
+/**
+ * vmm_handle_cow_fault - Resolve a write fault on a copy-on-write page
+ * @mm: Address space that faulted
+ * @vaddr: Faulting virtual address
+ * 
+ * Copies the page if it is still shared, or simply makes it writable
+ * again if this mapping holds the last reference.
+ * 
+ * Return: 0 if the fault was resolved, negative if it was not a COW fault
+ */
+int vmm_handle_cow_fault(struct mm_struct *mm, virt_addr_t vaddr);
+
+/**
+ * vmm_map_user_page - Map a page into a user address space
+ * @mm: Target address space
+ * @vaddr: User virtual address
+ * @paddr: Physical address (the mapping owns one page reference)
+ * @flags: Protection flags (VM_*)
+ * 
+ * Return: 0 on success, negative on error or if @vaddr is already mapped
+ */
+int vmm_map_user_page(struct mm_struct *mm, virt_addr_t vaddr, phys_addr_t paddr, uint32_t flags);
+
+/**
+ * vmm_add_vma - Record a VM area in an address space
+ * @mm: Target address space
+ * @start: Start address (inclusive)
+ * @end: End address (exclusive)
+ * @flags: Protection flags (VM_*)
+ * 
+ * Return: 0 on success, negative on error
+ */
+int vmm_add_vma(struct mm_struct *mm, virt_addr_t start, virt_addr_t end, uint32_t flags);
+
+/**
+ * vmm_find_vma - Find the VM area containing an address
+ * @mm: Address space to search
+ * @addr: Address to look up
+ * 
+ * Return: VM area, or NULL if @addr is not mapped
+ */
+struct vm_area *vmm_find_vma(struct mm_struct *mm, virt_addr_t addr);
+
+/**
+ * vmm_find_vma_after - Find the first VM area ending above an address
+ * @mm: Address space to search
+ * @addr: Address to look up
+ * 
+ * Returns the area containing @addr if there is one, otherwise the next
+ * area above it. Walk on from there with the ->next links.
+ * 
+ * Return: VM area, or NULL if nothing is mapped above @addr
+ */
+struct vm_area *vmm_find_vma_after(struct mm_struct *mm, virt_addr_t addr);
+
+/**
+ * vmm_add_file_vma - Record a file-backed VM area
+ * @mm: Target address space
+ * @start: Start address (inclusive)
+ * @end: End address (exclusive)
+ * @flags: Protection flags (VM_*)
+ * @file: Backing file (a reference is taken), or NULL for anonymous memory
+ * @pgoff: File page that @start maps
+ * 
+ * The new area is merged into an adjacent one when the flags, file and
+ * file offsets line up.
+ * 
+ * Return: 0 on success, negative on error
+ */
+int vmm_add_file_vma(struct mm_struct *mm, virt_addr_t start, virt_addr_t end,
+                     uint32_t flags, struct file *file, uint64_t pgoff);
+
+/**
+ * vmm_remove_vma_range - Remove a range from an address space's VMAs
+ * @mm: Target address space
+ * @start: Start address (page aligned)
+ * @end: End address (page aligned, exclusive)
+ * 
+ * Areas partially covered are trimmed, or split in two when the range
+ * punches a hole in the middle. Page tables are left alone; see
+ * vmm_unmap_user_range().
+ * 
+ * Return: 0 on success, negative if a split could not be allocated
+ */
+int vmm_remove_vma_range(struct mm_struct *mm, virt_addr_t start, virt_addr_t end);
+
+/**
+ * vmm_protect_range - Change the protection of mapped user memory
+ * @mm: Target address space
+ * @start: Start address (page aligned)
+ * @end: End address (page aligned, exclusive)
+ * @prot: New VM_READ/VM_WRITE/VM_EXEC bits
+ * 
+ * Areas straddling @start or @end are split, the covered ones take the
+ * new protection and are merged with matching neighbours. Present pages
+ * are updated in place; private pages that become writable are marked
+ * copy-on-write so page cache and zero pages are never written through.
+ * Present pages cannot be made inaccessible, so PROT_NONE only stops
+ * new faults.
+ * 
+ * Return: 0 on success, negative if a split could not be allocated
+ */
+int vmm_protect_range(struct mm_struct *mm, virt_addr_t start, virt_addr_t end,
+                      uint32_t prot);
+
+/**
+ * vmm_find_unmapped_area - Find a free range of user address space
+ * @mm: Address space to search
+ * @len: Size needed in bytes (page aligned)
+ * @low: Lowest acceptable start address
+ * @high: End of the acceptable window (exclusive)
+ * 
+ * O(log n): subtrees whose largest gap is too small are never visited.
+ * 
+ * Return: Lowest start address of a free range, or 0 if none fits
+ */
+virt_addr_t vmm_find_unmapped_area(struct mm_struct *mm, size_t len,
+                                   virt_addr_t low, virt_addr_t high);
+
+/**
+ * vmm_unmap_user_range - Remove user page mappings
+ * @mm: Target address space
+ * @start: Start address (page aligned)
+ * @end: End address (page aligned, exclusive)
+ * 
+ * Drops the page reference held by each mapping and flushes the TLB.
+ */
+void vmm_unmap_user_range(struct mm_struct *mm, virt_addr_t start, virt_addr_t end);
+
+/**
+ * vmm_user_virt_to_phys - Translate a user address in a given address space
+ * @mm: Address space
+ * @vaddr: User virtual address
+ * 
+ * Return: Physical address, or 0 if not mapped
+ */
+phys_addr_t vmm_user_virt_to_phys(struct mm_struct *mm, virt_addr_t vaddr);
+
+/**
+ * vmm_kernel_mm - Get the kernel's own address space
+ * 
+ * Tasks without an mm (and the programs run on kernel_pgd) use this for
+ * user-half mappings. It is never destroyed.
+ */
+struct mm_struct *vmm_kernel_mm(void);
+
+/**
+ * vmm_map_user_range - Allocate and map fresh pages into a user range
+ * @mm: Target address space
+ * @vaddr: Start address
+ * @size: Size in bytes
+ * @flags: Protection flags (VM_*)
+ * 
+ * Return: 0 on success, negative on error
+ */
+int vmm_map_user_range(struct mm_struct *mm, virt_addr_t vaddr, size_t size, uint32_t flags);
+
+/**
+ * vmm_cow_get_stats - Get copy-on-write fault counters
+ * @copies: Output for faults that copied a shared page
+ * @reuses: Output for faults that reclaimed a page with no other users
+ */
+void vmm_cow_get_stats(uint64_t *copies, uint64_t *reuses);
+
 /**
  * vmm_switch_address_space - Switch to a different address space
  * @mm: Address space to switch to
+ * 
+ * Loads the page table root tagged with @mm's ASID (see mm/asid.h), so
+ * the TLB is only flushed after an ASID rollover.
  */
 void vmm_switch_address_space(struct mm_struct *mm);
 
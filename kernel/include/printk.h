@@ -47,6 +47,44 @@ int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
  */
 int vprintk(const char *fmt, __builtin_va_list args);
 
+/**
+ * snprintf - Format a string into a buffer
+ * @buf: Destination buffer
+ * @size: Size of destination buffer (output is always NUL-terminated)
+ * @fmt: Format string (same subset as printk)
+ * 
+ * Return: Number of characters written, excluding the terminator
+ */
+int snprintf(char *buf, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * vsnprintf - Format a string into a buffer with va_list
+ */
+int vsnprintf(char *buf, size_t size, const char *fmt, __builtin_va_list args);
+
+/* Longest line report_printf() formats */
+#define REPORT_LINE_MAX 160
+
+/**
+ * report_printf - Emit one line of a report or benchmark
+ * @buf: Buffer collecting the report (may be NULL)
+ * @size: Size of @buf
+ * @len: Bytes in @buf so far, advanced past the line
+ * @fmt: Format string
+ *
+ * The line goes to the kernel console, and also into @buf while it has
+ * room, so shell commands can show what was printed.
+ */
+void report_printf(char *buf, size_t size, int *len, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+/*
+ * REPORT_OUT - report_printf() for a function taking (char *buf,
+ * size_t size) and keeping an int len
+ */
+#define REPORT_OUT(...) report_printf(buf, size, &len, __VA_ARGS__)
+
 /**
  * panic - Halt the system with error message
  * @msg: Panic message
@@ -0,0 +1,79 @@
+/*
+ * Vib-OS - Red-Black Trees
+ *
+ * Intrusive red-black tree: embed a struct rb_node in the object and do
+ * the ordered descent yourself, then let rb_insert_color() rebalance.
+ *
+ *   struct rb_node **link = &root->rb_node, *parent = NULL;
+ *   while (*link) {
+ *     parent = *link;
+ *     link = key < rb_entry(parent, T, node)->key ? &parent->rb_left
+ *                                                 : &parent->rb_right;
+ *   }
+ *   rb_link_node(&obj->node, parent, link);
+ *   rb_insert_color(&obj->node, root);
+ *
+ * Augmented trees keep a per-node summary of their subtree (a maximum,
+ * a sum...). Pass an update callback that recomputes one node's summary
+ * from its own value and its children's; the _augmented variants call it
+ * on every node whose subtree changes. If a node's own value changes in
+ * place, call rb_augment_propagate() on it.
+ */
+
+#ifndef _KERNEL_RBTREE_H
+#define _KERNEL_RBTREE_H
+
+#include "types.h"
+
+#define RB_RED    0
+#define RB_BLACK  1
+
+struct rb_node {
+  struct rb_node *rb_parent;
+  struct rb_node *rb_left;
+  struct rb_node *rb_right;
+  int rb_color;
+};
+
+struct rb_root {
+  struct rb_node *rb_node;
+};
+
+#define RB_ROOT ((struct rb_root){NULL})
+
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+#define rb_entry_safe(ptr, type, member) \
+  ((ptr) ? rb_entry(ptr, type, member) : NULL)
+
+#define RB_EMPTY_ROOT(root) ((root)->rb_node == NULL)
+
+/* Recompute @node's augmented value from itself and its children */
+typedef void (*rb_augment_fn)(struct rb_node *node);
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+                                struct rb_node **link) {
+  node->rb_parent = parent;
+  node->rb_left = node->rb_right = NULL;
+  node->rb_color = RB_RED;
+  *link = node;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+
+/* As above, keeping augmented values up to date through @update */
+void rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+                         rb_augment_fn update);
+void rb_erase_augmented(struct rb_node *node, struct rb_root *root,
+                        rb_augment_fn update);
+
+/* Re-run @update on @node and every ancestor */
+void rb_augment_propagate(struct rb_node *node, rb_augment_fn update);
+
+/* In-order traversal; O(1) amortized per step */
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_last(const struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+struct rb_node *rb_prev(const struct rb_node *node);
+
+#endif /* _KERNEL_RBTREE_H */
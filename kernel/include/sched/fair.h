@@ -0,0 +1,196 @@
+/*
+ * UnixOS Kernel - Fair Scheduling Class
+ *
+ * Each runnable entity accumulates virtual runtime: the CPU time it has
+ * used, scaled by NICE_0_LOAD over its weight. The entity furthest behind
+ * runs next, so over a scheduling period every entity gets CPU time in
+ * proportion to its weight. Weights come from the nice value; each nice
+ * step is worth about 10% of CPU against a competing task.
+ *
+ * Times are in arch timer counter ticks.
+ */
+
+#ifndef _SCHED_FAIR_H
+#define _SCHED_FAIR_H
+
+#include "rbtree.h"
+#include "types.h"
+
+#define NICE_0_LOAD 1024
+
+#define SCHED_LATENCY_MS 20        /* Period in which every entity runs */
+#define SCHED_MIN_GRANULARITY_MS 4 /* Shortest slice */
+#define SCHED_WAKEUP_GRANULARITY_MS 4
+
+/* fair_enqueue() / fair_place() flags */
+#define ENQUEUE_WAKEUP (1 << 0)  /* Was sleeping: sleeper credit */
+#define ENQUEUE_INITIAL (1 << 1) /* New entity: starts a slice in debt */
+
+/* fair_dequeue() flags */
+#define DEQUEUE_SLEEP (1 << 0) /* Stops being runnable */
+
+struct sched_entity {
+  struct rb_node run_node;
+  uint64_t vruntime;
+  uint64_t exec_start;            /* Counter when last accounted */
+  uint64_t sum_exec_runtime;      /* Total CPU time */
+  uint64_t prev_sum_exec_runtime; /* sum_exec_runtime when picked */
+  unsigned long weight;
+  bool on_rq;
+};
+
+/*
+ * Runnable entities of one CPU. The running entity (curr) counts towards
+ * load and nr_running but is kept out of the tree while it runs.
+ */
+struct cfs_rq {
+  struct rb_root timeline;    /* Waiting entities by vruntime */
+  struct rb_node *leftmost;   /* Cached first node */
+  struct sched_entity *curr;  /* Running entity, if fair */
+  uint64_t min_vruntime;      /* Monotonic floor of vruntime */
+  unsigned long load;         /* Sum of weights */
+  unsigned int nr_running;
+};
+
+/**
+ * sched_nice_to_weight - Load weight for a nice value
+ * @nice: Nice value, clamped to NICE_MIN..NICE_MAX
+ *
+ * Return: Weight, NICE_0_LOAD for nice 0
+ */
+unsigned long sched_nice_to_weight(int nice);
+
+/**
+ * cfs_rq_init - Initialize an empty fair run queue
+ * @cfs: Run queue
+ */
+void cfs_rq_init(struct cfs_rq *cfs);
+
+/**
+ * fair_account - Charge an entity for the time since it was last charged
+ * @se: Entity
+ * @now: Current counter value
+ *
+ * Return: CPU time charged
+ */
+uint64_t fair_account(struct sched_entity *se, uint64_t now);
+
+/**
+ * fair_slice - Wall-clock slice of an entity
+ * @weight: Entity's weight
+ * @load: Total runnable weight, including the entity's
+ *
+ * Return: The entity's share of SCHED_LATENCY_MS, at least
+ * SCHED_MIN_GRANULARITY_MS
+ */
+uint64_t fair_slice(unsigned long weight, unsigned long load);
+
+/**
+ * fair_place - Set the vruntime of an entity becoming runnable
+ * @se: Entity, with an absolute vruntime
+ * @min_vruntime: Floor of the queue it joins
+ * @load: Runnable weight of the queue, not counting @se
+ * @flags: ENQUEUE_WAKEUP or ENQUEUE_INITIAL
+ *
+ * A waking sleeper is placed at most half a period behind the floor, so
+ * it runs soon without starving the others for as long as it slept. A
+ * new entity starts one slice ahead, so creating tasks in a loop cannot
+ * grab the CPU.
+ */
+void fair_place(struct sched_entity *se, uint64_t min_vruntime,
+                unsigned long load, int flags);
+
+/**
+ * fair_should_preempt - Whether the running entity's turn is over
+ * @curr: Running entity
+ * @first: Waiting entity with the smallest vruntime
+ * @load: Runnable weight, including @curr
+ *
+ * True once @curr has used its slice, or has run the minimum granularity
+ * and is more than a slice ahead of @first.
+ */
+bool fair_should_preempt(struct sched_entity *curr, struct sched_entity *first,
+                         unsigned long load);
+
+/**
+ * fair_enqueue - Add a runnable entity
+ * @cfs: Run queue
+ * @se: Entity, vruntime relative to its last queue's min_vruntime
+ * @flags: ENQUEUE_WAKEUP, ENQUEUE_INITIAL or 0
+ */
+void fair_enqueue(struct cfs_rq *cfs, struct sched_entity *se, int flags);
+
+/**
+ * fair_dequeue - Remove an entity that stops being runnable or moves
+ * @cfs: Run queue
+ * @se: Entity, which may be curr
+ * @flags: DEQUEUE_SLEEP or 0
+ *
+ * An entity moving to another queue is left with its vruntime relative
+ * to @cfs's min_vruntime, so it keeps its lag. A sleeper keeps its
+ * absolute vruntime, which falls further behind the longer it sleeps;
+ * subtract min_vruntime of the queue it slept on when it wakes.
+ */
+void fair_dequeue(struct cfs_rq *cfs, struct sched_entity *se, int flags);
+
+/**
+ * fair_reweight - Change an entity's weight
+ * @cfs: Run queue @se is on, or NULL if it is not runnable
+ * @se: Entity
+ * @weight: New weight
+ */
+void fair_reweight(struct cfs_rq *cfs, struct sched_entity *se,
+                   unsigned long weight);
+
+/**
+ * fair_update_curr - Charge the running entity and advance min_vruntime
+ * @cfs: Run queue
+ */
+void fair_update_curr(struct cfs_rq *cfs);
+
+/**
+ * fair_first - Waiting entity with the smallest vruntime
+ * @cfs: Run queue
+ *
+ * Return: Entity, or NULL if none is waiting
+ */
+static inline struct sched_entity *fair_first(struct cfs_rq *cfs) {
+  return rb_entry_safe(cfs->leftmost, struct sched_entity, run_node);
+}
+
+/**
+ * fair_set_next - Make a queued entity the running one
+ * @cfs: Run queue
+ * @se: Entity from the tree
+ */
+void fair_set_next(struct cfs_rq *cfs, struct sched_entity *se);
+
+/**
+ * fair_put_prev - Stop running curr
+ * @cfs: Run queue
+ *
+ * Charges curr and, if it is still queued, puts it back in the tree.
+ */
+void fair_put_prev(struct cfs_rq *cfs);
+
+/**
+ * fair_check_preempt_tick - fair_should_preempt() for curr of @cfs
+ * @cfs: Run queue
+ *
+ * Return: True if curr should make way for another entity
+ */
+bool fair_check_preempt_tick(struct cfs_rq *cfs);
+
+/**
+ * fair_check_preempt_wakeup - Whether a woken entity should preempt curr
+ * @curr: Running entity
+ * @se: Entity just enqueued
+ *
+ * True if @se is behind @curr by more than the wakeup granularity, so
+ * interactive tasks waking from sleep get the CPU promptly but two busy
+ * tasks do not bounce it back and forth.
+ */
+bool fair_check_preempt_wakeup(struct sched_entity *curr,
+                               struct sched_entity *se);
+
+#endif /* _SCHED_FAIR_H */
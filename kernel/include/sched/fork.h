@@ -5,21 +5,23 @@
 #ifndef _SCHED_FORK_H
 #define _SCHED_FORK_H
 
+#include "sched/sched.h"
 #include "types.h"
 
-/* Clone flags (subset of Linux clone flags) */
-#define CLONE_VM        0x00000100  /* Share virtual memory */
-#define CLONE_FS        0x00000200  /* Share filesystem info */
-#define CLONE_FILES     0x00000400  /* Share file descriptors */
-#define CLONE_SIGHAND   0x00000800  /* Share signal handlers */
-#define CLONE_THREAD    0x00010000  /* Share thread group */
+/* Clone flags beyond those in sched/sched.h */
+#define CSIGNAL         0x000000ff  /* Signal sent to the parent on exit */
 #define CLONE_NEWNS     0x00020000  /* New mount namespace */
 
 /**
- * do_fork - Create a child process
+ * do_fork - Create a child of the current scheduler task
  * @flags: Clone flags
  * 
- * Returns child PID to parent, 0 to child, negative on error.
+ * The child gets a copy-on-write copy of the parent's address space (or
+ * shares it with CLONE_VM) and is queued only once that is done. It does
+ * not resume the parent's code: it starts afresh on a kernel stack of its
+ * own. User processes are not scheduler tasks and cannot fork this way.
+ * 
+ * Returns child PID, negative on error.
  */
 long do_fork(unsigned long flags);
 
@@ -34,6 +36,19 @@ long do_fork(unsigned long flags);
  */
 long do_execve(const char *filename, char *const argv[], char *const envp[]);
 
+/**
+ * fork_bench - Measure fork and exit cost against resident set size
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ * 
+ * Times the copy-on-write address space duplication done by fork, the
+ * teardown done by exit, and the child's first-write faults, for a range
+ * of parent sizes. The report is also printed to the kernel console.
+ * 
+ * Returns number of bytes written to @buf.
+ */
+int fork_bench(char *buf, size_t size);
+
 /**
  * task_entry_stub - Entry point for forked tasks
  * @arg: Argument passed to task
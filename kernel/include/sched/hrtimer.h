@@ -0,0 +1,146 @@
+/*
+ * UnixOS Kernel - High-Resolution Timers
+ *
+ * One-shot timers on the arch timer counter. Each CPU keeps its pending
+ * timers in a red-black tree by expiry and programs the hardware timer
+ * for the earliest one, so timers fire when due rather than on the next
+ * tick. The scheduler tick is itself a periodic hrtimer, which lets an
+ * idle secondary CPU stop it and sleep in wfi until real work is due.
+ *
+ * Expiry times are absolute counter values (arch_timer_get_ticks()).
+ */
+
+#ifndef _SCHED_HRTIMER_H
+#define _SCHED_HRTIMER_H
+
+#include "rbtree.h"
+#include "types.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+#define HZ 100 /* Scheduler tick rate */
+
+enum hrtimer_restart {
+  HRTIMER_NORESTART, /* One-shot: done */
+  HRTIMER_RESTART,   /* Requeue at the (forwarded) expiry */
+};
+
+struct hrtimer_base;
+
+struct hrtimer {
+  struct rb_node node;
+  uint64_t expires;
+  enum hrtimer_restart (*function)(struct hrtimer *timer);
+  struct hrtimer_base *base; /* CPU queued on, or last run on */
+  bool queued;
+};
+
+/**
+ * hrtimer_init - Initialize a timer
+ * @timer: Timer
+ * @function: Callback, run from the timer interrupt with IRQs off
+ */
+void hrtimer_init(struct hrtimer *timer,
+                  enum hrtimer_restart (*function)(struct hrtimer *));
+
+/**
+ * hrtimer_start - Arm a timer on this CPU
+ * @timer: Timer, requeued if already pending
+ * @expires: Absolute expiry in counter ticks; a time in the past fires
+ *           at once
+ */
+void hrtimer_start(struct hrtimer *timer, uint64_t expires);
+
+/**
+ * hrtimer_cancel - Disarm a timer
+ * @timer: Timer
+ *
+ * Waits for the callback to finish if it is running on another CPU.
+ *
+ * Return: True if the timer was pending
+ */
+bool hrtimer_cancel(struct hrtimer *timer);
+
+/**
+ * hrtimer_forward - Move a periodic timer's expiry past @now
+ * @timer: Timer, typically from inside its callback
+ * @now: Current counter value
+ * @interval: Period in counter ticks
+ *
+ * Return: Number of periods skipped
+ */
+uint64_t hrtimer_forward(struct hrtimer *timer, uint64_t now,
+                         uint64_t interval);
+
+/**
+ * hrtimer_interrupt - Run expired timers and reprogram the hardware
+ *
+ * Called from the arch timer interrupt handler.
+ */
+void hrtimer_interrupt(void);
+
+/**
+ * hrtimer_init_cpu - Start high-resolution timers on this CPU
+ *
+ * Called on each CPU once its timer interrupt is enabled; starts the
+ * scheduler tick.
+ */
+void hrtimer_init_cpu(void);
+
+/**
+ * tick_nohz_idle - Sleep an idle CPU without the tick
+ *
+ * Called by the idle loop instead of arch_idle(). Unless work is already
+ * queued, stops the tick, waits in wfi for the next interrupt (a timer,
+ * or a reschedule IPI), then restarts the tick. The boot CPU keeps its
+ * tick, which also preempts user processes.
+ */
+void tick_nohz_idle(void);
+
+/**
+ * ticks_to_ns - Convert counter ticks to nanoseconds
+ * @ticks: Counter ticks
+ *
+ * Return: Nanoseconds
+ */
+uint64_t ticks_to_ns(uint64_t ticks);
+
+/**
+ * ns_to_ticks - Convert nanoseconds to counter ticks, rounding up
+ * @ns: Nanoseconds
+ *
+ * Return: Counter ticks
+ */
+uint64_t ns_to_ticks(uint64_t ns);
+
+/**
+ * ktime_get_ns - Monotonic time since boot
+ *
+ * Return: Nanoseconds
+ */
+uint64_t ktime_get_ns(void);
+
+/**
+ * hrtimer_sleep_until - Sleep until an absolute time
+ * @expires: Absolute counter value
+ *
+ * Scheduler tasks and user processes block and are woken by a timer, so
+ * the CPU goes to others in the meantime. The boot CPU's own kernel
+ * context (the desktop loop) cannot block and waits in wfi instead.
+ *
+ * Return: 0 once @expires has passed, -EINTR (-4) if a task was
+ * interrupted by a signal
+ */
+int hrtimer_sleep_until(uint64_t expires);
+
+/**
+ * hrtimer_nanosleep - Sleep for a relative time
+ * @ns: Nanoseconds to sleep
+ * @rem: If not NULL, set to the time left when interrupted, else 0
+ *
+ * Return: As hrtimer_sleep_until()
+ */
+int hrtimer_nanosleep(uint64_t ns, uint64_t *rem);
+
+#endif /* _SCHED_HRTIMER_H */
@@ -0,0 +1,105 @@
+/*
+ * UnixOS Kernel - Process IDs
+ *
+ * Scheduler tasks and user processes draw IDs from one allocator, so a
+ * PID names at most one of them. IDs are handed out cyclically, like
+ * Linux's pid_max wrap, so a freed PID is not reused straight away. A
+ * two-level bitmap keeps finding a free ID cheap when most are taken.
+ *
+ * Lookup goes through a PID hash, which each kind of object embeds a
+ * node for, so finding a task or process by PID does not scan them all.
+ * A lookup takes a reference to what it finds, since the object can be
+ * freed on another CPU as soon as the hash is unlocked.
+ */
+
+#ifndef _SCHED_PID_H
+#define _SCHED_PID_H
+
+#include "sync/spinlock.h"
+#include "types.h"
+
+#define PID_MAX 32768 /* IDs are 1..PID_MAX-1; 0 is the idle tasks' */
+
+#define PID_HASH_BITS 8
+#define PID_HASH_SIZE (1 << PID_HASH_BITS)
+
+struct pid_node {
+  struct pid_node *next;
+  pid_t nr;
+};
+
+struct pid_hash {
+  spinlock_t lock;
+  struct pid_node *buckets[PID_HASH_SIZE];
+};
+
+/**
+ * pid_alloc - Allocate a process ID
+ *
+ * Return: The next free ID after the last one handed out, wrapping
+ * around, or -1 if all are in use
+ */
+pid_t pid_alloc(void);
+
+/**
+ * pid_free - Release a process ID for reuse
+ * @nr: ID from pid_alloc()
+ */
+void pid_free(pid_t nr);
+
+/**
+ * pid_nr_allocated - Number of IDs in use
+ *
+ * Return: Allocated IDs
+ */
+unsigned int pid_nr_allocated(void);
+
+/**
+ * pid_hash_init - Initialize an empty PID hash
+ * @hash: Hash table
+ */
+void pid_hash_init(struct pid_hash *hash);
+
+/**
+ * pid_hash_add - Make an object findable by PID
+ * @hash: Hash table
+ * @node: Node embedded in the object
+ * @nr: The object's PID
+ */
+void pid_hash_add(struct pid_hash *hash, struct pid_node *node, pid_t nr);
+
+/**
+ * pid_hash_del - Remove an object added with pid_hash_add()
+ * @hash: Hash table
+ * @node: Node embedded in the object
+ */
+void pid_hash_del(struct pid_hash *hash, struct pid_node *node);
+
+/**
+ * pid_hash_find - Look up an object by PID
+ * @hash: Hash table
+ * @nr: PID
+ * @get: Called on the node before the hash is unlocked, to take a
+ *       reference to the object
+ *
+ * An object may be removed and freed as soon as the hash is unlocked, so
+ * the reference @get takes is what keeps it around for the caller.
+ *
+ * Return: The object's node (use container_of()), or NULL
+ */
+struct pid_node *pid_hash_find(struct pid_hash *hash, pid_t nr,
+                               void (*get)(struct pid_node *node));
+
+/**
+ * pid_hash_for_each - Call a function on every object in a hash
+ * @hash: Hash table
+ * @fn: Called with each node; must not sleep or touch @hash
+ * @arg: Passed to @fn
+ *
+ * The hash is locked throughout, so an object cannot be removed, and
+ * freed, while @fn looks at it.
+ */
+void pid_hash_for_each(struct pid_hash *hash,
+                       void (*fn)(struct pid_node *node, void *arg), void *arg);
+
+#endif /* _SCHED_PID_H */
@@ -0,0 +1,128 @@
+/*
+ * UnixOS Kernel - Real-Time Scheduling Class
+ *
+ * SCHED_FIFO and SCHED_RR entities run ahead of every fair one, highest
+ * priority first. A FIFO entity keeps the CPU until it blocks, yields or
+ * a higher priority wakes; an RR entity also makes way for others of its
+ * priority once it has run for RR_TIMESLICE_MS.
+ *
+ * A real-time loop that never blocks would lock up its CPU, so the
+ * real-time entities of a queue may run for RT_RUNTIME_MS of every
+ * RT_PERIOD_MS. Past that they are throttled, and only fair and idle
+ * work runs until the period ends.
+ *
+ * Times are in arch timer counter ticks.
+ */
+
+#ifndef _SCHED_RT_H
+#define _SCHED_RT_H
+
+#include "types.h"
+
+/* Scheduling policies, as numbered by Linux */
+#define SCHED_NORMAL 0
+#define SCHED_FIFO 1
+#define SCHED_RR 2
+
+#define MAX_RT_PRIO 100 /* Real-time priorities are 1..MAX_RT_PRIO-1 */
+
+#define RR_TIMESLICE_MS 100
+#define RT_PERIOD_MS 1000
+#define RT_RUNTIME_MS 950
+
+struct sched_rt_entity {
+  struct sched_rt_entity *next; /* Queue of its priority */
+  struct sched_rt_entity *prev;
+  int prio;                     /* Priority it is queued at */
+  uint64_t exec_start;          /* Counter when last charged */
+  uint64_t time_slice;          /* RR time left in this slice */
+  bool on_rq;
+};
+
+/*
+ * Runnable real-time entities of one CPU: a FIFO per priority, and a
+ * bitmap of the non-empty ones. The running entity stays at the head of
+ * its FIFO while it runs.
+ */
+struct rt_rq {
+  uint64_t bitmap[2]; /* Bit p set: priority p has entities */
+  struct sched_rt_entity *head[MAX_RT_PRIO];
+  struct sched_rt_entity *tail[MAX_RT_PRIO];
+  unsigned int nr_running;
+};
+
+/* Real-time runtime used in the current period */
+struct rt_bandwidth {
+  uint64_t period_start; /* Counter when the period began */
+  uint64_t runtime;      /* Used so far in it */
+  bool throttled;        /* Used up until the period ends */
+  uint64_t nr_throttled; /* Periods that hit the limit */
+};
+
+/**
+ * rt_rq_init - Initialize an empty real-time run queue
+ * @rt: Run queue
+ */
+void rt_rq_init(struct rt_rq *rt);
+
+/**
+ * rt_enqueue - Add a runnable entity
+ * @rt: Run queue
+ * @rt_se: Entity
+ * @prio: Priority, 1..MAX_RT_PRIO-1
+ * @head: Queue ahead of others of @prio rather than behind them
+ *
+ * A preempted entity goes back at the head, so it resumes before its
+ * equals; a newly runnable one waits its turn at the tail.
+ */
+void rt_enqueue(struct rt_rq *rt, struct sched_rt_entity *rt_se, int prio,
+                bool head);
+
+/**
+ * rt_dequeue - Remove an entity that stops being runnable or moves
+ * @rt: Run queue
+ * @rt_se: Entity, which may be running
+ */
+void rt_dequeue(struct rt_rq *rt, struct sched_rt_entity *rt_se);
+
+/**
+ * rt_requeue - Move an entity behind the others of its priority
+ * @rt: Run queue
+ * @rt_se: Entity
+ */
+void rt_requeue(struct rt_rq *rt, struct sched_rt_entity *rt_se);
+
+/**
+ * rt_first - Runnable entity of the highest priority
+ * @rt: Run queue
+ *
+ * Return: Entity, or NULL if none is runnable
+ */
+struct sched_rt_entity *rt_first(struct rt_rq *rt);
+
+/**
+ * rt_timeslice - RR_TIMESLICE_MS in counter ticks
+ */
+uint64_t rt_timeslice(void);
+
+/**
+ * rt_bandwidth_init - Start the first period
+ * @b: Bandwidth
+ * @now: Current counter value
+ */
+void rt_bandwidth_init(struct rt_bandwidth *b, uint64_t now);
+
+/**
+ * rt_bandwidth_account - Charge real-time runtime and check the limit
+ * @b: Bandwidth
+ * @now: Current counter value
+ * @delta: Real-time runtime since the last call, 0 to just check
+ *
+ * Starts a new period, lifting any throttle, once RT_PERIOD_MS has
+ * passed since the current one began.
+ *
+ * Return: True while throttled
+ */
+bool rt_bandwidth_account(struct rt_bandwidth *b, uint64_t now, uint64_t delta);
+
+#endif /* _SCHED_RT_H */
@@ -5,7 +5,13 @@
 #ifndef _SCHED_SCHED_H
 #define _SCHED_SCHED_H
 
+#include "arch/fpsimd.h"
 #include "mm/vmm.h"
+#include "sched/fair.h"
+#include "sched/pid.h"
+#include "sched/rt.h"
+#include "sched/stats.h"
+#include "sync/spinlock.h"
 #include "types.h"
 
 /* ===================================================================== */
@@ -67,16 +73,31 @@ struct list_head {
 
 #define TASK_COMM_LEN 16
 
+struct mutex;
+
 struct task_struct {
   /* Scheduling info */
   volatile task_state_t state;
   int prio;
   int static_prio;
   int nice;
+  unsigned int cpu; /* CPU whose run queue holds the task */
+  struct sched_entity se;
+
+  /* Real-time class; see task_rt_prio() */
+  int policy;                  /* SCHED_NORMAL, SCHED_FIFO or SCHED_RR */
+  int rt_priority;             /* 1..MAX_RT_PRIO-1 unless SCHED_NORMAL */
+  int pi_prio;                 /* Inherited from mutex waiters, or 0 */
+  unsigned int pi_seq;         /* Bumped by each sched_pi_boost() */
+  struct sched_rt_entity rt;
+  struct mutex *pi_held;       /* Mutexes held, newest first */
+  struct mutex *pi_blocked_on; /* Mutex being waited for */
 
   /* Identifiers */
   pid_t pid;
   pid_t tgid; /* Thread group ID */
+  struct pid_node pid_node; /* In the PID hash */
+  int usage; /* References; the last put_task_struct() frees the task */
   uid_t uid;
   gid_t gid;
 
@@ -85,6 +106,7 @@ struct task_struct {
 
   /* CPU context for context switching */
   struct cpu_context cpu_context;
+  struct fpsimd_state fpsimd; /* Saved only once used (arch/fpsimd.h) */
 
   /* Memory management */
   struct mm_struct *mm;        /* User address space */
@@ -103,10 +125,15 @@ struct task_struct {
   struct task_struct *next; /* Run queue next */
   struct task_struct *prev; /* Run queue prev */
 
-  /* Timing */
+  /*
+   * Timing, in counter ticks. Kernel threads run only in the kernel and
+   * everything else's time counts as user time: there is no entry hook
+   * to split it further.
+   */
   uint64_t start_time;
   uint64_t utime; /* User time */
   uint64_t stime; /* System time */
+  struct sched_info sched_info; /* Run and wait times, switches */
 
   /* Exit info */
   int exit_code;
@@ -128,6 +155,8 @@ struct task_struct {
 #define PF_USER (1 << 3)       /* User process (runs at EL0) */
 #define PF_FORKNOEXEC (1 << 4) /* Forked but not yet exec'd */
 #define PF_THREAD (1 << 5)     /* Thread (shares address space) */
+#define PF_IDLEPRIO (1 << 6)   /* Runs only when the CPU would idle */
+#define PF_PERCPU (1 << 7)     /* Bound to its CPU (create_task_on()) */
 
 /* Clone flags for thread/process creation */
 #define CLONE_VM (1 << 8)       /* Share virtual memory */
@@ -144,17 +173,52 @@ struct task_struct {
 #define USER_HEAP_BASE 0x10000000ULL      /* User heap start */
 #define USER_MMAP_BASE 0x7F0000000000ULL  /* mmap region */
 
+/**
+ * task_rt_prio - Real-time priority a task runs at
+ * @task: Task
+ *
+ * Its own under SCHED_FIFO or SCHED_RR, raised to that of the highest
+ * waiter on a mutex it holds.
+ *
+ * Return: 1..MAX_RT_PRIO-1, or 0 for the fair class
+ */
+static inline int task_rt_prio(const struct task_struct *task) {
+  int prio = task->policy != SCHED_NORMAL ? task->rt_priority : 0;
+  return task->pi_prio > prio ? task->pi_prio : prio;
+}
+
 /* ===================================================================== */
 /* Per-CPU run queue */
 /* ===================================================================== */
 
+/*
+ * Each CPU schedules from its own queue under its own lock. The lock is
+ * held across the context switch and dropped by the incoming task, so a
+ * task that is still being switched out is never visible to another CPU.
+ *
+ * Real-time tasks run first, then normal tasks from the fair timeline;
+ * idle-priority tasks wait in a FIFO linked through their next/prev
+ * pointers.
+ */
 struct rq {
+  spinlock_t lock;
+  unsigned int cpu;
+  bool online;
+  volatile bool need_resched;  /* Preempt current on IRQ exit */
   struct task_struct *current; /* Currently running task */
+  struct task_struct *prev;    /* Switched from, until finish_task_switch() */
   struct task_struct *idle;    /* Idle task */
-  struct task_struct *head;    /* Run queue head */
-  struct task_struct *tail;    /* Run queue tail */
+  struct rt_rq rt;             /* Real-time tasks */
+  struct rt_bandwidth rt_bw;   /* Their runtime this period */
+  struct cfs_rq cfs;           /* Normal tasks */
+  struct task_struct *head;    /* Idle-priority queue head */
+  struct task_struct *tail;    /* Idle-priority queue tail */
   unsigned int nr_running;     /* Number of runnable tasks */
-  uint64_t clock;              /* Run queue clock */
+  unsigned int nr_idleprio;    /* Of which PF_IDLEPRIO */
+  uint64_t clock;              /* Ticks seen by this CPU */
+  uint64_t nr_switches;
+  uint64_t nr_migrations;      /* Tasks pulled in from other CPUs */
+  struct sched_info info;      /* Of the tasks run here, idle excluded */
 };
 
 /* ===================================================================== */
@@ -166,13 +230,81 @@ struct rq {
  */
 void sched_init(void);
 
+/**
+ * sched_init_secondary - Give a secondary CPU its run queue
+ * @cpu: Calling CPU
+ *
+ * Called on @cpu itself; the code running there becomes its idle task.
+ * From then on new and woken tasks may be placed on @cpu.
+ */
+void sched_init_secondary(unsigned int cpu);
+
 /**
  * schedule - Invoke the scheduler
  *
- * Selects the next task to run and performs context switch.
+ * Runs the task with the smallest vruntime and performs context switch.
+ * A CPU with nothing runnable of its own first tries to pull a waiting
+ * task from the busiest other CPU.
  */
 void schedule(void);
 
+/**
+ * schedule_tail - Finish the switch into a task's first run
+ *
+ * Called by task_entry_wrapper before the task's entry point.
+ */
+void schedule_tail(void);
+
+/**
+ * sched_tick - Account a timer tick on this CPU
+ *
+ * Called from the timer interrupt. Charges the running task and flags
+ * it for preemption once its slice is used up and others are waiting.
+ */
+void sched_tick(void);
+
+/**
+ * sched_cpu_idle - Whether this CPU has nothing to run
+ *
+ * Called by the idle loop with IRQs off, before it stops the tick.
+ *
+ * Return: True if the idle task is running and nothing is queued
+ */
+bool sched_cpu_idle(void);
+
+/**
+ * task_curr - Whether a task is running on its CPU right now
+ * @task: Task
+ *
+ * Lockless, so only a hint: used to decide whether spinning on a lock
+ * the task holds is likely to pay off.
+ */
+bool task_curr(struct task_struct *task);
+
+/**
+ * sched_cpu_online - Whether a CPU has joined the scheduler
+ * @cpu: CPU
+ */
+bool sched_cpu_online(unsigned int cpu);
+
+/**
+ * need_resched - Whether this CPU's current task should give way
+ */
+bool need_resched(void);
+
+/**
+ * sched_nr_switches - Context switches on all CPUs since boot
+ */
+uint64_t sched_nr_switches(void);
+
+/**
+ * sched_irq_exit - Preempt the interrupted task if flagged
+ *
+ * Called on the way out of an interrupt on CPUs that run scheduler
+ * tasks preemptively (the secondaries).
+ */
+void sched_irq_exit(void);
+
 /**
  * wake_up_process - Wake up a sleeping process
  * @task: Task to wake up
@@ -187,11 +319,56 @@ int wake_up_process(struct task_struct *task);
  * @arg: Argument to pass to entry
  * @flags: Task creation flags
  *
+ * With PF_IDLEPRIO in @flags the task only runs when the idle task calls
+ * schedule() and nothing else is runnable, and each schedule() it makes
+ * hands the CPU straight back to the idle task.
+ *
  * Return: Pointer to new task, or NULL on failure
  */
 struct task_struct *create_task(void (*entry)(void *), void *arg,
                                 uint32_t flags);
 
+/**
+ * create_task_stopped - Create a new task without queueing it
+ * @entry: Entry point function
+ * @arg: Argument to pass to entry
+ * @flags: Task creation flags
+ *
+ * Nothing can run the task until wake_up_new_task(), so the caller may
+ * finish setting it up first.
+ *
+ * Return: Pointer to new task, or NULL on failure
+ */
+struct task_struct *create_task_stopped(void (*entry)(void *), void *arg,
+                                        uint32_t flags);
+
+/**
+ * free_task_stopped - Free a task from create_task_stopped() never queued
+ * @task: Task
+ */
+void free_task_stopped(struct task_struct *task);
+
+/**
+ * wake_up_new_task - Queue a task from create_task_stopped()
+ * @task: Task, fully set up
+ */
+void wake_up_new_task(struct task_struct *task);
+
+/**
+ * create_task_on - Create a task bound to one CPU
+ * @entry: Entry point function
+ * @arg: Argument to pass to entry
+ * @flags: Task creation flags; PF_PERCPU is added
+ * @cpu: CPU it always runs on
+ *
+ * For per-CPU kernel threads. The task is never moved by load balancing;
+ * on a CPU that is not online yet it waits until the CPU comes up.
+ *
+ * Return: Pointer to new task, or NULL on failure
+ */
+struct task_struct *create_task_on(void (*entry)(void *), void *arg,
+                                   uint32_t flags, unsigned int cpu);
+
 /**
  * create_thread - Create a new thread (shares memory with parent)
  * @entry: Entry point function
@@ -204,11 +381,71 @@ struct task_struct *create_task(void (*entry)(void *), void *arg,
 pid_t create_thread(void (*entry)(void *), void *arg, void *stack,
                     uint32_t clone_flags);
 
+/**
+ * sched_set_nice - Change a task's nice value
+ * @task: Task
+ * @nice: New nice value, clamped to NICE_MIN..NICE_MAX
+ *
+ * Takes effect immediately, including for a queued or running task.
+ */
+void sched_set_nice(struct task_struct *task, int nice);
+
+/**
+ * sched_setscheduler - Change a task's scheduling policy
+ * @task: Task
+ * @policy: SCHED_NORMAL, SCHED_FIFO or SCHED_RR
+ * @prio: 1..MAX_RT_PRIO-1 for SCHED_FIFO and SCHED_RR, 0 for SCHED_NORMAL
+ *
+ * Takes effect immediately, including for a queued or running task.
+ *
+ * Return: 0 on success, -EINVAL (-22) for a bad policy or priority,
+ * -EPERM (-1) for idle and idle-priority tasks
+ */
+int sched_setscheduler(struct task_struct *task, int policy, int prio);
+
+/**
+ * sched_pi_boost - Raise a task to a mutex waiter's priority
+ * @task: Mutex owner
+ * @prio: Waiter's task_rt_prio()
+ *
+ * Only ever raises pi_prio; the owner lowers it again as it unlocks.
+ */
+void sched_pi_boost(struct task_struct *task, int prio);
+
+/**
+ * sched_pi_setprio - Set the priority a task inherits
+ * @task: Task, normally the caller
+ * @prio: New pi_prio
+ * @seq: pi_seq read before @prio was worked out
+ *
+ * Return: False, changing nothing, if a boost came in since @seq was
+ * read; work @prio out again and retry
+ */
+bool sched_pi_setprio(struct task_struct *task, int prio, unsigned int seq);
+
+/**
+ * get_task_struct - Take a reference to a task
+ * @task: Task
+ *
+ * Keeps the structure, though not the task, alive after it exits: a
+ * task that has exited is TASK_DEAD.
+ */
+static inline void get_task_struct(struct task_struct *task) {
+  __atomic_add_fetch(&task->usage, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * put_task_struct - Drop a reference taken with get_task_struct()
+ * @task: Task
+ */
+void put_task_struct(struct task_struct *task);
+
 /**
  * get_task_by_pid - Find a task by PID/TID
  * @pid: Process/Thread ID
  *
- * Return: Task pointer or NULL if not found
+ * Return: Task pointer, with a reference for the caller to put, or NULL
+ * if not found
  */
 struct task_struct *get_task_by_pid(pid_t pid);
 
@@ -220,6 +457,33 @@ struct task_struct *get_task_by_pid(pid_t pid);
  */
 int sched_kill_task(pid_t pid);
 
+/**
+ * smp_bench - CPU-bound throughput across CPUs
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ *
+ * Times one CPU-bound task, then one per CPU that takes scheduler
+ * tasks, and reports the speedup along with per-CPU switch and
+ * migration counts. The report is also printed to the kernel console.
+ *
+ * Return: Number of bytes written to @buf
+ */
+int smp_bench(char *buf, size_t size);
+
+/**
+ * cyclictest - Timer wakeup latency of a real-time and a normal task
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ *
+ * Loads every CPU that takes scheduler tasks with a busy normal task,
+ * then has a SCHED_FIFO and a SCHED_NORMAL task each sleep to a fixed
+ * interval many times, and reports how late their wakeups ran. The
+ * report is also printed to the kernel console.
+ *
+ * Return: Number of bytes written to @buf
+ */
+int cyclictest(char *buf, size_t size);
+
 /**
  * exit_task - Terminate current task
  * @code: Exit code
@@ -240,7 +504,27 @@ struct task_struct *get_current(void);
  */
 void context_switch(struct task_struct *prev, struct task_struct *next);
 
+/**
+ * process_kernel_wake - Give the desktop loop the CPU back
+ *
+ * The desktop loop has work (input, a frame due): it preempts processes
+ * below COMPOSITOR_RT_PRIO until process_kernel_idle(). May be called on
+ * any CPU, in any context.
+ */
+void process_kernel_wake(void);
+
+/**
+ * process_kernel_idle - Let processes run until there is desktop work
+ *
+ * Called by the desktop loop when it has drawn its frame; runs waiting
+ * processes until the next process_kernel_wake().
+ */
+void process_kernel_idle(void);
+
 /* Assembly helper for context switch */
-void cpu_switch_to(struct task_struct *prev, struct task_struct *next);
+void cpu_switch_to(struct cpu_context *prev, struct cpu_context *next);
+
+/* Entry trampoline for new tasks: schedule_tail(), x19(x20), exit_task() */
+void task_entry_wrapper(void);
 
 #endif /* _SCHED_SCHED_H */
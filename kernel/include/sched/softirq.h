@@ -0,0 +1,148 @@
+/*
+ * UnixOS Kernel - Softirqs and Tasklets
+ *
+ * Bottom halves for interrupt handlers. A handler does the minimum with
+ * the device (acknowledge it, note what happened) and raises a softirq;
+ * the softirq runs on the same CPU as the interrupt returns, after the
+ * GIC has seen the EOI, so the device can interrupt again meanwhile.
+ *
+ * Softirq handlers run with IRQs masked, like the rest of this kernel's
+ * interrupt path, and must not sleep or allocate from the kernel heap.
+ * Work that needs either belongs on a workqueue (sched/workqueue.h).
+ *
+ * Tasklets are the usual way to use softirqs: a tasklet is scheduled on
+ * the CPU that calls tasklet_schedule(), runs once however many times it
+ * was scheduled before it ran, and never runs on two CPUs at once.
+ */
+
+#ifndef _SCHED_SOFTIRQ_H
+#define _SCHED_SOFTIRQ_H
+
+#include "types.h"
+
+/* Softirq vectors, run in this order */
+enum {
+  HI_SOFTIRQ,      /* tasklet_hi_schedule() */
+  TASKLET_SOFTIRQ, /* tasklet_schedule() */
+  NR_SOFTIRQS
+};
+
+/*
+ * Latency accounting for one kind of deferred work: how long it waited
+ * between being raised or queued and starting, and how long it ran.
+ */
+struct defer_stats {
+  uint64_t count;
+  uint64_t wait_total_ns;
+  uint64_t wait_max_ns;
+  uint64_t run_total_ns;
+  uint64_t run_max_ns;
+};
+
+/**
+ * defer_stats_account - Record one run of deferred work
+ * @stats: Counters, possibly updated from several CPUs at once
+ * @wait_ns: Time from being raised or queued to starting
+ * @run_ns: Time the handler ran
+ */
+void defer_stats_account(struct defer_stats *stats, uint64_t wait_ns,
+                         uint64_t run_ns);
+
+/**
+ * open_softirq - Install a softirq handler
+ * @nr: Vector
+ * @action: Handler, run with IRQs masked
+ */
+void open_softirq(unsigned int nr, void (*action)(void));
+
+/**
+ * raise_softirq - Mark a softirq pending on this CPU
+ * @nr: Vector
+ *
+ * From an interrupt handler it runs on the way out of the interrupt;
+ * elsewhere it runs before this returns.
+ */
+void raise_softirq(unsigned int nr);
+
+/**
+ * irq_enter - Note entry to an interrupt handler on this CPU
+ */
+void irq_enter(void);
+
+/**
+ * irq_exit - Leave an interrupt handler, running pending softirqs
+ *
+ * Called with IRQs masked after the interrupt is acknowledged at the
+ * controller. Softirqs do not nest: one raised while they run is picked
+ * up by the loop already running.
+ */
+void irq_exit(void);
+
+/**
+ * in_interrupt - Whether this CPU is in an interrupt or softirq handler
+ */
+bool in_interrupt(void);
+
+/**
+ * softirq_init - Install the tasklet softirqs
+ */
+void softirq_init(void);
+
+/* ===================================================================== */
+/* Tasklets */
+/* ===================================================================== */
+
+struct tasklet_struct {
+  struct tasklet_struct *next;
+  unsigned long state; /* TASKLET_STATE_* bits */
+  void (*func)(void *data);
+  void *data;
+};
+
+#define TASKLET_STATE_SCHED 0 /* Queued to run */
+#define TASKLET_STATE_RUN 1   /* Running on some CPU */
+
+#define DECLARE_TASKLET(name, fn, arg)                                         \
+  struct tasklet_struct name = {NULL, 0, (fn), (arg)}
+
+/**
+ * tasklet_init - Initialize a tasklet
+ * @t: Tasklet
+ * @func: Function to run
+ * @data: Its argument
+ */
+void tasklet_init(struct tasklet_struct *t, void (*func)(void *data),
+                  void *data);
+
+/**
+ * tasklet_schedule - Run a tasklet from TASKLET_SOFTIRQ on this CPU
+ * @t: Tasklet; does nothing if it is already scheduled
+ */
+void tasklet_schedule(struct tasklet_struct *t);
+
+/**
+ * tasklet_hi_schedule - Run a tasklet from HI_SOFTIRQ on this CPU
+ * @t: Tasklet; does nothing if it is already scheduled
+ */
+void tasklet_hi_schedule(struct tasklet_struct *t);
+
+/**
+ * tasklet_kill - Wait for a tasklet to be neither scheduled nor running
+ * @t: Tasklet
+ *
+ * Not callable from softirq context.
+ */
+void tasklet_kill(struct tasklet_struct *t);
+
+/**
+ * softirq_report - Report softirq counts and latency
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ *
+ * The report is also printed to the kernel console.
+ *
+ * Return: Number of bytes written to @buf
+ */
+int softirq_report(char *buf, size_t size);
+
+#endif /* _SCHED_SOFTIRQ_H */
@@ -0,0 +1,159 @@
+/*
+ * UnixOS Kernel - Scheduler Statistics
+ *
+ * Every scheduler task and user process, and each CPU, keeps a
+ * struct sched_info: time on the CPU, time runnable but waiting for it,
+ * how often it got it, and how it gave it up. A switch is voluntary when
+ * the task blocked, involuntary when it was preempted or yielded while
+ * still runnable.
+ *
+ * Wakeup latency, from a wakeup to first running after it, also goes
+ * into a log2 histogram in microseconds. A CPU's counts are the sum of
+ * what ran on it.
+ *
+ * The desktop loop, which is the boot CPU's kernel context rather than a
+ * task, is accounted as the compositor: it is runnable from
+ * process_kernel_wake() until it gets the CPU back from the processes.
+ *
+ * Times are kept in arch timer counter ticks and reported in ns or us.
+ */
+
+#ifndef _SCHED_STATS_H
+#define _SCHED_STATS_H
+
+#include "types.h"
+
+/*
+ * Bucket 0: under 1us; bucket b: 2^(b-1) us up to 2^b us; the last
+ * bucket takes everything from 2^(SCHED_HIST_BUCKETS-2) us (16ms) up
+ */
+#define SCHED_HIST_BUCKETS 16
+
+struct sched_info {
+  uint64_t run_time;     /* On the CPU */
+  uint64_t run_delay;    /* Runnable, waiting for the CPU */
+  uint64_t pcount;       /* Times it got the CPU */
+  uint64_t nvcsw;        /* Voluntary switches away */
+  uint64_t nivcsw;       /* Involuntary switches away */
+  uint64_t last_queued;  /* Counter when it became runnable, 0 if not waiting */
+  uint64_t last_arrival; /* Counter when it last got the CPU */
+  uint64_t wakeups;      /* Wakeups that have run */
+  uint64_t wakeup_max;   /* Longest wakeup latency */
+  uint32_t wakeup_hist[SCHED_HIST_BUCKETS];
+  bool woken;            /* last_queued was a wakeup */
+};
+
+/* One task, process or the compositor, as top shows it */
+struct sched_stat {
+  pid_t pid;             /* 0 for the compositor */
+  char comm[16];
+  char state;            /* R, S or Z */
+  int policy;            /* SCHED_NORMAL, SCHED_FIFO or SCHED_RR */
+  int prio;              /* Nice for SCHED_NORMAL, else real-time priority */
+  int cpu;               /* -1 for processes, which the boot CPU runs */
+  uint64_t start_time;   /* Counter when created */
+  struct sched_info info; /* Including the current run, if running */
+};
+
+/**
+ * sched_info_queued - Note that an entity became runnable
+ * @si: Entity's counters
+ * @now: Current counter value
+ * @wakeup: It woke from sleep, rather than being preempted or created
+ *
+ * Does nothing if it is already waiting.
+ */
+void sched_info_queued(struct sched_info *si, uint64_t now, bool wakeup);
+
+/**
+ * sched_info_arrive - Note that an entity got the CPU
+ * @si: Entity's counters
+ * @cpu: The CPU's counters, or NULL
+ * @now: Current counter value
+ */
+void sched_info_arrive(struct sched_info *si, struct sched_info *cpu,
+                       uint64_t now);
+
+/**
+ * sched_info_depart - Note that an entity left the CPU
+ * @si: Entity's counters
+ * @cpu: The CPU's counters, or NULL
+ * @now: Current counter value
+ * @voluntary: It blocked, rather than being preempted or yielding
+ *
+ * An entity still runnable should be passed to sched_info_queued() too.
+ *
+ * Return: Ticks it ran since sched_info_arrive()
+ */
+uint64_t sched_info_depart(struct sched_info *si, struct sched_info *cpu,
+                           uint64_t now, bool voluntary);
+
+/**
+ * sched_info_snapshot - Counters as they stand now
+ * @dst: Copy
+ * @si: Entity's counters
+ * @now: Current counter value
+ * @running: The entity is on a CPU; its current run is added in
+ */
+void sched_info_snapshot(struct sched_info *dst, const struct sched_info *si,
+                         uint64_t now, bool running);
+
+/**
+ * sched_task_stats - Snapshot every scheduler task
+ * @out: Array to fill, may be NULL to count
+ * @max: Entries in @out
+ *
+ * Return: Number of tasks, which may exceed @max
+ */
+int sched_task_stats(struct sched_stat *out, int max);
+
+/**
+ * sched_cpu_stats - Snapshot a CPU's counters
+ * @cpu: CPU
+ * @out: Copy
+ *
+ * Return: False if @cpu is offline
+ */
+bool sched_cpu_stats(unsigned int cpu, struct sched_info *out);
+
+/**
+ * process_sched_stats - Snapshot the compositor and every user process
+ * @out: Array to fill, may be NULL to count; the compositor comes first
+ * @max: Entries in @out
+ *
+ * Return: Number of entries, which may exceed @max
+ */
+int process_sched_stats(struct sched_stat *out, int max);
+
+/**
+ * process_cpu_stats - Snapshot the boot CPU's counters for processes
+ * @out: Copy; the compositor is not included
+ */
+void process_cpu_stats(struct sched_info *out);
+
+/**
+ * schedstat_read - Format /proc/<pid>/schedstat
+ * @pid: Task or process, 0 for the compositor
+ * @buf: Buffer
+ * @size: Size of @buf
+ *
+ * The first line is Linux's: ns on the CPU, ns waiting, and runs. The
+ * rest are the switch counts and the wakeup latency histogram.
+ *
+ * Return: Number of bytes written, or -ESRCH (-3) if there is no such PID
+ */
+int schedstat_read(pid_t pid, char *buf, size_t size);
+
+/**
+ * sched_top - Report CPU use and run delay of everything that runs
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ *
+ * One line per CPU, then tasks and processes by CPU time, most first.
+ * The report is also printed to the kernel console.
+ *
+ * Return: Number of bytes written to @buf
+ */
+int sched_top(char *buf, size_t size);
+
+#endif /* _SCHED_STATS_H */
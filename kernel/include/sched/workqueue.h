@@ -0,0 +1,165 @@
+/*
+ * UnixOS Kernel - Workqueues
+ *
+ * Deferred work that runs in a kernel thread, so unlike a softirq it may
+ * sleep, take mutexes and allocate. Each CPU has one worker thread,
+ * kworker/N, bound to it; work queued from an interrupt runs on the
+ * worker of the CPU that took it.
+ *
+ * The boot CPU's scheduler only runs when the desktop loop yields, so
+ * once other CPUs are online, work queued there goes to their workers
+ * instead and does not wait on the compositor.
+ *
+ * A workqueue is a named kind of work, with its own latency counters.
+ * All workqueues share the per-CPU workers. A work item is never run by
+ * two workers at once: queueing it while it runs sends it to the worker
+ * already running it.
+ */
+
+#ifndef _SCHED_WORKQUEUE_H
+#define _SCHED_WORKQUEUE_H
+
+#include "sched/hrtimer.h"
+#include "sched/softirq.h"
+#include "types.h"
+
+struct worker_pool;
+
+struct workqueue_struct {
+  const char *name;
+  struct defer_stats stats;
+  struct workqueue_struct *next; /* All workqueues, for the report */
+};
+
+struct work_struct {
+  struct work_struct *next;
+  void (*func)(struct work_struct *work);
+  unsigned long state;          /* WORK_STATE_* bits */
+  struct workqueue_struct *wq;  /* Accounted to, set when queued */
+  struct worker_pool *pool;     /* Queued on, or last run on */
+  uint64_t queued_at;           /* ktime_get_ns() */
+};
+
+#define WORK_STATE_PENDING 0 /* Queued, or timer armed, not yet started */
+
+struct delayed_work {
+  struct work_struct work;
+  struct hrtimer timer;
+  struct workqueue_struct *wq;
+};
+
+#define INIT_WORK(w, f)                                                        \
+  do {                                                                         \
+    (w)->next = NULL;                                                          \
+    (w)->func = (f);                                                           \
+    (w)->state = 0;                                                            \
+    (w)->wq = NULL;                                                            \
+    (w)->pool = NULL;                                                          \
+    (w)->queued_at = 0;                                                        \
+  } while (0)
+
+#define to_delayed_work(w) container_of((w), struct delayed_work, work)
+
+/* For work that needs no workqueue of its own */
+extern struct workqueue_struct *system_wq;
+
+/**
+ * init_delayed_work - Initialize a delayed work item
+ * @dwork: Item
+ * @func: Function to run; gets &dwork->work
+ */
+void init_delayed_work(struct delayed_work *dwork,
+                       void (*func)(struct work_struct *work));
+
+/**
+ * alloc_workqueue - Create a workqueue
+ * @name: Name for the report; not copied
+ *
+ * Return: The workqueue, or NULL if out of memory
+ */
+struct workqueue_struct *alloc_workqueue(const char *name);
+
+/**
+ * queue_work - Queue work to run in a worker thread
+ * @wq: Workqueue to account it to
+ * @work: Work item
+ *
+ * Callable from any context, including interrupt handlers.
+ *
+ * Return: False if @work was already pending
+ */
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+
+/**
+ * queue_work_on - Queue work on a given CPU's worker
+ * @cpu: Online CPU
+ * @wq: Workqueue to account it to
+ * @work: Work item
+ *
+ * Return: False if @work was already pending
+ */
+bool queue_work_on(unsigned int cpu, struct workqueue_struct *wq,
+                   struct work_struct *work);
+
+/**
+ * queue_delayed_work - Queue work after a delay
+ * @wq: Workqueue to account it to
+ * @dwork: Work item
+ * @delay_ns: Delay in nanoseconds; 0 queues it at once
+ *
+ * The timer is armed on this CPU, so the work is queued from there.
+ * Its latency counts from when the delay ends.
+ *
+ * Return: False if @dwork was already pending
+ */
+bool queue_delayed_work(struct workqueue_struct *wq,
+                        struct delayed_work *dwork, uint64_t delay_ns);
+
+/**
+ * cancel_work - Take work off its queue if it has not started
+ * @work: Work item
+ *
+ * Does not wait for a run already in progress.
+ *
+ * Return: True if it was pending
+ */
+bool cancel_work(struct work_struct *work);
+
+/**
+ * cancel_delayed_work - Stop delayed work that has not started
+ * @dwork: Work item
+ *
+ * Return: True if it was pending
+ */
+bool cancel_delayed_work(struct delayed_work *dwork);
+
+static inline bool schedule_work(struct work_struct *work)
+{
+  return queue_work(system_wq, work);
+}
+
+static inline bool schedule_delayed_work(struct delayed_work *dwork,
+                                         uint64_t delay_ns)
+{
+  return queue_delayed_work(system_wq, dwork, delay_ns);
+}
+
+/**
+ * workqueue_init - Start a worker on each online CPU
+ *
+ * Call once the secondary CPUs are up, before anything queues work.
+ */
+void workqueue_init(void);
+
+/**
+ * workqueue_report - Report per-workqueue counts and latency
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ *
+ * The report is also printed to the kernel console.
+ *
+ * Return: Number of bytes written to @buf
+ */
+int workqueue_report(char *buf, size_t size);
+
+#endif /* _SCHED_WORKQUEUE_H */
@@ -0,0 +1,57 @@
+/*
+ * vib-OS Kernel - Condition Variables
+ *
+ * Wait for a predicate guarded by a mutex. cond_wait() queues the caller
+ * before it drops the mutex, so a signal sent after the predicate changes
+ * under the mutex cannot slip in unseen. Always retest the predicate in a
+ * loop: wakeups may be spurious.
+ */
+
+#ifndef _SYNC_CONDVAR_H
+#define _SYNC_CONDVAR_H
+
+#include "mutex.h"
+#include "wait.h"
+
+struct condvar {
+  wait_queue_head_t wait;
+};
+
+#define CONDVAR_INIT(name) { .wait = WAIT_QUEUE_HEAD_INIT((name).wait) }
+#define DEFINE_CONDVAR(name) struct condvar name = CONDVAR_INIT(name)
+
+/**
+ * cond_init - Initialize a condition variable
+ * @cv: Condition variable
+ */
+void cond_init(struct condvar *cv);
+
+/**
+ * cond_wait - Release a mutex, sleep until signalled, and retake it
+ * @cv: Condition variable
+ * @lock: Mutex held by the caller, held again on return
+ */
+void cond_wait(struct condvar *cv, struct mutex *lock);
+
+/**
+ * cond_wait_interruptible - cond_wait() that a signal also ends
+ * @cv: Condition variable
+ * @lock: Mutex held by the caller, held again on return
+ *
+ * Return: 0 if woken, -EINTR (-4) on a signal
+ */
+int cond_wait_interruptible(struct condvar *cv, struct mutex *lock);
+
+/**
+ * cond_signal - Wake one waiter
+ * @cv: Condition variable
+ */
+void cond_signal(struct condvar *cv);
+
+/**
+ * cond_broadcast - Wake every waiter
+ * @cv: Condition variable
+ */
+void cond_broadcast(struct condvar *cv);
+
+#endif /* _SYNC_CONDVAR_H */
@@ -0,0 +1,82 @@
+/*
+ * vib-OS Kernel - Mutexes
+ *
+ * Sleeping locks for sections that may block or run long. A contender
+ * first spins while the owner is running on another CPU, since it will
+ * likely release the lock before a sleep and wakeup would complete, and
+ * only sleeps once the owner is preempted or blocks itself.
+ *
+ * A real-time task that sleeps on a mutex lends its priority to the
+ * owner until the owner unlocks, so a normal task holding a lock that
+ * the audio thread wants is not left waiting behind other normal work.
+ * An owner that is itself waiting on a mutex passes the priority on.
+ * Only scheduler tasks take part; user processes and the boot CPU's
+ * kernel context neither lend nor inherit.
+ *
+ * Unlike a spinlock, a mutex must not be taken from interrupt context.
+ */
+
+#ifndef _SYNC_MUTEX_H
+#define _SYNC_MUTEX_H
+
+#include "../types.h"
+#include "wait.h"
+
+struct mutex {
+  int locked;
+  struct task_struct *owner; /* Holder if a scheduler task, for spinning */
+  int pi_prio;               /* Highest priority lent to this holder */
+  struct mutex *pi_next;     /* Holder's other mutexes (task->pi_held) */
+  wait_queue_head_t wait;
+};
+
+#define MUTEX_INIT(name)                                                       \
+  {                                                                            \
+    .locked = 0, .owner = NULL, .pi_prio = 0, .pi_next = NULL,                 \
+    .wait = WAIT_QUEUE_HEAD_INIT((name).wait)                                  \
+  }
+#define DEFINE_MUTEX(name) struct mutex name = MUTEX_INIT(name)
+
+/**
+ * mutex_init - Initialize an unlocked mutex
+ * @lock: Mutex
+ */
+void mutex_init(struct mutex *lock);
+
+/**
+ * mutex_lock - Acquire a mutex, sleeping until it is free
+ * @lock: Mutex
+ */
+void mutex_lock(struct mutex *lock);
+
+/**
+ * mutex_lock_interruptible - Acquire a mutex unless a signal arrives
+ * @lock: Mutex
+ *
+ * Return: 0 with the mutex held, -EINTR (-4) without it
+ */
+int mutex_lock_interruptible(struct mutex *lock);
+
+/**
+ * mutex_trylock - Acquire a mutex if it is free
+ * @lock: Mutex
+ *
+ * Return: True if acquired
+ */
+bool mutex_trylock(struct mutex *lock);
+
+/**
+ * mutex_unlock - Release a mutex and wake one waiter
+ * @lock: Mutex, held by the caller
+ */
+void mutex_unlock(struct mutex *lock);
+
+/**
+ * mutex_is_locked - Whether a mutex is held
+ * @lock: Mutex
+ */
+static inline bool mutex_is_locked(struct mutex *lock) {
+  return __atomic_load_n(&lock->locked, __ATOMIC_RELAXED) != 0;
+}
+
+#endif /* _SYNC_MUTEX_H */
@@ -0,0 +1,59 @@
+/*
+ * vib-OS Kernel - Counting Semaphores
+ *
+ * A count of available units; down() takes one, sleeping while there
+ * are none, and up() returns one. up() may be called from any context,
+ * including interrupt handlers.
+ */
+
+#ifndef _SYNC_SEMAPHORE_H
+#define _SYNC_SEMAPHORE_H
+
+#include "../types.h"
+#include "wait.h"
+
+struct semaphore {
+  int count;
+  wait_queue_head_t wait;
+};
+
+#define SEMAPHORE_INIT(name, n)                                                \
+  { .count = (n), .wait = WAIT_QUEUE_HEAD_INIT((name).wait) }
+#define DEFINE_SEMAPHORE(name, n) struct semaphore name = SEMAPHORE_INIT(name, n)
+
+/**
+ * sema_init - Initialize a semaphore
+ * @sem: Semaphore
+ * @count: Units initially available
+ */
+void sema_init(struct semaphore *sem, int count);
+
+/**
+ * down - Take a unit, sleeping until one is available
+ * @sem: Semaphore
+ */
+void down(struct semaphore *sem);
+
+/**
+ * down_interruptible - Take a unit unless a signal arrives
+ * @sem: Semaphore
+ *
+ * Return: 0 with a unit taken, -EINTR (-4) without
+ */
+int down_interruptible(struct semaphore *sem);
+
+/**
+ * down_trylock - Take a unit if one is available
+ * @sem: Semaphore
+ *
+ * Return: True if a unit was taken
+ */
+bool down_trylock(struct semaphore *sem);
+
+/**
+ * up - Return a unit and wake one waiter
+ * @sem: Semaphore
+ */
+void up(struct semaphore *sem);
+
+#endif /* _SYNC_SEMAPHORE_H */
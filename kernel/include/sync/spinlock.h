@@ -3,6 +3,20 @@
  *
  * Provides mutual exclusion primitives for protecting critical sections.
  * IRQ-safe variants disable interrupts to prevent deadlocks.
+ *
+ * spinlock_t is a ticket lock: CPUs get the lock in the order they asked
+ * for it, and it fits in one word. That suits the short, mostly
+ * uncontended sections that most locks guard.
+ *
+ * mcs_lock_t queues each waiter on a node of its own, usually on its
+ * stack, and each waiter spins on its own node. A release then touches
+ * only the next waiter's cache line rather than every waiter's, so use
+ * it for global locks that all CPUs fight over.
+ *
+ * Built with DEBUG_SPINLOCK (make LOCK_STAT=1), every lock counts its
+ * acquisitions, how many had to wait, and for how long. The counts are
+ * kept per lock class: a DEFINE_SPINLOCK() lock, or every lock set up
+ * by one spin_lock_init() call. lockstat_report() shows them.
  */
 
 #ifndef _SYNC_SPINLOCK_H
@@ -10,21 +24,58 @@
 
 #include "../types.h"
 
+#ifdef DEBUG_SPINLOCK
+/* Contention counts of one class of locks */
+struct lock_class {
+  const char *name;
+  const char *file;
+  uint64_t acquisitions;
+  uint64_t contended;  /* Acquisitions that had to wait */
+  uint64_t spin_total; /* Counter ticks spent waiting */
+  uint64_t spin_max;
+  int registered;      /* On the list lockstat_report() walks */
+  struct lock_class *next;
+};
+
+/* At file scope the compound literal is static, like the lock */
+#define LOCK_CLASS(n) (&(struct lock_class){.name = #n, .file = __FILE__})
+#endif
+
 /* Spinlock structure */
 typedef struct spinlock {
-  volatile uint32_t lock;
+  union {
+    uint32_t val;
+    struct {
+      uint16_t owner; /* Ticket being served */
+      uint16_t next;  /* Next ticket to hand out */
+    } tickets;
+  };
 #ifdef DEBUG_SPINLOCK
-  const char *name;
+  struct lock_class *class;
   int held_by_cpu;
 #endif
 } spinlock_t;
 
 /* Static initializer */
-#define SPINLOCK_INIT {.lock = 0}
+#define SPINLOCK_INIT {.val = 0}
+#ifdef DEBUG_SPINLOCK
+#define DEFINE_SPINLOCK(name)                                                  \
+  spinlock_t name = {.val = 0, .class = LOCK_CLASS(name), .held_by_cpu = -1}
+#else
 #define DEFINE_SPINLOCK(name) spinlock_t name = SPINLOCK_INIT
+#endif
 
 /* Spinlock API */
+#ifdef DEBUG_SPINLOCK
+void __spin_lock_init(spinlock_t *lock, struct lock_class *class);
+#define spin_lock_init(lock)                                                   \
+  do {                                                                         \
+    static struct lock_class __class = {.name = #lock, .file = __FILE__};     \
+    __spin_lock_init((lock), &__class);                                        \
+  } while (0)
+#else
 void spin_lock_init(spinlock_t *lock);
+#endif
 void spin_lock(spinlock_t *lock);
 void spin_unlock(spinlock_t *lock);
 int spin_trylock(spinlock_t *lock);
@@ -33,6 +84,85 @@ int spin_trylock(spinlock_t *lock);
 uint64_t spin_lock_irqsave(spinlock_t *lock);
 void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags);
 
+static inline bool spin_is_locked(spinlock_t *lock) {
+  uint32_t val = __atomic_load_n(&lock->val, __ATOMIC_RELAXED);
+  return (uint16_t)val != (uint16_t)(val >> 16);
+}
+
+/* Someone is waiting behind the holder */
+static inline bool spin_is_contended(spinlock_t *lock) {
+  uint32_t val = __atomic_load_n(&lock->val, __ATOMIC_RELAXED);
+  return (uint16_t)((val >> 16) - val) > 1;
+}
+
+/* ===================================================================== */
+/* MCS queued locks */
+/* ===================================================================== */
+
+/* A waiter's place in the queue; it must stay put until the unlock */
+struct mcs_node {
+  struct mcs_node *next;
+  uint32_t locked; /* Set by the previous holder to hand over */
+};
+
+typedef struct mcs_lock {
+  struct mcs_node *tail; /* Last waiter, or the holder; NULL if free */
+#ifdef DEBUG_SPINLOCK
+  struct lock_class *class;
+#endif
+} mcs_lock_t;
+
+#ifdef DEBUG_SPINLOCK
+#define DEFINE_MCS_LOCK(name)                                                  \
+  mcs_lock_t name = {.tail = NULL, .class = LOCK_CLASS(name)}
+#else
+#define DEFINE_MCS_LOCK(name) mcs_lock_t name = {.tail = NULL}
+#endif
+
+/**
+ * mcs_spin_lock - Acquire an MCS lock
+ * @lock: Lock
+ * @node: Caller's queue node, passed to mcs_spin_unlock() too
+ */
+void mcs_spin_lock(mcs_lock_t *lock, struct mcs_node *node);
+
+/**
+ * mcs_spin_unlock - Release an MCS lock
+ * @lock: Lock
+ * @node: Node it was acquired with
+ */
+void mcs_spin_unlock(mcs_lock_t *lock, struct mcs_node *node);
+
+/**
+ * mcs_spin_trylock - Acquire an MCS lock if nobody holds or waits for it
+ * @lock: Lock
+ * @node: Caller's queue node
+ *
+ * Return: Nonzero if acquired
+ */
+int mcs_spin_trylock(mcs_lock_t *lock, struct mcs_node *node);
+
+uint64_t mcs_spin_lock_irqsave(mcs_lock_t *lock, struct mcs_node *node);
+void mcs_spin_unlock_irqrestore(mcs_lock_t *lock, struct mcs_node *node,
+                                uint64_t flags);
+
+/**
+ * lockstat_report - Report lock contention, most time spent waiting first
+ * @buf: Buffer for the report (may be NULL)
+ * @size: Size of @buf
+ *
+ * Without DEBUG_SPINLOCK there are no counts, and the report says so.
+ * The report is also printed to the kernel console.
+ *
+ * Return: Number of bytes written to @buf
+ */
+int lockstat_report(char *buf, size_t size);
+
+/**
+ * lockstat_reset - Zero every lock class's counts
+ */
+void lockstat_reset(void);
+
 /* Architecture-specific interrupt control */
 static inline uint64_t arch_irq_save_local(void) {
   uint64_t flags;
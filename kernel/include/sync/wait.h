@@ -0,0 +1,240 @@
+/*
+ * vib-OS Kernel - Wait Queues
+ *
+ * A wait queue holds the contexts sleeping until some condition holds.
+ * The waiter queues itself and marks itself asleep before it tests the
+ * condition, and the waker changes the condition before it calls
+ * wake_up(), so a wakeup racing with the test is never lost.
+ *
+ * Three kinds of context can wait. Scheduler tasks block in schedule(),
+ * user processes on the boot CPU go PROC_STATE_BLOCKED, and the boot
+ * CPU's own kernel context (the desktop loop), which cannot block, waits
+ * in wfi until the next interrupt, running its own queued tasks first.
+ */
+
+#ifndef _SYNC_WAIT_H
+#define _SYNC_WAIT_H
+
+#include "../sched/sched.h"
+#include "../types.h"
+#include "spinlock.h"
+
+struct process;
+
+#define WQ_FLAG_EXCLUSIVE (1 << 0) /* wake_up() wakes one such waiter */
+
+typedef struct wait_queue_head {
+  spinlock_t lock;
+  struct list_head head;
+} wait_queue_head_t;
+
+struct wait_queue_entry {
+  struct list_head entry;
+  struct task_struct *task; /* Blocking scheduler task, or NULL */
+  struct process *proc;     /* Blocking user process, or NULL */
+  uint32_t cpu;             /* CPU of a kernel context waiting in wfi */
+  unsigned int flags;
+  uint64_t key;             /* Selects waiters on a shared queue */
+  wait_queue_head_t *head;  /* Queue it is on, which requeueing changes */
+  bool queued;
+};
+
+#define WAIT_QUEUE_HEAD_INIT(name)                                             \
+  { .lock = SPINLOCK_INIT, .head = {&(name).head, &(name).head} }
+#define DECLARE_WAIT_QUEUE_HEAD(name)                                          \
+  wait_queue_head_t name = WAIT_QUEUE_HEAD_INIT(name)
+
+/**
+ * init_waitqueue_head - Initialize an empty wait queue
+ * @wq: Wait queue
+ */
+void init_waitqueue_head(wait_queue_head_t *wq);
+
+/**
+ * init_wait_entry - Set up a wait entry for the calling context
+ * @wait: Entry, usually on the caller's stack
+ * @flags: WQ_FLAG_EXCLUSIVE or 0
+ */
+void init_wait_entry(struct wait_queue_entry *wait, unsigned int flags);
+
+/**
+ * prepare_to_wait - Queue the caller and mark it asleep
+ * @wq: Wait queue
+ * @wait: Caller's entry
+ * @state: TASK_INTERRUPTIBLE or TASK_UNINTERRUPTIBLE
+ *
+ * Test the condition after this and call wait_sleep() if it is still
+ * false. Exclusive waiters queue behind the others. An entry already
+ * queued stays where it is, even if it was requeued off @wq.
+ */
+void prepare_to_wait(wait_queue_head_t *wq, struct wait_queue_entry *wait,
+                     int state);
+
+/**
+ * finish_wait - Mark the caller running and dequeue it
+ * @wq: Wait queue
+ * @wait: Caller's entry
+ *
+ * Return: True if a waker had already dequeued it
+ */
+bool finish_wait(wait_queue_head_t *wq, struct wait_queue_entry *wait);
+
+/**
+ * wait_rearm - Mark the caller asleep again after a spurious return
+ * @wait: Caller's entry
+ * @state: TASK_INTERRUPTIBLE or TASK_UNINTERRUPTIBLE
+ *
+ * For waits that do not retest a condition: a woken entry is off its
+ * queue, so the caller need only check whether it still is.
+ *
+ * Return: False if the entry was woken in the meantime
+ */
+bool wait_rearm(struct wait_queue_entry *wait, int state);
+
+/**
+ * wait_sleep - Give up the CPU until woken
+ * @wait: Caller's entry, prepared with prepare_to_wait()
+ *
+ * Returns at once if the caller was woken since prepare_to_wait(). May
+ * also return spuriously, so always retest the condition.
+ */
+void wait_sleep(struct wait_queue_entry *wait);
+
+/**
+ * wait_signal_pending - Whether an interruptible wait should give up
+ * @wait: Caller's entry
+ *
+ * Return: True if the caller is a task with an unblocked signal pending
+ */
+bool wait_signal_pending(struct wait_queue_entry *wait);
+
+/**
+ * wait_current_task - Scheduler task that would block in the caller's place
+ *
+ * Return: The current task, or NULL for a user process or a context that
+ * waits in wfi (the boot CPU's kernel context, idle tasks)
+ */
+struct task_struct *wait_current_task(void);
+
+/**
+ * __wake_up - Wake waiters on a queue
+ * @wq: Wait queue
+ * @nr_exclusive: Exclusive waiters to wake, 0 for all
+ *
+ * Every non-exclusive waiter is woken. Woken waiters are dequeued.
+ */
+void __wake_up(wait_queue_head_t *wq, int nr_exclusive);
+
+#define wake_up(wq) __wake_up((wq), 1)
+#define wake_up_all(wq) __wake_up((wq), 0)
+
+/**
+ * __wake_up_key - Wake waiters with a given key
+ * @wq: Wait queue
+ * @key: Entry key to match
+ * @nr: Most waiters to wake
+ *
+ * Return: Number woken
+ */
+int __wake_up_key(wait_queue_head_t *wq, uint64_t key, int nr);
+
+/**
+ * wait_requeue_key - Move waiters to another queue without waking them
+ * @from: Queue they are on
+ * @key: Entry key to match
+ * @to: Queue to move them to
+ * @new_key: Their key on @to
+ * @nr: Most waiters to move
+ *
+ * Return: Number moved
+ */
+int wait_requeue_key(wait_queue_head_t *from, uint64_t key,
+                     wait_queue_head_t *to, uint64_t new_key, int nr);
+
+/**
+ * wait_wake - Wake an entry's context without dequeuing it
+ * @wait: Entry
+ *
+ * For timeouts: the waiter notices it is still queued and gives up.
+ */
+void wait_wake(struct wait_queue_entry *wait);
+
+/**
+ * waitqueue_active - Whether anyone is waiting
+ * @wq: Wait queue
+ *
+ * Lockless; the caller needs a full barrier between changing the
+ * condition and calling this.
+ */
+static inline bool waitqueue_active(wait_queue_head_t *wq) {
+  return __atomic_load_n(&wq->head.next, __ATOMIC_RELAXED) != &wq->head;
+}
+
+#define ___wait_event(wq, condition, state, wqflags)                           \
+  ({                                                                           \
+    struct wait_queue_entry __wait;                                            \
+    long __ret = 0;                                                            \
+    init_wait_entry(&__wait, (wqflags));                                       \
+    for (;;) {                                                                 \
+      prepare_to_wait((wq), &__wait, (state));                                 \
+      if (condition)                                                           \
+        break;                                                                 \
+      if ((state) == TASK_INTERRUPTIBLE && wait_signal_pending(&__wait)) {     \
+        __ret = -4; /* EINTR */                                                \
+        break;                                                                 \
+      }                                                                        \
+      wait_sleep(&__wait);                                                     \
+    }                                                                          \
+    finish_wait((wq), &__wait);                                                \
+    __ret;                                                                     \
+  })
+
+/**
+ * wait_event - Sleep until a condition is true
+ * @wq: Wait queue the condition's writers wake
+ * @condition: C expression, re-evaluated after every wakeup
+ */
+#define wait_event(wq, condition)                                              \
+  do {                                                                         \
+    if (!(condition))                                                          \
+      (void)___wait_event(wq, condition, TASK_UNINTERRUPTIBLE, 0);             \
+  } while (0)
+
+/**
+ * wait_event_interruptible - Sleep until a condition is true or a signal
+ * @wq: Wait queue the condition's writers wake
+ * @condition: C expression, re-evaluated after every wakeup
+ *
+ * Return: 0 once @condition is true, -EINTR (-4) on a signal
+ */
+#define wait_event_interruptible(wq, condition)                                \
+  ((condition) ? 0 : ___wait_event(wq, condition, TASK_INTERRUPTIBLE, 0))
+
+/**
+ * wait_event_exclusive - wait_event() as an exclusive waiter
+ * @wq: Wait queue
+ * @condition: C expression
+ *
+ * For resources only one waiter can take, so wake_up() does not wake
+ * every waiter just for all but one to go back to sleep.
+ */
+#define wait_event_exclusive(wq, condition)                                    \
+  do {                                                                         \
+    if (!(condition))                                                          \
+      (void)___wait_event(wq, condition, TASK_UNINTERRUPTIBLE,                 \
+                          WQ_FLAG_EXCLUSIVE);                                  \
+  } while (0)
+
+/**
+ * wait_event_interruptible_exclusive - Exclusive interruptible wait
+ * @wq: Wait queue
+ * @condition: C expression
+ *
+ * Return: As wait_event_interruptible()
+ */
+#define wait_event_interruptible_exclusive(wq, condition)                      \
+  ((condition) ? 0                                                             \
+               : ___wait_event(wq, condition, TASK_INTERRUPTIBLE,              \
+                               WQ_FLAG_EXCLUSIVE))
+
+#endif /* _SYNC_WAIT_H */
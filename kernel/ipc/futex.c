@@ -0,0 +1,233 @@
+/*
+ * UnixOS Kernel - Fast Userspace Mutexes
+ *
+ * Waiters sleep on one of a fixed set of hashed wait queues, their entry
+ * keyed by the futex's physical address so a wake picks out only its
+ * own futex's waiters. A requeue moves waiters between queues under both
+ * locks without waking them, so a condition variable broadcast does not
+ * stampede every waiter onto the mutex at once.
+ */
+
+#include "ipc/futex.h"
+#include "fs/vfs.h"
+#include "mm/vmm.h"
+#include "sched/hrtimer.h"
+#include "sched/sched.h"
+#include "sync/wait.h"
+
+#define FUTEX_HASH_BITS 6
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+static wait_queue_head_t futex_queues[FUTEX_HASH_SIZE];
+
+/* A waiter and the timer that ends its wait */
+struct futex_q {
+  struct wait_queue_entry wait;
+  struct hrtimer timer;
+  bool timed_out;
+};
+
+void futex_init(void) {
+  for (int i = 0; i < FUTEX_HASH_SIZE; i++)
+    init_waitqueue_head(&futex_queues[i]);
+}
+
+/* ===================================================================== */
+/* Keys */
+/* ===================================================================== */
+
+/* Physical address of the futex word, 0 if it is not mapped */
+static uint64_t futex_key(uint32_t *uaddr) {
+  struct task_struct *task = get_current();
+  phys_addr_t pa = 0;
+
+  if (task && task->mm)
+    pa = vmm_user_virt_to_phys(task->mm, (virt_addr_t)uaddr);
+  if (!pa)
+    pa = vmm_virt_to_phys((virt_addr_t)uaddr);
+  return pa;
+}
+
+static wait_queue_head_t *futex_hash(uint64_t key) {
+  /* Fibonacci hashing: words 4 bytes apart land in different buckets */
+  return &futex_queues[((key >> 2) * 0x9E3779B97F4A7C15ULL) >>
+                       (64 - FUTEX_HASH_BITS)];
+}
+
+static long get_key(uint32_t *uaddr, uint64_t *key) {
+  if ((uintptr_t)uaddr & 3)
+    return -EINVAL;
+  *key = uaddr ? futex_key(uaddr) : 0;
+  return *key ? 0 : -EFAULT;
+}
+
+/* ===================================================================== */
+/* Operations */
+/* ===================================================================== */
+
+static enum hrtimer_restart futex_timeout(struct hrtimer *timer) {
+  struct futex_q *q = container_of(timer, struct futex_q, timer);
+
+  __atomic_store_n(&q->timed_out, true, __ATOMIC_RELEASE);
+  wait_wake(&q->wait);
+  return HRTIMER_NORESTART;
+}
+
+static long futex_wait(uint32_t *uaddr, uint32_t val, uint64_t expires) {
+  uint64_t key;
+  long ret = get_key(uaddr, &key);
+  if (ret)
+    return ret;
+
+  wait_queue_head_t *wq = futex_hash(key);
+  struct futex_q q;
+  init_wait_entry(&q.wait, 0);
+  q.wait.key = key;
+  q.timed_out = false;
+
+  /* Queued before reading the word, so a wake after it changes finds us */
+  prepare_to_wait(wq, &q.wait, TASK_INTERRUPTIBLE);
+  if (__atomic_load_n(uaddr, __ATOMIC_SEQ_CST) != val) {
+    finish_wait(wq, &q.wait);
+    return -EAGAIN;
+  }
+
+  if (expires) {
+    hrtimer_init(&q.timer, futex_timeout);
+    hrtimer_start(&q.timer, expires);
+  }
+
+  /* A wake dequeues us; we may have been requeued onto another futex */
+  while (!__atomic_load_n(&q.timed_out, __ATOMIC_ACQUIRE) &&
+         !wait_signal_pending(&q.wait)) {
+    wait_sleep(&q.wait);
+    if (!wait_rearm(&q.wait, TASK_INTERRUPTIBLE))
+      break;
+  }
+
+  if (expires)
+    hrtimer_cancel(&q.timer);
+
+  /* Woken wins over a timeout or signal that raced with it */
+  if (finish_wait(wq, &q.wait))
+    return 0;
+  return q.timed_out ? -ETIMEDOUT : -EINTR;
+}
+
+static long futex_wake(uint32_t *uaddr, int nr) {
+  uint64_t key;
+  long ret = get_key(uaddr, &key);
+  if (ret)
+    return ret;
+  return __wake_up_key(futex_hash(key), key, nr);
+}
+
+static long futex_requeue(uint32_t *uaddr, int nr_wake, uint32_t *uaddr2,
+                          int nr_requeue, bool cmp, uint32_t cmpval) {
+  uint64_t key, key2;
+  long ret = get_key(uaddr, &key);
+  if (!ret)
+    ret = get_key(uaddr2, &key2);
+  if (ret)
+    return ret;
+
+  /*
+   * The word may still change after this check. Waiters moved onto the
+   * second futex then wake on its next release instead, which is only a
+   * spurious wakeup for the condition variables that use this.
+   */
+  if (cmp && __atomic_load_n(uaddr, __ATOMIC_SEQ_CST) != cmpval)
+    return -EAGAIN;
+
+  wait_queue_head_t *wq = futex_hash(key);
+  int woken = __wake_up_key(wq, key, nr_wake);
+  return woken + wait_requeue_key(wq, key, futex_hash(key2), key2, nr_requeue);
+}
+
+/* Sign-extend a 12-bit FUTEX_WAKE_OP argument */
+static int32_t op_arg(uint32_t bits) {
+  return (int32_t)(bits << 20) >> 20;
+}
+
+static long futex_wake_op(uint32_t *uaddr, int nr_wake, uint32_t *uaddr2,
+                          int nr_wake2, uint32_t encoded) {
+  uint64_t key, key2;
+  long ret = get_key(uaddr, &key);
+  if (!ret)
+    ret = get_key(uaddr2, &key2);
+  if (ret)
+    return ret;
+
+  unsigned int op = (encoded >> 28) & 0xf;
+  unsigned int cmp = (encoded >> 24) & 0xf;
+  int32_t oparg = op_arg(encoded >> 12);
+  int32_t cmparg = op_arg(encoded);
+
+  if (op & FUTEX_OP_OPARG_SHIFT) {
+    if (oparg < 0 || oparg > 31)
+      return -EINVAL;
+    oparg = (int32_t)(1U << oparg);
+    op &= ~FUTEX_OP_OPARG_SHIFT;
+  }
+
+  int32_t *word = (int32_t *)uaddr2;
+  int32_t old;
+  switch (op) {
+  case FUTEX_OP_SET:
+    old = __atomic_exchange_n(word, oparg, __ATOMIC_SEQ_CST);
+    break;
+  case FUTEX_OP_ADD:
+    old = __atomic_fetch_add(word, oparg, __ATOMIC_SEQ_CST);
+    break;
+  case FUTEX_OP_OR:
+    old = __atomic_fetch_or(word, oparg, __ATOMIC_SEQ_CST);
+    break;
+  case FUTEX_OP_ANDN:
+    old = __atomic_fetch_and(word, ~oparg, __ATOMIC_SEQ_CST);
+    break;
+  case FUTEX_OP_XOR:
+    old = __atomic_fetch_xor(word, oparg, __ATOMIC_SEQ_CST);
+    break;
+  default:
+    return -ENOSYS;
+  }
+
+  bool wake2;
+  switch (cmp) {
+  case FUTEX_OP_CMP_EQ: wake2 = old == cmparg; break;
+  case FUTEX_OP_CMP_NE: wake2 = old != cmparg; break;
+  case FUTEX_OP_CMP_LT: wake2 = old < cmparg; break;
+  case FUTEX_OP_CMP_LE: wake2 = old <= cmparg; break;
+  case FUTEX_OP_CMP_GT: wake2 = old > cmparg; break;
+  case FUTEX_OP_CMP_GE: wake2 = old >= cmparg; break;
+  default:
+    return -ENOSYS;
+  }
+
+  int woken = __wake_up_key(futex_hash(key), key, nr_wake);
+  if (wake2)
+    woken += __wake_up_key(futex_hash(key2), key2, nr_wake2);
+  return woken;
+}
+
+long do_futex(uint32_t *uaddr, int op, uint32_t val, uint64_t expires,
+              uint32_t *uaddr2, uint32_t val2, uint32_t val3) {
+  /* Counts above INT_MAX mean "all" */
+  int nr = val > 0x7fffffff ? 0x7fffffff : (int)val;
+  int nr2 = val2 > 0x7fffffff ? 0x7fffffff : (int)val2;
+
+  switch (op & FUTEX_CMD_MASK) {
+  case FUTEX_WAIT:
+    return futex_wait(uaddr, val, expires);
+  case FUTEX_WAKE:
+    return futex_wake(uaddr, nr);
+  case FUTEX_REQUEUE:
+    return futex_requeue(uaddr, nr, uaddr2, nr2, false, 0);
+  case FUTEX_CMP_REQUEUE:
+    return futex_requeue(uaddr, nr, uaddr2, nr2, true, val3);
+  case FUTEX_WAKE_OP:
+    return futex_wake_op(uaddr, nr, uaddr2, nr2, val3);
+  default:
+    return -ENOSYS;
+  }
+}
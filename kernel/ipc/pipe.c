@@ -1,10 +1,20 @@
 /*
  * UnixOS Kernel - Pipe Implementation
+ *
+ * A reader waiting for data and a writer waiting for space sleep on the
+ * pipe's wait queues and take no CPU until the other side wakes them.
  */
 
+#include "ipc/pipe.h"
+#include "arch/arch.h"
 #include "fs/vfs.h"
 #include "mm/kmalloc.h"
 #include "printk.h"
+#include "sched/hrtimer.h"
+#include "sched/sched.h"
+#include "sync/semaphore.h"
+#include "sync/spinlock.h"
+#include "sync/wait.h"
 
 /* ===================================================================== */
 /* Pipe structure */
@@ -19,25 +29,27 @@ struct pipe {
   size_t count;      /* Bytes in buffer */
   int readers;       /* Number of readers */
   int writers;       /* Number of writers */
-  volatile int lock; /* Simple spinlock */
+  spinlock_t lock;
+  wait_queue_head_t rd_wait; /* Readers waiting for data */
+  wait_queue_head_t wr_wait; /* Writers waiting for space */
 };
 
 /* ===================================================================== */
 /* Pipe operations */
 /* ===================================================================== */
 
-static void pipe_lock(struct pipe *p) {
-  while (__atomic_test_and_set(&p->lock, __ATOMIC_ACQUIRE)) {
-#ifdef ARCH_ARM64
-    asm volatile("yield");
-#elif defined(ARCH_X86_64) || defined(ARCH_X86)
-    asm volatile("pause");
-#endif
-  }
+static void pipe_lock(struct pipe *p) { spin_lock(&p->lock); }
+
+static void pipe_unlock(struct pipe *p) { spin_unlock(&p->lock); }
+
+static bool pipe_readable(struct pipe *p) {
+  return __atomic_load_n(&p->count, __ATOMIC_ACQUIRE) != 0 ||
+         __atomic_load_n(&p->writers, __ATOMIC_ACQUIRE) == 0;
 }
 
-static void pipe_unlock(struct pipe *p) {
-  __atomic_clear(&p->lock, __ATOMIC_RELEASE);
+static bool pipe_writable(struct pipe *p) {
+  return __atomic_load_n(&p->count, __ATOMIC_ACQUIRE) < PIPE_SIZE ||
+         __atomic_load_n(&p->readers, __ATOMIC_ACQUIRE) == 0;
 }
 
 static ssize_t pipe_read(struct file *file, char *buf, size_t count,
@@ -57,14 +69,11 @@ static ssize_t pipe_read(struct file *file, char *buf, size_t count,
     return 0;
   }
 
-  /* Wait for data (busy wait for now) */
+  /* Sleep until a writer adds data or the last one closes */
   while (p->count == 0 && p->writers > 0) {
     pipe_unlock(p);
-#ifdef ARCH_ARM64
-    asm volatile("yield");
-#elif defined(ARCH_X86_64) || defined(ARCH_X86)
-    asm volatile("pause");
-#endif
+    if (wait_event_interruptible(&p->rd_wait, pipe_readable(p)))
+      return -EINTR;
     pipe_lock(p);
   }
 
@@ -79,6 +88,9 @@ static ssize_t pipe_read(struct file *file, char *buf, size_t count,
 
   pipe_unlock(p);
 
+  if (to_read)
+    wake_up_all(&p->wr_wait);
+
   return to_read;
 }
 
@@ -102,14 +114,11 @@ static ssize_t pipe_write(struct file *file, const char *buf, size_t count,
   size_t written = 0;
 
   while (written < count) {
-    /* Wait for space */
+    /* Sleep until a reader makes space or the last one closes */
     while (p->count >= PIPE_SIZE && p->readers > 0) {
       pipe_unlock(p);
-#ifdef ARCH_ARM64
-      asm volatile("yield");
-#elif defined(ARCH_X86_64) || defined(ARCH_X86)
-      asm volatile("pause");
-#endif
+      if (wait_event_interruptible(&p->wr_wait, pipe_writable(p)))
+        return written > 0 ? (ssize_t)written : -EINTR;
       pipe_lock(p);
     }
 
@@ -128,6 +137,11 @@ static ssize_t pipe_write(struct file *file, const char *buf, size_t count,
 
     p->count += to_write;
     written += to_write;
+
+    /* Readers can start on this chunk while we wait for more space */
+    pipe_unlock(p);
+    wake_up_all(&p->rd_wait);
+    pipe_lock(p);
   }
 
   pipe_unlock(p);
@@ -150,6 +164,8 @@ static int pipe_release_read(struct inode *inode, struct file *file) {
       kfree(p);
     } else {
       pipe_unlock(p);
+      /* Blocked writers see EPIPE */
+      wake_up_all(&p->wr_wait);
     }
   }
 
@@ -170,6 +186,8 @@ static int pipe_release_write(struct inode *inode, struct file *file) {
       kfree(p);
     } else {
       pipe_unlock(p);
+      /* Blocked readers see EOF */
+      wake_up_all(&p->rd_wait);
     }
   }
 
@@ -210,7 +228,9 @@ int do_pipe(struct file **read_file, struct file **write_file) {
   p->count = 0;
   p->readers = 1;
   p->writers = 1;
-  p->lock = 0;
+  spin_lock_init(&p->lock);
+  init_waitqueue_head(&p->rd_wait);
+  init_waitqueue_head(&p->wr_wait);
 
   /* Allocate file structures */
   struct file *rf = kzalloc(sizeof(struct file), GFP_KERNEL);
@@ -239,3 +259,97 @@ int do_pipe(struct file **read_file, struct file **write_file) {
 
   return 0;
 }
+
+/* ===================================================================== */
+/* Ping-pong benchmark */
+/* ===================================================================== */
+
+#define PIPE_BENCH_ROUNDS 10000
+
+struct pipe_bench_end {
+  struct file *rd; /* Where the other side's byte arrives */
+  struct file *wr; /* Where ours goes */
+  bool serve;      /* Sends first */
+  int failed;
+  struct semaphore *done;
+};
+
+static void pipe_bench_worker(void *arg) {
+  struct pipe_bench_end *end = arg;
+  char c = 0;
+
+  for (int i = 0; i < PIPE_BENCH_ROUNDS && !end->failed; i++) {
+    if (end->serve && end->wr->f_op->write(end->wr, &c, 1, NULL) != 1)
+      end->failed = 1;
+    if (!end->failed && end->rd->f_op->read(end->rd, &c, 1, NULL) != 1)
+      end->failed = 1;
+    if (!end->serve && !end->failed &&
+        end->wr->f_op->write(end->wr, &c, 1, NULL) != 1)
+      end->failed = 1;
+  }
+
+  up(end->done);
+}
+
+static void pipe_bench_close(struct file *f) {
+  if (f) {
+    f->f_op->release(NULL, f);
+    kfree(f);
+  }
+}
+
+int pipe_bench(char *buf, size_t size) {
+  int len = 0;
+
+  struct file *a_rd = NULL, *a_wr = NULL, *b_rd = NULL, *b_wr = NULL;
+  if (do_pipe(&a_rd, &a_wr) || do_pipe(&b_rd, &b_wr)) {
+    REPORT_OUT("pipe bench: out of memory\n");
+    goto out;
+  }
+
+  struct semaphore done;
+  sema_init(&done, 0);
+  struct pipe_bench_end ping = {b_rd, a_wr, true, 0, &done};
+  struct pipe_bench_end pong = {a_rd, b_wr, false, 0, &done};
+
+  uint64_t switches = sched_nr_switches();
+  uint64_t start = arch_timer_get_ticks();
+
+  if (!create_task(pipe_bench_worker, &ping, PF_KTHREAD)) {
+    REPORT_OUT("pipe bench: cannot create tasks\n");
+    goto out;
+  }
+  if (!create_task(pipe_bench_worker, &pong, PF_KTHREAD)) {
+    /* The lone side fails on EPIPE once its peer's ends close */
+    pipe_bench_close(a_rd);
+    pipe_bench_close(b_wr);
+    a_rd = b_wr = NULL;
+    down(&done);
+    REPORT_OUT("pipe bench: cannot create tasks\n");
+    goto out;
+  }
+
+  down(&done);
+  down(&done);
+
+  uint64_t ns = ticks_to_ns(arch_timer_get_ticks() - start);
+  switches = sched_nr_switches() - switches;
+
+  if (ping.failed || pong.failed) {
+    REPORT_OUT("pipe bench: transfer failed\n");
+    goto out;
+  }
+
+  REPORT_OUT("pipe bench: %d one-byte round trips\n", PIPE_BENCH_ROUNDS);
+  REPORT_OUT("  %llu ns per round trip, %llu.%02llu switches per round trip\n",
+             (unsigned long long)(ns / PIPE_BENCH_ROUNDS),
+             (unsigned long long)(switches / PIPE_BENCH_ROUNDS),
+             (unsigned long long)(switches * 100 / PIPE_BENCH_ROUNDS % 100));
+
+out:
+  pipe_bench_close(a_rd);
+  pipe_bench_close(a_wr);
+  pipe_bench_close(b_rd);
+  pipe_bench_close(b_wr);
+  return len;
+}
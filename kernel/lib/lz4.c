@@ -0,0 +1,194 @@
+/*
+ * Vib-OS - LZ4 Block Compression
+ *
+ * Follows the reference format rules: every block ends with at least
+ * LZ4_LAST_LITERALS literals and no match starts in the final
+ * LZ4_MF_LIMIT bytes, so standard decoders accept our output.
+ */
+
+#include "lz4.h"
+#include "string.h"
+
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT      12
+#define LZ4_MAX_OFFSET    65535
+#define LZ4_SKIP_TRIGGER  6 /* Step faster after 2^6 misses in a row */
+
+struct __attribute__((packed, may_alias)) unaligned_u32 {
+  uint32_t v;
+};
+
+static inline uint32_t read32(const uint8_t *p) {
+  return ((const struct unaligned_u32 *)p)->v;
+}
+
+static inline uint32_t lz4_hash(uint32_t seq) {
+  return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Write a length continuation: runs of 255 then the remainder */
+static inline uint8_t *put_length(uint8_t *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+/* Emit one sequence; match_len 0 means the closing literal-only run */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *op_end,
+                             const uint8_t *literals, size_t lit_len,
+                             size_t offset, size_t match_len) {
+  size_t need = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+  if (need > (size_t)(op_end - op)) {
+    return NULL;
+  }
+
+  uint8_t *token = op++;
+  *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+  if (lit_len >= 15) {
+    op = put_length(op, lit_len - 15);
+  }
+  memcpy(op, literals, lit_len);
+  op += lit_len;
+
+  if (!match_len) {
+    return op;
+  }
+
+  *op++ = (uint8_t)offset;
+  *op++ = (uint8_t)(offset >> 8);
+  match_len -= LZ4_MIN_MATCH;
+  *token |= (uint8_t)(match_len >= 15 ? 15 : match_len);
+  if (match_len >= 15) {
+    op = put_length(op, match_len - 15);
+  }
+  return op;
+}
+
+size_t lz4_compress(const uint8_t *src, size_t src_len, uint8_t *dst,
+                    size_t dst_cap, void *wrkmem) {
+  uint32_t *table = (uint32_t *)wrkmem;
+  uint8_t *op = dst;
+  uint8_t *op_end = dst + dst_cap;
+  size_t anchor = 0;
+  size_t ip = 0;
+
+  /* Table entries hold position + 1 so zero means empty */
+  memset(table, 0, LZ4_WORKMEM_SIZE);
+
+  if (src_len > LZ4_MF_LIMIT) {
+    size_t match_limit = src_len - LZ4_MF_LIMIT;
+    size_t misses = 0;
+
+    while (ip <= match_limit) {
+      uint32_t seq = read32(src + ip);
+      uint32_t h = lz4_hash(seq);
+      size_t ref = table[h];
+      table[h] = (uint32_t)(ip + 1);
+
+      if (!ref || ip - (ref - 1) > LZ4_MAX_OFFSET ||
+          read32(src + ref - 1) != seq) {
+        ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+        continue;
+      }
+      ref--;
+      misses = 0;
+
+      /* Extend backwards into pending literals, then forwards */
+      while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+        ip--;
+        ref--;
+      }
+      size_t len = LZ4_MIN_MATCH;
+      while (ip + len < src_len - LZ4_LAST_LITERALS &&
+             src[ref + len] == src[ip + len]) {
+        len++;
+      }
+
+      op = put_sequence(op, op_end, src + anchor, ip - anchor, ip - ref, len);
+      if (!op) {
+        return 0;
+      }
+      ip += len;
+      anchor = ip;
+    }
+  }
+
+  op = put_sequence(op, op_end, src + anchor, src_len - anchor, 0, 0);
+  return op ? (size_t)(op - dst) : 0;
+}
+
+/* Read a length continuation; returns false on truncated input */
+static inline bool get_length(const uint8_t **ip, const uint8_t *ip_end,
+                              size_t *len) {
+  uint8_t b;
+  do {
+    if (*ip >= ip_end) {
+      return false;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+int lz4_decompress(const uint8_t *src, size_t src_len, uint8_t *dst,
+                   size_t dst_cap) {
+  const uint8_t *ip = src;
+  const uint8_t *ip_end = src + src_len;
+  uint8_t *op = dst;
+  uint8_t *op_end = dst + dst_cap;
+
+  while (ip < ip_end) {
+    uint8_t token = *ip++;
+
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && !get_length(&ip, ip_end, &lit_len)) {
+      return -1;
+    }
+    if (lit_len > (size_t)(ip_end - ip) || lit_len > (size_t)(op_end - op)) {
+      return -1;
+    }
+    memcpy(op, ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+
+    if (ip == ip_end) {
+      break; /* Closing literal run */
+    }
+
+    if (ip_end - ip < 2) {
+      return -1;
+    }
+    size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (!offset || offset > (size_t)(op - dst)) {
+      return -1;
+    }
+
+    size_t match_len = token & 15;
+    if (match_len == 15 && !get_length(&ip, ip_end, &match_len)) {
+      return -1;
+    }
+    match_len += LZ4_MIN_MATCH;
+    if (match_len > (size_t)(op_end - op)) {
+      return -1;
+    }
+
+    const uint8_t *match = op - offset;
+    if (offset >= match_len) {
+      memcpy(op, match, match_len);
+      op += match_len;
+    } else {
+      /* Overlapping copy repeats the last @offset bytes */
+      while (match_len--) {
+        *op++ = *match++;
+      }
+    }
+  }
+
+  return (int)(op - dst);
+}
@@ -0,0 +1,314 @@
+/*
+ * Vib-OS - Red-Black Trees
+ *
+ * Textbook (CLRS) insert and erase fixups with explicit parent pointers.
+ * Augmented values are kept correct with two rules: a rotation only
+ * reshapes the two nodes involved, so it re-runs the callback on both;
+ * a structural change (linking a leaf, unlinking a node) touches one
+ * path, which is refreshed up to the root before rebalancing.
+ */
+
+#include "rbtree.h"
+
+static void rb_set_child(struct rb_root *root, struct rb_node *parent,
+                         struct rb_node *old, struct rb_node *new) {
+  if (!parent) {
+    root->rb_node = new;
+  } else if (parent->rb_left == old) {
+    parent->rb_left = new;
+  } else {
+    parent->rb_right = new;
+  }
+}
+
+static void rb_rotate_left(struct rb_node *node, struct rb_root *root,
+                           rb_augment_fn update) {
+  struct rb_node *right = node->rb_right;
+
+  node->rb_right = right->rb_left;
+  if (right->rb_left) {
+    right->rb_left->rb_parent = node;
+  }
+  right->rb_parent = node->rb_parent;
+  rb_set_child(root, node->rb_parent, node, right);
+  right->rb_left = node;
+  node->rb_parent = right;
+
+  if (update) {
+    update(node);
+    update(right);
+  }
+}
+
+static void rb_rotate_right(struct rb_node *node, struct rb_root *root,
+                            rb_augment_fn update) {
+  struct rb_node *left = node->rb_left;
+
+  node->rb_left = left->rb_right;
+  if (left->rb_right) {
+    left->rb_right->rb_parent = node;
+  }
+  left->rb_parent = node->rb_parent;
+  rb_set_child(root, node->rb_parent, node, left);
+  left->rb_right = node;
+  node->rb_parent = left;
+
+  if (update) {
+    update(node);
+    update(left);
+  }
+}
+
+static inline bool rb_is_black(const struct rb_node *node) {
+  return !node || node->rb_color == RB_BLACK;
+}
+
+/* ===================================================================== */
+/* Insertion */
+/* ===================================================================== */
+
+static void rb_insert_fixup(struct rb_node *node, struct rb_root *root,
+                            rb_augment_fn update) {
+  struct rb_node *parent;
+
+  while ((parent = node->rb_parent) && parent->rb_color == RB_RED) {
+    /* A red parent is never the root, so the grandparent exists */
+    struct rb_node *gparent = parent->rb_parent;
+
+    if (parent == gparent->rb_left) {
+      struct rb_node *uncle = gparent->rb_right;
+      if (!rb_is_black(uncle)) {
+        parent->rb_color = RB_BLACK;
+        uncle->rb_color = RB_BLACK;
+        gparent->rb_color = RB_RED;
+        node = gparent;
+        continue;
+      }
+      if (node == parent->rb_right) {
+        rb_rotate_left(parent, root, update);
+        node = parent;
+        parent = node->rb_parent;
+      }
+      parent->rb_color = RB_BLACK;
+      gparent->rb_color = RB_RED;
+      rb_rotate_right(gparent, root, update);
+    } else {
+      struct rb_node *uncle = gparent->rb_left;
+      if (!rb_is_black(uncle)) {
+        parent->rb_color = RB_BLACK;
+        uncle->rb_color = RB_BLACK;
+        gparent->rb_color = RB_RED;
+        node = gparent;
+        continue;
+      }
+      if (node == parent->rb_left) {
+        rb_rotate_right(parent, root, update);
+        node = parent;
+        parent = node->rb_parent;
+      }
+      parent->rb_color = RB_BLACK;
+      gparent->rb_color = RB_RED;
+      rb_rotate_left(gparent, root, update);
+    }
+  }
+
+  root->rb_node->rb_color = RB_BLACK;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root) {
+  rb_insert_fixup(node, root, NULL);
+}
+
+void rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+                         rb_augment_fn update) {
+  rb_augment_propagate(node, update);
+  rb_insert_fixup(node, root, update);
+}
+
+/* ===================================================================== */
+/* Removal */
+/* ===================================================================== */
+
+/* @node may be NULL (a black leaf), hence the explicit @parent */
+static void rb_erase_fixup(struct rb_node *node, struct rb_node *parent,
+                           struct rb_root *root, rb_augment_fn update) {
+  while (node != root->rb_node && rb_is_black(node)) {
+    if (node == parent->rb_left) {
+      struct rb_node *sibling = parent->rb_right;
+      if (sibling->rb_color == RB_RED) {
+        sibling->rb_color = RB_BLACK;
+        parent->rb_color = RB_RED;
+        rb_rotate_left(parent, root, update);
+        sibling = parent->rb_right;
+      }
+      if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+        sibling->rb_color = RB_RED;
+        node = parent;
+        parent = node->rb_parent;
+        continue;
+      }
+      if (rb_is_black(sibling->rb_right)) {
+        sibling->rb_left->rb_color = RB_BLACK;
+        sibling->rb_color = RB_RED;
+        rb_rotate_right(sibling, root, update);
+        sibling = parent->rb_right;
+      }
+      sibling->rb_color = parent->rb_color;
+      parent->rb_color = RB_BLACK;
+      sibling->rb_right->rb_color = RB_BLACK;
+      rb_rotate_left(parent, root, update);
+    } else {
+      struct rb_node *sibling = parent->rb_left;
+      if (sibling->rb_color == RB_RED) {
+        sibling->rb_color = RB_BLACK;
+        parent->rb_color = RB_RED;
+        rb_rotate_right(parent, root, update);
+        sibling = parent->rb_left;
+      }
+      if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+        sibling->rb_color = RB_RED;
+        node = parent;
+        parent = node->rb_parent;
+        continue;
+      }
+      if (rb_is_black(sibling->rb_left)) {
+        sibling->rb_right->rb_color = RB_BLACK;
+        sibling->rb_color = RB_RED;
+        rb_rotate_left(sibling, root, update);
+        sibling = parent->rb_left;
+      }
+      sibling->rb_color = parent->rb_color;
+      parent->rb_color = RB_BLACK;
+      sibling->rb_left->rb_color = RB_BLACK;
+      rb_rotate_right(parent, root, update);
+    }
+    node = root->rb_node;
+    break;
+  }
+
+  if (node) {
+    node->rb_color = RB_BLACK;
+  }
+}
+
+void rb_erase_augmented(struct rb_node *node, struct rb_root *root,
+                        rb_augment_fn update) {
+  struct rb_node *child, *parent;
+  int color;
+
+  if (!node->rb_left || !node->rb_right) {
+    child = node->rb_left ? node->rb_left : node->rb_right;
+    parent = node->rb_parent;
+    color = node->rb_color;
+    rb_set_child(root, parent, node, child);
+    if (child) {
+      child->rb_parent = parent;
+    }
+  } else {
+    /* Two children: the in-order successor takes @node's place */
+    struct rb_node *succ = node->rb_right;
+    while (succ->rb_left) {
+      succ = succ->rb_left;
+    }
+    child = succ->rb_right;
+    color = succ->rb_color;
+
+    if (succ->rb_parent == node) {
+      parent = succ;
+    } else {
+      parent = succ->rb_parent;
+      parent->rb_left = child;
+      if (child) {
+        child->rb_parent = parent;
+      }
+      succ->rb_right = node->rb_right;
+      node->rb_right->rb_parent = succ;
+    }
+
+    rb_set_child(root, node->rb_parent, node, succ);
+    succ->rb_parent = node->rb_parent;
+    succ->rb_left = node->rb_left;
+    node->rb_left->rb_parent = succ;
+    succ->rb_color = node->rb_color;
+  }
+
+  /* Everything from the unlink point up lost a descendant */
+  if (update && parent) {
+    rb_augment_propagate(parent, update);
+  }
+
+  if (color == RB_BLACK) {
+    rb_erase_fixup(child, parent, root, update);
+  }
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root) {
+  rb_erase_augmented(node, root, NULL);
+}
+
+void rb_augment_propagate(struct rb_node *node, rb_augment_fn update) {
+  if (!update) {
+    return;
+  }
+  for (; node; node = node->rb_parent) {
+    update(node);
+  }
+}
+
+/* ===================================================================== */
+/* Traversal */
+/* ===================================================================== */
+
+struct rb_node *rb_first(const struct rb_root *root) {
+  struct rb_node *node = root->rb_node;
+  if (!node) {
+    return NULL;
+  }
+  while (node->rb_left) {
+    node = node->rb_left;
+  }
+  return node;
+}
+
+struct rb_node *rb_last(const struct rb_root *root) {
+  struct rb_node *node = root->rb_node;
+  if (!node) {
+    return NULL;
+  }
+  while (node->rb_right) {
+    node = node->rb_right;
+  }
+  return node;
+}
+
+struct rb_node *rb_next(const struct rb_node *node) {
+  if (node->rb_right) {
+    node = node->rb_right;
+    while (node->rb_left) {
+      node = node->rb_left;
+    }
+    return (struct rb_node *)node;
+  }
+
+  struct rb_node *parent;
+  while ((parent = node->rb_parent) && node == parent->rb_right) {
+    node = parent;
+  }
+  return parent;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node) {
+  if (node->rb_left) {
+    node = node->rb_left;
+    while (node->rb_right) {
+      node = node->rb_right;
+    }
+    return (struct rb_node *)node;
+  }
+
+  struct rb_node *parent;
+  while ((parent = node->rb_parent) && node == parent->rb_left) {
+    node = parent;
+  }
+  return parent;
+}
@@ -2,12 +2,58 @@
  * Vib-OS - Kernel String/Memory Functions
  */
 
+#include "arch/fpsimd.h"
 #include "types.h"
 
+/* Unaligned 64-bit access; both ARM64 and x86_64 handle these in hardware */
+struct __attribute__((packed, may_alias)) unaligned_u64 {
+  uint64_t v;
+};
+
 void *memcpy(void *dest, const void *src, size_t n) {
   uint8_t *d = (uint8_t *)dest;
   const uint8_t *s = (const uint8_t *)src;
 
+#ifdef ARCH_ARM64
+  /*
+   * Bulk copies go 64 bytes at a time through the SIMD registers, a chunk
+   * per kernel_neon_begin() so interrupts are taken in between
+   */
+  if (n >= NEON_COPY_MIN && may_use_simd()) {
+    while (n) {
+      size_t chunk = MIN(n, (size_t)NEON_COPY_CHUNK);
+      kernel_neon_begin();
+      neon_copy(d, s, chunk);
+      kernel_neon_end();
+      d += chunk;
+      s += chunk;
+      n -= chunk;
+    }
+    return dest;
+  }
+#endif
+
+  /* Align the destination, then move words, 32 bytes per iteration */
+  while (n && ((uintptr_t)d & 7)) {
+    *d++ = *s++;
+    n--;
+  }
+
+  uint64_t *dw = (uint64_t *)d;
+  const struct unaligned_u64 *sw = (const struct unaligned_u64 *)s;
+  for (; n >= 32; n -= 32, dw += 4, sw += 4) {
+    uint64_t a = sw[0].v, b = sw[1].v, c = sw[2].v, e = sw[3].v;
+    dw[0] = a;
+    dw[1] = b;
+    dw[2] = c;
+    dw[3] = e;
+  }
+  for (; n >= 8; n -= 8) {
+    *dw++ = (sw++)->v;
+  }
+
+  d = (uint8_t *)dw;
+  s = (const uint8_t *)sw;
   while (n--) {
     *d++ = *s++;
   }
@@ -18,6 +64,17 @@ void *memcpy(void *dest, const void *src, size_t n) {
 void *memset(void *s, int c, size_t n) {
   uint8_t *p = (uint8_t *)s;
 
+  /* Byte stores up to 8-byte alignment, then whole words */
+  while (n && ((uintptr_t)p & 7)) {
+    *p++ = (uint8_t)c;
+    n--;
+  }
+
+  uint64_t word = 0x0101010101010101ULL * (uint8_t)c;
+  for (; n >= 8; n -= 8, p += 8) {
+    *(uint64_t *)p = word;
+  }
+
   while (n--) {
     *p++ = (uint8_t)c;
   }
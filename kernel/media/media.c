@@ -5,6 +5,7 @@
 #include "media/media.h"
 #include "fs/vfs.h"
 #include "mm/kmalloc.h"
+#include "mm/vmalloc.h"
 #include "printk.h"
 #include "types.h"
 #include "sandbox/sandbox.h"
@@ -28,7 +29,7 @@ int media_load_file(const char *path, uint8_t **out_data, size_t *out_size) {
   }
 
   size_t size = (size_t)inode->i_size;
-  uint8_t *buf = (uint8_t *)kmalloc(size, GFP_KERNEL);
+  uint8_t *buf = (uint8_t *)vmalloc(size);
   if (!buf) {
     vfs_close(f);
     return -ENOMEM;
@@ -38,7 +39,7 @@ int media_load_file(const char *path, uint8_t **out_data, size_t *out_size) {
   vfs_close(f);
 
   if (read_bytes < 0) {
-    kfree(buf);
+    vfree(buf);
     return (int)read_bytes;
   }
 
@@ -49,7 +50,7 @@ int media_load_file(const char *path, uint8_t **out_data, size_t *out_size) {
 
 void media_free_file(uint8_t *data) {
   if (data)
-    kfree(data);
+    vfree(data);
 }
 
 /* --------------------------------------------------------------------- */
@@ -129,7 +130,7 @@ int media_decode_jpeg_buffer(const uint8_t *data, size_t size,
     }
     pixels = buffer;
   } else {
-    pixels = (uint32_t *)kmalloc(required_bytes, GFP_KERNEL);
+    pixels = (uint32_t *)vmalloc(required_bytes);
     if (!pixels)
       return -ENOMEM;
     allocated = true;
@@ -144,7 +145,7 @@ int media_decode_jpeg_buffer(const uint8_t *data, size_t size,
         break;
       printk(KERN_ERR "JPEG: decode_mcu failed (%u)\n", status);
       if (allocated)
-        kfree(pixels);
+        vfree(pixels);
       return -EINVAL;
     }
 
@@ -196,7 +197,7 @@ void media_free_image(media_image_t *image) {
   if (!image)
     return;
   if (image->pixels) {
-    kfree(image->pixels);
+    vfree(image->pixels);
     image->pixels = NULL;
   }
   image->width = 0;
@@ -278,8 +279,7 @@ int media_decode_png(const uint8_t *data, size_t size, media_image_t *out) {
   }
 
   /* Convert RGBA (uint8_t*) to 0x00RRGGBB (uint32_t*) format */
-  uint32_t *pixels =
-      (uint32_t *)kmalloc(pixel_count * sizeof(uint32_t), GFP_KERNEL);
+  uint32_t *pixels = (uint32_t *)vmalloc(pixel_count * sizeof(uint32_t));
   if (!pixels) {
     kfree(rgba);
     return -ENOMEM;
@@ -0,0 +1,296 @@
+/*
+ * UnixOS Kernel - Allocation Profiler
+ *
+ * Live allocations are kept in a chained hash table keyed by address,
+ * with entries carved from a static pool so recording never allocates.
+ * When the pool is full further allocations go uncounted (the report
+ * says how many). Reports fold the table by call site into a second,
+ * open-addressed table and print the heaviest sites first.
+ *
+ * Addresses are printed raw; resolve them against the kernel ELF with
+ * addr2line.
+ */
+
+#include "mm/allocprof.h"
+#include "arch/arch.h"
+#include "mm/kmalloc.h"
+#include "mm/pmm.h"
+#include "printk.h"
+#include "sync/spinlock.h"
+
+/* ===================================================================== */
+/* Live allocation table */
+/* ===================================================================== */
+
+#ifdef DEBUG_ALLOC_PROFILE
+
+#define PROF_ENTRIES        32768
+#define PROF_BUCKETS        8192    /* Power of two */
+#define PROF_SITES          1024    /* Power of two */
+#define PROF_TOP_SITES      20
+
+struct prof_entry {
+    uintptr_t addr;
+    void *caller;
+    size_t size;
+    uint64_t time;
+    int kind;
+    struct prof_entry *next;
+};
+
+struct prof_site {
+    void *caller;
+    int kind;
+    size_t bytes;
+    size_t count;
+    uint64_t oldest;
+};
+
+static struct prof_entry prof_pool[PROF_ENTRIES];
+static struct prof_entry *prof_buckets[PROF_BUCKETS];
+static struct prof_entry *prof_free_list;
+static size_t prof_pool_used;
+static DEFINE_SPINLOCK(prof_lock);
+
+static size_t prof_untracked;       /* Allocations the pool had no room for */
+static size_t prof_failed;          /* Allocations that returned NULL/0 */
+static void *prof_failed_caller;
+static size_t prof_failed_size;
+
+/* Report scratch space, only used under prof_lock */
+static struct prof_site prof_sites[PROF_SITES];
+
+static inline size_t prof_hash(uintptr_t addr, int kind)
+{
+    uint64_t h = ((uint64_t)addr >> 4) ^ (uint64_t)kind;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (PROF_BUCKETS - 1);
+}
+
+/* Find the link pointing at @addr's entry (prof_lock held) */
+static struct prof_entry **prof_find(int kind, uintptr_t addr)
+{
+    struct prof_entry **link = &prof_buckets[prof_hash(addr, kind)];
+    while (*link && ((*link)->addr != addr || (*link)->kind != kind)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+void allocprof_alloc(int kind, uintptr_t addr, size_t size, void *caller)
+{
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+
+    if (!addr) {
+        prof_failed++;
+        prof_failed_caller = caller;
+        prof_failed_size = size;
+        spin_unlock_irqrestore(&prof_lock, flags);
+        return;
+    }
+
+    struct prof_entry **link = prof_find(kind, addr);
+    struct prof_entry *e = *link;
+    if (!e) {
+        if (prof_free_list) {
+            e = prof_free_list;
+            prof_free_list = e->next;
+        } else if (prof_pool_used < PROF_ENTRIES) {
+            e = &prof_pool[prof_pool_used++];
+        } else {
+            prof_untracked++;
+            spin_unlock_irqrestore(&prof_lock, flags);
+            return;
+        }
+        e->addr = addr;
+        e->kind = kind;
+        e->next = NULL;
+        *link = e;
+    }
+
+    e->caller = caller;
+    e->size = size;
+    e->time = arch_timer_get_ticks();
+
+    spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+void allocprof_free(int kind, uintptr_t addr)
+{
+    if (!addr) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+
+    struct prof_entry **link = prof_find(kind, addr);
+    struct prof_entry *e = *link;
+    if (e) {
+        *link = e->next;
+        e->next = prof_free_list;
+        prof_free_list = e;
+    }
+
+    spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+/* Fold live entries into prof_sites (prof_lock held); returns sites used */
+static size_t prof_collect(size_t *kmalloc_sizes, int nsizes,
+                           size_t *live, size_t *live_bytes)
+{
+    size_t used = 0;
+
+    for (int i = 0; i < PROF_SITES; i++) {
+        prof_sites[i].count = 0;
+    }
+
+    for (int b = 0; b < PROF_BUCKETS; b++) {
+        for (struct prof_entry *e = prof_buckets[b]; e; e = e->next) {
+            live[e->kind]++;
+            live_bytes[e->kind] += e->size;
+
+            if (e->kind == ALLOCPROF_KMALLOC) {
+                int bucket = 0;
+                while (bucket < nsizes - 1 && e->size > (32UL << bucket)) {
+                    bucket++;
+                }
+                kmalloc_sizes[bucket]++;
+            }
+
+            size_t h = prof_hash((uintptr_t)e->caller, e->kind) & (PROF_SITES - 1);
+            size_t probes = 0;
+            while (prof_sites[h].count &&
+                   (prof_sites[h].caller != e->caller || prof_sites[h].kind != e->kind)) {
+                h = (h + 1) & (PROF_SITES - 1);
+                if (++probes == PROF_SITES) {
+                    break;
+                }
+            }
+            if (probes == PROF_SITES) {
+                continue;   /* More distinct sites than slots */
+            }
+
+            struct prof_site *site = &prof_sites[h];
+            if (!site->count) {
+                site->caller = e->caller;
+                site->kind = e->kind;
+                site->bytes = 0;
+                site->oldest = e->time;
+                used++;
+            }
+            site->count++;
+            site->bytes += e->size;
+            if (e->time < site->oldest) {
+                site->oldest = e->time;
+            }
+        }
+    }
+
+    return used;
+}
+
+#endif /* DEBUG_ALLOC_PROFILE */
+
+/* ===================================================================== */
+/* Report */
+/* ===================================================================== */
+
+#define SIZE_BUCKETS        14      /* 32B .. 128KB, then larger */
+#define HEAP_BUCKETS        16      /* 64B .. 2MB, then larger */
+
+static inline uint64_t ticks_to_ms(uint64_t ticks, uint64_t freq)
+{
+    return freq ? ticks * 1000ULL / freq : 0;
+}
+
+/* Print "label: a b c ..." for a histogram, skipping a zero tail */
+static int format_histogram(char *line, size_t size, const char *label,
+                            const size_t *counts, int n)
+{
+    int last = n - 1;
+    while (last > 0 && !counts[last]) {
+        last--;
+    }
+
+    int len = snprintf(line, size, "%s", label);
+    for (int i = 0; i <= last && (size_t)len < size; i++) {
+        len += snprintf(line + len, size - len, " %lu", (unsigned long)counts[i]);
+    }
+    if ((size_t)len < size) {
+        len += snprintf(line + len, size - len, "\n");
+    }
+    return len;
+}
+
+int allocprof_report(char *buf, size_t size)
+{
+    char line[160];
+    int len = 0;
+
+#ifdef DEBUG_ALLOC_PROFILE
+    static const char *const kind_names[] = {"kmalloc", "pages"};
+    size_t kmalloc_sizes[SIZE_BUCKETS] = {0};
+    size_t live[2] = {0}, live_bytes[2] = {0};
+    uint64_t freq = arch_timer_get_frequency();
+
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+    uint64_t now = arch_timer_get_ticks();
+    size_t used = prof_collect(kmalloc_sizes, SIZE_BUCKETS, live, live_bytes);
+
+    REPORT_OUT("Live: %lu kmalloc (%lu KB), %lu page allocs (%lu KB), "
+               "%lu sites, %lu untracked\n",
+               (unsigned long)live[ALLOCPROF_KMALLOC],
+               (unsigned long)(live_bytes[ALLOCPROF_KMALLOC] >> 10),
+               (unsigned long)live[ALLOCPROF_PAGES],
+               (unsigned long)(live_bytes[ALLOCPROF_PAGES] >> 10),
+               (unsigned long)used, (unsigned long)prof_untracked);
+    if (prof_failed) {
+        REPORT_OUT("Failed: %lu, last %lu bytes from %p\n",
+                   (unsigned long)prof_failed, (unsigned long)prof_failed_size,
+                   prof_failed_caller);
+    }
+
+    REPORT_OUT("kind          KB    count      avg  oldest(s)  caller\n");
+    for (int n = 0; n < PROF_TOP_SITES; n++) {
+        struct prof_site *top = NULL;
+        for (int i = 0; i < PROF_SITES; i++) {
+            if (prof_sites[i].count && (!top || prof_sites[i].bytes > top->bytes)) {
+                top = &prof_sites[i];
+            }
+        }
+        if (!top) {
+            break;
+        }
+        REPORT_OUT("%-8s %7lu %8lu %8lu %10llu  %p\n", kind_names[top->kind],
+                   (unsigned long)(top->bytes >> 10), (unsigned long)top->count,
+                   (unsigned long)(top->bytes / top->count),
+                   (unsigned long long)(ticks_to_ms(now - top->oldest, freq) / 1000),
+                   top->caller);
+        top->count = 0;     /* Printed */
+    }
+    spin_unlock_irqrestore(&prof_lock, flags);
+
+    format_histogram(line, sizeof(line), "kmalloc sizes (32B, 64B, ...):",
+                     kmalloc_sizes, SIZE_BUCKETS);
+    REPORT_OUT("%s", line);
+#else
+    REPORT_OUT("Call-site profiling not built in (make ALLOC_PROFILE=1)\n");
+#endif
+
+    size_t heap_free[HEAP_BUCKETS] = {0};
+    size_t largest = kmalloc_free_histogram(heap_free, HEAP_BUCKETS);
+    format_histogram(line, sizeof(line), "heap free blocks (<64B, <128B, ...):",
+                     heap_free, HEAP_BUCKETS);
+    REPORT_OUT("%s", line);
+    REPORT_OUT("largest free heap block: %lu KB\n", (unsigned long)(largest >> 10));
+
+    size_t buddy_free[PMM_MAX_ORDER + 1];
+    for (unsigned int order = 0; order <= PMM_MAX_ORDER; order++) {
+        buddy_free[order] = pmm_get_free_blocks(order);
+    }
+    format_histogram(line, sizeof(line), "buddy free blocks (order 0, 1, ...):",
+                     buddy_free, PMM_MAX_ORDER + 1);
+    REPORT_OUT("%s", line);
+
+    return len;
+}
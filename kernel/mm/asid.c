@@ -0,0 +1,527 @@
+/*
+ * UnixOS Kernel - Address Space ID Allocator
+ *
+ * Each mm_struct carries a context_id: the allocation generation in the
+ * high bits and its hardware ID in the low asid_bits. A switch whose
+ * generation is current is lock-free: it only publishes the ID in this
+ * CPU's active_asids slot and loads TTBR0 (or CR3). When the bitmap is
+ * exhausted the generation is bumped and every CPU owes one local TLB
+ * flush, taken on its next slow-path switch. IDs still loaded on some
+ * CPU at rollover are carried into the new generation as reserved, so
+ * the mm running there keeps its ID and its TLB entries stay unique.
+ *
+ * User PTEs are mapped non-global, kernel mappings global, so kernel
+ * translations survive every switch.
+ */
+
+#include "mm/asid.h"
+#include "arch/arch.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
+#include "printk.h"
+#include "sched/hrtimer.h"
+#include "sched/sched.h"
+#include "string.h"
+#include "sync/spinlock.h"
+
+/* ===================================================================== */
+/* Configuration */
+/* ===================================================================== */
+
+#define ASID_MAX_BITS       16
+
+#define NUM_ASIDS           (1UL << asid_bits)
+#define ASID_FIRST_VERSION  NUM_ASIDS
+#define ctx_asid(ctx)       ((ctx) & (NUM_ASIDS - 1))
+#define ctx_generation(ctx) ((ctx) & ~(NUM_ASIDS - 1))
+
+/* ===================================================================== */
+/* Static data */
+/* ===================================================================== */
+
+static unsigned int asid_bits;          /* 0: untagged, flush on switch */
+static uint64_t asid_generation;
+static uint64_t asid_map[(1UL << ASID_MAX_BITS) / 64];
+static uint64_t asid_next = 1;
+
+static uint64_t active_asids[MAX_CPUS];     /* 0 while a rollover is pending */
+static uint64_t reserved_asids[MAX_CPUS];
+static bool tlb_flush_pending[MAX_CPUS];
+static struct mm_struct *cpu_mm[MAX_CPUS];  /* Loaded on each CPU */
+
+static DEFINE_SPINLOCK(asid_lock);
+
+static uint64_t asid_allocs;
+static uint64_t asid_rollovers;
+static uint64_t asid_fast_switches;
+
+/* ===================================================================== */
+/* Hardware helpers */
+/* ===================================================================== */
+
+static inline unsigned int this_cpu(void)
+{
+    uint32_t cpu = arch_cpu_id();
+    return cpu < MAX_CPUS ? cpu : 0;
+}
+
+#ifdef ARCH_X86_64
+struct invpcid_desc {
+    uint64_t pcid;
+    uint64_t addr;
+};
+
+#define INVPCID_ADDR        0   /* One address in one PCID */
+#define INVPCID_SINGLE      1   /* Every non-global entry of one PCID */
+#define INVPCID_ALL_NONGLOBAL 3
+
+static inline void invpcid(unsigned long type, uint64_t pcid, uint64_t addr)
+{
+    struct invpcid_desc desc = { pcid, addr };
+    asm volatile("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
+#define CR3_NOFLUSH         (1UL << 63)
+#define CR4_PCIDE           (1UL << 17)
+#endif
+
+/* Load @pgd with hardware ID @asid */
+static void cpu_set_root(uint64_t *pgd, uint64_t asid)
+{
+#ifdef ARCH_ARM64
+    /* TCR_EL1.A1 = 0: TTBR0 carries the ASID, so one write switches both */
+    asm volatile(
+        "msr ttbr0_el1, %0\n"
+        "isb"
+        :: "r"((uint64_t)pgd | (asid << 48))
+    );
+#elif defined(ARCH_X86_64)
+    uint64_t cr3 = (uint64_t)pgd;
+    if (asid_bits) {
+        cr3 |= asid | CR3_NOFLUSH;
+    }
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+#elif defined(ARCH_X86)
+    (void)asid;
+    asm volatile("mov %0, %%cr3" :: "r"((uint32_t)pgd) : "memory");
+#endif
+}
+
+/* Drop every non-global entry from this CPU's TLB */
+static void local_flush_tlb_user(void)
+{
+#ifdef ARCH_ARM64
+    asm volatile(
+        "dsb nshst\n"
+        "tlbi vmalle1\n"
+        "dsb nsh\n"
+        "isb"
+        ::: "memory"
+    );
+#elif defined(ARCH_X86_64)
+    if (asid_bits) {
+        invpcid(INVPCID_ALL_NONGLOBAL, 0, 0);
+    } else {
+        vmm_flush_tlb();
+    }
+#else
+    vmm_flush_tlb();
+#endif
+}
+
+/* Hardware ID an mm's TLB entries may be tagged with, or -1 if none */
+static int64_t mm_hw_asid(struct mm_struct *mm)
+{
+    if (mm == vmm_kernel_mm()) {
+        return 0;
+    }
+    uint64_t ctx = __atomic_load_n(&mm->context_id, __ATOMIC_RELAXED);
+    if (ctx == 0) {
+        return -1;  /* Never loaded anywhere */
+    }
+    /* Possibly from an old generation - still the tag on its entries */
+    return (int64_t)ctx_asid(ctx);
+}
+
+/* ===================================================================== */
+/* Allocation (asid_lock held) */
+/* ===================================================================== */
+
+static inline bool asid_test_and_set(uint64_t asid)
+{
+    uint64_t bit = 1UL << (asid % 64);
+    bool was = asid_map[asid / 64] & bit;
+    asid_map[asid / 64] |= bit;
+    return was;
+}
+
+/* Lowest clear bit in [start, NUM_ASIDS), or 0 if there is none */
+static uint64_t asid_find_free(uint64_t start)
+{
+    for (uint64_t asid = start; asid < NUM_ASIDS; ) {
+        uint64_t word = asid_map[asid / 64] | ((1UL << (asid % 64)) - 1);
+        if (word != ~0UL) {
+            uint64_t found = (asid & ~63UL) + __builtin_ctzl(~word);
+            return found < NUM_ASIDS ? found : 0;
+        }
+        asid = (asid & ~63UL) + 64;
+    }
+    return 0;
+}
+
+/* Start a new generation: every ID is free again except the loaded ones */
+static void flush_context(void)
+{
+    memset(asid_map, 0, NUM_ASIDS / 8);
+    asid_map[0] = 1;    /* ASID 0 is the kernel's */
+
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        uint64_t ctx = __atomic_exchange_n(&active_asids[cpu], 0, __ATOMIC_SEQ_CST);
+        /*
+         * A CPU that has not switched since the last rollover still runs
+         * its reserved ID; keep that one instead.
+         */
+        if (ctx == 0) {
+            ctx = reserved_asids[cpu];
+        }
+        asid_test_and_set(ctx_asid(ctx));
+        reserved_asids[cpu] = ctx;
+        tlb_flush_pending[cpu] = true;
+    }
+
+    asid_rollovers++;
+}
+
+/* If @ctx is reserved on some CPU, move the reservation to @newctx */
+static bool check_update_reserved(uint64_t ctx, uint64_t newctx)
+{
+    bool hit = false;
+
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (reserved_asids[cpu] == ctx) {
+            reserved_asids[cpu] = newctx;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+static uint64_t new_context(struct mm_struct *mm)
+{
+    uint64_t ctx = mm->context_id;
+    uint64_t generation = asid_generation;
+
+    if (ctx != 0) {
+        uint64_t newctx = generation | ctx_asid(ctx);
+
+        /* Loaded on some CPU at rollover: keep it, its entries are ours */
+        if (check_update_reserved(ctx, newctx)) {
+            return newctx;
+        }
+        /* Try to keep the old ID if nobody took it this generation */
+        if (!asid_test_and_set(ctx_asid(ctx))) {
+            return newctx;
+        }
+    }
+
+    uint64_t asid = asid_find_free(asid_next);
+    if (asid == 0) {
+        asid_generation += ASID_FIRST_VERSION;
+        generation = asid_generation;
+        flush_context();
+        asid = asid_find_free(1);
+    }
+
+    asid_test_and_set(asid);
+    asid_next = asid + 1;
+    asid_allocs++;
+    return generation | asid;
+}
+
+/* ===================================================================== */
+/* Public functions */
+/* ===================================================================== */
+
+unsigned int asid_init(void)
+{
+#ifdef ARCH_ARM64
+    uint64_t mmfr0;
+    asm volatile("mrs %0, id_aa64mmfr0_el1" : "=r"(mmfr0));
+    asid_bits = ((mmfr0 >> 4) & 0xF) == 2 ? 16 : 8;
+#elif defined(ARCH_X86_64)
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                 : "a"(1), "c"(0));
+    bool pcid = ecx & (1U << 17);
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                 : "a"(7), "c"(0));
+    bool has_invpcid = ebx & (1U << 10);
+
+    /* Scoped flushes of other address spaces need INVPCID */
+    if (pcid && has_invpcid) {
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_PCIDE) : "memory");
+        asid_bits = 12;
+    }
+#endif
+
+    if (asid_bits) {
+        asid_generation = ASID_FIRST_VERSION;
+        asid_map[0] = 1;
+        printk(KERN_INFO "ASID: %u-bit address space IDs\n", asid_bits);
+    } else {
+        printk(KERN_INFO "ASID: Not supported, flushing TLB on every switch\n");
+    }
+    return asid_bits;
+}
+
+void asid_switch_mm(struct mm_struct *mm)
+{
+    if (!mm || !mm->pgd) {
+        return;
+    }
+
+    unsigned int cpu = this_cpu();
+    cpu_mm[cpu] = mm;
+
+    if (!asid_bits) {
+        cpu_set_root(mm->pgd, 0);
+        vmm_flush_tlb();
+        return;
+    }
+
+    if (mm == vmm_kernel_mm()) {
+        /*
+         * ID 0 is never handed out, so it needs no generation check.
+         * active_asids keeps the last user ID: it stays reserved over a
+         * rollover, and the next switch back to it takes the fast path.
+         */
+        cpu_set_root(mm->pgd, 0);
+        return;
+    }
+
+    /*
+     * Fast path: our generation is current and no rollover has zeroed
+     * this CPU's slot under us, so just publish the ID.
+     */
+    uint64_t ctx = __atomic_load_n(&mm->context_id, __ATOMIC_RELAXED);
+    uint64_t old_active = __atomic_load_n(&active_asids[cpu], __ATOMIC_RELAXED);
+    if (old_active &&
+        ctx_generation(ctx) == __atomic_load_n(&asid_generation, __ATOMIC_RELAXED) &&
+        __atomic_compare_exchange_n(&active_asids[cpu], &old_active, ctx, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        asid_fast_switches++;
+        cpu_set_root(mm->pgd, ctx_asid(ctx));
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&asid_lock);
+
+    ctx = mm->context_id;
+    if (ctx_generation(ctx) != asid_generation) {
+        ctx = new_context(mm);
+        __atomic_store_n(&mm->context_id, ctx, __ATOMIC_RELAXED);
+    }
+
+    bool flush = tlb_flush_pending[cpu];
+    tlb_flush_pending[cpu] = false;
+    __atomic_store_n(&active_asids[cpu], ctx, __ATOMIC_RELAXED);
+
+    spin_unlock_irqrestore(&asid_lock, flags);
+
+    if (flush) {
+        local_flush_tlb_user();
+    }
+    cpu_set_root(mm->pgd, ctx_asid(ctx));
+}
+
+void asid_release_mm(struct mm_struct *mm)
+{
+    if (!mm || mm == vmm_kernel_mm()) {
+        return;
+    }
+
+    if (cpu_mm[this_cpu()] == mm) {
+        asid_switch_mm(vmm_kernel_mm());
+    }
+    asid_flush_mm(mm);
+}
+
+void asid_flush_mm(struct mm_struct *mm)
+{
+    if (!mm) {
+        return;
+    }
+    if (!asid_bits) {
+        vmm_flush_tlb();
+        return;
+    }
+
+    int64_t asid = mm_hw_asid(mm);
+    if (asid < 0) {
+        return;
+    }
+
+#ifdef ARCH_ARM64
+    asm volatile(
+        "dsb ishst\n"
+        "tlbi aside1is, %0\n"
+        "dsb ish\n"
+        "isb"
+        :: "r"((uint64_t)asid << 48)
+        : "memory"
+    );
+#elif defined(ARCH_X86_64)
+    invpcid(INVPCID_SINGLE, (uint64_t)asid, 0);
+#endif
+}
+
+void asid_flush_page(struct mm_struct *mm, virt_addr_t vaddr)
+{
+    if (!mm) {
+        return;
+    }
+    if (!asid_bits) {
+        vmm_flush_tlb_page(vaddr);
+        return;
+    }
+
+    int64_t asid = mm_hw_asid(mm);
+    if (asid < 0) {
+        return;
+    }
+
+#ifdef ARCH_ARM64
+    asm volatile(
+        "dsb ishst\n"
+        "tlbi vae1is, %0\n"
+        "dsb ish\n"
+        "isb"
+        :: "r"(((uint64_t)asid << 48) | ((vaddr >> 12) & ((1UL << 44) - 1)))
+        : "memory"
+    );
+#elif defined(ARCH_X86_64)
+    invpcid(INVPCID_ADDR, (uint64_t)asid, vaddr);
+#endif
+}
+
+void asid_get_stats(uint64_t *allocs, uint64_t *rollovers, uint64_t *fast)
+{
+    if (allocs) {
+        *allocs = asid_allocs;
+    }
+    if (rollovers) {
+        *rollovers = asid_rollovers;
+    }
+    if (fast) {
+        *fast = asid_fast_switches;
+    }
+}
+
+/* ===================================================================== */
+/* Benchmark */
+/* ===================================================================== */
+
+#define BENCH_PAGES         64      /* Working set per address space */
+#define BENCH_ROUNDS        2000
+#define BENCH_CHURN         1024    /* Short-lived address spaces */
+
+/* Switch to @mm and read one word from each working set page */
+static inline uint64_t bench_switch_touch(struct mm_struct *mm, bool full_flush)
+{
+    uint64_t sum = 0;
+
+    asid_switch_mm(mm);
+    if (full_flush) {
+        vmm_flush_tlb();
+    }
+    for (int i = 0; i < BENCH_PAGES; i++) {
+        sum += *(volatile uint64_t *)(USER_MMAP_BASE + i * PAGE_SIZE);
+    }
+    return sum;
+}
+
+/* Ticks for @rounds A->B->A ping-pongs */
+static uint64_t bench_ping_pong(struct mm_struct *a, struct mm_struct *b,
+                                bool full_flush)
+{
+    uint64_t ticks = 0;
+
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        /* Nothing else may switch TTBR0 mid-round */
+        uint64_t irq = arch_irq_save_local();
+        uint64_t t0 = arch_timer_get_ticks();
+        bench_switch_touch(a, full_flush);
+        bench_switch_touch(b, full_flush);
+        ticks += arch_timer_get_ticks() - t0;
+        asid_switch_mm(vmm_kernel_mm());
+        arch_irq_restore_local(irq);
+    }
+    return ticks;
+}
+
+int asid_bench(char *buf, size_t size)
+{
+    int len = 0;
+
+    REPORT_OUT("ASID bench: %u-bit IDs, %d pages touched per switch\n",
+               asid_bits, BENCH_PAGES);
+
+    struct mm_struct *saved = cpu_mm[this_cpu()];
+    struct mm_struct *a = vmm_create_address_space();
+    struct mm_struct *b = vmm_create_address_space();
+    if (!a || !b ||
+        vmm_map_user_range(a, USER_MMAP_BASE, BENCH_PAGES * PAGE_SIZE,
+                           VM_READ | VM_WRITE | VM_USER) < 0 ||
+        vmm_map_user_range(b, USER_MMAP_BASE, BENCH_PAGES * PAGE_SIZE,
+                           VM_READ | VM_WRITE | VM_USER) < 0) {
+        REPORT_OUT("  address space setup failed\n");
+        vmm_destroy_address_space(a);
+        vmm_destroy_address_space(b);
+        return len;
+    }
+
+    /* Warm up so both have IDs, then measure tagged vs flushed switches */
+    bench_ping_pong(a, b, false);
+    uint64_t tagged = bench_ping_pong(a, b, false);
+    uint64_t flushed = bench_ping_pong(a, b, true);
+
+    vmm_destroy_address_space(a);
+    vmm_destroy_address_space(b);
+
+    /* Process churn: more short-lived address spaces than there are IDs */
+    uint64_t rollovers_before = asid_rollovers;
+    uint64_t churn_ticks = 0;
+    int churned = 0;
+    for (int i = 0; i < BENCH_CHURN; i++) {
+        struct mm_struct *mm = vmm_create_address_space();
+        if (!mm) {
+            break;
+        }
+        uint64_t irq = arch_irq_save_local();
+        uint64_t t0 = arch_timer_get_ticks();
+        asid_switch_mm(mm);
+        churn_ticks += arch_timer_get_ticks() - t0;
+        asid_switch_mm(vmm_kernel_mm());
+        arch_irq_restore_local(irq);
+        vmm_destroy_address_space(mm);
+        churned++;
+    }
+
+    asid_switch_mm(saved ? saved : vmm_kernel_mm());
+
+    uint64_t switches = BENCH_ROUNDS * 2ULL;
+    REPORT_OUT("  tagged switch+touch:  %6llu ns\n",
+               (unsigned long long)(ticks_to_ns(tagged) / switches));
+    REPORT_OUT("  flushed switch+touch: %6llu ns\n",
+               (unsigned long long)(ticks_to_ns(flushed) / switches));
+    REPORT_OUT("  churn: %d new mms, %6llu ns/switch, %llu rollovers\n", churned,
+               (unsigned long long)(churned ? ticks_to_ns(churn_ticks) / churned : 0),
+               (unsigned long long)(asid_rollovers - rollovers_before));
+    REPORT_OUT("  totals: %llu IDs allocated, %llu fast switches\n",
+               (unsigned long long)asid_allocs,
+               (unsigned long long)asid_fast_switches);
+
+    return len;
+}
@@ -0,0 +1,309 @@
+/*
+ * UnixOS Kernel - Page Cache Implementation
+ *
+ * VFS inodes are rebuilt on every lookup, so cached pages are keyed by
+ * what stays stable: the superblock and inode number. One hash table
+ * covers all files. Each entry owns one reference on its physical page;
+ * anything that maps the page owns another, which is what lets the
+ * shrinker tell idle pages (refcount 1) from mapped ones.
+ */
+
+#include "mm/filemap.h"
+#include "fs/vfs.h"
+#include "mm/kmalloc.h"
+#include "mm/pmm.h"
+#include "printk.h"
+#include "string.h"
+#include "sync/spinlock.h"
+
+/* ===================================================================== */
+/* Configuration */
+/* ===================================================================== */
+
+#define FILEMAP_HASH_BITS       8
+#define FILEMAP_HASH_SIZE       (1U << FILEMAP_HASH_BITS)
+
+/* Start evicting idle pages once the cache holds 1/8 of RAM */
+#define FILEMAP_MAX_FRACTION    8
+#define FILEMAP_SHRINK_BATCH    32
+
+/* ===================================================================== */
+/* Types and static data */
+/* ===================================================================== */
+
+struct filemap_page {
+    struct super_block *sb;
+    ino_t ino;
+    uint64_t index;
+    phys_addr_t paddr;
+    size_t valid;                   /* Bytes of the page backed by the file */
+    struct filemap_page *next;      /* Hash chain */
+};
+
+static struct filemap_page *filemap_hash[FILEMAP_HASH_SIZE];
+static DEFINE_SPINLOCK(filemap_lock);
+
+static size_t filemap_nr_pages;
+static unsigned int filemap_shrink_cursor;
+static uint64_t filemap_hits;
+static uint64_t filemap_misses;
+
+/* ===================================================================== */
+/* Helper functions */
+/* ===================================================================== */
+
+static inline unsigned int filemap_hashfn(struct super_block *sb, ino_t ino,
+                                          uint64_t index)
+{
+    uint64_t key = ((uint64_t)(uintptr_t)sb >> 4) ^ (ino * 0x9E3779B97F4A7C15ULL) ^ index;
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(key >> (64 - FILEMAP_HASH_BITS));
+}
+
+/* Find a cached page (filemap_lock held) */
+static struct filemap_page *filemap_lookup(struct super_block *sb, ino_t ino,
+                                           uint64_t index)
+{
+    struct filemap_page *entry = filemap_hash[filemap_hashfn(sb, ino, index)];
+    while (entry) {
+        if (entry->sb == sb && entry->ino == ino && entry->index == index) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+static inline struct inode *file_inode(struct file *file)
+{
+    return file && file->f_dentry ? file->f_dentry->d_inode : NULL;
+}
+
+/* Fill @dst with file page @index, zeroing anything past end of file */
+static ssize_t filemap_read_page(struct file *file, uint64_t index, char *dst)
+{
+    loff_t pos = (loff_t)(index * PAGE_SIZE);
+    size_t done = 0;
+
+    while (done < PAGE_SIZE) {
+        ssize_t n = file->f_op->read(file, dst + done, PAGE_SIZE - done, &pos);
+        if (n < 0) {
+            if (done == 0) {
+                return n;
+            }
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+
+    memset(dst + done, 0, PAGE_SIZE - done);
+    return done;
+}
+
+/* ===================================================================== */
+/* Public functions */
+/* ===================================================================== */
+
+phys_addr_t filemap_get_page(struct file *file, uint64_t index)
+{
+    struct inode *inode = file_inode(file);
+    if (!inode || !file->f_op || !file->f_op->read) {
+        return 0;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&filemap_lock);
+    struct filemap_page *entry = filemap_lookup(inode->i_sb, inode->i_ino, index);
+    if (entry) {
+        phys_addr_t paddr = entry->paddr;
+        pmm_page_get(paddr);
+        filemap_hits++;
+        spin_unlock_irqrestore(&filemap_lock, flags);
+        return paddr;
+    }
+    filemap_misses++;
+    spin_unlock_irqrestore(&filemap_lock, flags);
+
+    /* Miss - read the page in without holding the lock */
+    struct filemap_page *new = kmalloc(sizeof(*new));
+    if (!new) {
+        return 0;
+    }
+
+    phys_addr_t paddr = pmm_alloc_page();
+    if (!paddr && filemap_shrink(FILEMAP_SHRINK_BATCH)) {
+        paddr = pmm_alloc_page();
+    }
+    if (!paddr) {
+        kfree(new);
+        return 0;
+    }
+
+    ssize_t valid = filemap_read_page(file, index, (char *)paddr);
+    if (valid < 0) {
+        pmm_free_page(paddr);
+        kfree(new);
+        return 0;
+    }
+
+    new->sb = inode->i_sb;
+    new->ino = inode->i_ino;
+    new->index = index;
+    new->paddr = paddr;
+    new->valid = valid;
+
+    flags = spin_lock_irqsave(&filemap_lock);
+    entry = filemap_lookup(inode->i_sb, inode->i_ino, index);
+    if (entry) {
+        /* Someone else read it in first - use theirs */
+        phys_addr_t existing = entry->paddr;
+        pmm_page_get(existing);
+        spin_unlock_irqrestore(&filemap_lock, flags);
+        pmm_free_page(paddr);
+        kfree(new);
+        return existing;
+    }
+
+    unsigned int bucket = filemap_hashfn(new->sb, new->ino, index);
+    new->next = filemap_hash[bucket];
+    filemap_hash[bucket] = new;
+    filemap_nr_pages++;
+
+    /* One reference for the cache (from the allocator), one for the caller */
+    pmm_page_get(paddr);
+
+    bool over = filemap_nr_pages >
+                pmm_get_total_memory() / PAGE_SIZE / FILEMAP_MAX_FRACTION;
+    spin_unlock_irqrestore(&filemap_lock, flags);
+
+    if (over) {
+        filemap_shrink(FILEMAP_SHRINK_BATCH);
+    }
+
+    return paddr;
+}
+
+void filemap_update(struct inode *inode, loff_t pos, const char *buf, size_t len)
+{
+    if (!inode || pos < 0 || len == 0) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&filemap_lock);
+    if (filemap_nr_pages == 0) {
+        spin_unlock_irqrestore(&filemap_lock, flags);
+        return;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        uint64_t index = (uint64_t)(pos + done) / PAGE_SIZE;
+        size_t offset = (size_t)(pos + done) % PAGE_SIZE;
+        size_t chunk = MIN(len - done, PAGE_SIZE - offset);
+
+        struct filemap_page *entry = filemap_lookup(inode->i_sb, inode->i_ino, index);
+        if (entry) {
+            memcpy((char *)entry->paddr + offset, buf + done, chunk);
+            entry->valid = MAX(entry->valid, offset + chunk);
+        }
+        done += chunk;
+    }
+
+    spin_unlock_irqrestore(&filemap_lock, flags);
+}
+
+int filemap_writeback(struct file *file, uint64_t first, uint64_t last)
+{
+    struct inode *inode = file_inode(file);
+    if (!inode || !file->f_op || !file->f_op->write) {
+        return -1;
+    }
+
+    int ret = 0;
+    for (uint64_t index = first; index < last; index++) {
+        uint64_t flags = spin_lock_irqsave(&filemap_lock);
+        struct filemap_page *entry = filemap_lookup(inode->i_sb, inode->i_ino, index);
+        if (!entry || entry->valid == 0) {
+            spin_unlock_irqrestore(&filemap_lock, flags);
+            continue;
+        }
+        phys_addr_t paddr = entry->paddr;
+        size_t valid = entry->valid;
+        pmm_page_get(paddr);
+        spin_unlock_irqrestore(&filemap_lock, flags);
+
+        loff_t pos = (loff_t)(index * PAGE_SIZE);
+        if (file->f_op->write(file, (const char *)paddr, valid, &pos) < 0) {
+            ret = -1;
+        }
+        pmm_page_put(paddr);
+    }
+
+    return ret;
+}
+
+void filemap_invalidate(struct inode *inode)
+{
+    if (!inode) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&filemap_lock);
+    for (unsigned int i = 0; i < FILEMAP_HASH_SIZE && filemap_nr_pages; i++) {
+        struct filemap_page **pp = &filemap_hash[i];
+        while (*pp) {
+            struct filemap_page *entry = *pp;
+            if (entry->sb == inode->i_sb && entry->ino == inode->i_ino) {
+                *pp = entry->next;
+                filemap_nr_pages--;
+                pmm_page_put(entry->paddr);
+                kfree(entry);
+            } else {
+                pp = &entry->next;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&filemap_lock, flags);
+}
+
+size_t filemap_shrink(size_t nr)
+{
+    size_t freed = 0;
+
+    uint64_t flags = spin_lock_irqsave(&filemap_lock);
+    for (unsigned int n = 0; n < FILEMAP_HASH_SIZE && freed < nr; n++) {
+        /* Rotate the starting bucket so eviction is spread out */
+        unsigned int i = filemap_shrink_cursor++ % FILEMAP_HASH_SIZE;
+        struct filemap_page **pp = &filemap_hash[i];
+        while (*pp && freed < nr) {
+            struct filemap_page *entry = *pp;
+            if (pmm_page_refcount(entry->paddr) == 1) {
+                *pp = entry->next;
+                filemap_nr_pages--;
+                pmm_page_put(entry->paddr);
+                kfree(entry);
+                freed++;
+            } else {
+                pp = &entry->next;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&filemap_lock, flags);
+
+    return freed;
+}
+
+void filemap_get_stats(size_t *pages, uint64_t *hits, uint64_t *misses)
+{
+    if (pages) {
+        *pages = filemap_nr_pages;
+    }
+    if (hits) {
+        *hits = filemap_hits;
+    }
+    if (misses) {
+        *misses = filemap_misses;
+    }
+}
@@ -1,13 +1,25 @@
 /*
  * UnixOS Kernel - Kernel Heap Allocator Implementation
  *
- * A simple bucket-based allocator for kernel memory.
- * Fixed to use direct memory region like VibeOS for reliability.
+ * Small requests (up to KMALLOC_MAX_CACHE_SIZE) are served in O(1) by the
+ * power-of-two slab caches in slab.c. Medium requests use a first-fit
+ * free list over a fixed heap region, like VibeOS; free blocks carry
+ * their size in a footer so kfree() merges with both neighbours and
+ * krealloc() can usually resize in place.
+ *
+ * Everything kmalloc() returns is physically contiguous, so it may be
+ * handed to a device. Big CPU-only buffers should come from vmalloc()
+ * instead; kfree() and krealloc() accept those too.
  */
 
 #include "mm/kmalloc.h"
+#include "mm/allocprof.h"
 #include "mm/pmm.h"
+#include "mm/slab.h"
+#include "mm/vmalloc.h"
 #include "printk.h"
+#include "string.h"
+#include "sync/spinlock.h"
 
 /* ===================================================================== */
 /* Configuration */
@@ -17,7 +29,7 @@
   (128 * 1024 * 1024) /* 128MB kernel heap - 4K wallpapers need space */
 #define MIN_ALLOC 32  /* Minimum allocation size */
 #define MAX_ALLOC                                                              \
-  (32 * 1024 * 1024) /* Maximum single allocation (32MB for large images) */
+  (32 * 1024 * 1024) /* Maximum single heap allocation */
 
 /* Fixed heap location - after kernel at 0x42000000 */
 /* Kernel loads at 0x40200000, so 0x42000000 gives 30MB for kernel code/data */
@@ -36,6 +48,7 @@ struct block_header {
 #define BLOCK_MAGIC_USED 0xCAFEBABE
 
 #define BLOCK_FLAG_FREE 0x01
+#define BLOCK_FLAG_PREV_FREE 0x02 /* Physically preceding block is free */
 
 /* ===================================================================== */
 /* Static data */
@@ -48,20 +61,19 @@ static size_t heap_total;
 static size_t heap_used;
 static bool heap_initialized = false;
 
-/* Simple spinlock for heap operations */
-static volatile int heap_lock = 0;
+/*
+ * Every CPU's heap operations meet here, so waiters queue (MCS).
+ * Interrupt handlers allocate too, so interrupts stay off while queued.
+ */
+static DEFINE_MCS_LOCK(heap_lock);
 
-static void lock_heap(void) {
-  while (__atomic_test_and_set(&heap_lock, __ATOMIC_ACQUIRE)) {
-#ifdef ARCH_ARM64
-    asm volatile("yield");
-#elif defined(ARCH_X86_64) || defined(ARCH_X86)
-    asm volatile("pause");
-#endif
-  }
+static uint64_t lock_heap(struct mcs_node *node) {
+  return mcs_spin_lock_irqsave(&heap_lock, node);
 }
 
-static void unlock_heap(void) { __atomic_clear(&heap_lock, __ATOMIC_RELEASE); }
+static void unlock_heap(struct mcs_node *node, uint64_t irqflags) {
+  mcs_spin_unlock_irqrestore(&heap_lock, node, irqflags);
+}
 
 /* ===================================================================== */
 /* Helper functions */
@@ -79,6 +91,27 @@ static inline struct block_header *data_to_block(void *ptr) {
   return (struct block_header *)((uint8_t *)ptr - sizeof(struct block_header));
 }
 
+static inline struct block_header *block_next_physical(struct block_header *block) {
+  uint8_t *next = (uint8_t *)block + block->size;
+  return next < heap_end ? (struct block_header *)next : NULL;
+}
+
+/* Free blocks end with a copy of their size so the next block can find them */
+static inline void block_set_footer(struct block_header *block) {
+  *(size_t *)((uint8_t *)block + block->size - sizeof(size_t)) = block->size;
+}
+
+static inline void block_set_prev_free(struct block_header *block, bool free) {
+  if (!block) {
+    return;
+  }
+  if (free) {
+    block->flags |= BLOCK_FLAG_PREV_FREE;
+  } else {
+    block->flags &= ~BLOCK_FLAG_PREV_FREE;
+  }
+}
+
 /* ===================================================================== */
 /* Initialization */
 /* ===================================================================== */
@@ -98,9 +131,16 @@ void kmalloc_init(void) {
   free_list->flags = BLOCK_FLAG_FREE;
   free_list->next = NULL;
   free_list->prev = NULL;
+  block_set_footer(free_list);
 
   heap_initialized = true;
 
+  /* Keep the PMM from handing out pages that overlap the heap */
+  pmm_reserve_range(HEAP_BASE, HEAP_SIZE);
+
+  /* Small-object size classes */
+  kmem_cache_init();
+
   printk(KERN_INFO "KMALLOC: Heap at 0x%lx - 0x%lx (%lu KB)\n",
          (unsigned long)heap_start, (unsigned long)heap_end,
          (unsigned long)(HEAP_SIZE / 1024));
@@ -110,7 +150,7 @@ void kmalloc_init(void) {
 /* Allocation */
 /* ===================================================================== */
 
-void *_kmalloc(size_t size, uint32_t flags) {
+static void *__kmalloc(size_t size, uint32_t flags) {
   if (!heap_initialized) {
     kmalloc_init();
     if (!heap_initialized) {
@@ -122,10 +162,21 @@ void *_kmalloc(size_t size, uint32_t flags) {
     return NULL;
   }
 
+  /* Small requests go to the size-class slab caches */
+  struct kmem_cache *cache = kmalloc_slab(size);
+  if (cache) {
+    void *obj = kmem_cache_alloc(cache, flags);
+    if (obj) {
+      return obj;
+    }
+    /* Slab pages exhausted - fall back to the heap */
+  }
+
   /* Align size and add header */
   size_t total_size = align_up(size + sizeof(struct block_header), MIN_ALLOC);
 
-  lock_heap();
+  struct mcs_node node;
+  uint64_t irqflags = lock_heap(&node);
 
   /* Find first fit */
   struct block_header *block = free_list;
@@ -134,7 +185,7 @@ void *_kmalloc(size_t size, uint32_t flags) {
   while (block) {
     if (block->magic != BLOCK_MAGIC_FREE) {
       printk(KERN_ERR "KMALLOC: Corrupted free list!\n");
-      unlock_heap();
+      unlock_heap(&node, irqflags);
       return NULL;
     }
 
@@ -149,7 +200,7 @@ void *_kmalloc(size_t size, uint32_t flags) {
 
   if (!block) {
     /* No suitable block found */
-    unlock_heap();
+    unlock_heap(&node, irqflags);
     return NULL;
   }
 
@@ -170,6 +221,9 @@ void *_kmalloc(size_t size, uint32_t flags) {
 
     block->size = total_size;
     block->next = new_block;
+    block_set_footer(new_block);
+  } else {
+    block_set_prev_free(block_next_physical(block), false);
   }
 
   /* Remove block from free list */
@@ -190,34 +244,113 @@ void *_kmalloc(size_t size, uint32_t flags) {
 
   heap_used += block->size;
 
-  unlock_heap();
+  unlock_heap(&node, irqflags);
 
   void *ptr = block_data(block);
 
-  /* Zero if requested */
+  /* Zero if requested: all of it, so krealloc() can grow into the slack */
   if (flags & GFP_ZERO) {
-    uint8_t *p = (uint8_t *)ptr;
-    for (size_t i = 0; i < size; i++) {
-      p[i] = 0;
-    }
+    memset(ptr, 0, block->size - sizeof(struct block_header));
   }
 
   return ptr;
 }
 
+void *_kmalloc(size_t size, uint32_t flags) {
+  void *ptr = __kmalloc(size, flags);
+  allocprof_alloc(ALLOCPROF_KMALLOC, (uintptr_t)ptr, size,
+                  __builtin_return_address(0));
+  return ptr;
+}
+
 void *kzalloc(size_t size, uint32_t flags) {
-  return kmalloc(size, flags | GFP_ZERO);
+  void *ptr = __kmalloc(size, flags | GFP_ZERO);
+  allocprof_alloc(ALLOCPROF_KMALLOC, (uintptr_t)ptr, size,
+                  __builtin_return_address(0));
+  return ptr;
 }
 
 /* ===================================================================== */
 /* Deallocation */
 /* ===================================================================== */
 
+/* Unlink a free block from the free list (heap lock held) */
+static void free_list_remove(struct block_header *block) {
+  if (block->prev) {
+    block->prev->next = block->next;
+  } else {
+    free_list = block->next;
+  }
+  if (block->next) {
+    block->next->prev = block->prev;
+  }
+}
+
+/*
+ * Free @size bytes at @block as one block, merging with free physical
+ * neighbours on both sides, so free space never stays split between
+ * adjacent blocks (heap lock held).
+ */
+static void heap_free_block(struct block_header *block, size_t size,
+                            bool prev_free) {
+  struct block_header *next =
+      (struct block_header *)((uint8_t *)block + size);
+  if ((uint8_t *)next < heap_end && next->magic == BLOCK_MAGIC_FREE) {
+    free_list_remove(next);
+    size += next->size;
+    next->magic = 0; /* Invalidate merged header to catch double frees */
+  }
+
+  if (prev_free) {
+    size_t prev_size = *(size_t *)((uint8_t *)block - sizeof(size_t));
+    struct block_header *prev =
+        (struct block_header *)((uint8_t *)block - prev_size);
+    free_list_remove(prev);
+    block->magic = 0;
+    block = prev;
+    size += prev_size;
+  }
+
+  block->size = size;
+  block->magic = BLOCK_MAGIC_FREE;
+  block->flags = BLOCK_FLAG_FREE;
+  block->prev = NULL;
+  block->next = free_list;
+  if (free_list) {
+    free_list->prev = block;
+  }
+  free_list = block;
+
+  block_set_footer(block);
+  block_set_prev_free(block_next_physical(block), true);
+}
+
+static inline bool ptr_in_heap(const void *ptr) {
+  return (const uint8_t *)ptr >= heap_start && (const uint8_t *)ptr < heap_end;
+}
+
 void kfree(void *ptr) {
   if (!ptr) {
     return;
   }
 
+  allocprof_free(ALLOCPROF_KMALLOC, (uintptr_t)ptr);
+
+  if (is_vmalloc_addr(ptr)) {
+    vfree(ptr);
+    return;
+  }
+
+  if (!ptr_in_heap(ptr)) {
+    struct kmem_cache *cache = kmem_cache_of(ptr);
+    if (cache) {
+      kmem_cache_free(cache, ptr);
+    } else {
+      printk(KERN_ERR "KMALLOC: kfree of unknown pointer %p\n", ptr);
+    }
+    return;
+  }
+
   struct block_header *block = data_to_block(ptr);
 
   /* Validate block */
@@ -227,52 +360,65 @@ void kfree(void *ptr) {
     return;
   }
 
-  lock_heap();
+  struct mcs_node node;
+  uint64_t irqflags = lock_heap(&node);
 
   heap_used -= block->size;
+  heap_free_block(block, block->size, block->flags & BLOCK_FLAG_PREV_FREE);
 
-  /* Mark as free */
-  block->magic = BLOCK_MAGIC_FREE;
-  block->flags = BLOCK_FLAG_FREE;
+  unlock_heap(&node, irqflags);
+}
 
-  /* Add to front of free list */
-  block->next = free_list;
-  block->prev = NULL;
-  if (free_list) {
-    free_list->prev = block;
-  }
-  free_list = block;
+/* ===================================================================== */
+/* Reallocation */
+/* ===================================================================== */
 
-  /* Coalesce with next physical block if it's free */
-  struct block_header *next_physical =
-      (struct block_header *)((uint8_t *)block + block->size);
-  if ((uint8_t *)next_physical < heap_end &&
-      next_physical->magic == BLOCK_MAGIC_FREE) {
-    /* Remove next_physical from free list */
-    if (next_physical->prev) {
-      next_physical->prev->next = next_physical->next;
-    } else {
-      /* next_physical was head of free list, but block is new head now */
-    }
-    if (next_physical->next) {
-      next_physical->next->prev = next_physical->prev;
+/*
+ * Resize a heap block without moving it: grow by absorbing a free
+ * successor, and give back any tail big enough to be a block of its own.
+ * Returns false if the block has to move.
+ */
+static bool heap_resize_in_place(struct block_header *block, size_t new_size) {
+  size_t total_size =
+      align_up(new_size + sizeof(struct block_header), MIN_ALLOC);
+
+  struct mcs_node node;
+  uint64_t irqflags = lock_heap(&node);
+
+  if (total_size > block->size) {
+    struct block_header *next =
+        (struct block_header *)((uint8_t *)block + block->size);
+    if ((uint8_t *)next >= heap_end || next->magic != BLOCK_MAGIC_FREE ||
+        block->size + next->size < total_size) {
+      unlock_heap(&node, irqflags);
+      return false;
     }
-    /* Merge sizes */
-    block->size += next_physical->size;
-    /* Invalidate merged block's magic to prevent double-free */
-    next_physical->magic = 0;
+    free_list_remove(next);
+    next->magic = 0;
+    heap_used += next->size;
+    block->size += next->size;
+    block_set_prev_free(block_next_physical(block), false);
   }
 
-  unlock_heap();
-}
+  if (block->size >= total_size + sizeof(struct block_header) + MIN_ALLOC) {
+    size_t tail = block->size - total_size;
+    block->size = total_size;
+    heap_used -= tail;
+    heap_free_block((struct block_header *)((uint8_t *)block + total_size),
+                    tail, false);
+  }
 
-/* ===================================================================== */
-/* Reallocation */
-/* ===================================================================== */
+  unlock_heap(&node, irqflags);
+  return true;
+}
 
 void *krealloc(void *ptr, size_t new_size, uint32_t flags) {
+  void *caller = __builtin_return_address(0);
+
   if (!ptr) {
-    return kmalloc(new_size, flags);
+    ptr = __kmalloc(new_size, flags);
+    allocprof_alloc(ALLOCPROF_KMALLOC, (uintptr_t)ptr, new_size, caller);
+    return ptr;
   }
 
   if (new_size == 0) {
@@ -280,26 +426,60 @@ void *krealloc(void *ptr, size_t new_size, uint32_t flags) {
     return NULL;
   }
 
-  struct block_header *block = data_to_block(ptr);
-  size_t old_size = block->size - sizeof(struct block_header);
+  size_t old_size;
+  if (is_vmalloc_addr(ptr)) {
+    old_size = vmalloc_size(ptr);
+    if (!old_size) {
+      return NULL;
+    }
+  } else if (ptr_in_heap(ptr)) {
+    struct block_header *block = data_to_block(ptr);
+    if (block->magic != BLOCK_MAGIC_USED) {
+      printk(KERN_ERR "KMALLOC: krealloc of invalid pointer %p\n", ptr);
+      return NULL;
+    }
+    old_size = block->size - sizeof(struct block_header);
+
+    /* Growing buffers (file data, socket queues) usually stay put */
+    if (heap_resize_in_place(block, new_size)) {
+      if (flags & GFP_ZERO) {
+        size_t keep = MIN(old_size, new_size);
+        memset((uint8_t *)ptr + keep, 0,
+               block->size - sizeof(struct block_header) - keep);
+      }
+      allocprof_alloc(ALLOCPROF_KMALLOC, (uintptr_t)ptr, new_size, caller);
+      return ptr;
+    }
+  } else {
+    struct kmem_cache *cache = kmem_cache_of(ptr);
+    if (!cache) {
+      return NULL;
+    }
+    old_size = cache->object_size;
+  }
 
-  /* If new size fits in current block, just return */
+  /*
+   * If new size fits in current block, just return. The slack past it may
+   * hold what the caller wrote before shrinking, and a later krealloc()
+   * within the block would hand that back.
+   */
   if (new_size <= old_size) {
+    if (flags & GFP_ZERO) {
+      memset((uint8_t *)ptr + new_size, 0, old_size - new_size);
+    }
+    allocprof_alloc(ALLOCPROF_KMALLOC, (uintptr_t)ptr, new_size, caller);
     return ptr;
   }
 
   /* Allocate new block */
-  void *new_ptr = kmalloc(new_size, flags);
+  void *new_ptr = __kmalloc(new_size, flags);
+  allocprof_alloc(ALLOCPROF_KMALLOC, (uintptr_t)new_ptr, new_size, caller);
   if (!new_ptr) {
     return NULL;
   }
 
   /* Copy old data */
-  uint8_t *src = (uint8_t *)ptr;
-  uint8_t *dst = (uint8_t *)new_ptr;
-  for (size_t i = 0; i < old_size; i++) {
-    dst[i] = src[i];
-  }
+  memcpy(new_ptr, ptr, old_size);
 
   /* Free old block */
   kfree(ptr);
@@ -319,3 +499,30 @@ void kmalloc_get_stats(size_t *total, size_t *used, size_t *free_mem) {
   if (free_mem)
     *free_mem = heap_total - heap_used;
 }
+
+size_t kmalloc_free_histogram(size_t *counts, int nbuckets) {
+  size_t largest = 0;
+
+  for (int i = 0; i < nbuckets; i++) {
+    counts[i] = 0;
+  }
+  if (!heap_initialized) {
+    return 0;
+  }
+
+  struct mcs_node node;
+  uint64_t irqflags = lock_heap(&node);
+  for (struct block_header *block = free_list; block; block = block->next) {
+    int bucket = 0;
+    while (bucket < nbuckets - 1 && block->size >= (64UL << bucket)) {
+      bucket++;
+    }
+    counts[bucket]++;
+    if (block->size > largest) {
+      largest = block->size;
+    }
+  }
+  unlock_heap(&node, irqflags);
+
+  return largest;
+}
@@ -0,0 +1,442 @@
+/*
+ * UnixOS Kernel - Memory Mapping Implementation
+ *
+ * mmap() only records a VMA; page tables are filled in by
+ * handle_mm_fault() on first touch. Read faults on private anonymous
+ * memory map a single shared zero page copy-on-write, so untouched
+ * memory costs nothing. File mappings map page cache pages directly:
+ * MAP_SHARED writes land in the cache and are written back on
+ * munmap/msync, MAP_PRIVATE pages are copied on first write.
+ *
+ * Each entry point holds mm->mmap_lock throughout, so threads sharing an
+ * mm (CLONE_VM) see the VM areas change atomically.
+ */
+
+#include "mm/mmap.h"
+#include "arch/arch.h"
+#include "fs/vfs.h"
+#include "mm/filemap.h"
+#include "mm/pmm.h"
+#include "printk.h"
+#include "sched/hrtimer.h"
+#include "sched/sched.h"
+#include "string.h"
+
+/* ===================================================================== */
+/* Configuration */
+/* ===================================================================== */
+
+/* Window for mmap placement - clear of the kernel's identity map */
+#define MMAP_START          USER_MMAP_BASE
+#define MMAP_END            (USER_STACK_TOP - USER_STACK_SIZE)
+
+/* ===================================================================== */
+/* Zero page */
+/* ===================================================================== */
+
+static phys_addr_t zero_page;
+
+/* Shared all-zero page; holds a permanent reference so it is never freed */
+static phys_addr_t get_zero_page(void)
+{
+    if (zero_page) {
+        return zero_page;
+    }
+
+    phys_addr_t page = pmm_alloc_page_zeroed();
+    if (!page) {
+        return 0;
+    }
+
+    if (!__sync_bool_compare_and_swap(&zero_page, 0, page)) {
+        pmm_free_page(page);    /* Lost the race */
+    }
+    return zero_page;
+}
+
+/* ===================================================================== */
+/* Helper functions */
+/* ===================================================================== */
+
+static uint32_t prot_to_vm_flags(int prot, int flags)
+{
+    uint32_t vm_flags = VM_USER;
+
+    if (prot & PROT_READ) vm_flags |= VM_READ;
+    if (prot & PROT_WRITE) vm_flags |= VM_WRITE;
+    if (prot & PROT_EXEC) vm_flags |= VM_EXEC;
+    if ((flags & MAP_TYPE) == MAP_SHARED) vm_flags |= VM_SHARED;
+
+    return vm_flags;
+}
+
+/* Write back shared writable file mappings in [start, end) (mmap_lock held) */
+static int mmap_writeback(struct mm_struct *mm, virt_addr_t start, virt_addr_t end)
+{
+    int ret = 0;
+
+    for (struct vm_area *vma = vmm_find_vma_after(mm, start);
+         vma && vma->start < end; vma = vma->next) {
+        if (!vma->file) {
+            continue;
+        }
+        if ((vma->flags & (VM_SHARED | VM_WRITE)) != (VM_SHARED | VM_WRITE)) {
+            continue;
+        }
+
+        virt_addr_t s = MAX(start, vma->start);
+        virt_addr_t e = MIN(end, vma->end);
+        uint64_t first = vma->pgoff + ((s - vma->start) >> PAGE_SHIFT);
+        uint64_t last = vma->pgoff + ((e - vma->start) >> PAGE_SHIFT);
+        if (filemap_writeback(vma->file, first, last) < 0) {
+            ret = -EIO;
+        }
+    }
+
+    return ret;
+}
+
+/* Fill in the page at @vaddr (page aligned, mmap_lock held) */
+static int fault_page(struct mm_struct *mm, virt_addr_t vaddr, bool write)
+{
+    struct vm_area *vma = vmm_find_vma(mm, vaddr);
+    if (!vma) {
+        return -1;
+    }
+    if (write ? !(vma->flags & VM_WRITE)
+              : !(vma->flags & (VM_READ | VM_WRITE | VM_EXEC))) {
+        return -1;
+    }
+
+    if (vmm_user_virt_to_phys(mm, vaddr)) {
+        /* Present: a write to a COW page, or another CPU got here first */
+        return write ? vmm_handle_cow_fault(mm, vaddr) : 0;
+    }
+
+    uint32_t map_flags = vma->flags;
+    bool private_write = (vma->flags & (VM_SHARED | VM_WRITE)) == VM_WRITE;
+    phys_addr_t paddr;
+
+    if (vma->file) {
+        uint64_t index = vma->pgoff + ((vaddr - vma->start) >> PAGE_SHIFT);
+        paddr = filemap_get_page(vma->file, index);
+        if (!paddr) {
+            printk(KERN_ERR "MMAP: Cannot read file page %lu\n",
+                   (unsigned long)index);
+            return -1;
+        }
+        /* Private mappings share the cached page until written */
+        if (private_write) {
+            map_flags = (map_flags & ~VM_WRITE) | VM_COW;
+        }
+    } else if (!write && private_write) {
+        paddr = get_zero_page();
+        if (!paddr) {
+            return -1;
+        }
+        pmm_page_get(paddr);
+        map_flags = (map_flags & ~VM_WRITE) | VM_COW;
+    } else {
+        paddr = pmm_alloc_page_zeroed();
+        if (!paddr) {
+            printk(KERN_ERR "MMAP: Out of memory at 0x%lx\n", (unsigned long)vaddr);
+            return -1;
+        }
+    }
+
+    if (vmm_map_user_page(mm, vaddr, paddr, map_flags) < 0) {
+        pmm_page_put(paddr);
+        /* Lost a race with another fault on the same page? */
+        return vmm_user_virt_to_phys(mm, vaddr) ? 0 : -1;
+    }
+
+    if (write && (map_flags & VM_COW)) {
+        return vmm_handle_cow_fault(mm, vaddr);
+    }
+    return 0;
+}
+
+/* Unmap [addr, end) (mmap_lock held) */
+static int munmap_range(struct mm_struct *mm, virt_addr_t addr, virt_addr_t end)
+{
+    mmap_writeback(mm, addr, end);
+
+    if (vmm_remove_vma_range(mm, addr, end) < 0) {
+        return -ENOMEM;
+    }
+    vmm_unmap_user_range(mm, addr, end);
+    return 0;
+}
+
+/* Change the protection of [addr, end) (mmap_lock held) */
+static int mprotect_range(struct mm_struct *mm, virt_addr_t addr,
+                          virt_addr_t end, int prot)
+{
+    /* The whole range must be mapped, and shared files writable if asked */
+    virt_addr_t covered = addr;
+    for (struct vm_area *vma = vmm_find_vma_after(mm, addr);
+         vma && vma->start < end; vma = vma->next) {
+        if (vma->start > covered) {
+            return -ENOMEM;
+        }
+        if ((prot & PROT_WRITE) && vma->file && (vma->flags & VM_SHARED) &&
+            (vma->file->f_flags & O_ACCMODE) != O_RDWR) {
+            return -EACCES;
+        }
+        covered = vma->end;
+    }
+    if (covered < end) {
+        return -ENOMEM;
+    }
+
+    if (vmm_protect_range(mm, addr, end, prot_to_vm_flags(prot, MAP_PRIVATE)) < 0) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* Place and record a mapping (mmap_lock held) */
+static long mmap_region(struct mm_struct *mm, virt_addr_t addr, size_t len,
+                        int prot, int flags, struct file *file, uint64_t offset)
+{
+    virt_addr_t start;
+    if (flags & MAP_FIXED) {
+        int ret = munmap_range(mm, addr, addr + len);
+        if (ret < 0) {
+            return ret;
+        }
+        start = addr;
+    } else {
+        /* Honour the hint if that range is free */
+        start = 0;
+        addr = PAGE_ALIGN_DOWN(addr);
+        if (addr >= MMAP_START && addr <= MMAP_END - len) {
+            start = vmm_find_unmapped_area(mm, len, addr, addr + len);
+        }
+        if (!start) {
+            start = vmm_find_unmapped_area(mm, len, MMAP_START, MMAP_END);
+        }
+        if (!start) {
+            return -ENOMEM;
+        }
+    }
+
+    if (vmm_add_file_vma(mm, start, start + len, prot_to_vm_flags(prot, flags),
+                         file, offset >> PAGE_SHIFT) < 0) {
+        return -ENOMEM;
+    }
+
+    if (flags & MAP_POPULATE) {
+        for (virt_addr_t va = start; va < start + len; va += PAGE_SIZE) {
+            if (fault_page(mm, va, false) < 0) {
+                break;
+            }
+        }
+    }
+
+    return (long)start;
+}
+
+/* ===================================================================== */
+/* Public functions */
+/* ===================================================================== */
+
+long do_mmap(struct mm_struct *mm, virt_addr_t addr, size_t len, int prot,
+             int flags, struct file *file, uint64_t offset)
+{
+    if (!mm || len == 0 || (offset & (PAGE_SIZE - 1))) {
+        return -EINVAL;
+    }
+
+    int type = flags & MAP_TYPE;
+    if (type != MAP_SHARED && type != MAP_PRIVATE) {
+        return -EINVAL;
+    }
+
+    if (len > MMAP_END - MMAP_START) {
+        return -ENOMEM;
+    }
+    len = PAGE_ALIGN(len);
+
+    if (flags & MAP_ANONYMOUS) {
+        file = NULL;
+        offset = 0;
+    } else {
+        if (!file) {
+            return -EBADF;
+        }
+        if (!file->f_op || !file->f_op->read) {
+            return -ENODEV;
+        }
+        int acc = file->f_flags & O_ACCMODE;
+        if (acc == O_WRONLY) {
+            return -EACCES;
+        }
+        if (type == MAP_SHARED && (prot & PROT_WRITE) && acc != O_RDWR) {
+            return -EACCES;
+        }
+    }
+
+    if ((flags & MAP_FIXED) &&
+        ((addr & (PAGE_SIZE - 1)) || addr < MMAP_START || addr > MMAP_END - len)) {
+        return -EINVAL;
+    }
+
+    uint64_t irq = spin_lock_irqsave(&mm->mmap_lock);
+    long ret = mmap_region(mm, addr, len, prot, flags, file, offset);
+    spin_unlock_irqrestore(&mm->mmap_lock, irq);
+    return ret;
+}
+
+int do_munmap(struct mm_struct *mm, virt_addr_t addr, size_t len)
+{
+    if (!mm || len == 0 || (addr & (PAGE_SIZE - 1))) {
+        return -EINVAL;
+    }
+
+    virt_addr_t end = addr + PAGE_ALIGN(len);
+    if (end <= addr || end > USER_VMA_END) {
+        return -EINVAL;
+    }
+
+    uint64_t irq = spin_lock_irqsave(&mm->mmap_lock);
+    int ret = munmap_range(mm, addr, end);
+    spin_unlock_irqrestore(&mm->mmap_lock, irq);
+    return ret;
+}
+
+int do_msync(struct mm_struct *mm, virt_addr_t addr, size_t len)
+{
+    if (!mm || (addr & (PAGE_SIZE - 1))) {
+        return -EINVAL;
+    }
+
+    virt_addr_t end = addr + PAGE_ALIGN(len);
+    if (end < addr) {
+        return -EINVAL;
+    }
+
+    uint64_t irq = spin_lock_irqsave(&mm->mmap_lock);
+    int ret = mmap_writeback(mm, addr, end);
+    spin_unlock_irqrestore(&mm->mmap_lock, irq);
+    return ret;
+}
+
+int do_mprotect(struct mm_struct *mm, virt_addr_t addr, size_t len, int prot)
+{
+    if (!mm || (addr & (PAGE_SIZE - 1)) ||
+        (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))) {
+        return -EINVAL;
+    }
+
+    virt_addr_t end = addr + PAGE_ALIGN(len);
+    if (end < addr || end > USER_VMA_END) {
+        return -EINVAL;
+    }
+    if (end == addr) {
+        return 0;
+    }
+
+    uint64_t irq = spin_lock_irqsave(&mm->mmap_lock);
+    int ret = mprotect_range(mm, addr, end, prot);
+    spin_unlock_irqrestore(&mm->mmap_lock, irq);
+    return ret;
+}
+
+int handle_mm_fault(struct mm_struct *mm, virt_addr_t vaddr, bool write)
+{
+    if (!mm) {
+        return -1;
+    }
+
+    uint64_t irq = spin_lock_irqsave(&mm->mmap_lock);
+    int ret = fault_page(mm, PAGE_ALIGN_DOWN(vaddr), write);
+    spin_unlock_irqrestore(&mm->mmap_lock, irq);
+    return ret;
+}
+
+/* ===================================================================== */
+/* VMA benchmark */
+/* ===================================================================== */
+
+static const size_t vma_bench_sizes[] = {256, 1024, 4096};
+
+int vma_bench(char *buf, size_t size)
+{
+    int len = 0;
+
+    REPORT_OUT("VMA bench: 1-page anonymous mappings, ns per operation\n");
+    REPORT_OUT("   vmas     mmap     find   munmap   refill mprotect  left\n");
+
+    for (size_t r = 0; r < ARRAY_SIZE(vma_bench_sizes); r++) {
+        size_t n = vma_bench_sizes[r];
+
+        /* Scratch address space; nothing is faulted in */
+        struct mm_struct *mm = vmm_create_address_space();
+        if (!mm) {
+            REPORT_OUT("%7lu  address space allocation failed\n", (unsigned long)n);
+            continue;
+        }
+
+        /* Alternate protections so neighbours never merge */
+        uint64_t t0 = arch_timer_get_ticks();
+        size_t mapped = 0;
+        for (size_t i = 0; i < n; i++) {
+            int prot = (i & 1) ? PROT_READ : PROT_READ | PROT_WRITE;
+            if (do_mmap(mm, 0, PAGE_SIZE, prot, MAP_PRIVATE | MAP_ANONYMOUS,
+                        NULL, 0) < 0) {
+                break;
+            }
+            mapped++;
+        }
+        uint64_t t1 = arch_timer_get_ticks();
+        if (mapped < n) {
+            REPORT_OUT("%7lu  mmap failed after %lu\n", (unsigned long)n,
+                       (unsigned long)mapped);
+            vmm_destroy_address_space(mm);
+            continue;
+        }
+
+        /* Random lookups, defeating the last-hit cache */
+        size_t lookups = n * 4;
+        uint32_t seed = 12345;
+        uint64_t irq = spin_lock_irqsave(&mm->mmap_lock);
+        for (size_t i = 0; i < lookups; i++) {
+            seed = seed * 1103515245 + 12345;
+            vmm_find_vma(mm, USER_MMAP_BASE + (seed % n) * PAGE_SIZE);
+        }
+        spin_unlock_irqrestore(&mm->mmap_lock, irq);
+        uint64_t t2 = arch_timer_get_ticks();
+
+        /* Punch a hole every fourth page, then fill them with mmap(NULL) */
+        for (size_t i = 0; i < n; i += 4) {
+            do_munmap(mm, USER_MMAP_BASE + i * PAGE_SIZE, PAGE_SIZE);
+        }
+        uint64_t t3 = arch_timer_get_ticks();
+        for (size_t i = 0; i < n; i += 4) {
+            do_mmap(mm, 0, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0);
+        }
+        uint64_t t4 = arch_timer_get_ticks();
+
+        /* Read-only every eighth page: each one merges with both neighbours */
+        for (size_t i = 0; i < n; i += 8) {
+            do_mprotect(mm, USER_MMAP_BASE + i * PAGE_SIZE, PAGE_SIZE, PROT_READ);
+        }
+        uint64_t t5 = arch_timer_get_ticks();
+
+        size_t holes = (n + 3) / 4;
+        size_t protects = (n + 7) / 8;
+        REPORT_OUT("%7lu %8llu %8llu %8llu %8llu %8llu %5lu\n", (unsigned long)n,
+                   (unsigned long long)(ticks_to_ns(t1 - t0) / n),
+                   (unsigned long long)(ticks_to_ns(t2 - t1) / lookups),
+                   (unsigned long long)(ticks_to_ns(t3 - t2) / holes),
+                   (unsigned long long)(ticks_to_ns(t4 - t3) / holes),
+                   (unsigned long long)(ticks_to_ns(t5 - t4) / protects),
+                   (unsigned long)mm->map_count);
+
+        vmm_destroy_address_space(mm);
+    }
+
+    return len;
+}
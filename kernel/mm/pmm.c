@@ -1,45 +1,139 @@
 /*
  * UnixOS Kernel - Physical Memory Manager Implementation
- * 
+ *
  * Buddy allocator for physical page allocation.
+ *
+ * RAM banks come from the device tree (/memory nodes), falling back to a
+ * fixed default when the bootloader does not pass one. Each bank gets a
+ * struct page array carved from its own memory, and a sparse section map
+ * translates PFNs to struct pages so discontiguous banks cost nothing
+ * for the holes between them.
+ *
+ * Free blocks live on doubly linked per-order lists with per-order free
+ * bitmaps, so coalescing is O(1). Single pages are cached on per-CPU
+ * hot/cold lists in front of the buddy allocator, and a pool of
+ * pre-zeroed pages, refilled in idle time, serves callers that need
+ * zeroed memory.
  */
 
 #include "mm/pmm.h"
+#include "arch/arch.h"
+#include "mm/allocprof.h"
+#include "dtb.h"
 #include "printk.h"
+#include "sched/hrtimer.h"
+#include "sched/sched.h"
+#include "string.h"
+#include "sync/spinlock.h"
 
 /* ===================================================================== */
 /* Constants */
 /* ===================================================================== */
 
-#define MAX_ORDER           11      /* Maximum order (2^11 = 2048 pages = 8MB) */
+#define MAX_ORDER           PMM_MAX_ORDER
 #define BUDDY_MAX_PAGES     (1UL << MAX_ORDER)
 
-/* Initial memory layout - will be updated from DTB/UEFI */
+/* Fallback memory layout when no device tree is available */
 #define MEMORY_BASE         0x40000000  /* 1GB - typical for ARM64 */
 #define MEMORY_SIZE         (256UL * 1024 * 1024)  /* 256MB - matches QEMU default */
 
+/* Sparse memory model: 128MB sections over a 256GB physical space */
+#define SECTION_SHIFT       27
+#define PFN_SECTION_SHIFT   (SECTION_SHIFT - PAGE_SHIFT)
+#define PAGES_PER_SECTION   (1UL << PFN_SECTION_SHIFT)
+#define MAX_PHYS_BITS       38
+#define MAX_PHYS_ADDR       (1UL << MAX_PHYS_BITS)
+#define NR_MEM_SECTIONS     (1UL << (MAX_PHYS_BITS - SECTION_SHIFT))
+
+#define PMM_MAX_BANKS       DTB_MAX_MEMORY
+#define PMM_MAX_RESERVED    (DTB_MAX_RESERVED + PMM_MAX_BANKS + 4)
+
+/* Per-CPU order-0 lists */
+#define PCP_BATCH           16      /* Pages moved per refill/drain */
+#define PCP_HIGH            64      /* Drain a list above this many pages */
+
+/* Pre-zeroed page pool */
+#define ZERO_POOL_HIGH      256     /* Refill up to 1MB of zeroed pages */
+#define ZERO_POOL_LOW       64      /* Wake kzerod below this */
+#define ZERO_BATCH          16      /* Pages cleared per idle turn */
+#define ZERO_MIN_FREE       4096    /* Stop refilling below 16MB free */
+#define ZERO_BACKOFF_MS     10      /* Retry a refill that found no page */
+
+/* ===================================================================== */
+/* Types */
+/* ===================================================================== */
+
+/* A contiguous bank of RAM */
+struct mem_bank {
+    phys_addr_t start;
+    phys_addr_t end;
+    struct page *pages;     /* struct page for each page in the bank */
+    size_t nr_pages;
+    size_t usable_pages;    /* Pages handed to the buddy allocator */
+    size_t map_base_pfn;    /* PFN of bit 0 in every free_map */
+    uint64_t *free_map[MAX_ORDER + 1];  /* Free block bitmaps per order */
+};
+
+/* One section of the sparse map; map is NULL for holes */
+struct mem_section {
+    struct page *map;       /* struct page of the first present page */
+    struct mem_bank *bank;
+    uint32_t first;         /* Index of the first present page */
+    uint32_t count;         /* Present pages */
+};
+
+/* Free blocks of one order */
+struct free_area {
+    struct page *head;
+    size_t nr_free;
+};
+
+struct pcp_list {
+    struct page *head;      /* Most recently freed */
+    struct page *tail;
+    uint32_t count;
+};
+
+/* Per-CPU page cache - only touched by its own CPU with IRQs off */
+struct per_cpu_pages {
+    struct pcp_list hot;
+    struct pcp_list cold;
+    uint64_t alloc_hits;
+    uint64_t refills;
+    uint64_t drains;
+} __aligned(64);
+
 /* ===================================================================== */
 /* Static data */
 /* ===================================================================== */
 
 /* Free lists for each order */
-static struct page *free_lists[MAX_ORDER + 1];
+static struct free_area free_area[MAX_ORDER + 1];
+static DEFINE_MCS_LOCK(pmm_lock); /* All CPUs refill and drain here */
+
+static struct per_cpu_pages pcp[MAX_CPUS];
 
-/* Page array - describes all physical pages */
-static struct page *page_array;
-static size_t total_pages;
+/* RAM banks, sorted by address */
+static struct mem_bank banks[PMM_MAX_BANKS];
+static int nr_banks;
+
+/* PFN -> struct page translation */
+static struct mem_section mem_sections[NR_MEM_SECTIONS];
+
+/* Boot-time reservations (kernel image, DTB, page arrays, ...) */
+static struct dtb_region reserved[PMM_MAX_RESERVED];
+static int nr_reserved;
 
 /* Memory statistics */
 static size_t free_pages_count;
 static size_t total_memory;
-static phys_addr_t memory_start;
-static phys_addr_t memory_end;
 
-/* Bitmap for early page tracking before page_array is set up */
-/* Track 64K pages = 256MB - enough for initial boot */
-#define EARLY_BITMAP_SIZE   (64 * 1024 / 8)  /* 8KB bitmap */
-static uint8_t early_bitmap[EARLY_BITMAP_SIZE];
-static bool early_mode = true;
+/* Pre-zeroed pages (allocated, refcount 1) and their refill thread */
+static struct pcp_list zero_pool;
+static DEFINE_SPINLOCK(zero_lock);
+static struct task_struct *kzerod_task;
+static uint64_t zero_hits;
+static uint64_t zero_misses;
 
 /* ===================================================================== */
 /* Helper functions */
@@ -59,59 +153,273 @@ static inline unsigned int size_to_order(size_t size)
 {
     unsigned int order = 0;
     size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-    
+
     while ((1UL << order) < pages && order < MAX_ORDER) {
         order++;
     }
-    
+
     return order;
 }
 
+static inline bool ranges_overlap(phys_addr_t a_start, phys_addr_t a_end,
+                                  phys_addr_t b_start, phys_addr_t b_end)
+{
+    return a_start < b_end && b_start < a_end;
+}
+
 /* ===================================================================== */
-/* Early boot allocator (bitmap-based) */
+/* Boot-time layout */
 /* ===================================================================== */
 
-static void early_mark_used(phys_addr_t addr)
+static void add_bank(phys_addr_t start, phys_addr_t end)
 {
-    size_t pfn = PHYS_TO_PFN(addr - memory_start);
-    if (pfn < EARLY_BITMAP_SIZE * 8) {
-        early_bitmap[pfn / 8] |= (1 << (pfn % 8));
+    start = PAGE_ALIGN(start);
+    end = PAGE_ALIGN_DOWN(end);
+    if (end > MAX_PHYS_ADDR) {
+        printk(KERN_WARNING "PMM: Ignoring RAM above 0x%lx\n",
+               (unsigned long)MAX_PHYS_ADDR);
+        end = MAX_PHYS_ADDR;
+    }
+    if (start >= end) {
+        return;
     }
+    if (nr_banks >= PMM_MAX_BANKS) {
+        printk(KERN_WARNING "PMM: Too many banks, ignoring 0x%lx\n",
+               (unsigned long)start);
+        return;
+    }
+
+    /* Insertion sort by start address */
+    int i = nr_banks++;
+    while (i > 0 && banks[i - 1].start > start) {
+        banks[i] = banks[i - 1];
+        i--;
+    }
+    banks[i].start = start;
+    banks[i].end = end;
+    banks[i].pages = NULL;
+    banks[i].nr_pages = 0;
+    banks[i].usable_pages = 0;
 }
 
-static void early_mark_free(phys_addr_t addr)
+/*
+ * Banks must not overlap, and two banks may not share a section since a
+ * section holds a single contiguous run of struct pages.
+ */
+static void sanitize_banks(void)
 {
-    size_t pfn = PHYS_TO_PFN(addr - memory_start);
-    if (pfn < EARLY_BITMAP_SIZE * 8) {
-        early_bitmap[pfn / 8] &= ~(1 << (pfn % 8));
+    for (int i = 1; i < nr_banks; i++) {
+        phys_addr_t limit = ALIGN(banks[i - 1].end, 1UL << SECTION_SHIFT);
+        if (banks[i].start < limit) {
+            printk(KERN_WARNING "PMM: Bank 0x%lx shares a section with "
+                   "0x%lx, trimming\n", (unsigned long)banks[i].start,
+                   (unsigned long)banks[i - 1].start);
+            banks[i].start = limit;
+        }
+        if (banks[i].start >= banks[i].end) {
+            for (int j = i; j < nr_banks - 1; j++) {
+                banks[j] = banks[j + 1];
+            }
+            nr_banks--;
+            i--;
+        }
     }
 }
 
-static bool early_is_free(phys_addr_t addr)
+static void add_reserved(phys_addr_t start, size_t size)
 {
-    size_t pfn = PHYS_TO_PFN(addr - memory_start);
-    if (pfn >= EARLY_BITMAP_SIZE * 8) {
-        return false;
+    if (size == 0) {
+        return;
+    }
+    if (nr_reserved >= PMM_MAX_RESERVED) {
+        printk(KERN_ERR "PMM: Reservation table full, 0x%lx not reserved\n",
+               (unsigned long)start);
+        return;
+    }
+
+    phys_addr_t base = PAGE_ALIGN_DOWN(start);
+    phys_addr_t end = PAGE_ALIGN(start + size);
+
+    /* Insertion sort by base address */
+    int i = nr_reserved++;
+    while (i > 0 && reserved[i - 1].base > base) {
+        reserved[i] = reserved[i - 1];
+        i--;
     }
-    return !(early_bitmap[pfn / 8] & (1 << (pfn % 8)));
+    reserved[i].base = base;
+    reserved[i].size = end - base;
 }
 
-static phys_addr_t early_alloc_page(void)
+/* Find @size bytes inside @bank not covered by any reservation, top-down */
+static phys_addr_t find_free_area(struct mem_bank *bank, size_t size)
 {
-    for (size_t i = 0; i < EARLY_BITMAP_SIZE; i++) {
-        if (early_bitmap[i] != 0xFF) {
-            for (int j = 0; j < 8; j++) {
-                if (!(early_bitmap[i] & (1 << j))) {
-                    early_bitmap[i] |= (1 << j);
-                    phys_addr_t addr = memory_start + (i * 8 + j) * PAGE_SIZE;
-                    return addr;
-                }
+    phys_addr_t end = bank->end;
+
+    while (end >= bank->start + size) {
+        phys_addr_t start = PAGE_ALIGN_DOWN(end - size);
+        bool clash = false;
+
+        for (int i = nr_reserved - 1; i >= 0; i--) {
+            phys_addr_t r_start = reserved[i].base;
+            phys_addr_t r_end = r_start + reserved[i].size;
+            if (ranges_overlap(start, start + size, r_start, r_end)) {
+                end = r_start;
+                clash = true;
+                break;
             }
         }
+        if (!clash) {
+            return start;
+        }
     }
     return 0;
 }
 
+/* Size of the free bitmap for one order of a bank, in bytes */
+static size_t free_map_bytes(struct mem_bank *bank, unsigned int order)
+{
+    size_t bits = ((PHYS_TO_PFN(bank->end) - bank->map_base_pfn) >> order) + 1;
+    return ALIGN(bits, 64) / 8;
+}
+
+/* Allocate and initialize the struct page array and bitmaps for a bank */
+static int bank_init_pages(struct mem_bank *bank)
+{
+    bank->nr_pages = (bank->end - bank->start) / PAGE_SIZE;
+    bank->map_base_pfn = ALIGN_DOWN(PHYS_TO_PFN(bank->start),
+                                    order_to_pages(MAX_ORDER));
+
+    size_t array_bytes = ALIGN(bank->nr_pages * sizeof(struct page), 8);
+    size_t bytes = array_bytes;
+    for (unsigned int o = 0; o <= MAX_ORDER; o++) {
+        bytes += free_map_bytes(bank, o);
+    }
+    bytes = PAGE_ALIGN(bytes);
+
+    phys_addr_t array = find_free_area(bank, bytes);
+    if (!array) {
+        printk(KERN_ERR "PMM: No room for page array of bank 0x%lx\n",
+               (unsigned long)bank->start);
+        return -1;
+    }
+    add_reserved(array, bytes);
+
+    /* Identity mapped */
+    bank->pages = (struct page *)array;
+    for (size_t i = 0; i < bank->nr_pages; i++) {
+        struct page *page = &bank->pages[i];
+        page->flags = PAGE_FLAG_RESERVED;
+        page->order = 0;
+        page->next = NULL;
+        page->prev = NULL;
+        page->slab = NULL;
+        atomic_set(&page->refcount, 0);
+    }
+
+    /* Free bitmaps follow the page array */
+    uint64_t *map = (uint64_t *)(array + array_bytes);
+    for (unsigned int o = 0; o <= MAX_ORDER; o++) {
+        size_t words = free_map_bytes(bank, o) / 8;
+        bank->free_map[o] = map;
+        for (size_t w = 0; w < words; w++) {
+            map[w] = 0;
+        }
+        map += words;
+    }
+
+    /* Populate the sections this bank spans */
+    size_t pfn = PHYS_TO_PFN(bank->start);
+    size_t end_pfn = PHYS_TO_PFN(bank->end);
+    while (pfn < end_pfn) {
+        size_t sec = pfn >> PFN_SECTION_SHIFT;
+        size_t sec_end = (sec + 1) << PFN_SECTION_SHIFT;
+        size_t run_end = MIN(sec_end, end_pfn);
+
+        mem_sections[sec].map = &bank->pages[pfn - PHYS_TO_PFN(bank->start)];
+        mem_sections[sec].bank = bank;
+        mem_sections[sec].first = pfn & (PAGES_PER_SECTION - 1);
+        mem_sections[sec].count = run_end - pfn;
+
+        pfn = run_end;
+    }
+
+    return 0;
+}
+
+/* ===================================================================== */
+/* Free areas */
+/* ===================================================================== */
+
+/*
+ * Each order has a doubly linked list of free block heads plus, per bank,
+ * a bitmap with one bit per naturally aligned block of that order. The
+ * bitmap answers "is my buddy free at this order?" without touching the
+ * buddy's struct page, and the doubly linked list removes it in O(1).
+ * All free-area state is protected by pmm_lock.
+ */
+
+static inline uint64_t *free_map_word(phys_addr_t addr, unsigned int order,
+                                      uint64_t *mask)
+{
+    size_t pfn = PHYS_TO_PFN(addr);
+    struct mem_bank *bank = mem_sections[pfn >> PFN_SECTION_SHIFT].bank;
+    size_t bit = (pfn - bank->map_base_pfn) >> order;
+
+    *mask = 1UL << (bit % 64);
+    return &bank->free_map[order][bit / 64];
+}
+
+static void free_area_add(struct page *page, phys_addr_t addr,
+                          unsigned int order)
+{
+    struct free_area *area = &free_area[order];
+    uint64_t mask;
+
+    page->order = order;
+    page->flags = PAGE_FLAG_BUDDY;
+    page->prev = NULL;
+    page->next = area->head;
+    if (area->head) {
+        area->head->prev = page;
+    }
+    area->head = page;
+    area->nr_free++;
+
+    *free_map_word(addr, order, &mask) |= mask;
+}
+
+static void free_area_del(struct page *page, phys_addr_t addr,
+                          unsigned int order)
+{
+    struct free_area *area = &free_area[order];
+    uint64_t mask;
+
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        area->head = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+    page->next = page->prev = NULL;
+    page->flags = PAGE_FLAG_USED;
+    area->nr_free--;
+
+    *free_map_word(addr, order, &mask) &= ~mask;
+}
+
+/* Is the block at @addr a free block of exactly @order? */
+static inline bool free_area_test(phys_addr_t addr, unsigned int order)
+{
+    uint64_t mask;
+
+    if (!pmm_phys_to_page(addr)) {
+        return false;
+    }
+    return (*free_map_word(addr, order, &mask) & mask) != 0;
+}
+
 /* ===================================================================== */
 /* Buddy allocator */
 /* ===================================================================== */
@@ -123,25 +431,399 @@ static inline phys_addr_t buddy_address(phys_addr_t addr, unsigned int order)
 
 static void buddy_add_to_list(phys_addr_t addr, unsigned int order)
 {
-    struct page *page = pmm_phys_to_page(addr);
-    page->order = order;
-    page->flags = PAGE_FLAG_FREE;
-    page->next = free_lists[order];
-    free_lists[order] = page;
+    free_area_add(pmm_phys_to_page(addr), addr, order);
 }
 
-static phys_addr_t buddy_remove_from_list(unsigned int order)
+/* Allocate a block of @order (pmm_lock held) */
+static phys_addr_t __buddy_alloc(unsigned int order)
 {
-    if (!free_lists[order]) {
-        return 0;
+    for (unsigned int o = order; o <= MAX_ORDER; o++) {
+        struct page *page = free_area[o].head;
+        if (!page) {
+            continue;
+        }
+
+        phys_addr_t addr = pmm_page_to_phys(page);
+        free_area_del(page, addr, o);
+
+        /* Split larger blocks if needed */
+        while (o > order) {
+            o--;
+            buddy_add_to_list(buddy_address(addr, o), o);
+        }
+        page->order = order;
+        atomic_set(&page->refcount, 1);
+        free_pages_count -= order_to_pages(order);
+        return addr;
+    }
+
+    return 0;
+}
+
+/* Free a block of @order, coalescing with its buddies (pmm_lock held) */
+static void __buddy_free(phys_addr_t addr, unsigned int order)
+{
+    free_pages_count += order_to_pages(order);
+
+    while (order < MAX_ORDER) {
+        phys_addr_t buddy = buddy_address(addr, order);
+        if (!free_area_test(buddy, order)) {
+            break;
+        }
+
+        free_area_del(pmm_phys_to_page(buddy), buddy, order);
+        if (buddy < addr) {
+            addr = buddy;
+        }
+        order++;
+    }
+
+    buddy_add_to_list(addr, order);
+}
+
+/*
+ * Hand [start, end) to the free lists as the largest aligned blocks that
+ * fit, working down from the top so the lowest blocks end up at the list
+ * heads and get allocated first.
+ */
+static size_t buddy_free_range(phys_addr_t start, phys_addr_t end)
+{
+    size_t pages = 0;
+
+    while (end > start) {
+        unsigned int order = MAX_ORDER;
+        while (order > 0 &&
+               (!IS_ALIGNED(end, order_to_size(order)) ||
+                end - order_to_size(order) < start)) {
+            order--;
+        }
+        end -= order_to_size(order);
+        buddy_add_to_list(end, order);
+        pages += order_to_pages(order);
+    }
+
+    return pages;
+}
+
+/*
+ * Take the page at @addr out of the free lists. If the whole free block
+ * containing it lies below @limit, the block is taken in one go.
+ * Returns the address to continue from. Called with pmm_lock held.
+ */
+static phys_addr_t buddy_reserve(phys_addr_t addr, phys_addr_t limit)
+{
+    for (unsigned int order = 0; order <= MAX_ORDER; order++) {
+        phys_addr_t head = ALIGN_DOWN(addr, order_to_size(order));
+        if (!free_area_test(head, order)) {
+            continue;
+        }
+
+        struct page *page = pmm_phys_to_page(head);
+        free_area_del(page, head, order);
+
+        /* Whole block inside the range */
+        if (head == addr && head + order_to_size(order) <= limit) {
+            page->flags = PAGE_FLAG_RESERVED;
+            free_pages_count -= order_to_pages(order);
+            return head + order_to_size(order);
+        }
+
+        /* Split, giving back the halves that do not contain @addr */
+        while (order > 0) {
+            order--;
+            phys_addr_t upper = head + order_to_size(order);
+            if (addr >= upper) {
+                buddy_add_to_list(head, order);
+                head = upper;
+            } else {
+                buddy_add_to_list(upper, order);
+            }
+        }
+        pmm_phys_to_page(addr)->flags = PAGE_FLAG_RESERVED;
+        free_pages_count--;
+        return addr + PAGE_SIZE;
+    }
+
+    /* Not free (already allocated or reserved) */
+    return addr + PAGE_SIZE;
+}
+
+/* ===================================================================== */
+/* Per-CPU page lists */
+/* ===================================================================== */
+
+/*
+ * Order-0 requests are served from per-CPU lists with only local IRQs
+ * disabled. Recently freed pages go on the hot list and are reused first
+ * while still in cache; pages fresh from the buddy allocator, and pages
+ * the caller knows are cache-cold, go on the cold list. Lists are
+ * refilled and drained PCP_BATCH pages at a time under pmm_lock.
+ */
+
+static inline struct per_cpu_pages *this_cpu_pages(void)
+{
+    uint32_t cpu = arch_cpu_id();
+    if (cpu >= MAX_CPUS) {
+        cpu = 0;
+    }
+    return &pcp[cpu];
+}
+
+static void pcp_push(struct pcp_list *list, struct page *page)
+{
+    page->prev = NULL;
+    page->next = list->head;
+    if (list->head) {
+        list->head->prev = page;
+    } else {
+        list->tail = page;
+    }
+    list->head = page;
+    list->count++;
+}
+
+static struct page *pcp_pop(struct pcp_list *list)
+{
+    struct page *page = list->head;
+    list->head = page->next;
+    if (list->head) {
+        list->head->prev = NULL;
+    } else {
+        list->tail = NULL;
     }
-    
-    struct page *page = free_lists[order];
-    free_lists[order] = page->next;
     page->next = NULL;
+    list->count--;
+    return page;
+}
+
+/* Remove the least recently freed page */
+static struct page *pcp_pop_tail(struct pcp_list *list)
+{
+    struct page *page = list->tail;
+    list->tail = page->prev;
+    if (list->tail) {
+        list->tail->next = NULL;
+    } else {
+        list->head = NULL;
+    }
+    page->prev = NULL;
+    list->count--;
+    return page;
+}
+
+/* Return up to @count of the coldest pages on @list to the buddy lists */
+static void pcp_drain(struct per_cpu_pages *cpu, struct pcp_list *list,
+                      uint32_t count)
+{
+    if (!list->count) {
+        return;
+    }
+
+    struct mcs_node node;
+
+    uint64_t flags = mcs_spin_lock_irqsave(&pmm_lock, &node);
+    while (count-- && list->count) {
+        struct page *page = pcp_pop_tail(list);
+        __buddy_free(pmm_page_to_phys(page), 0);
+    }
+    mcs_spin_unlock_irqrestore(&pmm_lock, &node, flags);
+    cpu->drains++;
+}
+
+static void pcp_refill(struct per_cpu_pages *cpu)
+{
+    struct mcs_node node;
+    uint64_t flags = mcs_spin_lock_irqsave(&pmm_lock, &node);
+    for (int i = 0; i < PCP_BATCH; i++) {
+        phys_addr_t addr = __buddy_alloc(0);
+        if (!addr) {
+            break;
+        }
+        pcp_push(&cpu->cold, pmm_phys_to_page(addr));
+    }
+    mcs_spin_unlock_irqrestore(&pmm_lock, &node, flags);
+    cpu->refills++;
+}
+
+static phys_addr_t pcp_alloc(bool cold)
+{
+    uint64_t flags = arch_irq_save_local();
+    struct per_cpu_pages *cpu = this_cpu_pages();
+
+    struct pcp_list *first = cold ? &cpu->cold : &cpu->hot;
+    struct pcp_list *second = cold ? &cpu->hot : &cpu->cold;
+
+    if (!first->count && !second->count) {
+        pcp_refill(cpu);
+    }
+
+    struct page *page = NULL;
+    if (first->count) {
+        page = pcp_pop(first);
+    } else if (second->count) {
+        page = pcp_pop(second);
+    }
+
+    phys_addr_t addr = 0;
+    if (page) {
+        atomic_set(&page->refcount, 1);
+        addr = pmm_page_to_phys(page);
+        cpu->alloc_hits++;
+    }
+
+    arch_irq_restore_local(flags);
+    return addr;
+}
+
+static void pcp_free(struct page *page, bool cold)
+{
+    uint64_t flags = arch_irq_save_local();
+    struct per_cpu_pages *cpu = this_cpu_pages();
+    struct pcp_list *list = cold ? &cpu->cold : &cpu->hot;
+
     page->flags = PAGE_FLAG_USED;
-    
-    return pmm_page_to_phys(page);
+    atomic_set(&page->refcount, 0);
+    pcp_push(list, page);
+    if (list->count > PCP_HIGH) {
+        pcp_drain(cpu, list, PCP_BATCH);
+    }
+
+    arch_irq_restore_local(flags);
+}
+
+/* Empty every CPU's lists (other CPUs must not be allocating) */
+static void pcp_drain_all(void)
+{
+    uint64_t flags = arch_irq_save_local();
+    for (int i = 0; i < MAX_CPUS; i++) {
+        pcp_drain(&pcp[i], &pcp[i].hot, pcp[i].hot.count);
+        pcp_drain(&pcp[i], &pcp[i].cold, pcp[i].cold.count);
+    }
+    arch_irq_restore_local(flags);
+}
+
+/* ===================================================================== */
+/* Pre-zeroed pages */
+/* ===================================================================== */
+
+/*
+ * Page tables, anonymous faults and GFP_ZERO buffers need cleared pages.
+ * The kzerod thread clears them ahead of time with arch_clear_page(),
+ * running at idle priority ZERO_BATCH pages at a turn, so a caller
+ * normally just pops the pool and only clears a page itself when the
+ * pool has run dry. The pool doubles as a last reserve for ordinary
+ * allocations.
+ */
+
+static phys_addr_t zero_pool_take(void)
+{
+    struct page *page = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&zero_lock);
+    if (zero_pool.count) {
+        page = pcp_pop(&zero_pool);
+    }
+    spin_unlock_irqrestore(&zero_lock, flags);
+
+    return page ? pmm_page_to_phys(page) : 0;
+}
+
+static void zero_pool_put(phys_addr_t addr)
+{
+    uint64_t flags = spin_lock_irqsave(&zero_lock);
+    pcp_push(&zero_pool, pmm_phys_to_page(addr));
+    spin_unlock_irqrestore(&zero_lock, flags);
+}
+
+static inline bool zero_pool_wants_pages(void)
+{
+    return zero_pool.count < ZERO_POOL_HIGH && free_pages_count > ZERO_MIN_FREE;
+}
+
+static void kzerod(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        int cleared = 0;
+        bool starved = false;
+        while (cleared < ZERO_BATCH && zero_pool_wants_pages()) {
+            phys_addr_t addr = pmm_alloc_page_cold();
+            if (!addr) {
+                starved = true;
+                break;
+            }
+            arch_clear_page((void *)addr);
+            zero_pool_put(addr);
+            cleared++;
+        }
+
+        /*
+         * No page to take though free_pages_count says there are (they
+         * sit on other CPUs' lists): retrying at once would spin.
+         */
+        if (starved) {
+            hrtimer_nanosleep(ZERO_BACKOFF_MS * NSEC_PER_MSEC, NULL);
+            continue;
+        }
+
+        /* Full or short of memory: sleep until allocations drain the pool */
+        if (!zero_pool_wants_pages()) {
+            kzerod_task->state = TASK_INTERRUPTIBLE;
+        }
+        schedule();
+    }
+}
+
+phys_addr_t pmm_alloc_page_zeroed(void)
+{
+    phys_addr_t addr = zero_pool_take();
+    if (addr) {
+        __atomic_fetch_add(&zero_hits, 1, __ATOMIC_RELAXED);
+    } else {
+        addr = pcp_alloc(false);
+        if (!addr) {
+            return 0;
+        }
+        arch_clear_page((void *)addr);
+        __atomic_fetch_add(&zero_misses, 1, __ATOMIC_RELAXED);
+    }
+    allocprof_alloc(ALLOCPROF_PAGES, addr, PAGE_SIZE, __builtin_return_address(0));
+
+    if (kzerod_task && zero_pool.count < ZERO_POOL_LOW &&
+        kzerod_task->state != TASK_RUNNING) {
+        wake_up_process(kzerod_task);
+    }
+    return addr;
+}
+
+void pmm_zero_start(void)
+{
+#ifdef ARCH_ARM64
+    kzerod_task = create_task(kzerod, NULL, PF_KTHREAD | PF_IDLEPRIO);
+    if (!kzerod_task) {
+        printk(KERN_ERR "PMM: Failed to start kzerod\n");
+        return;
+    }
+    strncpy(kzerod_task->comm, "kzerod", TASK_COMM_LEN - 1);
+    kzerod_task->nice = NICE_MAX;
+    kzerod_task->prio = kzerod_task->static_prio = PRIO_MAX;
+#else
+    /* No kernel thread switching here - callers clear pages on demand */
+#endif
+}
+
+void pmm_zero_get_stats(uint64_t *hits, uint64_t *misses, size_t *pooled)
+{
+    if (hits) {
+        *hits = __atomic_load_n(&zero_hits, __ATOMIC_RELAXED);
+    }
+    if (misses) {
+        *misses = __atomic_load_n(&zero_misses, __ATOMIC_RELAXED);
+    }
+    if (pooled) {
+        *pooled = zero_pool.count;
+    }
 }
 
 /* ===================================================================== */
@@ -151,64 +833,111 @@ static phys_addr_t buddy_remove_from_list(unsigned int order)
 int pmm_init(void)
 {
     printk("PMM: Starting init\n");
-    
-    /* For now, use hardcoded memory range */
-    /* TODO: Parse device tree or UEFI memory map */
-    
-    memory_start = MEMORY_BASE;
-    memory_end = MEMORY_BASE + MEMORY_SIZE;
-    total_memory = MEMORY_SIZE;
-    total_pages = total_memory / PAGE_SIZE;
-    
-    printk("PMM: Memory configured\n");
-    
-    /* Initialize free lists */
+
+    /* Initialize free areas */
     for (int i = 0; i <= MAX_ORDER; i++) {
-        free_lists[i] = NULL;
-    }
-    
-    printk("PMM: Free lists cleared\n");
-    
-    /* Skip bitmap clearing - BSS should already be zero */
-    printk("PMM: Skipping bitmap clear (BSS pre-zeroed)\n");
-    
-    /* Reserve kernel memory */
+        free_area[i].head = NULL;
+        free_area[i].nr_free = 0;
+    }
+
+    /* Discover RAM */
+    struct dtb_region regions[DTB_MAX_RESERVED];
+    int n = dtb_memory_banks(regions, DTB_MAX_MEMORY);
+    for (int i = 0; i < n; i++) {
+        add_bank(regions[i].base, regions[i].base + regions[i].size);
+    }
+    if (nr_banks == 0) {
+        printk(KERN_WARNING "PMM: No memory in device tree, assuming "
+               "%lu MB at 0x%lx\n", (unsigned long)(MEMORY_SIZE >> 20),
+               (unsigned long)MEMORY_BASE);
+        add_bank(MEMORY_BASE, MEMORY_BASE + MEMORY_SIZE);
+    }
+    sanitize_banks();
+
+    /* Reserve the kernel image, the DTB and firmware-reserved regions */
     extern char __kernel_start[];
     extern char __kernel_end[];
-    
+
     phys_addr_t kernel_start = (phys_addr_t)__kernel_start;
     phys_addr_t kernel_end = (phys_addr_t)__kernel_end;
-    
-    printk("PMM: Got kernel addresses\n");
-    
-    /* Mark kernel pages as used */
-    for (phys_addr_t addr = PAGE_ALIGN_DOWN(kernel_start);
-         addr < PAGE_ALIGN(kernel_end);
-         addr += PAGE_SIZE) {
-        early_mark_used(addr);
-    }
-    
-    printk("PMM: Kernel pages marked\n");
-    
-    /* Count free pages */
+    add_reserved(kernel_start, kernel_end - kernel_start);
+
+    size_t dtb_size;
+    phys_addr_t dtb_addr = dtb_blob(&dtb_size);
+    if (dtb_addr) {
+        add_reserved(dtb_addr, dtb_size);
+    }
+
+    n = dtb_reserved_regions(regions, DTB_MAX_RESERVED);
+    for (int i = 0; i < n; i++) {
+        add_reserved(regions[i].base, regions[i].size);
+    }
+
+    /* Page arrays, bitmaps and section map */
+    for (int i = 0; i < nr_banks; i++) {
+        if (bank_init_pages(&banks[i]) < 0) {
+            return -1;
+        }
+    }
+
+    /* Release everything not reserved to the buddy allocator */
     free_pages_count = 0;
-    for (size_t i = 0; i < total_pages && i < EARLY_BITMAP_SIZE * 8; i++) {
-        if (!(early_bitmap[i / 8] & (1 << (i % 8)))) {
-            free_pages_count++;
+    total_memory = 0;
+    for (int b = nr_banks - 1; b >= 0; b--) {
+        struct mem_bank *bank = &banks[b];
+        phys_addr_t end = bank->end;
+
+        for (int r = nr_reserved - 1; r >= 0 && end > bank->start; r--) {
+            phys_addr_t r_start = MAX(reserved[r].base, bank->start);
+            phys_addr_t r_end = MIN(reserved[r].base + reserved[r].size,
+                                    bank->end);
+            if (r_start >= r_end || r_start >= end) {
+                continue;   /* Outside this bank or already covered */
+            }
+            if (r_end < end) {
+                bank->usable_pages += buddy_free_range(r_end, end);
+            }
+            end = MIN(end, r_start);
+        }
+        if (end > bank->start) {
+            bank->usable_pages += buddy_free_range(bank->start, end);
         }
+
+        free_pages_count += bank->usable_pages;
+        total_memory += bank->end - bank->start;
     }
-    
-    printk("PMM: Init complete\n");
-    
-    /* TODO: Initialize buddy allocator with free pages */
-    /* For now, we stay in early mode using bitmap */
-    
+
+    for (int i = 0; i < nr_banks; i++) {
+        printk(KERN_INFO "PMM: Bank %d: 0x%lx-0x%lx, %lu MB, %lu MB usable\n",
+               i, (unsigned long)banks[i].start, (unsigned long)banks[i].end,
+               (unsigned long)((banks[i].end - banks[i].start) >> 20),
+               (unsigned long)((banks[i].usable_pages * PAGE_SIZE) >> 20));
+    }
+    printk(KERN_INFO "PMM: %lu MB total, %lu MB free\n",
+           (unsigned long)(total_memory >> 20),
+           (unsigned long)((free_pages_count * PAGE_SIZE) >> 20));
+
     return 0;
 }
 
 phys_addr_t pmm_alloc_page(void)
 {
-    return pmm_alloc_pages(0);
+    phys_addr_t addr = pcp_alloc(false);
+    if (!addr) {
+        addr = zero_pool_take();
+    }
+    allocprof_alloc(ALLOCPROF_PAGES, addr, PAGE_SIZE, __builtin_return_address(0));
+    return addr;
+}
+
+phys_addr_t pmm_alloc_page_cold(void)
+{
+    phys_addr_t addr = pcp_alloc(true);
+    if (!addr) {
+        addr = zero_pool_take();
+    }
+    allocprof_alloc(ALLOCPROF_PAGES, addr, PAGE_SIZE, __builtin_return_address(0));
+    return addr;
 }
 
 phys_addr_t pmm_alloc_pages(unsigned int order)
@@ -216,52 +945,20 @@ phys_addr_t pmm_alloc_pages(unsigned int order)
     if (order > MAX_ORDER) {
         return 0;
     }
-    
-    if (early_mode) {
-        /* Allocate contiguous pages in early mode */
-        size_t count = order_to_pages(order);
-        phys_addr_t start = 0;
-        size_t found = 0;
-        
-        for (phys_addr_t addr = memory_start;
-             addr < memory_end;
-             addr += PAGE_SIZE) {
-            if (early_is_free(addr)) {
-                if (found == 0) {
-                    start = addr;
-                }
-                found++;
-                if (found == count) {
-                    /* Mark all as used */
-                    for (size_t i = 0; i < count; i++) {
-                        early_mark_used(start + i * PAGE_SIZE);
-                    }
-                    free_pages_count -= count;
-                    return start;
-                }
-            } else {
-                found = 0;
-            }
-        }
-        return 0;
-    }
-    
-    /* Buddy allocator */
-    for (unsigned int o = order; o <= MAX_ORDER; o++) {
-        phys_addr_t addr = buddy_remove_from_list(o);
-        if (addr) {
-            /* Split larger blocks if needed */
-            while (o > order) {
-                o--;
-                phys_addr_t buddy = buddy_address(addr, o);
-                buddy_add_to_list(buddy, o);
-            }
-            free_pages_count -= order_to_pages(order);
-            return addr;
-        }
+
+    phys_addr_t addr;
+    if (order == 0) {
+        addr = pcp_alloc(false);
+    } else {
+        struct mcs_node node;
+        uint64_t flags = mcs_spin_lock_irqsave(&pmm_lock, &node);
+        addr = __buddy_alloc(order);
+        mcs_spin_unlock_irqrestore(&pmm_lock, &node, flags);
     }
-    
-    return 0;
+
+    allocprof_alloc(ALLOCPROF_PAGES, addr, order_to_size(order),
+                    __builtin_return_address(0));
+    return addr;
 }
 
 void pmm_free_page(phys_addr_t addr)
@@ -269,49 +966,73 @@ void pmm_free_page(phys_addr_t addr)
     pmm_free_pages(addr, 0);
 }
 
+void pmm_free_page_cold(phys_addr_t addr)
+{
+    struct page *page = pmm_phys_to_page(addr);
+    if (!page || (page->flags & PAGE_FLAG_BUDDY)) {
+        printk(KERN_ERR "PMM: Bad free of 0x%lx\n", (unsigned long)addr);
+        return;
+    }
+    allocprof_free(ALLOCPROF_PAGES, addr);
+    pcp_free(page, true);
+}
+
 void pmm_free_pages(phys_addr_t addr, unsigned int order)
 {
     if (!addr || order > MAX_ORDER) {
         return;
     }
-    
-    if (early_mode) {
-        size_t count = order_to_pages(order);
-        for (size_t i = 0; i < count; i++) {
-            early_mark_free(addr + i * PAGE_SIZE);
-        }
-        free_pages_count += count;
+
+    struct page *page = pmm_phys_to_page(addr);
+    if (!page || (page->flags & PAGE_FLAG_BUDDY)) {
+        printk(KERN_ERR "PMM: Bad free of 0x%lx (order %u)\n",
+               (unsigned long)addr, order);
         return;
     }
-    
-    /* Buddy allocator - coalesce with buddy if possible */
-    while (order < MAX_ORDER) {
-        phys_addr_t buddy = buddy_address(addr, order);
-        struct page *buddy_page = pmm_phys_to_page(buddy);
-        
-        /* Check if buddy is free and same order */
-        if (buddy_page && buddy_page->flags == PAGE_FLAG_FREE &&
-            buddy_page->order == order) {
-            /* Remove buddy from free list */
-            /* ... */
-            
-            /* Merge with buddy */
-            if (buddy < addr) {
-                addr = buddy;
-            }
-            order++;
-        } else {
-            break;
+    allocprof_free(ALLOCPROF_PAGES, addr);
+
+    if (order == 0) {
+        pcp_free(page, false);
+        return;
+    }
+
+    atomic_set(&page->refcount, 0);
+
+    struct mcs_node node;
+
+    uint64_t flags = mcs_spin_lock_irqsave(&pmm_lock, &node);
+    __buddy_free(addr, order);
+    mcs_spin_unlock_irqrestore(&pmm_lock, &node, flags);
+}
+
+void pmm_reserve_range(phys_addr_t start, size_t size)
+{
+    phys_addr_t addr = PAGE_ALIGN_DOWN(start);
+    phys_addr_t end = PAGE_ALIGN(start + size);
+
+    /* Pages parked on per-CPU lists are invisible to the buddy lists */
+    pcp_drain_all();
+
+    struct mcs_node node;
+
+    uint64_t flags = mcs_spin_lock_irqsave(&pmm_lock, &node);
+    while (addr < end) {
+        if (!pmm_phys_to_page(addr)) {
+            addr += PAGE_SIZE;
+            continue;
         }
+        addr = buddy_reserve(addr, end);
     }
-    
-    buddy_add_to_list(addr, order);
-    free_pages_count += order_to_pages(order);
+    mcs_spin_unlock_irqrestore(&pmm_lock, &node, flags);
 }
 
 size_t pmm_get_free_memory(void)
 {
-    return free_pages_count * PAGE_SIZE;
+    size_t pages = free_pages_count + zero_pool.count;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        pages += pcp[i].hot.count + pcp[i].cold.count;
+    }
+    return pages * PAGE_SIZE;
 }
 
 size_t pmm_get_total_memory(void)
@@ -319,20 +1040,197 @@ size_t pmm_get_total_memory(void)
     return total_memory;
 }
 
+size_t pmm_get_free_blocks(unsigned int order)
+{
+    return order <= MAX_ORDER ? free_area[order].nr_free : 0;
+}
+
+int pmm_get_bank(unsigned int index, phys_addr_t *start, size_t *size)
+{
+    if (index >= (unsigned int)nr_banks) {
+        return -1;
+    }
+    if (start) {
+        *start = banks[index].start;
+    }
+    if (size) {
+        *size = banks[index].end - banks[index].start;
+    }
+    return 0;
+}
+
+void pmm_page_get(phys_addr_t addr)
+{
+    struct page *page = pmm_phys_to_page(addr);
+    if (page) {
+        atomic_inc(&page->refcount);
+    }
+}
+
+void pmm_page_put(phys_addr_t addr)
+{
+    struct page *page = pmm_phys_to_page(addr);
+    if (!page) {
+        return;     /* Not RAM we manage (e.g. a device page) */
+    }
+
+    /* Reserved pages were never handed out with a reference */
+    if (atomic_read(&page->refcount) <= 0) {
+        return;
+    }
+    if (atomic_dec_and_test(&page->refcount)) {
+        pmm_free_page(addr);
+    }
+}
+
+int pmm_page_refcount(phys_addr_t addr)
+{
+    struct page *page = pmm_phys_to_page(addr);
+    return page ? atomic_read(&page->refcount) : 0;
+}
+
 phys_addr_t pmm_page_to_phys(struct page *page)
 {
-    if (!page_array || !page) {
+    if (!page) {
         return 0;
     }
-    size_t index = page - page_array;
-    return memory_start + index * PAGE_SIZE;
+    for (int i = 0; i < nr_banks; i++) {
+        struct mem_bank *bank = &banks[i];
+        if (page >= bank->pages && page < bank->pages + bank->nr_pages) {
+            return bank->start + (size_t)(page - bank->pages) * PAGE_SIZE;
+        }
+    }
+    return 0;
 }
 
 struct page *pmm_phys_to_page(phys_addr_t addr)
 {
-    if (!page_array || addr < memory_start || addr >= memory_end) {
+    size_t pfn = PHYS_TO_PFN(addr);
+    size_t sec = pfn >> PFN_SECTION_SHIFT;
+    if (sec >= NR_MEM_SECTIONS) {
         return NULL;
     }
-    size_t index = PHYS_TO_PFN(addr - memory_start);
-    return &page_array[index];
+
+    struct mem_section *ms = &mem_sections[sec];
+    size_t idx = pfn & (PAGES_PER_SECTION - 1);
+    if (!ms->map || idx < ms->first || idx >= ms->first + ms->count) {
+        return NULL;
+    }
+    return ms->map + (idx - ms->first);
+}
+
+/* ===================================================================== */
+/* Benchmark */
+/* ===================================================================== */
+
+#define BENCH_BLOCKS        64
+#define BENCH_TARGET_PAGES  16384   /* Pages moved per order */
+
+int pmm_bench(char *buf, size_t size)
+{
+    static phys_addr_t blocks[BENCH_BLOCKS];
+    int len = 0;
+
+    REPORT_OUT("PMM bench: %lu MB free\n",
+               (unsigned long)(pmm_get_free_memory() >> 20));
+    REPORT_OUT("order    size   blocks  ns/alloc   ns/free   Kops/s\n");
+
+    for (unsigned int order = 0; order <= MAX_ORDER; order++) {
+        /* Never take more than half of what is free */
+        size_t avail = (free_pages_count / 2) >> order;
+        size_t count = MIN((size_t)BENCH_BLOCKS, avail);
+        if (count == 0) {
+            REPORT_OUT("%5u  skipped (not enough free memory)\n", order);
+            continue;
+        }
+        size_t rounds = MAX(BENCH_TARGET_PAGES / (count << order), 1UL);
+
+        uint64_t alloc_ticks = 0, free_ticks = 0, ops = 0;
+        for (size_t r = 0; r < rounds; r++) {
+            size_t got = 0;
+
+            uint64_t t0 = arch_timer_get_ticks();
+            while (got < count) {
+                blocks[got] = pmm_alloc_pages(order);
+                if (!blocks[got]) {
+                    break;
+                }
+                got++;
+            }
+            uint64_t t1 = arch_timer_get_ticks();
+            for (size_t i = 0; i < got; i++) {
+                pmm_free_pages(blocks[i], order);
+            }
+            uint64_t t2 = arch_timer_get_ticks();
+
+            alloc_ticks += t1 - t0;
+            free_ticks += t2 - t1;
+            ops += got;
+        }
+        if (ops == 0) {
+            REPORT_OUT("%5u  allocation failed\n", order);
+            continue;
+        }
+
+        uint64_t alloc_ns = ticks_to_ns(alloc_ticks) / ops;
+        uint64_t free_ns = ticks_to_ns(free_ticks) / ops;
+        uint64_t pair_ns = alloc_ns + free_ns;
+        REPORT_OUT("%5u %6luK %8lu %9llu %9llu %8llu\n", order,
+                   (unsigned long)(order_to_size(order) >> 10),
+                   (unsigned long)ops,
+                   (unsigned long long)alloc_ns,
+                   (unsigned long long)free_ns,
+                   (unsigned long long)(pair_ns ? 1000000ULL / pair_ns : 0));
+    }
+
+    uint64_t hits = 0, refills = 0, drains = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        hits += pcp[i].alloc_hits;
+        refills += pcp[i].refills;
+        drains += pcp[i].drains;
+    }
+    REPORT_OUT("per-cpu lists: %llu allocs, %llu refills, %llu drains\n",
+               (unsigned long long)hits, (unsigned long long)refills,
+               (unsigned long long)drains);
+
+    /* What a caller pays per zeroed page: clearing inline vs the pool */
+    size_t n = 0;
+    while (n < BENCH_BLOCKS && (blocks[n] = pmm_alloc_page())) {
+        n++;
+    }
+    uint64_t t0 = arch_timer_get_ticks();
+    for (size_t i = 0; i < n; i++) {
+        memset((void *)blocks[i], 0, PAGE_SIZE);
+    }
+    uint64_t t1 = arch_timer_get_ticks();
+    for (size_t i = 0; i < n; i++) {
+        arch_clear_page((void *)blocks[i]);
+    }
+    uint64_t t2 = arch_timer_get_ticks();
+    for (size_t i = 0; i < n; i++) {
+        pmm_free_page(blocks[i]);
+    }
+
+    uint64_t pool_hits = __atomic_load_n(&zero_hits, __ATOMIC_RELAXED);
+    size_t z = 0;
+    uint64_t t3 = arch_timer_get_ticks();
+    while (z < BENCH_BLOCKS && (blocks[z] = pmm_alloc_page_zeroed())) {
+        z++;
+    }
+    uint64_t t4 = arch_timer_get_ticks();
+    pool_hits = __atomic_load_n(&zero_hits, __ATOMIC_RELAXED) - pool_hits;
+    for (size_t i = 0; i < z; i++) {
+        pmm_free_page(blocks[i]);
+    }
+
+    if (n && z) {
+        REPORT_OUT("zeroed page: memset %llu ns, clear_page %llu ns, "
+                   "alloc_zeroed %llu ns (%lu/%lu pooled)\n",
+                   (unsigned long long)(ticks_to_ns(t1 - t0) / n),
+                   (unsigned long long)(ticks_to_ns(t2 - t1) / n),
+                   (unsigned long long)(ticks_to_ns(t4 - t3) / z),
+                   (unsigned long)pool_hits, (unsigned long)z);
+    }
+
+    return len;
 }
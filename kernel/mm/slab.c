@@ -0,0 +1,736 @@
+/*
+ * UnixOS Kernel - Slab Allocator Implementation
+ *
+ * Fixed-size object caches backed by naturally aligned PMM blocks.
+ * Every slab is SLAB_SIZE bytes with its descriptor at the start, so the
+ * owning slab of any object is found by masking the object address.
+ * Allocation and free are O(1): slabs with free objects sit on a partial
+ * list and each slab keeps a singly linked list of its free objects.
+ *
+ * The slab layer is fronted by per-CPU magazines. kmem_cache_alloc/free
+ * first try the local CPU's loaded and previous magazines under that
+ * CPU's own lock, which only a flush from another CPU ever contends;
+ * when both are exhausted a magazine is exchanged
+ * with the cache's depot under the depot lock, and only when the depot
+ * cannot help does the request fall through to the locked slab layer.
+ */
+
+#include "mm/slab.h"
+#include "mm/kmalloc.h"
+#include "mm/pmm.h"
+#include "printk.h"
+#include "string.h"
+
+/* ===================================================================== */
+/* Static data */
+/* ===================================================================== */
+
+/* Cache of kmem_cache descriptors (bootstrapped statically) */
+static struct kmem_cache cache_cache;
+
+/* All caches, for slabinfo */
+static struct kmem_cache *cache_chain;
+static DEFINE_SPINLOCK(cache_chain_lock);
+
+/* kmalloc size classes: 32, 64, ..., 2048 */
+static struct kmem_cache *kmalloc_caches[KMALLOC_NR_CACHES];
+
+/* Backing cache for magazines themselves */
+static struct kmem_cache *magazine_cache;
+
+static bool slab_ready = false;
+
+/* ===================================================================== */
+/* Helper functions */
+/* ===================================================================== */
+
+static inline struct slab *obj_to_slab(const void *obj)
+{
+    return (struct slab *)ALIGN_DOWN((uintptr_t)obj, SLAB_SIZE);
+}
+
+static void slab_list_add(struct slab **head, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void slab_list_del(struct slab **head, struct slab *slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = slab->prev = NULL;
+}
+
+static void copy_name(char *dst, const char *src)
+{
+    int i = 0;
+    if (src) {
+        while (src[i] && i < SLAB_NAME_LEN - 1) {
+            dst[i] = src[i];
+            i++;
+        }
+    }
+    dst[i] = '\0';
+}
+
+static int cache_setup(struct kmem_cache *cache, const char *name,
+                       size_t size, size_t align, uint32_t flags)
+{
+    if (align == 0) {
+        align = sizeof(void *);
+    }
+    if (flags & SLAB_HWCACHE_ALIGN) {
+        align = MAX(align, SLAB_CACHE_LINE);
+    }
+    if (align & (align - 1)) {
+        return -1;      /* Alignment must be a power of two */
+    }
+
+    copy_name(cache->name, name);
+    cache->object_size = size;
+    cache->size = ALIGN(MAX(size, sizeof(void *)), align);
+    cache->align = align;
+    cache->offset = ALIGN(sizeof(struct slab), align);
+    cache->flags = flags;
+
+    if (cache->offset + cache->size > SLAB_SIZE) {
+        return -1;      /* Object does not fit in a slab */
+    }
+    cache->objs_per_slab = (SLAB_SIZE - cache->offset) / cache->size;
+
+    spin_lock_init(&cache->lock);
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->nr_empty = 0;
+    cache->nr_slabs = 0;
+    cache->active_objs = 0;
+    cache->allocs = 0;
+    cache->frees = 0;
+
+    spin_lock_init(&cache->depot_lock);
+    cache->depot_full = NULL;
+    cache->depot_empty = NULL;
+    cache->depot_nr_full = 0;
+    cache->depot_nr_empty = 0;
+    cache->depot_refills = 0;
+    cache->depot_flushes = 0;
+    memset(cache->cpu, 0, sizeof(cache->cpu));
+    for (int i = 0; i < MAX_CPUS; i++) {
+        spin_lock_init(&cache->cpu[i].lock);
+    }
+
+    return 0;
+}
+
+static void cache_link(struct kmem_cache *cache)
+{
+    uint64_t flags = spin_lock_irqsave(&cache_chain_lock);
+    cache->next = cache_chain;
+    cache_chain = cache;
+    spin_unlock_irqrestore(&cache_chain_lock, flags);
+}
+
+static void cache_unlink(struct kmem_cache *cache)
+{
+    uint64_t flags = spin_lock_irqsave(&cache_chain_lock);
+    struct kmem_cache **pp = &cache_chain;
+    while (*pp) {
+        if (*pp == cache) {
+            *pp = cache->next;
+            break;
+        }
+        pp = &(*pp)->next;
+    }
+    spin_unlock_irqrestore(&cache_chain_lock, flags);
+}
+
+/* Allocate a new slab from the PMM (cache lock held) */
+static struct slab *slab_grow(struct kmem_cache *cache)
+{
+    phys_addr_t paddr = pmm_alloc_pages(SLAB_ORDER);
+    if (!paddr) {
+        return NULL;
+    }
+
+    /* Identity mapped, and PMM blocks are naturally aligned */
+    struct slab *slab = (struct slab *)paddr;
+    slab->magic = SLAB_MAGIC;
+    slab->inuse = 0;
+    slab->cache = cache;
+    slab->next = slab->prev = NULL;
+    slab->freelist = NULL;
+
+    /* Thread objects onto the free list, lowest address first */
+    uint8_t *base = (uint8_t *)slab + cache->offset;
+    for (int i = (int)cache->objs_per_slab - 1; i >= 0; i--) {
+        void *obj = base + (size_t)i * cache->size;
+        *(void **)obj = slab->freelist;
+        slab->freelist = obj;
+    }
+
+    cache->nr_slabs++;
+    return slab;
+}
+
+/* Return a slab's pages to the PMM (cache lock held) */
+static void slab_release(struct kmem_cache *cache, struct slab *slab)
+{
+    slab->magic = 0;
+    cache->nr_slabs--;
+    pmm_free_pages((phys_addr_t)slab, SLAB_ORDER);
+}
+
+/* ===================================================================== */
+/* Slab layer */
+/* ===================================================================== */
+
+static void *slab_alloc_obj(struct kmem_cache *cache)
+{
+    uint64_t irqflags = spin_lock_irqsave(&cache->lock);
+
+    struct slab *slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_del(&cache->empty, slab);
+            cache->nr_empty--;
+        } else {
+            slab = slab_grow(cache);
+            if (!slab) {
+                spin_unlock_irqrestore(&cache->lock, irqflags);
+                return NULL;
+            }
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+
+    void *obj = slab->freelist;
+    slab->freelist = *(void **)obj;
+    slab->inuse++;
+
+    if (!slab->freelist) {
+        slab_list_del(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    cache->active_objs++;
+    cache->allocs++;
+
+    spin_unlock_irqrestore(&cache->lock, irqflags);
+    return obj;
+}
+
+static void slab_free_obj(struct kmem_cache *cache, void *obj)
+{
+    struct slab *slab = obj_to_slab(obj);
+
+    uint64_t irqflags = spin_lock_irqsave(&cache->lock);
+
+    bool was_full = (slab->freelist == NULL);
+
+    *(void **)obj = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+
+    cache->active_objs--;
+    cache->frees++;
+
+    if (slab->inuse == 0) {
+        slab_list_del(was_full ? &cache->full : &cache->partial, slab);
+        if (cache->nr_empty < SLAB_MAX_EMPTY) {
+            slab_list_add(&cache->empty, slab);
+            cache->nr_empty++;
+        } else {
+            slab_release(cache, slab);
+        }
+    } else if (was_full) {
+        slab_list_del(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    spin_unlock_irqrestore(&cache->lock, irqflags);
+}
+
+/* ===================================================================== */
+/* Magazine layer */
+/* ===================================================================== */
+
+static inline bool cache_has_magazines(struct kmem_cache *cache)
+{
+    return magazine_cache && !(cache->flags & SLAB_NO_MAGAZINE);
+}
+
+/* Local CPU's magazines (local interrupts disabled, so no migration) */
+static inline struct kmem_cpu_cache *cpu_cache(struct kmem_cache *cache)
+{
+    uint32_t cpu = arch_cpu_id();
+    if (cpu >= MAX_CPUS) {
+        cpu = 0;
+    }
+    return &cache->cpu[cpu];
+}
+
+static struct kmem_magazine *magazine_new(void)
+{
+    struct kmem_magazine *mag = slab_alloc_obj(magazine_cache);
+    if (mag) {
+        mag->next = NULL;
+        mag->rounds = 0;
+    }
+    return mag;
+}
+
+/* Return every round in @mag to the slab layer */
+static void magazine_drain(struct kmem_cache *cache, struct kmem_magazine *mag)
+{
+    while (mag->rounds) {
+        slab_free_obj(cache, mag->objs[--mag->rounds]);
+    }
+}
+
+/* Park an empty magazine in the depot, or free it if the depot is full */
+static void magazine_put_empty(struct kmem_cache *cache,
+                               struct kmem_magazine *mag)
+{
+    spin_lock(&cache->depot_lock);
+    if (cache->depot_nr_empty < DEPOT_MAX_EMPTY) {
+        mag->next = cache->depot_empty;
+        cache->depot_empty = mag;
+        cache->depot_nr_empty++;
+        mag = NULL;
+    }
+    spin_unlock(&cache->depot_lock);
+
+    if (mag) {
+        slab_free_obj(magazine_cache, mag);
+    }
+}
+
+/* Called with cc->lock held */
+static void *magazine_alloc(struct kmem_cache *cache,
+                            struct kmem_cpu_cache *cc)
+{
+    for (;;) {
+        if (cc->loaded && cc->loaded->rounds) {
+            cc->alloc_hits++;
+            return cc->loaded->objs[--cc->loaded->rounds];
+        }
+
+        if (cc->previous && cc->previous->rounds) {
+            struct kmem_magazine *tmp = cc->loaded;
+            cc->loaded = cc->previous;
+            cc->previous = tmp;
+            continue;
+        }
+
+        /* Both magazines empty: trade for a full one from the depot */
+        spin_lock(&cache->depot_lock);
+        struct kmem_magazine *full = cache->depot_full;
+        if (full) {
+            cache->depot_full = full->next;
+            cache->depot_nr_full--;
+            cache->depot_refills++;
+        }
+        spin_unlock(&cache->depot_lock);
+
+        if (!full) {
+            cc->alloc_misses++;
+            return NULL;
+        }
+
+        if (cc->previous) {
+            magazine_put_empty(cache, cc->previous);
+        }
+        cc->previous = cc->loaded;
+        cc->loaded = full;
+    }
+}
+
+/* Called with cc->lock held */
+static bool magazine_free(struct kmem_cache *cache, struct kmem_cpu_cache *cc,
+                          void *obj)
+{
+    for (;;) {
+        if (cc->loaded && cc->loaded->rounds < MAGAZINE_SIZE) {
+            cc->loaded->objs[cc->loaded->rounds++] = obj;
+            cc->free_hits++;
+            return true;
+        }
+
+        if (cc->previous && cc->previous->rounds < MAGAZINE_SIZE) {
+            struct kmem_magazine *tmp = cc->loaded;
+            cc->loaded = cc->previous;
+            cc->previous = tmp;
+            continue;
+        }
+
+        /* Both magazines full (or absent): get an empty one */
+        spin_lock(&cache->depot_lock);
+        struct kmem_magazine *empty = cache->depot_empty;
+        if (empty) {
+            cache->depot_empty = empty->next;
+            cache->depot_nr_empty--;
+        }
+        spin_unlock(&cache->depot_lock);
+
+        if (!empty) {
+            empty = magazine_new();
+            if (!empty) {
+                cc->free_misses++;
+                return false;
+            }
+        }
+
+        /* Hand the full previous magazine to the depot */
+        struct kmem_magazine *full = cc->previous;
+        if (full) {
+            spin_lock(&cache->depot_lock);
+            if (cache->depot_nr_full < DEPOT_MAX_FULL) {
+                full->next = cache->depot_full;
+                cache->depot_full = full;
+                cache->depot_nr_full++;
+                cache->depot_flushes++;
+                full = NULL;
+            }
+            spin_unlock(&cache->depot_lock);
+
+            /* Depot saturated: the objects go back to their slabs */
+            if (full) {
+                magazine_drain(cache, full);
+                magazine_put_empty(cache, full);
+            }
+        }
+
+        cc->previous = cc->loaded;
+        cc->loaded = empty;
+    }
+}
+
+/*
+ * Flush all magazines of @cache back to the slab layer. Each CPU's pair
+ * is taken under its lock, so that CPU is not using it meanwhile.
+ */
+static void magazine_flush_all(struct kmem_cache *cache)
+{
+    if (!cache_has_magazines(cache)) {
+        return;
+    }
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        struct kmem_cpu_cache *cc = &cache->cpu[i];
+
+        uint64_t irqflags = spin_lock_irqsave(&cc->lock);
+        struct kmem_magazine *mags[2] = { cc->loaded, cc->previous };
+        cc->loaded = cc->previous = NULL;
+        spin_unlock_irqrestore(&cc->lock, irqflags);
+
+        for (int j = 0; j < 2; j++) {
+            if (mags[j]) {
+                magazine_drain(cache, mags[j]);
+                slab_free_obj(magazine_cache, mags[j]);
+            }
+        }
+    }
+
+    uint64_t irqflags = spin_lock_irqsave(&cache->depot_lock);
+    struct kmem_magazine *full = cache->depot_full;
+    struct kmem_magazine *empty = cache->depot_empty;
+    cache->depot_full = cache->depot_empty = NULL;
+    cache->depot_nr_full = cache->depot_nr_empty = 0;
+    spin_unlock_irqrestore(&cache->depot_lock, irqflags);
+
+    while (full) {
+        struct kmem_magazine *next = full->next;
+        magazine_drain(cache, full);
+        slab_free_obj(magazine_cache, full);
+        full = next;
+    }
+    while (empty) {
+        struct kmem_magazine *next = empty->next;
+        slab_free_obj(magazine_cache, empty);
+        empty = next;
+    }
+}
+
+/* ===================================================================== */
+/* Cache management */
+/* ===================================================================== */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, uint32_t flags)
+{
+    if (size == 0) {
+        return NULL;
+    }
+
+    struct kmem_cache *cache = kmem_cache_alloc(&cache_cache, GFP_ZERO);
+    if (!cache) {
+        goto fail;
+    }
+
+    if (cache_setup(cache, name, size, align, flags) < 0) {
+        kmem_cache_free(&cache_cache, cache);
+        cache = NULL;
+        goto fail;
+    }
+
+    cache_link(cache);
+    return cache;
+
+fail:
+    printk(KERN_ERR "SLAB: Failed to create cache '%s' (size %lu)\n",
+           name ? name : "?", (unsigned long)size);
+    if (flags & SLAB_PANIC) {
+        panic("SLAB: cache creation failed");
+    }
+    return NULL;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+    if (!cache || cache == &cache_cache || cache == magazine_cache) {
+        return;
+    }
+
+    magazine_flush_all(cache);
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    if (cache->active_objs) {
+        spin_unlock_irqrestore(&cache->lock, flags);
+        printk(KERN_ERR "SLAB: Destroying cache '%s' with %lu live objects\n",
+               cache->name, (unsigned long)cache->active_objs);
+        return;
+    }
+
+    while (cache->empty) {
+        struct slab *slab = cache->empty;
+        slab_list_del(&cache->empty, slab);
+        slab_release(cache, slab);
+    }
+    cache->nr_empty = 0;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    cache_unlink(cache);
+    kmem_cache_free(&cache_cache, cache);
+}
+
+void kmem_cache_shrink(struct kmem_cache *cache)
+{
+    if (!cache) {
+        return;
+    }
+
+    magazine_flush_all(cache);
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    while (cache->empty) {
+        struct slab *slab = cache->empty;
+        slab_list_del(&cache->empty, slab);
+        slab_release(cache, slab);
+    }
+    cache->nr_empty = 0;
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/* ===================================================================== */
+/* Object allocation */
+/* ===================================================================== */
+
+void *kmem_cache_alloc(struct kmem_cache *cache, uint32_t flags)
+{
+    if (!cache) {
+        return NULL;
+    }
+
+    void *obj = NULL;
+    if (cache_has_magazines(cache)) {
+        uint64_t irqflags = arch_irq_save_local();
+        struct kmem_cpu_cache *cc = cpu_cache(cache);
+        spin_lock(&cc->lock);
+        obj = magazine_alloc(cache, cc);
+        spin_unlock(&cc->lock);
+        arch_irq_restore_local(irqflags);
+    }
+    if (!obj) {
+        obj = slab_alloc_obj(cache);
+        if (!obj) {
+            return NULL;
+        }
+    }
+
+    if (flags & GFP_ZERO) {
+        memset(obj, 0, cache->object_size);
+    }
+
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    if (!cache || !obj) {
+        return;
+    }
+
+    struct slab *slab = obj_to_slab(obj);
+    if (slab->magic != SLAB_MAGIC || slab->cache != cache) {
+        printk(KERN_ERR "SLAB: Bad free of %p to cache '%s'\n", obj,
+               cache->name);
+        return;
+    }
+
+    if (cache_has_magazines(cache)) {
+        uint64_t irqflags = arch_irq_save_local();
+        struct kmem_cpu_cache *cc = cpu_cache(cache);
+        spin_lock(&cc->lock);
+        bool cached = magazine_free(cache, cc, obj);
+        spin_unlock(&cc->lock);
+        arch_irq_restore_local(irqflags);
+        if (cached) {
+            return;
+        }
+    }
+
+    slab_free_obj(cache, obj);
+}
+
+/* ===================================================================== */
+/* kmalloc size classes */
+/* ===================================================================== */
+
+struct kmem_cache *kmalloc_slab(size_t size)
+{
+    if (!slab_ready || size == 0 || size > KMALLOC_MAX_CACHE_SIZE) {
+        return NULL;
+    }
+    if (size <= KMALLOC_MIN_SIZE) {
+        return kmalloc_caches[0];
+    }
+
+    /* Round up to the next power of two */
+    unsigned int shift = 64 - __builtin_clzl(size - 1);
+    return kmalloc_caches[shift - KMALLOC_MIN_SHIFT];
+}
+
+struct kmem_cache *kmem_cache_of(const void *obj)
+{
+    if (!obj) {
+        return NULL;
+    }
+
+    struct slab *slab = obj_to_slab(obj);
+    if (slab->magic != SLAB_MAGIC) {
+        return NULL;
+    }
+    return slab->cache;
+}
+
+void kmem_cache_init(void)
+{
+    if (slab_ready) {
+        return;
+    }
+
+    cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0,
+                SLAB_HWCACHE_ALIGN | SLAB_NO_MAGAZINE);
+    cache_link(&cache_cache);
+
+    magazine_cache = kmem_cache_create("kmem_magazine",
+                                       sizeof(struct kmem_magazine), 0,
+                                       SLAB_NO_MAGAZINE | SLAB_PANIC);
+
+    for (int i = 0; i < KMALLOC_NR_CACHES; i++) {
+        size_t size = 1UL << (KMALLOC_MIN_SHIFT + i);
+        char name[SLAB_NAME_LEN];
+        snprintf(name, sizeof(name), "kmalloc-%lu", (unsigned long)size);
+
+        /* Power-of-two classes are naturally aligned up to a cache line */
+        kmalloc_caches[i] = kmem_cache_create(name, size,
+                                              MIN(size, SLAB_CACHE_LINE),
+                                              SLAB_PANIC);
+    }
+
+    slab_ready = true;
+
+    printk(KERN_INFO "SLAB: %d kmalloc size classes (%lu-%lu bytes), "
+           "%lu KB slabs, %d-object magazines\n", KMALLOC_NR_CACHES,
+           (unsigned long)KMALLOC_MIN_SIZE,
+           (unsigned long)KMALLOC_MAX_CACHE_SIZE,
+           (unsigned long)(SLAB_SIZE / 1024), MAGAZINE_SIZE);
+}
+
+/* ===================================================================== */
+/* Statistics */
+/* ===================================================================== */
+
+static int format_cache(char *buf, size_t size, struct kmem_cache *cache)
+{
+    /* Sum per-CPU counters; a slightly stale view is fine for reporting */
+    uint64_t hits = 0, requests = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        struct kmem_cpu_cache *cc = &cache->cpu[i];
+        hits += cc->alloc_hits + cc->free_hits;
+        requests += cc->alloc_hits + cc->alloc_misses +
+                    cc->free_hits + cc->free_misses;
+    }
+    unsigned long permille = requests ? (unsigned long)(hits * 1000 / requests) : 0;
+
+    return snprintf(buf, size, "%-20s %8lu %8lu %6lu %5u %4lu : %6lu %10llu %10llu : %3lu.%lu%% %8llu %8llu\n",
+                    cache->name, (unsigned long)cache->active_objs,
+                    (unsigned long)(cache->nr_slabs * cache->objs_per_slab),
+                    (unsigned long)cache->size, cache->objs_per_slab,
+                    (unsigned long)(SLAB_SIZE / PAGE_SIZE),
+                    (unsigned long)cache->nr_slabs,
+                    (unsigned long long)cache->allocs,
+                    (unsigned long long)cache->frees,
+                    permille / 10, permille % 10,
+                    (unsigned long long)cache->depot_refills,
+                    (unsigned long long)cache->depot_flushes);
+}
+
+/* allocs/frees count slab-layer traffic; hit% is the magazine hit rate */
+static const char slabinfo_header[] =
+    "# name                 active    total objsz  /slb pgs :  slabs     allocs      frees :   hit%  refills  flushes\n";
+
+int kmem_cache_info(char *buf, size_t size)
+{
+    if (!buf || size == 0) {
+        return 0;
+    }
+
+    int len = snprintf(buf, size, "%s", slabinfo_header);
+
+    uint64_t flags = spin_lock_irqsave(&cache_chain_lock);
+    for (struct kmem_cache *c = cache_chain; c && (size_t)len < size - 1;
+         c = c->next) {
+        len += format_cache(buf + len, size - len, c);
+    }
+    spin_unlock_irqrestore(&cache_chain_lock, flags);
+
+    return len;
+}
+
+void kmem_cache_dump(void)
+{
+    char line[160];
+
+    printk(KERN_INFO "%s", slabinfo_header);
+
+    uint64_t flags = spin_lock_irqsave(&cache_chain_lock);
+    for (struct kmem_cache *c = cache_chain; c; c = c->next) {
+        format_cache(line, sizeof(line), c);
+        printk(KERN_INFO "%s", line);
+    }
+    spin_unlock_irqrestore(&cache_chain_lock, flags);
+}
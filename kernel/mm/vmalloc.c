@@ -0,0 +1,282 @@
+/*
+ * UnixOS Kernel - vmalloc Implementation
+ *
+ * Each allocation reserves a range of the vmalloc window (plus an
+ * unmapped guard page), then backs it with the largest physically
+ * contiguous PMM blocks available, mapping each run with vmm_map_range.
+ * Large areas are aligned so those runs can become 2MB block or 64KB
+ * contiguous mappings.
+ * Live areas are kept on an address-sorted list; the window is large
+ * and allocations are few, so first-fit over the list is sufficient.
+ */
+
+#include "mm/vmalloc.h"
+#include "arch/arch.h"
+#include "mm/kmalloc.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
+#include "printk.h"
+#include "string.h"
+#include "sync/spinlock.h"
+
+/* ===================================================================== */
+/* Configuration */
+/* ===================================================================== */
+
+/* Largest physically contiguous run to try per mapping (2MB, one block) */
+#define VMALLOC_MAX_CHUNK_ORDER 9
+
+/* Unmapped page after each area to catch overruns */
+#define VMALLOC_GUARD_SIZE      PAGE_SIZE
+
+/* ===================================================================== */
+/* Types and static data */
+/* ===================================================================== */
+
+struct vm_struct {
+    virt_addr_t addr;
+    size_t size;                /* Mapped size, excluding the guard page */
+    struct vm_struct *next;     /* Address-sorted list */
+};
+
+static struct vm_struct *vmlist;
+static DEFINE_SPINLOCK(vmap_lock);
+
+static size_t vmalloc_used;
+static size_t vmalloc_areas;
+
+/* ===================================================================== */
+/* Address range management */
+/* ===================================================================== */
+
+/* Alignment that lets an area of @size use the largest mappings */
+static size_t vmap_align(size_t size)
+{
+    if (size >= VMM_BLOCK_SIZE) {
+        return VMM_BLOCK_SIZE;
+    }
+    if (size >= VMM_CONT_SIZE) {
+        return VMM_CONT_SIZE;
+    }
+    return PAGE_SIZE;
+}
+
+/* Reserve @size bytes of virtual space and link @area in (first fit) */
+static int vmap_reserve(struct vm_struct *area, size_t size)
+{
+    size_t need = size + VMALLOC_GUARD_SIZE;
+    size_t align = vmap_align(size);
+    virt_addr_t candidate = VMALLOC_START;
+
+    uint64_t flags = spin_lock_irqsave(&vmap_lock);
+
+    struct vm_struct **pp = &vmlist;
+    while (*pp) {
+        if (candidate + need <= (*pp)->addr) {
+            break;
+        }
+        candidate = ALIGN((*pp)->addr + (*pp)->size + VMALLOC_GUARD_SIZE, align);
+        pp = &(*pp)->next;
+    }
+
+    if (candidate + need > VMALLOC_END) {
+        spin_unlock_irqrestore(&vmap_lock, flags);
+        return -1;
+    }
+
+    area->addr = candidate;
+    area->size = size;
+    area->next = *pp;
+    *pp = area;
+
+    vmalloc_used += size;
+    vmalloc_areas++;
+
+    spin_unlock_irqrestore(&vmap_lock, flags);
+    return 0;
+}
+
+/* Find and unlink the area starting at @addr */
+static struct vm_struct *vmap_remove(virt_addr_t addr)
+{
+    uint64_t flags = spin_lock_irqsave(&vmap_lock);
+
+    struct vm_struct **pp = &vmlist;
+    while (*pp && (*pp)->addr != addr) {
+        pp = &(*pp)->next;
+    }
+
+    struct vm_struct *area = *pp;
+    if (area) {
+        *pp = area->next;
+        vmalloc_used -= area->size;
+        vmalloc_areas--;
+    }
+
+    spin_unlock_irqrestore(&vmap_lock, flags);
+    return area;
+}
+
+/* ===================================================================== */
+/* Page backing */
+/* ===================================================================== */
+
+/* Unmap and free the pages backing [addr, addr + size) */
+static void vmap_free_pages(virt_addr_t addr, size_t size)
+{
+    for (size_t off = 0; off < size; off += PAGE_SIZE) {
+        phys_addr_t paddr = vmm_virt_to_phys(addr + off);
+        if (!paddr) {
+            continue;
+        }
+
+        /* Blocks were allocated in runs but can be returned page by page */
+        pmm_free_page(paddr);
+    }
+
+    /*
+     * One unmap for the whole area, so 2MB blocks and contiguous runs are
+     * torn down whole instead of being split page by page. Nothing uses
+     * the area any more, so the pages may be freed first.
+     */
+    vmm_unmap_range(addr, size);
+}
+
+/* Back [addr, addr + size); with @zero, pages come out cleared */
+static int vmap_populate(virt_addr_t addr, size_t size, bool zero)
+{
+    size_t pages = size / PAGE_SIZE;
+    size_t done = 0;
+    unsigned int order = VMALLOC_MAX_CHUNK_ORDER;
+
+    while (done < pages) {
+        while ((1UL << order) > pages - done) {
+            order--;
+        }
+
+        phys_addr_t paddr;
+        if (zero && order == 0) {
+            paddr = pmm_alloc_page_zeroed();    /* Usually pre-cleared */
+        } else {
+            paddr = pmm_alloc_pages(order);
+            if (paddr && zero) {
+                for (size_t i = 0; i < (1UL << order); i++) {
+                    arch_clear_page((void *)(paddr + i * PAGE_SIZE));
+                }
+            }
+        }
+        if (!paddr) {
+            if (order == 0) {
+                vmap_free_pages(addr, done * PAGE_SIZE);
+                return -1;
+            }
+            order--;    /* Fragmented - fall back to smaller runs */
+            continue;
+        }
+
+        size_t run = (1UL << order) * PAGE_SIZE;
+        if (vmm_map_range(addr + done * PAGE_SIZE, paddr, run,
+                          VM_READ | VM_WRITE) < 0) {
+            for (size_t i = 0; i < (1UL << order); i++) {
+                pmm_free_page(paddr + i * PAGE_SIZE);
+            }
+            vmap_free_pages(addr, done * PAGE_SIZE);
+            return -1;
+        }
+        done += 1UL << order;
+    }
+
+    return 0;
+}
+
+/* ===================================================================== */
+/* Public functions */
+/* ===================================================================== */
+
+void *__vmalloc(size_t size, uint32_t flags)
+{
+    if (size == 0 || size > VMALLOC_SIZE) {
+        return NULL;
+    }
+    size = PAGE_ALIGN(size);
+
+    struct vm_struct *area = kmalloc(sizeof(*area));
+    if (!area) {
+        return NULL;
+    }
+
+    if (vmap_reserve(area, size) < 0) {
+        printk(KERN_ERR "VMALLOC: Out of address space for %lu KB\n",
+               (unsigned long)(size / 1024));
+        kfree(area);
+        return NULL;
+    }
+
+    if (vmap_populate(area->addr, size, flags & GFP_ZERO) < 0) {
+        printk(KERN_ERR "VMALLOC: Out of memory for %lu KB\n",
+               (unsigned long)(size / 1024));
+        vmap_remove(area->addr);
+        kfree(area);
+        return NULL;
+    }
+
+    return (void *)area->addr;
+}
+
+void *vmalloc(size_t size)
+{
+    return __vmalloc(size, GFP_KERNEL);
+}
+
+void *vzalloc(size_t size)
+{
+    return __vmalloc(size, GFP_ZERO);
+}
+
+void vfree(const void *addr)
+{
+    if (!addr) {
+        return;
+    }
+
+    struct vm_struct *area = vmap_remove((virt_addr_t)addr);
+    if (!area) {
+        printk(KERN_ERR "VMALLOC: vfree of unknown address %p\n", addr);
+        return;
+    }
+
+    vmap_free_pages(area->addr, area->size);
+    kfree(area);
+}
+
+bool is_vmalloc_addr(const void *addr)
+{
+    virt_addr_t va = (virt_addr_t)addr;
+    return va >= VMALLOC_START && va < VMALLOC_END;
+}
+
+size_t vmalloc_size(const void *addr)
+{
+    size_t size = 0;
+    uint64_t flags = spin_lock_irqsave(&vmap_lock);
+
+    for (struct vm_struct *area = vmlist; area; area = area->next) {
+        if (area->addr == (virt_addr_t)addr) {
+            size = area->size;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&vmap_lock, flags);
+    return size;
+}
+
+void vmalloc_get_stats(size_t *used, size_t *areas)
+{
+    if (used) {
+        *used = vmalloc_used;
+    }
+    if (areas) {
+        *areas = vmalloc_areas;
+    }
+}
@@ -3,8 +3,15 @@
  */
 
 #include "mm/vmm.h"
+#include "fs/vfs.h"
+#include "mm/asid.h"
+#include "mm/filemap.h"
+#include "mm/kmalloc.h"
 #include "mm/pmm.h"
 #include "printk.h"
+#include "rbtree.h"
+#include "string.h"
+#include "sync/spinlock.h"
 
 /* ===================================================================== */
 /* Static data */
@@ -24,6 +31,31 @@ uint64_t *get_kernel_pgd(void)
 static uint64_t early_tables[EARLY_TABLES_COUNT][VMM_ENTRIES] __aligned(PAGE_SIZE);
 static size_t early_table_index = 0;
 
+/*
+ * L1 table of the kernel's identity map (L0 entry 0). The kernel runs
+ * from these addresses through TTBR0, so every address space shares it.
+ */
+static uint64_t *idmap_l1;
+
+/*
+ * Kernel address space. Programs that have no mm of their own run on
+ * kernel_pgd, so their user-half mappings (mmap) are made here.
+ */
+static struct mm_struct init_mm = {
+    .pgd = kernel_pgd,
+    .users = { 1 },
+    .mmap_lock = SPINLOCK_INIT,
+    .page_table_lock = SPINLOCK_INIT,
+};
+
+struct mm_struct *vmm_kernel_mm(void)
+{
+    return &init_mm;
+}
+
+static uint64_t cow_copies;
+static uint64_t cow_reuses;
+
 /* ===================================================================== */
 /* Helper functions */
 /* ===================================================================== */
@@ -56,6 +88,12 @@ static inline phys_addr_t pte_to_phys(uint64_t pte)
     return pte & PTE_ADDR_MASK;
 }
 
+/* Is this L0 entry the shared kernel identity map? User walks skip it */
+static inline bool pte_is_idmap(uint64_t pte)
+{
+    return idmap_l1 && pte_is_table(pte) && pte_to_phys(pte) == (phys_addr_t)idmap_l1;
+}
+
 static inline uint64_t phys_to_pte(phys_addr_t paddr, uint64_t flags)
 {
     return (paddr & PTE_ADDR_MASK) | flags;
@@ -101,30 +139,45 @@ static uint64_t *alloc_page_table(void)
         return table;
     }
     
-    /* Allocate from physical memory */
-    phys_addr_t paddr = pmm_alloc_page();
+    /* Allocate from physical memory, usually cleared ahead of time */
+    phys_addr_t paddr = pmm_alloc_page_zeroed();
     if (!paddr) {
         return NULL;
     }
     
-    uint64_t *table = (uint64_t *)paddr;  /* Identity mapped for now */
-    for (int i = 0; i < VMM_ENTRIES; i++) {
-        table[i] = 0;
+    return (uint64_t *)paddr;  /* Identity mapped for now */
+}
+
+static void free_page_table(uint64_t *table)
+{
+    /* Early tables live in the kernel image and are never returned */
+    if (table >= &early_tables[0][0] &&
+        table < &early_tables[EARLY_TABLES_COUNT][0]) {
+        return;
     }
-    
-    return table;
+    pmm_free_page((phys_addr_t)table);
+}
+
+/* Release a VMA and its reference on the backing file */
+static void vma_free(struct vm_area *vma)
+{
+    if (vma->file) {
+        vfs_close(vma->file);
+    }
+    kfree(vma);
 }
 
 /* ===================================================================== */
 /* Page table walking */
 /* ===================================================================== */
 
-static uint64_t *walk_page_table(uint64_t *pgd, virt_addr_t vaddr, bool allocate)
+/* Walk to the level @level table covering @vaddr, allocating as needed */
+static uint64_t *walk_table(uint64_t *pgd, virt_addr_t vaddr, int level, bool allocate)
 {
     uint64_t *table = pgd;
     
-    for (int level = 0; level < 3; level++) {
-        int idx = pte_index(vaddr, level);
+    for (int l = 0; l < level; l++) {
+        int idx = pte_index(vaddr, l);
         uint64_t pte = table[idx];
         
         if (!pte_is_valid(pte)) {
@@ -152,6 +205,11 @@ static uint64_t *walk_page_table(uint64_t *pgd, virt_addr_t vaddr, bool allocate
     return table;
 }
 
+static uint64_t *walk_page_table(uint64_t *pgd, virt_addr_t vaddr, bool allocate)
+{
+    return walk_table(pgd, vaddr, 3, allocate);
+}
+
 /* ===================================================================== */
 /* Public functions */
 /* ===================================================================== */
@@ -173,6 +231,8 @@ int vmm_init(void)
     
     asm volatile("msr mair_el1, %0" : : "r" (mair));
     
+    unsigned int asid_bits = asid_init();
+    
     /* Set up TCR (Translation Control Register) for 4KB granule, 48-bit VA */
     uint64_t tcr = 
         (16UL << 0) |       /* T0SZ: 48-bit VA for TTBR0 */
@@ -185,12 +245,15 @@ int vmm_init(void)
         (1UL << 24) |       /* IRGN1: Inner Write-back */
         (1UL << 26) |       /* ORGN1: Outer Write-back */
         (3UL << 28) |       /* SH1: Inner Shareable */
-        (5UL << 32);        /* IPS: 48-bit Output Address */
+        (5UL << 32) |       /* IPS: 48-bit Output Address */
+        (0UL << 22) |       /* A1: ASID comes from TTBR0 */
+        (asid_bits == 16 ? (1UL << 36) : 0);  /* AS: 16-bit ASIDs */
     
     asm volatile("msr tcr_el1, %0" : : "r" (tcr));
 #elif defined(ARCH_X86_64)
     /* x86_64: Set up PAT (Page Attribute Table) if needed */
     /* For now, use default PAT settings from bootloader */
+    asid_init();
 #elif defined(ARCH_X86)
     /* x86 32-bit: Use default memory attributes */
 #endif
@@ -208,6 +271,7 @@ int vmm_init(void)
         return -1;
     }
     kernel_pgd[idx0] = phys_to_pte((phys_addr_t)l1_table, PTE_VALID | PTE_TABLE);
+    idmap_l1 = l1_table;
     
     /* Map 0x00000000-0x3FFFFFFF (first 1GB - MMIO) as DEVICE memory */
     l1_table[0] = (0x00000000UL & PTE_ADDR_MASK) | 
@@ -217,13 +281,29 @@ int vmm_init(void)
     l1_table[1] = (0x40000000UL & PTE_ADDR_MASK) | 
                   PTE_VALID | PTE_BLOCK | PTE_ATTR_NORMAL | PTE_SH_INNER | PTE_ACCESSED;
     
+    /* Map the rest of RAM as reported by the PMM, 1GB at a time */
+    phys_addr_t bank_start;
+    size_t bank_size;
+    for (unsigned int i = 0; pmm_get_bank(i, &bank_start, &bank_size) == 0; i++) {
+        for (phys_addr_t gb = ALIGN_DOWN(bank_start, 1UL << VMM_LEVEL1_SHIFT);
+             gb < bank_start + bank_size;
+             gb += 1UL << VMM_LEVEL1_SHIFT) {
+            int idx1 = pte_index(gb, 1);
+            if (gb == 0 || pte_is_valid(l1_table[idx1])) {
+                continue;   /* First 1GB stays device memory */
+            }
+            l1_table[idx1] = (gb & PTE_ADDR_MASK) |
+                             PTE_VALID | PTE_BLOCK | PTE_ATTR_NORMAL | PTE_SH_INNER | PTE_ACCESSED;
+        }
+    }
+    
     /* Map High PCI ECAM region (0x40_0000_0000) for 1GB (covers 0x40_1000_0000) */
     /* L1 index 256 (256GB) maps 0x40_0000_0000 - 0x40_3FFF_FFFF */
     /* Map as DEVICE memory (nGnRnE) */
     l1_table[256] = (0x4000000000ULL & PTE_ADDR_MASK) | 
                     PTE_VALID | PTE_BLOCK | PTE_ATTR_DEVICE | PTE_SH_NONE | PTE_ACCESSED;
     
-    printk("VMM: RAM identity mapped (0-2GB) + High PCI ECAM (256GB base)\n");
+    printk("VMM: RAM identity mapped (all banks) + High PCI ECAM (256GB base)\n");
     
     /* Map device region 0x08000000-0x10000000 for GIC, UART etc */
     /* This is at L1 index 0, but we need L2 tables for finer control */
@@ -278,9 +358,208 @@ int vmm_init(void)
     return 0;
 }
 
+/* ===================================================================== */
+/* Kernel mappings */
+/* ===================================================================== */
+
+/*
+ * vmm_map_range() uses the largest descriptor that fits: 2MB level-2
+ * blocks where virtual and physical addresses are both 2MB aligned,
+ * 16-entry contiguous runs (one TLB entry per 64KB) where they are
+ * 64KB aligned, and single pages at the edges. Unmapping or
+ * re-protecting part of a block or run splits it first.
+ */
+
+static uint64_t block_maps;
+static uint64_t cont_maps;
+static uint64_t block_splits;
+
+static inline bool pte_is_block(uint64_t pte, int level)
+{
+    return level < 3 && (pte & (PTE_VALID | PTE_TABLE)) == PTE_VALID;
+}
+
+/* Kernel descriptor bits for @flags at @level (2: block, 3: page) */
+static inline uint64_t kernel_pte_attrs(uint32_t flags, int level)
+{
+    uint64_t attrs = vm_flags_to_pte(flags);
+    return level == 3 ? attrs : attrs & ~PTE_TABLE;
+}
+
+/* Fails if anything is mapped in the 2MB at @vaddr */
+static int map_block(virt_addr_t vaddr, phys_addr_t paddr, uint32_t flags)
+{
+    uint64_t *l2 = walk_table(kernel_pgd, vaddr, 2, true);
+    if (!l2) {
+        return -1;
+    }
+    
+    int idx = pte_index(vaddr, 2);
+    uint64_t pte = l2[idx];
+    if (pte_is_table(pte)) {
+        /* A page table left behind by earlier mappings, reusable if empty */
+        uint64_t *l3 = (uint64_t *)pte_to_phys(pte);
+        for (int i = 0; i < VMM_ENTRIES; i++) {
+            if (pte_is_valid(l3[i])) {
+                return -1;
+            }
+        }
+        l2[idx] = 0;
+        vmm_flush_tlb();    /* Walk caches may still hold the table */
+        free_page_table(l3);
+    } else if (pte_is_valid(pte)) {
+        return -1;
+    }
+    
+    l2[idx] = phys_to_pte(paddr, kernel_pte_attrs(flags, 2));
+    block_maps++;
+    return 0;
+}
+
+/* Fails if any of the 16 pages at @vaddr is already mapped */
+static int map_cont(virt_addr_t vaddr, phys_addr_t paddr, uint32_t flags)
+{
+    uint64_t *l3 = walk_page_table(kernel_pgd, vaddr, true);
+    if (!l3) {
+        return -1;
+    }
+    
+    int first = pte_index(vaddr, 3);
+    for (int i = 0; i < VMM_CONT_PTES; i++) {
+        if (pte_is_valid(l3[first + i])) {
+            return -1;
+        }
+    }
+    
+    uint64_t attrs = kernel_pte_attrs(flags, 3) | PTE_CONT;
+    for (int i = 0; i < VMM_CONT_PTES; i++) {
+        l3[first + i] = phys_to_pte(paddr + i * PAGE_SIZE, attrs);
+    }
+    cont_maps++;
+    return 0;
+}
+
+/* Replace the 2MB block at @l2[idx] with an equivalent page table */
+static int split_block(uint64_t *l2, int idx, virt_addr_t vaddr)
+{
+    uint64_t block = l2[idx];
+    uint64_t *l3 = alloc_page_table();
+    if (!l3) {
+        return -1;
+    }
+    
+    /* Every 64KB run of the block is aligned, so keep them contiguous */
+    phys_addr_t base = pte_to_phys(block);
+    uint64_t attrs = (block & ~PTE_ADDR_MASK) | PTE_PAGE | PTE_CONT;
+    for (int i = 0; i < VMM_ENTRIES; i++) {
+        l3[i] = phys_to_pte(base + i * PAGE_SIZE, attrs);
+    }
+    
+    /* Break-before-make: the block must leave the TLB before the table goes in */
+    l2[idx] = 0;
+    vmm_flush_tlb_page(ALIGN_DOWN(vaddr, VMM_BLOCK_SIZE));
+    l2[idx] = phys_to_pte((phys_addr_t)l3, PTE_VALID | PTE_TABLE);
+    
+    block_splits++;
+    return 0;
+}
+
+/* Drop the contiguous hint from the 16-entry run holding @l3[idx] */
+static void split_cont(uint64_t *l3, int idx, virt_addr_t vaddr)
+{
+    int first = ALIGN_DOWN(idx, VMM_CONT_PTES);
+    virt_addr_t base = ALIGN_DOWN(vaddr, VMM_CONT_SIZE);
+    uint64_t saved[VMM_CONT_PTES];
+    
+    /* Break-before-make again: no mix of hinted and plain entries in the TLB */
+    for (int i = 0; i < VMM_CONT_PTES; i++) {
+        saved[i] = l3[first + i] & ~PTE_CONT;
+        l3[first + i] = 0;
+    }
+    for (int i = 0; i < VMM_CONT_PTES; i++) {
+        vmm_flush_tlb_page(base + i * PAGE_SIZE);
+    }
+    for (int i = 0; i < VMM_CONT_PTES; i++) {
+        l3[first + i] = saved[i];
+    }
+}
+
+/*
+ * Clear the kernel mappings in [start, end), or with @unmap false give
+ * them @flags. Blocks and runs straddling the edges are split, ones
+ * fully inside are changed whole. The caller flushes the TLB.
+ */
+static int kernel_range_op(virt_addr_t start, virt_addr_t end, bool unmap, uint32_t flags)
+{
+    for (virt_addr_t addr = start; addr < end; ) {
+        virt_addr_t next = ALIGN_DOWN(addr, VMM_BLOCK_SIZE) + VMM_BLOCK_SIZE;
+        virt_addr_t stop = MIN(next, end);
+        
+        /* Nothing mapped here, or part of a 1GB identity block (left alone) */
+        uint64_t *l2 = walk_table(kernel_pgd, addr, 2, false);
+        if (!l2) {
+            addr = next;
+            continue;
+        }
+        
+        int i2 = pte_index(addr, 2);
+        if (pte_is_block(l2[i2], 2)) {
+            if (IS_ALIGNED(addr, VMM_BLOCK_SIZE) && stop == next) {
+                l2[i2] = unmap ? 0 : phys_to_pte(pte_to_phys(l2[i2]),
+                                                 kernel_pte_attrs(flags, 2));
+                addr = next;
+                continue;
+            }
+            if (split_block(l2, i2, addr) < 0) {
+                return -1;
+            }
+        }
+        if (!pte_is_table(l2[i2])) {
+            addr = next;
+            continue;
+        }
+        
+        uint64_t *l3 = (uint64_t *)pte_to_phys(l2[i2]);
+        for (; addr < stop; addr += PAGE_SIZE) {
+            int i3 = pte_index(addr, 3);
+            if (!pte_is_valid(l3[i3])) {
+                continue;
+            }
+            
+            if (l3[i3] & PTE_CONT) {
+                if (IS_ALIGNED(addr, VMM_CONT_SIZE) && addr + VMM_CONT_SIZE <= stop) {
+                    uint64_t attrs = kernel_pte_attrs(flags, 3) | PTE_CONT;
+                    for (int i = 0; i < VMM_CONT_PTES; i++) {
+                        l3[i3 + i] = unmap ? 0 : phys_to_pte(pte_to_phys(l3[i3 + i]), attrs);
+                    }
+                    addr += VMM_CONT_SIZE - PAGE_SIZE;
+                    continue;
+                }
+                split_cont(l3, i3, addr);
+            }
+            
+            l3[i3] = unmap ? 0 : phys_to_pte(pte_to_phys(l3[i3]), kernel_pte_attrs(flags, 3));
+        }
+    }
+    
+    return 0;
+}
+
+/* Flush kernel translations for [start, end) */
+static void flush_kernel_range(virt_addr_t start, virt_addr_t end)
+{
+    if (end - start > 32 * PAGE_SIZE) {
+        vmm_flush_tlb();
+    } else {
+        for (virt_addr_t addr = start; addr < end; addr += PAGE_SIZE) {
+            vmm_flush_tlb_page(addr);
+        }
+    }
+}
+
 int vmm_map_page(virt_addr_t vaddr, phys_addr_t paddr, uint32_t flags)
 {
-    /* Walk to level 3 table, allocating as needed */
+    /* Walk to level 3 table, allocating as needed (fails inside a block) */
     uint64_t *pte_table = walk_page_table(kernel_pgd, vaddr, true);
     if (!pte_table) {
         return -1;
@@ -306,24 +585,18 @@ int vmm_map_page(virt_addr_t vaddr, phys_addr_t paddr, uint32_t flags)
 
 int vmm_unmap_page(virt_addr_t vaddr)
 {
-    uint64_t *pte_table = walk_page_table(kernel_pgd, vaddr, false);
-    if (!pte_table) {
-        return -1;
-    }
-    
-    int idx = pte_index(vaddr, 3);
+    vaddr = PAGE_ALIGN_DOWN(vaddr);
     
-    if (!pte_is_valid(pte_table[idx])) {
-        return -1;  /* Not mapped */
+    /* Not mapped, or inside a 1GB identity block */
+    if (!walk_table(kernel_pgd, vaddr, 2, false) || !vmm_virt_to_phys(vaddr)) {
+        return -1;
     }
     
-    /* Clear the entry */
-    pte_table[idx] = 0;
-    
-    /* Flush TLB */
+    /* May split a block or contiguous run around the page */
+    int ret = kernel_range_op(vaddr, vaddr + PAGE_SIZE, true, 0);
     vmm_flush_tlb_page(vaddr);
     
-    return 0;
+    return ret;
 }
 
 int vmm_map_range(virt_addr_t vaddr, phys_addr_t paddr, size_t size, uint32_t flags)
@@ -332,13 +605,29 @@ int vmm_map_range(virt_addr_t vaddr, phys_addr_t paddr, size_t size, uint32_t fl
     paddr = PAGE_ALIGN_DOWN(paddr);
     size = PAGE_ALIGN(size);
     
-    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
-        int ret = vmm_map_page(vaddr + offset, paddr + offset, flags);
+    for (size_t offset = 0; offset < size; ) {
+        virt_addr_t va = vaddr + offset;
+        phys_addr_t pa = paddr + offset;
+        size_t left = size - offset;
+        
+        if (IS_ALIGNED(va | pa, VMM_BLOCK_SIZE) && left >= VMM_BLOCK_SIZE &&
+            map_block(va, pa, flags) == 0) {
+            offset += VMM_BLOCK_SIZE;
+            continue;
+        }
+        if (IS_ALIGNED(va | pa, VMM_CONT_SIZE) && left >= VMM_CONT_SIZE &&
+            map_cont(va, pa, flags) == 0) {
+            offset += VMM_CONT_SIZE;
+            continue;
+        }
+        
+        int ret = vmm_map_page(va, pa, flags);
         if (ret < 0) {
             /* Rollback on failure */
             vmm_unmap_range(vaddr, offset);
             return ret;
         }
+        offset += PAGE_SIZE;
     }
     
     return 0;
@@ -348,86 +637,156 @@ int vmm_unmap_range(virt_addr_t vaddr, size_t size)
 {
     vaddr = PAGE_ALIGN_DOWN(vaddr);
     size = PAGE_ALIGN(size);
-    
-    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
-        vmm_unmap_page(vaddr + offset);
+    if (size == 0) {
+        return 0;
     }
     
-    return 0;
+    int ret = kernel_range_op(vaddr, vaddr + size, true, 0);
+    flush_kernel_range(vaddr, vaddr + size);
+    
+    return ret;
 }
 
-phys_addr_t vmm_virt_to_phys(virt_addr_t vaddr)
+int vmm_set_range_flags(virt_addr_t vaddr, size_t size, uint32_t flags)
 {
-    uint64_t *pte_table = walk_page_table(kernel_pgd, vaddr, false);
-    if (!pte_table) {
+    vaddr = PAGE_ALIGN_DOWN(vaddr);
+    size = PAGE_ALIGN(size);
+    if (size == 0) {
         return 0;
     }
     
-    int idx = pte_index(vaddr, 3);
-    uint64_t pte = pte_table[idx];
+    int ret = kernel_range_op(vaddr, vaddr + size, false, flags);
+    flush_kernel_range(vaddr, vaddr + size);
     
-    if (!pte_is_valid(pte)) {
-        return 0;
+    return ret;
+}
+
+phys_addr_t vmm_virt_to_phys(virt_addr_t vaddr)
+{
+    uint64_t *table = kernel_pgd;
+    
+    for (int level = 0; level <= 3; level++) {
+        uint64_t pte = table[pte_index(vaddr, level)];
+        if (!pte_is_valid(pte)) {
+            return 0;
+        }
+        
+        /* Page, or a 1GB/2MB block */
+        if (level == 3 || !pte_is_table(pte)) {
+            size_t span = 1UL << (VMM_LEVEL0_SHIFT - 9 * level);
+            return pte_to_phys(pte) + (vaddr & (span - 1));
+        }
+        table = (uint64_t *)pte_to_phys(pte);
     }
     
-    return pte_to_phys(pte) | (vaddr & (PAGE_SIZE - 1));
+    return 0;
+}
+
+void vmm_block_get_stats(uint64_t *blocks, uint64_t *cont, uint64_t *splits)
+{
+    if (blocks) {
+        *blocks = block_maps;
+    }
+    if (cont) {
+        *cont = cont_maps;
+    }
+    if (splits) {
+        *splits = block_splits;
+    }
 }
 
 struct mm_struct *vmm_create_address_space(void)
 {
-    /* Allocate mm_struct */
-    /* TODO: Use kmalloc when available */
-    static struct mm_struct mm_pool[64];
-    static int mm_index = 0;
-    
-    if (mm_index >= 64) {
+    struct mm_struct *mm = kzalloc(sizeof(*mm), GFP_KERNEL);
+    if (!mm) {
         return NULL;
     }
     
-    struct mm_struct *mm = &mm_pool[mm_index++];
-    
     /* Allocate page table */
     mm->pgd = alloc_page_table();
     if (!mm->pgd) {
+        kfree(mm);
         return NULL;
     }
     
     mm->vma_list = NULL;
+    mm->vma_tree = RB_ROOT;
     mm->total_vm = 0;
-    mm->users.counter = 1;
+    atomic_set(&mm->users, 1);
     
     /* Copy kernel mappings (upper half) */
     for (int i = VMM_ENTRIES / 2; i < VMM_ENTRIES; i++) {
         mm->pgd[i] = kernel_pgd[i];
     }
     
+#ifdef ARCH_ARM64
+    /* The kernel executes from the identity map, which TTBR0 translates */
+    mm->pgd[0] = kernel_pgd[0];
+#endif
+    
     return mm;
 }
 
+/*
+ * Drop the page references held by the first @limit entries of @table and
+ * free every table below it. Only PTE_USER leaf pages are refcounted.
+ */
+static void free_user_tables(uint64_t *table, int level, int limit)
+{
+    for (int i = 0; i < limit; i++) {
+        uint64_t pte = table[i];
+        if (!pte_is_valid(pte)) {
+            continue;
+        }
+        
+        if (level < 3) {
+            if (pte_is_table(pte) && !(level == 0 && pte_is_idmap(pte))) {
+                uint64_t *next = (uint64_t *)pte_to_phys(pte);
+                free_user_tables(next, level + 1, VMM_ENTRIES);
+                free_page_table(next);
+            }
+        } else if (pte & PTE_USER) {
+            pmm_page_put(pte_to_phys(pte));
+        }
+        table[i] = 0;
+    }
+}
+
 void vmm_destroy_address_space(struct mm_struct *mm)
 {
     if (!mm) {
         return;
     }
     
-    /* Free all VMAs */
+    if (mm == &init_mm || !atomic_dec_and_test(&mm->users)) {
+        return;     /* Still shared by a CLONE_VM sibling */
+    }
+    
+    /* Free all VMAs, flushing shared file mappings back to their files */
     struct vm_area *vma = mm->vma_list;
     while (vma) {
         struct vm_area *next = vma->next;
-        /* Note: Should use kfree but avoiding for now */
+        if (vma->file && (vma->flags & VM_SHARED) && (vma->flags & VM_WRITE)) {
+            filemap_writeback(vma->file, vma->pgoff,
+                              vma->pgoff + ((vma->end - vma->start) >> PAGE_SHIFT));
+        }
+        vma_free(vma);
         vma = next;
     }
     
-    /* TODO: Free all user page tables recursively */
-    /* For now, just clear the lower half */
+    /* Nothing may still translate through the tables freed below */
+    asid_release_mm(mm);
+    
+    /* Lower half only - the upper half belongs to the kernel */
     if (mm->pgd) {
-        for (int i = 0; i < VMM_ENTRIES / 2; i++) {
-            mm->pgd[i] = 0;
-        }
+        free_user_tables(mm->pgd, 0, VMM_ENTRIES / 2);
+        free_page_table(mm->pgd);
     }
     
     mm->pgd = NULL;
     mm->vma_list = NULL;
+    mm->vma_tree = RB_ROOT;
+    kfree(mm);
 }
 
 /* ===================================================================== */
@@ -442,95 +801,506 @@ int vmm_map_user_page(struct mm_struct *mm, virt_addr_t vaddr, phys_addr_t paddr
     /* Ensure this is a user address */
     if (vaddr >= USER_VMA_END) return -1;
     
-    /* Save and switch page tables temporarily if needed */
-    uint64_t *saved_pgd = get_kernel_pgd();
+    /* Convert VM flags to page table flags */
+    uint64_t pte_flags = PTE_VALID | PTE_PAGE | PTE_USER | PTE_ATTR_NORMAL | 
+                         PTE_SH_INNER | PTE_ACCESSED;
     
-    /* Use mm's page tables */
-    /* For simplicity, we manipulate the tables directly */
+    if (!(flags & VM_WRITE)) pte_flags |= PTE_RDONLY;
+    if (!(flags & VM_EXEC)) pte_flags |= PTE_UXN;
+    if (flags & VM_SHARED) pte_flags |= PTE_SHARED;
+    if (flags & VM_COW) pte_flags |= PTE_RDONLY | PTE_COW;
+    pte_flags |= PTE_PXN;  /* Always disable privileged execute */
+    pte_flags |= PTE_NOT_GLOBAL;  /* Tagged with the mm's ASID */
     
-    /* Build page table indices */
-    int l0_idx = (vaddr >> VMM_LEVEL0_SHIFT) & (VMM_ENTRIES - 1);
-    int l1_idx = (vaddr >> VMM_LEVEL1_SHIFT) & (VMM_ENTRIES - 1);
-    int l2_idx = (vaddr >> VMM_LEVEL2_SHIFT) & (VMM_ENTRIES - 1);
-    int l3_idx = (vaddr >> VMM_LEVEL3_SHIFT) & (VMM_ENTRIES - 1);
+    /* Never build user tables inside the shared kernel identity map */
+    if (pte_is_idmap(mm->pgd[pte_index(vaddr, 0)])) return -1;
     
-    uint64_t *l0 = mm->pgd;
+    uint64_t irq = spin_lock_irqsave(&mm->page_table_lock);
     
-    /* Walk/create L1 */
-    if (!(l0[l0_idx] & PTE_VALID)) {
-        uint64_t *l1 = alloc_page_table();
-        if (!l1) return -1;
-        l0[l0_idx] = ((uint64_t)l1 & PTE_ADDR_MASK) | PTE_VALID | PTE_TABLE;
+    /* Walk/create L1-L3; fails on kernel block mappings */
+    uint64_t *l3 = walk_page_table(mm->pgd, vaddr, true);
+    int idx = pte_index(vaddr, 3);
+    if (!l3 || pte_is_valid(l3[idx])) {
+        spin_unlock_irqrestore(&mm->page_table_lock, irq);
+        return -1;  /* No table, or already mapped */
     }
-    uint64_t *l1 = (uint64_t *)(l0[l0_idx] & PTE_ADDR_MASK);
     
-    /* Walk/create L2 */
-    if (!(l1[l1_idx] & PTE_VALID)) {
-        uint64_t *l2 = alloc_page_table();
-        if (!l2) return -1;
-        l1[l1_idx] = ((uint64_t)l2 & PTE_ADDR_MASK) | PTE_VALID | PTE_TABLE;
+    /* Set the page */
+    l3[idx] = phys_to_pte(paddr, pte_flags);
+    
+    spin_unlock_irqrestore(&mm->page_table_lock, irq);
+    return 0;
+}
+
+phys_addr_t vmm_user_virt_to_phys(struct mm_struct *mm, virt_addr_t vaddr)
+{
+    if (!mm || !mm->pgd || vaddr >= USER_VMA_END) return 0;
+    
+    uint64_t *l3 = walk_page_table(mm->pgd, vaddr, false);
+    if (!l3) return 0;
+    
+    uint64_t pte = l3[pte_index(vaddr, 3)];
+    if (!pte_is_valid(pte)) return 0;
+    
+    return pte_to_phys(pte) | (vaddr & (PAGE_SIZE - 1));
+}
+
+/* Clear the entries of @table (a level @level table) covering [start, end) */
+static size_t unmap_user_table(uint64_t *table, int level,
+                               virt_addr_t start, virt_addr_t end)
+{
+    size_t span = 1UL << (VMM_LEVEL0_SHIFT - 9 * level);
+    size_t cleared = 0;
+    
+    for (virt_addr_t addr = start; addr < end; ) {
+        virt_addr_t next = ALIGN_DOWN(addr, span) + span;
+        int idx = pte_index(addr, level);
+        uint64_t pte = table[idx];
+        
+        if (level < 3) {
+            /* Absent tables skip the whole span; blocks are never user */
+            if (pte_is_table(pte) && !(level == 0 && pte_is_idmap(pte))) {
+                cleared += unmap_user_table((uint64_t *)pte_to_phys(pte),
+                                            level + 1, addr, MIN(next, end));
+            }
+        } else if (pte_is_valid(pte)) {
+            table[idx] = 0;
+            if (pte & PTE_USER) {
+                pmm_page_put(pte_to_phys(pte));
+            }
+            cleared++;
+        }
+        addr = next;
     }
-    uint64_t *l2 = (uint64_t *)(l1[l1_idx] & PTE_ADDR_MASK);
     
-    /* Walk/create L3 */
-    if (!(l2[l2_idx] & PTE_VALID)) {
-        uint64_t *l3 = alloc_page_table();
-        if (!l3) return -1;
-        l2[l2_idx] = ((uint64_t)l3 & PTE_ADDR_MASK) | PTE_VALID | PTE_TABLE;
+    return cleared;
+}
+
+/* Flush [start, end) of @mm; past a handful of pages one ASID flush is cheaper */
+static void vmm_flush_user_range(struct mm_struct *mm, virt_addr_t start, virt_addr_t end)
+{
+    if (end - start > 32 * PAGE_SIZE) {
+        asid_flush_mm(mm);
+    } else {
+        for (virt_addr_t addr = start; addr < end; addr += PAGE_SIZE) {
+            asid_flush_page(mm, addr);
+        }
     }
-    uint64_t *l3 = (uint64_t *)(l2[l2_idx] & PTE_ADDR_MASK);
+}
+
+/* Unmap [start, end) from a user address space, dropping page references */
+void vmm_unmap_user_range(struct mm_struct *mm, virt_addr_t start, virt_addr_t end)
+{
+    if (!mm || !mm->pgd || start >= end || end > USER_VMA_END) return;
     
-    /* Convert VM flags to page table flags */
-    uint64_t pte_flags = PTE_VALID | PTE_PAGE | PTE_USER | PTE_ATTR_NORMAL | 
-                         PTE_SH_INNER | PTE_ACCESSED;
+    uint64_t irq = spin_lock_irqsave(&mm->page_table_lock);
+    size_t cleared = unmap_user_table(mm->pgd, 0, start, end);
+    spin_unlock_irqrestore(&mm->page_table_lock, irq);
     
-    if (!(flags & VM_WRITE)) pte_flags |= PTE_RDONLY;
-    if (!(flags & VM_EXEC)) pte_flags |= PTE_UXN;
-    pte_flags |= PTE_PXN;  /* Always disable privileged execute */
+    if (cleared) {
+        vmm_flush_user_range(mm, start, end);
+    }
+}
+
+/*
+ * Apply @prot (VM_READ/VM_WRITE/VM_EXEC) to the present user pages of
+ * @table covering [start, end). Returns the number of entries changed.
+ */
+static size_t protect_user_table(uint64_t *table, int level,
+                                 virt_addr_t start, virt_addr_t end, uint32_t prot)
+{
+    size_t span = 1UL << (VMM_LEVEL0_SHIFT - 9 * level);
+    size_t changed = 0;
     
-    /* Set the page */
-    l3[l3_idx] = (paddr & PTE_ADDR_MASK) | pte_flags;
+    for (virt_addr_t addr = start; addr < end; ) {
+        virt_addr_t next = ALIGN_DOWN(addr, span) + span;
+        int idx = pte_index(addr, level);
+        uint64_t pte = table[idx];
+        
+        if (level < 3) {
+            if (pte_is_table(pte) && !(level == 0 && pte_is_idmap(pte))) {
+                changed += protect_user_table((uint64_t *)pte_to_phys(pte),
+                                              level + 1, addr, MIN(next, end), prot);
+            }
+        } else if (pte_is_valid(pte) && (pte & PTE_USER)) {
+            uint64_t new = pte & ~(PTE_RDONLY | PTE_UXN);
+            if (!(prot & VM_EXEC)) {
+                new |= PTE_UXN;
+            }
+            if (!(prot & VM_WRITE)) {
+                new |= PTE_RDONLY;
+            } else if ((pte & PTE_RDONLY) && !(pte & PTE_SHARED)) {
+                /* Private page that may be shared; let the COW fault decide */
+                new |= PTE_RDONLY | PTE_COW;
+            }
+            if (new != pte) {
+                table[idx] = new;
+                changed++;
+            }
+        }
+        addr = next;
+    }
+    
+    return changed;
+}
+
+/* ===================================================================== */
+/* VM areas */
+/* ===================================================================== */
+
+/* Start of the free gap below @vma */
+static inline virt_addr_t vma_gap_start(struct vm_area *vma)
+{
+    return vma->prev ? vma->prev->end : USER_VMA_START;
+}
+
+/* rbtree augment callback: refresh @node's subtree_gap from its children */
+static void vma_gap_update(struct rb_node *node)
+{
+    struct vm_area *vma = rb_entry(node, struct vm_area, rb);
+    size_t gap = vma->start - vma_gap_start(vma);
+    
+    if (node->rb_left) {
+        gap = MAX(gap, rb_entry(node->rb_left, struct vm_area, rb)->subtree_gap);
+    }
+    if (node->rb_right) {
+        gap = MAX(gap, rb_entry(node->rb_right, struct vm_area, rb)->subtree_gap);
+    }
+    vma->subtree_gap = gap;
+}
+
+/* @vma's own gap changed (its start, or its predecessor's end, moved) */
+static inline void vma_gap_propagate(struct vm_area *vma)
+{
+    if (vma) {
+        rb_augment_propagate(&vma->rb, vma_gap_update);
+    }
+}
+
+/* Insert @vma into the tree and the sorted list */
+static void vma_link(struct mm_struct *mm, struct vm_area *vma)
+{
+    struct rb_node **link = &mm->vma_tree.rb_node;
+    struct rb_node *parent = NULL;
+    struct vm_area *prev = NULL;
+    
+    while (*link) {
+        parent = *link;
+        struct vm_area *cur = rb_entry(parent, struct vm_area, rb);
+        if (vma->start < cur->start) {
+            link = &parent->rb_left;
+        } else {
+            prev = cur;
+            link = &parent->rb_right;
+        }
+    }
+    
+    vma->prev = prev;
+    vma->next = prev ? prev->next : mm->vma_list;
+    if (vma->next) {
+        vma->next->prev = vma;
+    }
+    if (prev) {
+        prev->next = vma;
+    } else {
+        mm->vma_list = vma;
+    }
+    
+    rb_link_node(&vma->rb, parent, link);
+    rb_insert_augmented(&vma->rb, &mm->vma_tree, vma_gap_update);
+    
+    /* The gap below our successor now ends at us */
+    vma_gap_propagate(vma->next);
+    
+    mm->map_count++;
+    mm->total_vm += vma->end - vma->start;
+}
+
+/* Remove @vma from the tree and the sorted list (does not free it) */
+static void vma_unlink(struct mm_struct *mm, struct vm_area *vma)
+{
+    struct vm_area *next = vma->next;
+    
+    rb_erase_augmented(&vma->rb, &mm->vma_tree, vma_gap_update);
+    
+    if (vma->prev) {
+        vma->prev->next = next;
+    } else {
+        mm->vma_list = next;
+    }
+    if (next) {
+        next->prev = vma->prev;
+        vma_gap_propagate(next);
+    }
+    
+    if (mm->vma_cache == vma) {
+        mm->vma_cache = NULL;
+    }
+    mm->map_count--;
+    mm->total_vm -= vma->end - vma->start;
+}
+
+/* Move the end of @vma; the tree order is unaffected */
+static void vma_set_end(struct mm_struct *mm, struct vm_area *vma, virt_addr_t end)
+{
+    mm->total_vm = mm->total_vm - (vma->end - vma->start) + (end - vma->start);
+    vma->end = end;
+    vma_gap_propagate(vma->next);
+}
+
+/* Move the start of @vma up to @start, keeping the file offset in step */
+static void vma_trim_start(struct mm_struct *mm, struct vm_area *vma, virt_addr_t start)
+{
+    mm->total_vm -= start - vma->start;
+    vma->pgoff += (start - vma->start) >> PAGE_SHIFT;
+    vma->start = start;
+    vma_gap_propagate(vma);
+}
+
+/* Split @vma at @addr; @vma keeps the low part. Returns the high part */
+static struct vm_area *vma_split(struct mm_struct *mm, struct vm_area *vma,
+                                 virt_addr_t addr)
+{
+    struct vm_area *tail = kmalloc(sizeof(*tail));
+    if (!tail) return NULL;
+    
+    tail->start = addr;
+    tail->end = vma->end;
+    tail->flags = vma->flags;
+    tail->file = vma->file ? vfs_file_get(vma->file) : NULL;
+    tail->pgoff = vma->pgoff + ((addr - vma->start) >> PAGE_SHIFT);
+    
+    vma_set_end(mm, vma, addr);
+    vma_link(mm, tail);
+    return tail;
+}
+
+/* Can @next (which directly follows @prev) be folded into @prev? */
+static bool vma_can_merge(struct vm_area *prev, struct vm_area *next)
+{
+    if (prev->end != next->start || prev->flags != next->flags ||
+        prev->file != next->file) {
+        return false;
+    }
+    return !prev->file ||
+           prev->pgoff + ((prev->end - prev->start) >> PAGE_SHIFT) == next->pgoff;
+}
+
+/* Merge @vma with matching neighbours; returns the area that survives */
+static struct vm_area *vma_merge(struct mm_struct *mm, struct vm_area *vma)
+{
+    struct vm_area *next = vma->next;
+    if (next && vma_can_merge(vma, next)) {
+        virt_addr_t end = next->end;
+        vma_unlink(mm, next);
+        vma_free(next);
+        vma_set_end(mm, vma, end);
+    }
+    
+    struct vm_area *prev = vma->prev;
+    if (prev && vma_can_merge(prev, vma)) {
+        virt_addr_t end = vma->end;
+        vma_unlink(mm, vma);
+        vma_free(vma);
+        vma_set_end(mm, prev, end);
+        vma = prev;
+    }
+    
+    return vma;
+}
+
+/* Add a file-backed VM area; takes a reference on @file */
+int vmm_add_file_vma(struct mm_struct *mm, virt_addr_t start, virt_addr_t end,
+                     uint32_t flags, struct file *file, uint64_t pgoff)
+{
+    if (!mm || start >= end) return -1;
+    
+    struct vm_area *vma = kmalloc(sizeof(*vma));
+    if (!vma) return -1;
+    
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->file = file ? vfs_file_get(file) : NULL;
+    vma->pgoff = pgoff;
+    vma_link(mm, vma);
+    vma_merge(mm, vma);
     
-    (void)saved_pgd;  /* Not used currently */
     return 0;
 }
 
 /* Add a VM area to the address space */
 int vmm_add_vma(struct mm_struct *mm, virt_addr_t start, virt_addr_t end, uint32_t flags)
+{
+    return vmm_add_file_vma(mm, start, end, flags, NULL, 0);
+}
+
+/* Remove [start, end) from the VMAs, trimming or splitting as needed */
+int vmm_remove_vma_range(struct mm_struct *mm, virt_addr_t start, virt_addr_t end)
 {
     if (!mm) return -1;
     
-    /* Allocate VMA from static pool (should use kmalloc) */
-    static struct vm_area vma_pool[256];
-    static int vma_index = 0;
+    struct vm_area *vma = vmm_find_vma_after(mm, start);
+    if (!vma || vma->start >= end) return 0;
     
-    if (vma_index >= 256) return -1;
+    if (vma->start < start) {
+        if (vma->end > end && !vma_split(mm, vma, end)) {
+            return -1;  /* Hole in the middle needs a new tail area */
+        }
+        vma_set_end(mm, vma, start);
+        vma = vma->next;
+    }
     
-    struct vm_area *vma = &vma_pool[vma_index++];
-    vma->start = start;
-    vma->end = end;
-    vma->flags = flags;
-    vma->next = mm->vma_list;
-    mm->vma_list = vma;
+    while (vma && vma->start < end) {
+        if (vma->end > end) {
+            vma_trim_start(mm, vma, end);
+            break;
+        }
+        struct vm_area *next = vma->next;
+        vma_unlink(mm, vma);
+        vma_free(vma);
+        vma = next;
+    }
+    
+    return 0;
+}
+
+int vmm_protect_range(struct mm_struct *mm, virt_addr_t start, virt_addr_t end,
+                      uint32_t prot)
+{
+    if (!mm || start >= end || end > USER_VMA_END) return -1;
+    prot &= VM_READ | VM_WRITE | VM_EXEC;
+    
+    struct vm_area *vma = vmm_find_vma_after(mm, start);
+    if (vma && vma->start < start) {
+        vma = vma_split(mm, vma, start);
+        if (!vma) return -1;
+    }
     
-    mm->total_vm += (end - start);
+    while (vma && vma->start < end) {
+        if (vma->end > end && !vma_split(mm, vma, end)) {
+            return -1;
+        }
+        vma->flags = (vma->flags & ~(VM_READ | VM_WRITE | VM_EXEC)) | prot;
+        vma = vma_merge(mm, vma)->next;
+    }
     
+    uint64_t irq = spin_lock_irqsave(&mm->page_table_lock);
+    size_t changed = protect_user_table(mm->pgd, 0, start, end, prot);
+    spin_unlock_irqrestore(&mm->page_table_lock, irq);
+    
+    if (changed) {
+        vmm_flush_user_range(mm, start, end);
+    }
     return 0;
 }
 
+/* Find the lowest free range of @len bytes within [low, high) */
+virt_addr_t vmm_find_unmapped_area(struct mm_struct *mm, size_t len,
+                                   virt_addr_t low, virt_addr_t high)
+{
+    if (!mm || len == 0 || low >= high || len > high - low) return 0;
+    
+    /* Last acceptable start address */
+    virt_addr_t limit = high - len;
+    
+    /*
+     * Every free range is the gap below some VMA, or the gap above the
+     * last one. Walk the tree in address order, descending only into
+     * subtrees whose largest gap could hold @len.
+     */
+    struct rb_node *node = mm->vma_tree.rb_node;
+    if (node && rb_entry(node, struct vm_area, rb)->subtree_gap >= len) {
+        struct vm_area *vma = rb_entry(node, struct vm_area, rb);
+        bool descend = true;
+        
+        while (vma) {
+            /* Lower gaps end at or below vma->start; useless if that is too low */
+            if (descend && vma->start >= low + len && vma->rb.rb_left) {
+                struct vm_area *left = rb_entry(vma->rb.rb_left, struct vm_area, rb);
+                if (left->subtree_gap >= len) {
+                    vma = left;
+                    continue;
+                }
+            }
+            
+            virt_addr_t gap_start = vma_gap_start(vma);
+            if (gap_start > limit) {
+                return 0;   /* Every remaining gap starts higher still */
+            }
+            virt_addr_t candidate = MAX(gap_start, low);
+            if (candidate + len <= vma->start) {
+                return candidate;
+            }
+            
+            if (vma->rb.rb_right) {
+                struct vm_area *right = rb_entry(vma->rb.rb_right, struct vm_area, rb);
+                if (right->subtree_gap >= len) {
+                    vma = right;
+                    descend = true;
+                    continue;
+                }
+            }
+            
+            /* Climb to the next ancestor not yet visited in order */
+            struct rb_node *child = &vma->rb;
+            struct rb_node *parent = child->rb_parent;
+            while (parent && child == parent->rb_right) {
+                child = parent;
+                parent = parent->rb_parent;
+            }
+            vma = rb_entry_safe(parent, struct vm_area, rb);
+            descend = false;
+        }
+    }
+    
+    /* The gap above the highest VMA */
+    struct rb_node *last = rb_last(&mm->vma_tree);
+    virt_addr_t gap_start = last ? rb_entry(last, struct vm_area, rb)->end
+                                 : USER_VMA_START;
+    virt_addr_t candidate = MAX(gap_start, low);
+    return candidate <= limit ? candidate : 0;
+}
+
+/* Find the first VM area that ends above an address */
+struct vm_area *vmm_find_vma_after(struct mm_struct *mm, virt_addr_t addr)
+{
+    if (!mm) return NULL;
+    
+    struct vm_area *found = NULL;
+    struct rb_node *node = mm->vma_tree.rb_node;
+    while (node) {
+        struct vm_area *vma = rb_entry(node, struct vm_area, rb);
+        if (vma->end > addr) {
+            found = vma;
+            if (vma->start <= addr) {
+                break;
+            }
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+    return found;
+}
+
 /* Find a VM area containing an address */
 struct vm_area *vmm_find_vma(struct mm_struct *mm, virt_addr_t addr)
 {
     if (!mm) return NULL;
     
-    struct vm_area *vma = mm->vma_list;
-    while (vma) {
-        if (addr >= vma->start && addr < vma->end) {
-            return vma;
-        }
-        vma = vma->next;
+    /* Faults tend to hit the same area repeatedly */
+    struct vm_area *vma = mm->vma_cache;
+    if (vma && vma->start <= addr && addr < vma->end) {
+        return vma;
     }
-    return NULL;
+    
+    vma = vmm_find_vma_after(mm, addr);
+    if (!vma || vma->start > addr) {
+        return NULL;
+    }
+    mm->vma_cache = vma;
+    return vma;
 }
 
 /* Map user address range with physical pages */
@@ -542,7 +1312,9 @@ int vmm_map_user_range(struct mm_struct *mm, virt_addr_t vaddr, size_t size, uin
     vaddr = vaddr & ~(PAGE_SIZE - 1);
     
     /* Add VMA */
+    uint64_t irq = spin_lock_irqsave(&mm->mmap_lock);
     vmm_add_vma(mm, vaddr, end, flags);
+    spin_unlock_irqrestore(&mm->mmap_lock, irq);
     
     /* Allocate and map pages */
     for (virt_addr_t addr = vaddr; addr < end; addr += PAGE_SIZE) {
@@ -562,22 +1334,161 @@ int vmm_map_user_range(struct mm_struct *mm, virt_addr_t vaddr, size_t size, uin
     return 0;
 }
 
-void vmm_switch_address_space(struct mm_struct *mm)
+/* ===================================================================== */
+/* Copy-on-write */
+/* ===================================================================== */
+
+/*
+ * Duplicate the first @limit entries of @src into @dst. Leaf pages are
+ * shared: private writable ones are write-protected and tagged PTE_COW
+ * in both tables, and every PTE_USER page gains a reference.
+ */
+static int dup_user_tables(uint64_t *dst, uint64_t *src, int level, int limit)
 {
-    if (!mm || !mm->pgd) {
-        return;
+    for (int i = 0; i < limit; i++) {
+        uint64_t pte = src[i];
+        if (!pte_is_valid(pte)) {
+            continue;
+        }
+        
+        if (level < 3) {
+            if (!pte_is_table(pte) || (level == 0 && pte_is_idmap(pte))) {
+                continue;   /* User mappings are never blocks; idmap is shared */
+            }
+            uint64_t *table = alloc_page_table();
+            if (!table) {
+                return -1;
+            }
+            dst[i] = phys_to_pte((phys_addr_t)table, PTE_VALID | PTE_TABLE);
+            if (dup_user_tables(table, (uint64_t *)pte_to_phys(pte),
+                                level + 1, VMM_ENTRIES) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        
+        if (pte & PTE_USER) {
+            if (!(pte & (PTE_RDONLY | PTE_SHARED))) {
+                pte |= PTE_RDONLY | PTE_COW;
+                src[i] = pte;
+            }
+            pmm_page_get(pte_to_phys(pte));
+        }
+        dst[i] = pte;
     }
     
-    /* Load TTBR0 (user page tables) */
-#ifdef ARCH_ARM64
-    asm volatile("msr ttbr0_el1, %0" : : "r" ((uint64_t)mm->pgd));
-    asm volatile("isb");
-#elif defined(ARCH_X86_64)
-    asm volatile("mov %0, %%cr3" :: "r"((uint64_t)mm->pgd) : "memory");
-#elif defined(ARCH_X86)
-    asm volatile("mov %0, %%cr3" :: "r"((uint32_t)mm->pgd) : "memory");
-#endif
-    vmm_flush_tlb();
+    return 0;
+}
+
+struct mm_struct *vmm_dup_address_space(struct mm_struct *src)
+{
+    if (!src || !src->pgd) {
+        return NULL;
+    }
+    
+    struct mm_struct *mm = vmm_create_address_space();
+    if (!mm) {
+        return NULL;
+    }
+    
+    /* Layout is inherited unchanged */
+    mm->start_code = src->start_code;
+    mm->end_code = src->end_code;
+    mm->start_data = src->start_data;
+    mm->end_data = src->end_data;
+    mm->start_brk = src->start_brk;
+    mm->brk = src->brk;
+    mm->start_stack = src->start_stack;
+    mm->arg_start = src->arg_start;
+    mm->arg_end = src->arg_end;
+    mm->env_start = src->env_start;
+    mm->env_end = src->env_end;
+    
+    /* Nobody else can see @mm yet, so only @src needs locking */
+    uint64_t irq = spin_lock_irqsave(&src->mmap_lock);
+    for (struct vm_area *vma = src->vma_list; vma; vma = vma->next) {
+        if (vmm_add_file_vma(mm, vma->start, vma->end, vma->flags,
+                             vma->file, vma->pgoff) < 0) {
+            spin_unlock_irqrestore(&src->mmap_lock, irq);
+            vmm_destroy_address_space(mm);
+            return NULL;
+        }
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&src->page_table_lock);
+    int ret = dup_user_tables(mm->pgd, src->pgd, 0, VMM_ENTRIES / 2);
+    spin_unlock_irqrestore(&src->page_table_lock, flags);
+    spin_unlock_irqrestore(&src->mmap_lock, irq);
+    
+    /* The parent's writable entries just became read-only */
+    asid_flush_mm(src);
+    
+    if (ret < 0) {
+        printk(KERN_ERR "VMM: Out of memory duplicating address space\n");
+        vmm_destroy_address_space(mm);
+        return NULL;
+    }
+    
+    return mm;
+}
+
+int vmm_handle_cow_fault(struct mm_struct *mm, virt_addr_t vaddr)
+{
+    if (!mm || !mm->pgd || vaddr >= USER_VMA_END) {
+        return -1;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&mm->page_table_lock);
+    
+    uint64_t *l3 = walk_page_table(mm->pgd, vaddr, false);
+    int idx = pte_index(vaddr, 3);
+    if (!l3 || (l3[idx] & (PTE_VALID | PTE_COW)) != (PTE_VALID | PTE_COW)) {
+        spin_unlock_irqrestore(&mm->page_table_lock, flags);
+        return -1;
+    }
+    
+    uint64_t pte = l3[idx];
+    phys_addr_t old = pte_to_phys(pte);
+    uint64_t attrs = (pte & ~PTE_ADDR_MASK) & ~(PTE_RDONLY | PTE_COW);
+    
+    if (pmm_page_refcount(old) == 1) {
+        /* Every other sharer already copied - take the page back */
+        l3[idx] = phys_to_pte(old, attrs);
+        cow_reuses++;
+    } else {
+        phys_addr_t new = pmm_alloc_page();
+        if (!new) {
+            spin_unlock_irqrestore(&mm->page_table_lock, flags);
+            printk(KERN_ERR "VMM: Out of memory on COW fault at 0x%lx\n",
+                   (unsigned long)vaddr);
+            return -1;
+        }
+        memcpy((void *)new, (void *)old, PAGE_SIZE);
+        l3[idx] = phys_to_pte(new, attrs);
+        pmm_page_put(old);
+        cow_copies++;
+    }
+    
+    spin_unlock_irqrestore(&mm->page_table_lock, flags);
+    
+    asid_flush_page(mm, vaddr);
+    return 0;
+}
+
+void vmm_cow_get_stats(uint64_t *copies, uint64_t *reuses)
+{
+    if (copies) {
+        *copies = cow_copies;
+    }
+    if (reuses) {
+        *reuses = cow_reuses;
+    }
+}
+
+void vmm_switch_address_space(struct mm_struct *mm)
+{
+    /* TTBR0/CR3 plus the mm's ASID; no TLB flush on the common path */
+    asid_switch_mm(mm);
 }
 
 void vmm_flush_tlb(void)
@@ -0,0 +1,283 @@
+/*
+ * UnixOS Kernel - Fair Scheduling Class
+ *
+ * vruntime is unsigned and allowed to wrap, so it is only ever compared
+ * through a signed difference.
+ */
+
+#include "sched/fair.h"
+#include "arch/arch.h"
+#include "sched/sched.h"
+
+/*
+ * Nice -20 .. 19. Neighbouring entries differ by a factor of 1.25, so
+ * one nice step moves about 10% of the CPU between two busy tasks.
+ */
+static const unsigned long prio_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+/* ===================================================================== */
+/* Helpers */
+/* ===================================================================== */
+
+static inline int64_t vruntime_diff(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b);
+}
+
+static inline uint64_t ms_to_ticks(uint64_t ms)
+{
+    return arch_timer_get_frequency() * ms / 1000;
+}
+
+/* Convert CPU time to virtual time for an entity of @weight */
+static inline uint64_t calc_delta_fair(uint64_t delta, unsigned long weight)
+{
+    if (weight == NICE_0_LOAD || !weight) {
+        return delta;
+    }
+    return delta * NICE_0_LOAD / weight;
+}
+
+static void update_min_vruntime(struct cfs_rq *cfs)
+{
+    struct sched_entity *first = fair_first(cfs);
+    uint64_t vruntime = cfs->min_vruntime;
+
+    if (cfs->curr) {
+        vruntime = cfs->curr->vruntime;
+    }
+    if (first && (!cfs->curr || vruntime_diff(first->vruntime, vruntime) < 0)) {
+        vruntime = first->vruntime;
+    }
+
+    /* Never goes backwards */
+    if (vruntime_diff(vruntime, cfs->min_vruntime) > 0) {
+        cfs->min_vruntime = vruntime;
+    }
+}
+
+static void timeline_insert(struct cfs_rq *cfs, struct sched_entity *se)
+{
+    struct rb_node **link = &cfs->timeline.rb_node, *parent = NULL;
+    bool leftmost = true;
+
+    /* Equal keys go right, so entities with the same vruntime take turns */
+    while (*link) {
+        parent = *link;
+        struct sched_entity *entry = rb_entry(parent, struct sched_entity, run_node);
+        if (vruntime_diff(se->vruntime, entry->vruntime) < 0) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = false;
+        }
+    }
+
+    if (leftmost) {
+        cfs->leftmost = &se->run_node;
+    }
+    rb_link_node(&se->run_node, parent, link);
+    rb_insert_color(&se->run_node, &cfs->timeline);
+}
+
+static void timeline_erase(struct cfs_rq *cfs, struct sched_entity *se)
+{
+    if (cfs->leftmost == &se->run_node) {
+        cfs->leftmost = rb_next(&se->run_node);
+    }
+    rb_erase(&se->run_node, &cfs->timeline);
+}
+
+/* ===================================================================== */
+/* Entity accounting */
+/* ===================================================================== */
+
+unsigned long sched_nice_to_weight(int nice)
+{
+    if (nice < NICE_MIN) {
+        nice = NICE_MIN;
+    } else if (nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
+    return prio_to_weight[nice - NICE_MIN];
+}
+
+void cfs_rq_init(struct cfs_rq *cfs)
+{
+    cfs->timeline = RB_ROOT;
+    cfs->leftmost = NULL;
+    cfs->curr = NULL;
+    cfs->min_vruntime = 0;
+    cfs->load = 0;
+    cfs->nr_running = 0;
+}
+
+uint64_t fair_account(struct sched_entity *se, uint64_t now)
+{
+    uint64_t delta = now - se->exec_start;
+
+    /* The counter read on another CPU may be slightly behind */
+    if ((int64_t)delta <= 0) {
+        se->exec_start = now;
+        return 0;
+    }
+
+    se->exec_start = now;
+    se->sum_exec_runtime += delta;
+    se->vruntime += calc_delta_fair(delta, se->weight);
+    return delta;
+}
+
+uint64_t fair_slice(unsigned long weight, unsigned long load)
+{
+    uint64_t min_gran = ms_to_ticks(SCHED_MIN_GRANULARITY_MS);
+
+    if (!load || load < weight) {
+        load = weight;
+    }
+    uint64_t slice = weight ? ms_to_ticks(SCHED_LATENCY_MS) * weight / load : 0;
+    return slice > min_gran ? slice : min_gran;
+}
+
+void fair_place(struct sched_entity *se, uint64_t min_vruntime,
+                unsigned long load, int flags)
+{
+    uint64_t vruntime = min_vruntime;
+
+    if (flags & ENQUEUE_INITIAL) {
+        uint64_t slice = fair_slice(se->weight, load + se->weight);
+        vruntime += calc_delta_fair(slice, se->weight);
+    } else if (flags & ENQUEUE_WAKEUP) {
+        vruntime -= ms_to_ticks(SCHED_LATENCY_MS) / 2;
+    } else {
+        return;
+    }
+
+    /* Sleeper credit only ever brings a long sleeper up to the floor */
+    if ((flags & ENQUEUE_INITIAL) || vruntime_diff(vruntime, se->vruntime) > 0) {
+        se->vruntime = vruntime;
+    }
+}
+
+bool fair_should_preempt(struct sched_entity *curr, struct sched_entity *first,
+                         unsigned long load)
+{
+    if (!first) {
+        return false;
+    }
+
+    uint64_t ideal = fair_slice(curr->weight, load);
+    uint64_t ran = curr->sum_exec_runtime - curr->prev_sum_exec_runtime;
+    if (ran > ideal) {
+        return true;
+    }
+
+    /* Let a task that just got the CPU do some work first */
+    if (ran < ms_to_ticks(SCHED_MIN_GRANULARITY_MS)) {
+        return false;
+    }
+    return vruntime_diff(curr->vruntime, first->vruntime) > (int64_t)ideal;
+}
+
+/* ===================================================================== */
+/* Run queue */
+/* ===================================================================== */
+
+void fair_update_curr(struct cfs_rq *cfs)
+{
+    if (cfs->curr) {
+        fair_account(cfs->curr, arch_timer_get_ticks());
+    }
+    update_min_vruntime(cfs);
+}
+
+void fair_enqueue(struct cfs_rq *cfs, struct sched_entity *se, int flags)
+{
+    fair_update_curr(cfs);
+
+    se->vruntime += cfs->min_vruntime;
+    fair_place(se, cfs->min_vruntime, cfs->load, flags);
+
+    if (se != cfs->curr) {
+        timeline_insert(cfs, se);
+    }
+    se->on_rq = true;
+    cfs->load += se->weight;
+    cfs->nr_running++;
+}
+
+void fair_dequeue(struct cfs_rq *cfs, struct sched_entity *se, int flags)
+{
+    fair_update_curr(cfs);
+
+    if (se == cfs->curr) {
+        cfs->curr = NULL;
+    } else {
+        timeline_erase(cfs, se);
+    }
+    se->on_rq = false;
+    cfs->load -= se->weight;
+    cfs->nr_running--;
+
+    update_min_vruntime(cfs);
+    if (!(flags & DEQUEUE_SLEEP)) {
+        se->vruntime -= cfs->min_vruntime;
+    }
+}
+
+void fair_reweight(struct cfs_rq *cfs, struct sched_entity *se,
+                   unsigned long weight)
+{
+    /* Charge the time run so far at the old weight */
+    if (cfs && se->on_rq) {
+        fair_update_curr(cfs);
+        cfs->load += weight - se->weight;
+    }
+    se->weight = weight;
+}
+
+void fair_set_next(struct cfs_rq *cfs, struct sched_entity *se)
+{
+    timeline_erase(cfs, se);
+    cfs->curr = se;
+    se->exec_start = arch_timer_get_ticks();
+    se->prev_sum_exec_runtime = se->sum_exec_runtime;
+}
+
+void fair_put_prev(struct cfs_rq *cfs)
+{
+    struct sched_entity *se = cfs->curr;
+    if (!se) {
+        return;
+    }
+
+    fair_update_curr(cfs);
+    cfs->curr = NULL;
+    timeline_insert(cfs, se);
+}
+
+bool fair_check_preempt_tick(struct cfs_rq *cfs)
+{
+    if (!cfs->curr) {
+        return false;
+    }
+    return fair_should_preempt(cfs->curr, fair_first(cfs), cfs->load);
+}
+
+bool fair_check_preempt_wakeup(struct sched_entity *curr,
+                               struct sched_entity *se)
+{
+    /* Granularity in @se's virtual time: heavier tasks preempt sooner */
+    uint64_t gran = calc_delta_fair(ms_to_ticks(SCHED_WAKEUP_GRANULARITY_MS),
+                                    se->weight);
+    return vruntime_diff(curr->vruntime, se->vruntime) > (int64_t)gran;
+}
@@ -4,10 +4,12 @@
  * Implements process creation (fork) and program loading (exec).
  */
 
+#include "arch/arch.h"
 #include "fs/vfs.h"
 #include "mm/pmm.h"
 #include "mm/vmm.h"
 #include "printk.h"
+#include "sched/hrtimer.h"
 #include "sched/sched.h"
 
 /* Forward declaration */
@@ -56,14 +58,23 @@ struct elf64_phdr {
 /* Fork implementation */
 /* ===================================================================== */
 
-static int copy_mm(struct task_struct *child, struct task_struct *parent) {
+static int copy_mm(struct task_struct *child, struct task_struct *parent,
+                   unsigned long clone_flags) {
   if (!parent->mm) {
     child->mm = NULL;
     child->active_mm = parent->active_mm;
     return 0;
   }
 
-  child->mm = vmm_create_address_space();
+  if (clone_flags & CLONE_VM) {
+    atomic_inc(&parent->mm->users);
+    child->mm = parent->mm;
+    child->active_mm = parent->mm;
+    return 0;
+  }
+
+  /* Share every page copy-on-write; nothing is copied until written */
+  child->mm = vmm_dup_address_space(parent->mm);
   if (!child->mm) {
     return -1;
   }
@@ -72,31 +83,33 @@ static int copy_mm(struct task_struct *child, struct task_struct *parent) {
   return 0;
 }
 
-static void copy_thread(struct task_struct *child, struct task_struct *parent) {
-  child->cpu_context = parent->cpu_context;
-}
-
 static void fork_entry(void *arg) { (void)arg; }
 
 long do_fork(unsigned long flags) {
   struct task_struct *current_task = get_current();
   struct task_struct *child;
 
-  child = create_task(fork_entry, NULL, (uint32_t)flags);
+  /*
+   * The child keeps the context create_task_stopped() gave it, on a stack
+   * of its own: the parent's saved context is stale and points into the
+   * parent's stack, so there is nothing of it to resume.
+   */
+  child = create_task_stopped(fork_entry, NULL, (uint32_t)flags);
   if (!child) {
     return -1;
   }
 
-  if (copy_mm(child, current_task) < 0) {
+  if (copy_mm(child, current_task, flags) < 0) {
+    free_task_stopped(child);
     return -1;
   }
 
-  copy_thread(child, current_task);
   child->parent = current_task;
   child->uid = current_task->uid;
   child->gid = current_task->gid;
-  child->state = TASK_RUNNING;
 
+  /* Only now may another CPU pick it up */
+  wake_up_new_task(child);
   return child->pid;
 }
 
@@ -227,3 +240,95 @@ long do_execve(const char *filename, char *const argv[], char *const envp[]) {
   printk(KERN_INFO "execve: ready\n");
   return 0;
 }
+
+/* ===================================================================== */
+/* Fork benchmark */
+/* ===================================================================== */
+
+#define FORK_BENCH_ITERS 16
+#define FORK_BENCH_TOUCH 16 /* Pages the child writes after each fork */
+
+static const size_t fork_bench_rss_kb[] = {0, 64, 256, 1024, 4096, 16384};
+
+int fork_bench(char *buf, size_t size) {
+  int len = 0;
+
+  REPORT_OUT("fork bench: COW address space copy + teardown, %d rounds\n",
+             FORK_BENCH_ITERS);
+  REPORT_OUT("  rss KB   pages   fork us   exit us  fault ns\n");
+
+  for (size_t r = 0; r < ARRAY_SIZE(fork_bench_rss_kb); r++) {
+    size_t rss = fork_bench_rss_kb[r] * 1024;
+    size_t pages = rss / PAGE_SIZE;
+
+    /* Parent pages plus the child's copies must fit comfortably */
+    if (rss * 2 > pmm_get_free_memory() / 2) {
+      REPORT_OUT("%8lu  skipped (not enough free memory)\n",
+                 (unsigned long)(rss / 1024));
+      continue;
+    }
+
+    struct mm_struct *parent = vmm_create_address_space();
+    if (!parent) {
+      REPORT_OUT("%8lu  address space allocation failed\n",
+                 (unsigned long)(rss / 1024));
+      continue;
+    }
+    if (pages && vmm_map_user_range(parent, USER_MMAP_BASE, rss,
+                                    VM_READ | VM_WRITE | VM_USER) < 0) {
+      REPORT_OUT("%8lu  populate failed\n", (unsigned long)(rss / 1024));
+      vmm_destroy_address_space(parent);
+      continue;
+    }
+
+    size_t touch = MIN(pages, (size_t)FORK_BENCH_TOUCH);
+    uint64_t fork_ticks = 0, exit_ticks = 0, fault_ticks = 0;
+    uint64_t rounds = 0, faults = 0;
+
+    for (int i = 0; i < FORK_BENCH_ITERS; i++) {
+      uint64_t t0 = arch_timer_get_ticks();
+      struct mm_struct *child = vmm_dup_address_space(parent);
+      uint64_t t1 = arch_timer_get_ticks();
+      if (!child) {
+        break;
+      }
+
+      /* First writes from the child take the copy-on-write path */
+      for (size_t p = 0; p < touch; p++) {
+        if (vmm_handle_cow_fault(child, USER_MMAP_BASE + p * PAGE_SIZE) == 0) {
+          faults++;
+        }
+      }
+      uint64_t t2 = arch_timer_get_ticks();
+
+      vmm_destroy_address_space(child);
+      uint64_t t3 = arch_timer_get_ticks();
+
+      fork_ticks += t1 - t0;
+      fault_ticks += t2 - t1;
+      exit_ticks += t3 - t2;
+      rounds++;
+    }
+
+    vmm_destroy_address_space(parent);
+
+    if (rounds == 0) {
+      REPORT_OUT("%8lu  fork failed\n", (unsigned long)(rss / 1024));
+      continue;
+    }
+
+    REPORT_OUT("%8lu %7lu %9llu %9llu %9llu\n", (unsigned long)(rss / 1024),
+               (unsigned long)pages,
+               (unsigned long long)(ticks_to_ns(fork_ticks) / rounds / 1000),
+               (unsigned long long)(ticks_to_ns(exit_ticks) / rounds / 1000),
+               (unsigned long long)(faults ? ticks_to_ns(fault_ticks) / faults
+                                           : 0));
+  }
+
+  uint64_t copies = 0, reuses = 0;
+  vmm_cow_get_stats(&copies, &reuses);
+  REPORT_OUT("cow faults: %llu copied, %llu reused\n",
+             (unsigned long long)copies, (unsigned long long)reuses);
+
+  return len;
+}
@@ -0,0 +1,390 @@
+/*
+ * UnixOS Kernel - High-Resolution Timers
+ *
+ * Timers are always queued on the CPU that arms them, whose hardware
+ * timer is then programmed for the earliest expiry. Callbacks run with
+ * the base unlocked, so they may re-arm timers or wake tasks.
+ */
+
+#include "sched/hrtimer.h"
+#include "arch/arch.h"
+#include "printk.h"
+#include "sched/sched.h"
+#include "sync/spinlock.h"
+#include "../core/process.h"
+
+struct hrtimer_base {
+    spinlock_t lock;
+    struct rb_root timers;
+    struct rb_node *leftmost;
+    struct hrtimer *running;    /* Callback in progress */
+    struct hrtimer tick;        /* Scheduler tick */
+    uint64_t tick_period;
+    bool tick_stopped;
+};
+
+static struct hrtimer_base bases[MAX_CPUS];
+
+/* ===================================================================== */
+/* Time conversion */
+/* ===================================================================== */
+
+uint64_t ticks_to_ns(uint64_t ticks)
+{
+    uint64_t freq = arch_timer_get_frequency();
+    if (!freq) {
+        return 0;
+    }
+    /* Split to avoid overflowing ticks * NSEC_PER_SEC */
+    return (ticks / freq) * NSEC_PER_SEC + (ticks % freq) * NSEC_PER_SEC / freq;
+}
+
+uint64_t ns_to_ticks(uint64_t ns)
+{
+    uint64_t freq = arch_timer_get_frequency();
+    return (ns / NSEC_PER_SEC) * freq +
+           ((ns % NSEC_PER_SEC) * freq + NSEC_PER_SEC - 1) / NSEC_PER_SEC;
+}
+
+uint64_t ktime_get_ns(void)
+{
+    return ticks_to_ns(arch_timer_get_ticks());
+}
+
+/* ===================================================================== */
+/* Timer queue */
+/* ===================================================================== */
+
+static inline struct hrtimer_base *this_base(void)
+{
+    uint32_t cpu = arch_cpu_id();
+    return &bases[cpu < MAX_CPUS ? cpu : 0];
+}
+
+static inline bool expired(uint64_t expires, uint64_t now)
+{
+    return (int64_t)(expires - now) <= 0;
+}
+
+static void enqueue_timer(struct hrtimer_base *base, struct hrtimer *timer)
+{
+    struct rb_node **link = &base->timers.rb_node, *parent = NULL;
+    bool leftmost = true;
+
+    while (*link) {
+        parent = *link;
+        struct hrtimer *entry = rb_entry(parent, struct hrtimer, node);
+        if ((int64_t)(timer->expires - entry->expires) < 0) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = false;
+        }
+    }
+
+    if (leftmost) {
+        base->leftmost = &timer->node;
+    }
+    rb_link_node(&timer->node, parent, link);
+    rb_insert_color(&timer->node, &base->timers);
+    timer->base = base;
+    timer->queued = true;
+}
+
+static void dequeue_timer(struct hrtimer_base *base, struct hrtimer *timer)
+{
+    if (base->leftmost == &timer->node) {
+        base->leftmost = rb_next(&timer->node);
+    }
+    rb_erase(&timer->node, &base->timers);
+    timer->queued = false;
+}
+
+/* Program this CPU's hardware timer for its earliest timer (base locked) */
+static void reprogram(struct hrtimer_base *base)
+{
+    struct hrtimer *first = rb_entry_safe(base->leftmost, struct hrtimer, node);
+
+    /* With nothing pending, fire as late as the hardware allows */
+    arch_timer_program(first ? first->expires
+                             : arch_timer_get_ticks() + ~0ULL / 2);
+}
+
+/* Lock the base @timer is queued on, following it if it moves */
+static struct hrtimer_base *lock_timer_base(struct hrtimer *timer,
+                                            unsigned long *flags)
+{
+    for (;;) {
+        struct hrtimer_base *base = timer->base;
+        if (!base) {
+            return NULL;
+        }
+        *flags = spin_lock_irqsave(&base->lock);
+        if (base == timer->base) {
+            return base;
+        }
+        spin_unlock_irqrestore(&base->lock, *flags);
+    }
+}
+
+void hrtimer_init(struct hrtimer *timer,
+                  enum hrtimer_restart (*function)(struct hrtimer *))
+{
+    timer->node.rb_parent = NULL;
+    timer->node.rb_left = timer->node.rb_right = NULL;
+    timer->expires = 0;
+    timer->function = function;
+    timer->base = NULL;
+    timer->queued = false;
+}
+
+void hrtimer_start(struct hrtimer *timer, uint64_t expires)
+{
+    unsigned long flags;
+    struct hrtimer_base *old = lock_timer_base(timer, &flags);
+    if (old) {
+        if (timer->queued) {
+            dequeue_timer(old, timer);
+        }
+        spin_unlock_irqrestore(&old->lock, flags);
+    }
+
+    flags = arch_irq_save();
+    struct hrtimer_base *base = this_base();
+    spin_lock(&base->lock);
+
+    timer->expires = expires;
+    enqueue_timer(base, timer);
+    if (base->leftmost == &timer->node) {
+        reprogram(base);
+    }
+
+    spin_unlock(&base->lock);
+    arch_irq_restore(flags);
+}
+
+bool hrtimer_cancel(struct hrtimer *timer)
+{
+    for (;;) {
+        unsigned long flags;
+        struct hrtimer_base *base = lock_timer_base(timer, &flags);
+        if (!base) {
+            return false;
+        }
+
+        /* Its callback may still be using it on another CPU */
+        if (base->running == timer && base != this_base()) {
+            spin_unlock_irqrestore(&base->lock, flags);
+            continue;
+        }
+
+        bool was_queued = timer->queued;
+        if (was_queued) {
+            dequeue_timer(base, timer);
+        }
+        spin_unlock_irqrestore(&base->lock, flags);
+        return was_queued;
+    }
+}
+
+uint64_t hrtimer_forward(struct hrtimer *timer, uint64_t now, uint64_t interval)
+{
+    if (!interval || !expired(timer->expires, now)) {
+        return 0;
+    }
+
+    uint64_t periods = (now - timer->expires) / interval + 1;
+    timer->expires += periods * interval;
+    return periods;
+}
+
+void hrtimer_interrupt(void)
+{
+    struct hrtimer_base *base = this_base();
+
+    spin_lock(&base->lock);
+
+    uint64_t now = arch_timer_get_ticks();
+    struct hrtimer *timer;
+    while ((timer = rb_entry_safe(base->leftmost, struct hrtimer, node)) &&
+           expired(timer->expires, now)) {
+        dequeue_timer(base, timer);
+        base->running = timer;
+        spin_unlock(&base->lock);
+
+        enum hrtimer_restart restart = timer->function(timer);
+
+        spin_lock(&base->lock);
+        if (restart == HRTIMER_RESTART && !timer->queued) {
+            enqueue_timer(base, timer);
+        }
+        base->running = NULL;
+        now = arch_timer_get_ticks();
+    }
+
+    reprogram(base);
+    spin_unlock(&base->lock);
+}
+
+/* ===================================================================== */
+/* Scheduler tick */
+/* ===================================================================== */
+
+static enum hrtimer_restart tick_sched_timer(struct hrtimer *timer)
+{
+    sched_tick();
+
+    /* Only the boot CPU runs user processes */
+    if (arch_cpu_id() == 0) {
+        process_schedule_from_irq();
+    }
+
+    hrtimer_forward(timer, arch_timer_get_ticks(), this_base()->tick_period);
+    return HRTIMER_RESTART;
+}
+
+void hrtimer_init_cpu(void)
+{
+    struct hrtimer_base *base = this_base();
+
+    spin_lock_init(&base->lock);
+    base->timers = RB_ROOT;
+    base->leftmost = NULL;
+    base->running = NULL;
+    base->tick_period = arch_timer_get_frequency() / HZ;
+    base->tick_stopped = false;
+
+    hrtimer_init(&base->tick, tick_sched_timer);
+    hrtimer_start(&base->tick, arch_timer_get_ticks() + base->tick_period);
+}
+
+void tick_nohz_idle(void)
+{
+    unsigned long flags = arch_irq_save();
+    struct hrtimer_base *base = this_base();
+
+    /* Anything queued or woken since the idle loop looked runs first */
+    if (arch_cpu_id() == 0 || !sched_cpu_idle()) {
+        arch_irq_restore(flags);
+        arch_idle();
+        return;
+    }
+
+    hrtimer_cancel(&base->tick);
+    base->tick_stopped = true;
+
+    /* IRQs stay masked: a pending interrupt still ends the wfi */
+    arch_idle();
+
+    /* Resume on the tick grid, skipping the ticks slept through */
+    base->tick_stopped = false;
+    hrtimer_forward(&base->tick, arch_timer_get_ticks(), base->tick_period);
+    hrtimer_start(&base->tick, base->tick.expires);
+
+    arch_irq_restore(flags);
+}
+
+/* ===================================================================== */
+/* Sleeping */
+/* ===================================================================== */
+
+struct hrtimer_sleeper {
+    struct hrtimer timer;
+    struct task_struct *task;   /* Cleared when the timer fires */
+};
+
+static enum hrtimer_restart hrtimer_wakeup(struct hrtimer *timer)
+{
+    struct hrtimer_sleeper *sl = container_of(timer, struct hrtimer_sleeper, timer);
+    struct task_struct *task = sl->task;
+
+    __atomic_store_n(&sl->task, NULL, __ATOMIC_RELEASE);
+    if (task) {
+        wake_up_process(task);
+    }
+    return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart hrtimer_nop(struct hrtimer *timer)
+{
+    (void)timer;
+    return HRTIMER_NORESTART;
+}
+
+static inline bool signal_pending(struct task_struct *task)
+{
+    return (task->pending_signals & ~task->blocked_signals) != 0;
+}
+
+/* Block a scheduler task until @expires */
+static int task_sleep_until(struct task_struct *task, uint64_t expires)
+{
+    struct hrtimer_sleeper sl;
+    int ret = 0;
+
+    hrtimer_init(&sl.timer, hrtimer_wakeup);
+    sl.task = task;
+
+    /* Sleeping before arming means an early expiry still wakes us */
+    task->state = TASK_INTERRUPTIBLE;
+    hrtimer_start(&sl.timer, expires);
+
+    while (__atomic_load_n(&sl.task, __ATOMIC_ACQUIRE)) {
+        if (signal_pending(task)) {
+            ret = -4;   /* EINTR */
+            break;
+        }
+        schedule();
+        task->state = TASK_INTERRUPTIBLE;
+    }
+
+    hrtimer_cancel(&sl.timer);
+    task->state = TASK_RUNNING;
+    return ret;
+}
+
+/* The boot CPU's kernel context cannot block: idle until the timer */
+static void idle_wait_until(uint64_t expires)
+{
+    struct hrtimer timer;
+
+    hrtimer_init(&timer, hrtimer_nop);
+    hrtimer_start(&timer, expires);
+    while (!expired(expires, arch_timer_get_ticks())) {
+        arch_idle();
+    }
+    hrtimer_cancel(&timer);
+}
+
+int hrtimer_sleep_until(uint64_t expires)
+{
+    if (expired(expires, arch_timer_get_ticks())) {
+        return 0;
+    }
+
+    /* User processes run on the boot CPU beside its idle task */
+    if (arch_cpu_id() == 0 && process_current()) {
+        process_sleep_until(expires);
+        return 0;
+    }
+
+    struct task_struct *task = get_current();
+    if (task && !(task->flags & PF_IDLE)) {
+        return task_sleep_until(task, expires);
+    }
+
+    idle_wait_until(expires);
+    return 0;
+}
+
+int hrtimer_nanosleep(uint64_t ns, uint64_t *rem)
+{
+    uint64_t expires = arch_timer_get_ticks() + ns_to_ticks(ns);
+    int ret = hrtimer_sleep_until(expires);
+
+    if (rem) {
+        uint64_t now = arch_timer_get_ticks();
+        *rem = (ret && !expired(expires, now)) ? ticks_to_ns(expires - now) : 0;
+    }
+    return ret;
+}
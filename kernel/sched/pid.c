@@ -0,0 +1,169 @@
+/*
+ * UnixOS Kernel - Process IDs
+ *
+ * One bit per PID, plus a summary bit per 64-bit word of the map that
+ * is set while the word is full. Allocation checks the rest of the
+ * current word, then skips full words 64 at a time through the summary,
+ * so it touches a handful of words however many PIDs are taken.
+ */
+
+#include "sched/pid.h"
+
+#define PID_WORDS (PID_MAX / 64)
+#define PID_SUMMARY_WORDS (PID_WORDS / 64)
+
+static uint64_t pid_map[PID_WORDS] = { 1 };   /* PID 0 is never handed out */
+static uint64_t pid_full[PID_SUMMARY_WORDS];  /* Bit set: pid_map word full */
+static pid_t last_pid;
+static unsigned int nr_pids;
+static DEFINE_SPINLOCK(pid_lock);
+
+/* ===================================================================== */
+/* Allocator */
+/* ===================================================================== */
+
+/* First map word at or after @word with a free bit, or -1 */
+static int find_free_word(unsigned int word)
+{
+    for (unsigned int i = word / 64; i < PID_SUMMARY_WORDS; i++) {
+        uint64_t avail = ~pid_full[i];
+        if (i == word / 64) {
+            avail &= ~0ULL << (word % 64);
+        }
+        if (avail) {
+            return (int)(i * 64 + __builtin_ctzll(avail));
+        }
+    }
+    return -1;
+}
+
+/* First free PID at or after @start, or -1 (pid_lock held) */
+static pid_t find_free_pid(pid_t start)
+{
+    unsigned int word = (unsigned int)start / 64;
+    uint64_t avail = ~pid_map[word] & (~0ULL << (start % 64));
+    if (avail) {
+        return (pid_t)(word * 64 + __builtin_ctzll(avail));
+    }
+
+    int next = find_free_word(word + 1);
+    if (next < 0) {
+        return -1;
+    }
+    return (pid_t)(next * 64 + __builtin_ctzll(~pid_map[next]));
+}
+
+pid_t pid_alloc(void)
+{
+    uint64_t flags = spin_lock_irqsave(&pid_lock);
+
+    pid_t start = (last_pid + 1 < PID_MAX) ? last_pid + 1 : 1;
+    pid_t nr = find_free_pid(start);
+    if (nr < 0 && start > 1) {
+        nr = find_free_pid(1);
+    }
+
+    if (nr > 0) {
+        unsigned int word = (unsigned int)nr / 64;
+        pid_map[word] |= 1ULL << (nr % 64);
+        if (pid_map[word] == ~0ULL) {
+            pid_full[word / 64] |= 1ULL << (word % 64);
+        }
+        last_pid = nr;
+        nr_pids++;
+    }
+
+    spin_unlock_irqrestore(&pid_lock, flags);
+    return nr > 0 ? nr : -1;
+}
+
+void pid_free(pid_t nr)
+{
+    if (nr <= 0 || nr >= PID_MAX) {
+        return;
+    }
+
+    unsigned int word = (unsigned int)nr / 64;
+    uint64_t flags = spin_lock_irqsave(&pid_lock);
+    if (pid_map[word] & (1ULL << (nr % 64))) {
+        pid_map[word] &= ~(1ULL << (nr % 64));
+        pid_full[word / 64] &= ~(1ULL << (word % 64));
+        nr_pids--;
+    }
+    spin_unlock_irqrestore(&pid_lock, flags);
+}
+
+unsigned int pid_nr_allocated(void)
+{
+    return __atomic_load_n(&nr_pids, __ATOMIC_RELAXED);
+}
+
+/* ===================================================================== */
+/* PID hash */
+/* ===================================================================== */
+
+static inline unsigned int pid_hashfn(pid_t nr)
+{
+    /* PIDs are handed out in sequence, so the low bits spread well */
+    return (unsigned int)nr & (PID_HASH_SIZE - 1);
+}
+
+void pid_hash_init(struct pid_hash *hash)
+{
+    spin_lock_init(&hash->lock);
+    for (int i = 0; i < PID_HASH_SIZE; i++) {
+        hash->buckets[i] = NULL;
+    }
+}
+
+void pid_hash_add(struct pid_hash *hash, struct pid_node *node, pid_t nr)
+{
+    struct pid_node **bucket = &hash->buckets[pid_hashfn(nr)];
+
+    node->nr = nr;
+    uint64_t flags = spin_lock_irqsave(&hash->lock);
+    node->next = *bucket;
+    *bucket = node;
+    spin_unlock_irqrestore(&hash->lock, flags);
+}
+
+void pid_hash_del(struct pid_hash *hash, struct pid_node *node)
+{
+    uint64_t flags = spin_lock_irqsave(&hash->lock);
+    struct pid_node **link = &hash->buckets[pid_hashfn(node->nr)];
+    while (*link && *link != node) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = node->next;
+    }
+    spin_unlock_irqrestore(&hash->lock, flags);
+    node->next = NULL;
+}
+
+struct pid_node *pid_hash_find(struct pid_hash *hash, pid_t nr,
+                               void (*get)(struct pid_node *node))
+{
+    uint64_t flags = spin_lock_irqsave(&hash->lock);
+    struct pid_node *node = hash->buckets[pid_hashfn(nr)];
+    while (node && node->nr != nr) {
+        node = node->next;
+    }
+    if (node) {
+        get(node);
+    }
+    spin_unlock_irqrestore(&hash->lock, flags);
+    return node;
+}
+
+void pid_hash_for_each(struct pid_hash *hash,
+                       void (*fn)(struct pid_node *node, void *arg), void *arg)
+{
+    uint64_t flags = spin_lock_irqsave(&hash->lock);
+    for (unsigned int i = 0; i < PID_HASH_SIZE; i++) {
+        for (struct pid_node *node = hash->buckets[i]; node; node = node->next) {
+            fn(node, arg);
+        }
+    }
+    spin_unlock_irqrestore(&hash->lock, flags);
+}
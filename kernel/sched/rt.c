@@ -0,0 +1,177 @@
+/*
+ * UnixOS Kernel - Real-Time Scheduling Class
+ *
+ * Picking is O(1): the highest set bit of the bitmap names the first
+ * non-empty priority, and its FIFO's head runs.
+ */
+
+#include "sched/rt.h"
+#include "arch/arch.h"
+
+/* ===================================================================== */
+/* Helpers */
+/* ===================================================================== */
+
+static inline uint64_t ms_to_ticks(uint64_t ms)
+{
+    return arch_timer_get_frequency() * ms / 1000;
+}
+
+static inline void prio_set(struct rt_rq *rt, int prio)
+{
+    rt->bitmap[prio / 64] |= 1ULL << (prio % 64);
+}
+
+static inline void prio_clear(struct rt_rq *rt, int prio)
+{
+    rt->bitmap[prio / 64] &= ~(1ULL << (prio % 64));
+}
+
+/* Unlink @rt_se from its FIFO, leaving the counts alone */
+static void fifo_unlink(struct rt_rq *rt, struct sched_rt_entity *rt_se)
+{
+    int prio = rt_se->prio;
+
+    if (rt_se->prev) {
+        rt_se->prev->next = rt_se->next;
+    } else {
+        rt->head[prio] = rt_se->next;
+    }
+    if (rt_se->next) {
+        rt_se->next->prev = rt_se->prev;
+    } else {
+        rt->tail[prio] = rt_se->prev;
+    }
+    rt_se->next = rt_se->prev = NULL;
+
+    if (!rt->head[prio]) {
+        prio_clear(rt, prio);
+    }
+}
+
+static void fifo_add_tail(struct rt_rq *rt, struct sched_rt_entity *rt_se)
+{
+    int prio = rt_se->prio;
+
+    rt_se->next = NULL;
+    rt_se->prev = rt->tail[prio];
+    if (rt->tail[prio]) {
+        rt->tail[prio]->next = rt_se;
+    } else {
+        rt->head[prio] = rt_se;
+    }
+    rt->tail[prio] = rt_se;
+    prio_set(rt, prio);
+}
+
+static void fifo_add_head(struct rt_rq *rt, struct sched_rt_entity *rt_se)
+{
+    int prio = rt_se->prio;
+
+    rt_se->prev = NULL;
+    rt_se->next = rt->head[prio];
+    if (rt->head[prio]) {
+        rt->head[prio]->prev = rt_se;
+    } else {
+        rt->tail[prio] = rt_se;
+    }
+    rt->head[prio] = rt_se;
+    prio_set(rt, prio);
+}
+
+/* ===================================================================== */
+/* Run queue */
+/* ===================================================================== */
+
+void rt_rq_init(struct rt_rq *rt)
+{
+    rt->bitmap[0] = rt->bitmap[1] = 0;
+    for (int prio = 0; prio < MAX_RT_PRIO; prio++) {
+        rt->head[prio] = NULL;
+        rt->tail[prio] = NULL;
+    }
+    rt->nr_running = 0;
+}
+
+void rt_enqueue(struct rt_rq *rt, struct sched_rt_entity *rt_se, int prio,
+                bool head)
+{
+    if (prio < 1) {
+        prio = 1;
+    } else if (prio >= MAX_RT_PRIO) {
+        prio = MAX_RT_PRIO - 1;
+    }
+
+    rt_se->prio = prio;
+    if (head) {
+        fifo_add_head(rt, rt_se);
+    } else {
+        fifo_add_tail(rt, rt_se);
+    }
+    rt_se->on_rq = true;
+    rt->nr_running++;
+}
+
+void rt_dequeue(struct rt_rq *rt, struct sched_rt_entity *rt_se)
+{
+    fifo_unlink(rt, rt_se);
+    rt_se->on_rq = false;
+    rt->nr_running--;
+}
+
+void rt_requeue(struct rt_rq *rt, struct sched_rt_entity *rt_se)
+{
+    /* Already last, or alone at its priority */
+    if (!rt_se->next) {
+        return;
+    }
+    fifo_unlink(rt, rt_se);
+    fifo_add_tail(rt, rt_se);
+}
+
+struct sched_rt_entity *rt_first(struct rt_rq *rt)
+{
+    if (rt->bitmap[1]) {
+        return rt->head[64 + 63 - __builtin_clzll(rt->bitmap[1])];
+    }
+    if (rt->bitmap[0]) {
+        return rt->head[63 - __builtin_clzll(rt->bitmap[0])];
+    }
+    return NULL;
+}
+
+uint64_t rt_timeslice(void)
+{
+    return ms_to_ticks(RR_TIMESLICE_MS);
+}
+
+/* ===================================================================== */
+/* Throttling */
+/* ===================================================================== */
+
+void rt_bandwidth_init(struct rt_bandwidth *b, uint64_t now)
+{
+    b->period_start = now;
+    b->runtime = 0;
+    b->throttled = false;
+    b->nr_throttled = 0;
+}
+
+bool rt_bandwidth_account(struct rt_bandwidth *b, uint64_t now, uint64_t delta)
+{
+    uint64_t period = ms_to_ticks(RT_PERIOD_MS);
+
+    if (now - b->period_start >= period) {
+        /* Whole periods may have gone by with nothing real-time running */
+        b->period_start = now - (now - b->period_start) % period;
+        b->runtime = 0;
+        b->throttled = false;
+    }
+
+    b->runtime += delta;
+    if (!b->throttled && b->runtime >= ms_to_ticks(RT_RUNTIME_MS)) {
+        b->throttled = true;
+        b->nr_throttled++;
+    }
+    return b->throttled;
+}
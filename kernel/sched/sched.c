@@ -1,25 +1,44 @@
 /*
  * UnixOS Kernel - Scheduler Implementation
+ *
+ * One run queue per CPU. New and woken tasks go to the least loaded CPU,
+ * and a CPU that runs out of work pulls a waiting task from the busiest
+ * one. CPU0's idle task is the desktop main loop, which only yields
+ * cooperatively, so once secondaries are online normal tasks are placed
+ * on them and CPU0 keeps to the desktop, user processes and its own
+ * idle-priority threads.
+ *
+ * Within a CPU, real-time tasks (rt.c) run first, by priority, while
+ * their runtime allowance lasts. Normal tasks share what is left by
+ * weight through the fair class (fair.c), preempting each other on the
+ * tick when a slice runs out and on wakeup when the woken task is far
+ * enough behind.
  */
 
 #include "sched/sched.h"
+#include "arch/arch.h"
+#include "mm/kmalloc.h"
 #include "mm/pmm.h"
+#include "mm/slab.h"
 #include "printk.h"
+#include "sched/hrtimer.h"
+#include "string.h"
+
+/* enqueue_task() flag: a real-time task goes ahead of its equals */
+#define ENQUEUE_HEAD (1 << 2)
 
 /* ===================================================================== */
 /* Static data */
 /* ===================================================================== */
 
-/* Global run queue (single CPU for now) */
-static struct rq runqueue;
+static struct rq runqueues[MAX_CPUS];
+static unsigned int nr_cpus_online = 1;
 
-/* Task pool (simple allocation for now) */
-#define MAX_TASKS   256
-static struct task_struct task_pool[MAX_TASKS];
-static int task_pool_index = 0;
+/* Task structures come from a slab cache and go back when reaped */
+static struct kmem_cache *task_cache;
 
-/* PID counter */
-static pid_t next_pid = 1;
+/* Live tasks by PID */
+static struct pid_hash task_pids;
 
 /* Init task (PID 0 / swapper) */
 static struct task_struct init_task = {
@@ -31,38 +50,61 @@ static struct task_struct init_task = {
     .tgid = 0,
     .comm = "swapper",
     .flags = PF_KTHREAD | PF_IDLE,
+    .usage = 1,
 };
 
+/* Idle tasks of the secondary CPUs: their boot code, once scheduling */
+static struct task_struct idle_tasks[MAX_CPUS];
+
 /* ===================================================================== */
 /* Helper functions */
 /* ===================================================================== */
 
+static inline struct rq *this_rq(void)
+{
+    uint32_t cpu = arch_cpu_id();
+    return &runqueues[cpu < MAX_CPUS ? cpu : 0];
+}
+
 static struct task_struct *alloc_task(void)
 {
-    if (task_pool_index >= MAX_TASKS) {
+    if (!task_cache) {
         return NULL;
     }
     
-    struct task_struct *task = &task_pool[task_pool_index++];
+    struct task_struct *task = kmem_cache_alloc(task_cache, GFP_KERNEL);
+    if (!task) {
+        return NULL;
+    }
+    
+    memset(task, 0, sizeof(*task));
+    task->usage = 1;    /* Dropped by release_task() */
     
-    /* Zero initialize */
-    char *p = (char *)task;
-    for (size_t i = 0; i < sizeof(*task); i++) {
-        p[i] = 0;
+    task->pid = pid_alloc();
+    if (task->pid < 0) {
+        kmem_cache_free(task_cache, task);
+        return NULL;
     }
+    task->cpu = this_rq()->cpu;
+    task->start_time = arch_timer_get_ticks();
+    pid_hash_add(&task_pids, &task->pid_node, task->pid);
     
     return task;
 }
 
-static void *alloc_stack(size_t size)
+static unsigned int stack_order(size_t size)
 {
-    /* Allocate kernel stack pages */
     unsigned int order = 0;
     while ((PAGE_SIZE << order) < size && order < 10) {
         order++;
     }
-    
-    phys_addr_t paddr = pmm_alloc_pages(order);
+    return order;
+}
+
+static void *alloc_stack(size_t size)
+{
+    /* Allocate kernel stack pages */
+    phys_addr_t paddr = pmm_alloc_pages(stack_order(size));
     if (!paddr) {
         return NULL;
     }
@@ -70,100 +112,569 @@ static void *alloc_stack(size_t size)
     return (void *)paddr;  /* Identity mapped for now */
 }
 
-static void enqueue_task(struct task_struct *task)
+/*
+ * Free a task that will never run again: its PID, its kernel stack and
+ * its own reference to the structure, which goes back to the cache once
+ * whoever looked it up by PID is done with it. The caller must not be
+ * running on that stack.
+ */
+static void release_task(struct task_struct *task)
 {
-    task->state = TASK_RUNNING;
+    pid_hash_del(&task_pids, &task->pid_node);
+    pid_free(task->pid);
     
-    if (!runqueue.head) {
-        runqueue.head = runqueue.tail = task;
-        task->next = task->prev = NULL;
-    } else {
-        task->prev = runqueue.tail;
-        task->next = NULL;
-        runqueue.tail->next = task;
-        runqueue.tail = task;
+    /* stack_size is 0 for a stack the creator supplied */
+    if (task->stack && task->stack_size) {
+        pmm_free_pages((phys_addr_t)task->stack, stack_order(task->stack_size));
     }
+    task->stack = NULL;
     
-    runqueue.nr_running++;
+    task->state = TASK_DEAD;
+    put_task_struct(task);
 }
 
-static void dequeue_task(struct task_struct *task)
+void put_task_struct(struct task_struct *task)
 {
-    if (task->prev) {
-        task->prev->next = task->next;
+    if (__atomic_sub_fetch(&task->usage, 1, __ATOMIC_ACQ_REL) == 0) {
+        kmem_cache_free(task_cache, task);
+    }
+}
+
+static void task_get_node(struct pid_node *node)
+{
+    get_task_struct(container_of(node, struct task_struct, pid_node));
+}
+
+static inline bool task_on_rq(struct task_struct *task)
+{
+    return task->se.on_rq;
+}
+
+static inline struct task_struct *task_of(struct sched_entity *se)
+{
+    return container_of(se, struct task_struct, se);
+}
+
+static inline struct task_struct *rt_task_of(struct sched_rt_entity *rt_se)
+{
+    return container_of(rt_se, struct task_struct, rt);
+}
+
+/* Whether @task belongs on the real-time queue when runnable */
+static inline bool task_is_rt(struct task_struct *task)
+{
+    return task_rt_prio(task) && !(task->flags & PF_IDLEPRIO);
+}
+
+/* Normal and real-time tasks queued on @rq, counting the running one */
+static inline unsigned int rq_load(struct rq *rq)
+{
+    return rq->cfs.nr_running + rq->rt.nr_running;
+}
+
+static void enqueue_task(struct rq *rq, struct task_struct *task, int flags)
+{
+    task->cpu = rq->cpu;
+    
+    if (task->flags & PF_IDLEPRIO) {
+        task->prev = rq->tail;
+        task->next = NULL;
+        if (rq->tail) {
+            rq->tail->next = task;
+        } else {
+            rq->head = task;
+        }
+        rq->tail = task;
+        task->se.on_rq = true;
+        rq->nr_idleprio++;
+    } else if (task_is_rt(task)) {
+        rt_enqueue(&rq->rt, &task->rt, task_rt_prio(task), flags & ENQUEUE_HEAD);
+        task->se.on_rq = true;
     } else {
-        runqueue.head = task->next;
+        fair_enqueue(&rq->cfs, &task->se, flags);
     }
     
-    if (task->next) {
-        task->next->prev = task->prev;
+    rq->nr_running++;
+}
+
+static void dequeue_task(struct rq *rq, struct task_struct *task, int flags)
+{
+    if (task->flags & PF_IDLEPRIO) {
+        if (task->prev) {
+            task->prev->next = task->next;
+        } else {
+            rq->head = task->next;
+        }
+        if (task->next) {
+            task->next->prev = task->prev;
+        } else {
+            rq->tail = task->prev;
+        }
+        task->next = task->prev = NULL;
+        task->se.on_rq = false;
+        rq->nr_idleprio--;
+    } else if (task->rt.on_rq) {
+        rt_dequeue(&rq->rt, &task->rt);
+        task->se.on_rq = false;
     } else {
-        runqueue.tail = task->prev;
+        fair_dequeue(&rq->cfs, &task->se, flags);
     }
     
-    task->next = task->prev = NULL;
+    rq->nr_running--;
+}
+
+/* Lock the run queue @task is on; interrupts must be off */
+static struct rq *task_rq_lock(struct task_struct *task)
+{
+    for (;;) {
+        struct rq *rq = &runqueues[task->cpu];
+        spin_lock(&rq->lock);
+        if (rq->cpu == task->cpu) {
+            return rq;
+        }
+        /* Migrated while we waited */
+        spin_unlock(&rq->lock);
+    }
+}
+
+/* Pick the CPU for a task becoming runnable */
+static unsigned int select_task_rq(struct task_struct *task)
+{
+    /* Bound and idle-priority threads stay where they were started */
+    if ((task->flags & (PF_PERCPU | PF_IDLEPRIO)) || nr_cpus_online == 1) {
+        return task->cpu;
+    }
     
-    if (runqueue.nr_running > 0) {
-        runqueue.nr_running--;
+    /* Least loaded secondary, preferring the last CPU on a tie */
+    unsigned int best = task->cpu;
+    unsigned int best_load = best ? rq_load(&runqueues[best]) : ~0U;
+    for (unsigned int cpu = 1; cpu < MAX_CPUS; cpu++) {
+        struct rq *rq = &runqueues[cpu];
+        if (rq->online && rq_load(rq) < best_load) {
+            best = cpu;
+            best_load = rq_load(rq);
+        }
     }
+    return best;
 }
 
-static struct task_struct *pick_next_task(void)
+/*
+ * Whether @task, just queued on @rq, should preempt what runs there (rq
+ * locked). Real-time tasks preempt any lower priority unless throttled;
+ * normal tasks preempt idle-priority ones and each other by vruntime.
+ */
+static bool check_preempt(struct rq *rq, struct task_struct *task)
 {
-    /* Simple round-robin: pick head of queue */
-    struct task_struct *next = runqueue.head;
+    struct task_struct *curr = rq->current;
+    if (curr == task || (task->flags & PF_IDLEPRIO)) {
+        return false;
+    }
+    if (curr == rq->idle || (curr->flags & PF_IDLEPRIO)) {
+        return true;
+    }
     
-    if (!next) {
-        /* No runnable tasks - return idle task */
-        return runqueue.idle;
+    if (curr->rt.on_rq || task->rt.on_rq) {
+        return task->rt.on_rq && !rq->rt_bw.throttled &&
+               (!curr->rt.on_rq || task->rt.prio > curr->rt.prio);
     }
+    return fair_check_preempt_wakeup(&curr->se, &task->se);
+}
+
+/* Queue @task on @cpu and kick that CPU if @task should run now */
+static void activate_task(struct task_struct *task, unsigned int cpu, int flags)
+{
+    struct rq *rq = &runqueues[cpu];
+    
+    spin_lock(&rq->lock);
+    task->state = TASK_RUNNING;
+    enqueue_task(rq, task, flags);
+    sched_info_queued(&task->sched_info, arch_timer_get_ticks(),
+                      flags & ENQUEUE_WAKEUP);
     
-    return next;
+    bool kick = check_preempt(rq, task);
+    if (kick) {
+        rq->need_resched = true;
+    }
+    spin_unlock(&rq->lock);
+    
+    /* No-op for this CPU, which acts on need_resched by itself */
+    if (kick) {
+        smp_send_reschedule(cpu);
+    }
 }
 
-/* ===================================================================== */
-/* Public functions */
-/* ===================================================================== */
+/*
+ * Pull one waiting task from the busiest other CPU (rq locked). Only
+ * tasks that are queued but not running can move; their context was
+ * saved before the victim's lock was dropped. The victim gives up the
+ * task furthest behind, which keeps its lag relative to the new queue.
+ * Victims are only trylocked, so two CPUs stealing from each other
+ * cannot deadlock.
+ */
+static struct task_struct *steal_task(struct rq *rq)
+{
+    /* CPU0's idle loop is the desktop; it must not pick up long work */
+    if (rq->cpu == 0) {
+        return NULL;
+    }
+    
+    struct rq *busiest = NULL;
+    unsigned int max_waiting = 0;
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct rq *victim = &runqueues[cpu];
+        if (victim == rq || !victim->online) {
+            continue;
+        }
+        unsigned int waiting = victim->cfs.nr_running;
+        if (victim->cfs.curr) {
+            waiting--;
+        }
+        if (waiting > max_waiting) {
+            busiest = victim;
+            max_waiting = waiting;
+        }
+    }
+    
+    if (!busiest || !spin_trylock(&busiest->lock)) {
+        return NULL;
+    }
+    
+    /* The running task is never on the timeline */
+    struct sched_entity *se = fair_first(&busiest->cfs);
+    struct task_struct *task = se ? task_of(se) : NULL;
+    if (task && (task->flags & PF_PERCPU)) {
+        task = NULL;
+    }
+    if (task) {
+        dequeue_task(busiest, task, 0);
+        enqueue_task(rq, task, 0);
+        rq->nr_migrations++;
+    }
+    
+    spin_unlock(&busiest->lock);
+    return task;
+}
 
-void sched_init(void)
+/*
+ * Charge the running real-time task, if any, for the time since it was
+ * last charged (rq locked). Rotates an RR task whose slice ran out
+ * behind its equals.
+ *
+ * Return: True if it should make way: throttled, or its RR slice is over
+ * and another task of its priority is waiting
+ */
+static bool update_curr_rt(struct rq *rq)
 {
-    printk(KERN_INFO "SCHED: Initializing scheduler\n");
+    struct task_struct *curr = rq->current;
+    if (curr == rq->idle || !curr->rt.on_rq) {
+        return false;
+    }
     
-    /* Initialize run queue */
-    runqueue.current = &init_task;
-    runqueue.idle = &init_task;
-    runqueue.head = NULL;
-    runqueue.tail = NULL;
-    runqueue.nr_running = 0;
-    runqueue.clock = 0;
+    uint64_t now = arch_timer_get_ticks();
+    uint64_t delta = now - curr->rt.exec_start;
+    curr->rt.exec_start = now;
+    curr->se.sum_exec_runtime += delta;
     
-    printk(KERN_INFO "SCHED: Scheduler initialized\n");
+    if (rt_bandwidth_account(&rq->rt_bw, now, delta)) {
+        return true;
+    }
+    if (curr->policy != SCHED_RR) {
+        return false;
+    }
+    if (curr->rt.time_slice > delta) {
+        curr->rt.time_slice -= delta;
+        return false;
+    }
+    
+    curr->rt.time_slice = rt_timeslice();
+    if (curr->rt.next) {
+        rt_requeue(&rq->rt, &curr->rt);
+        return true;
+    }
+    return false;
 }
 
-void schedule(void)
+static struct task_struct *pick_next_task(struct rq *rq, struct task_struct *prev)
+{
+    /* Real-time tasks first, while they have runtime left this period */
+    struct sched_rt_entity *rt_se = rq->rt_bw.throttled ? NULL : rt_first(&rq->rt);
+    if (rt_se) {
+        rt_se->exec_start = arch_timer_get_ticks();
+        if (!rt_se->time_slice) {
+            rt_se->time_slice = rt_timeslice();
+        }
+        return rt_task_of(rt_se);
+    }
+    
+    /* Then fair tasks: the one furthest behind, else one stolen */
+    struct sched_entity *se = fair_first(&rq->cfs);
+    struct task_struct *next = se ? task_of(se) : steal_task(rq);
+    if (next) {
+        fair_set_next(&rq->cfs, &next->se);
+        return next;
+    }
+    
+    /* Idle-priority tasks borrow the idle task's time, one turn each */
+    if (prev == rq->idle && rq->head) {
+        return rq->head;
+    }
+    
+    /* No runnable tasks - return idle task */
+    return rq->idle;
+}
+
+/*
+ * Drop the run queue lock taken by the schedule() that switched to us,
+ * then reap the task we switched from if it exited: now that we are off
+ * its stack, nothing uses it any more.
+ */
+static inline void finish_task_switch(void)
 {
-    struct task_struct *prev = runqueue.current;
+    struct rq *rq = this_rq();
+    struct task_struct *prev = rq->prev;
+    
+    rq->prev = NULL;
+    spin_unlock(&rq->lock);
+    
+    if (prev && prev->state == TASK_ZOMBIE) {
+        release_task(prev);
+    }
+}
+
+/*
+ * Switch away from the current task. A voluntary call drops a task that
+ * is no longer TASK_RUNNING from the queue; a preemption leaves it
+ * queued, since it may be between setting its state and sleeping.
+ */
+static void __schedule(bool preempt)
+{
+    /* Wakeups may come from interrupt handlers */
+    unsigned long flags = arch_irq_save();
+    struct rq *rq = this_rq();
+    
+    spin_lock(&rq->lock);
+    
+    struct task_struct *prev = rq->current;
     struct task_struct *next;
     
-    /* Don't schedule if interrupts disabled (should check) */
+    rq->need_resched = false;
+    update_curr_rt(rq);
+    
+    /*
+     * Drop current if it stopped being runnable. One that yields goes
+     * behind its equals; a preempted real-time task stays first in line.
+     */
+    if (prev != rq->idle && task_on_rq(prev)) {
+        if (prev->state != TASK_RUNNING && !preempt) {
+            dequeue_task(rq, prev, DEQUEUE_SLEEP);
+        } else if (prev->flags & PF_IDLEPRIO) {
+            dequeue_task(rq, prev, 0);
+            enqueue_task(rq, prev, 0);
+        } else if (prev->rt.on_rq && !preempt) {
+            rt_requeue(&rq->rt, &prev->rt);
+        }
+    }
+    
+    /* A fair task still runnable goes back on the timeline */
+    fair_put_prev(&rq->cfs);
     
     /* Pick next task */
-    next = pick_next_task();
+    next = pick_next_task(rq, prev);
     
     if (next == prev) {
         /* Same task, no switch needed */
+        spin_unlock(&rq->lock);
+        arch_irq_restore(flags);
         return;
     }
     
-    /* Move current to end of queue if still runnable */
-    if (prev->state == TASK_RUNNING && prev != runqueue.idle) {
-        dequeue_task(prev);
-        enqueue_task(prev);
+    /* Account the switch; a task still queued starts waiting again */
+    uint64_t now = arch_timer_get_ticks();
+    if (prev != rq->idle) {
+        bool voluntary = !preempt && prev->state != TASK_RUNNING;
+        uint64_t ran = sched_info_depart(&prev->sched_info, &rq->info, now,
+                                         voluntary);
+        if (prev->flags & PF_KTHREAD) {
+            prev->stime += ran;
+        } else {
+            prev->utime += ran;
+        }
+        if (task_on_rq(prev)) {
+            sched_info_queued(&prev->sched_info, now, false);
+        }
+    }
+    if (next != rq->idle) {
+        sched_info_arrive(&next->sched_info, &rq->info, now);
     }
     
     /* Perform context switch */
-    runqueue.current = next;
+    rq->current = next;
+    rq->prev = prev;
+    rq->nr_switches++;
     context_switch(prev, next);
+    
+    /* Back on prev's stack, maybe on another CPU, holding its lock */
+    finish_task_switch();
+    arch_irq_restore(flags);
+}
+
+/* ===================================================================== */
+/* Public functions */
+/* ===================================================================== */
+
+void sched_init(void)
+{
+    printk(KERN_INFO "SCHED: Initializing scheduler\n");
+    
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct rq *rq = &runqueues[cpu];
+        spin_lock_init(&rq->lock);
+        rq->cpu = cpu;
+        rq->online = false;
+        rq->need_resched = false;
+        rq->current = NULL;
+        rq->prev = NULL;
+        rq->idle = NULL;
+        rt_rq_init(&rq->rt);
+        rt_bandwidth_init(&rq->rt_bw, arch_timer_get_ticks());
+        cfs_rq_init(&rq->cfs);
+        rq->head = NULL;
+        rq->tail = NULL;
+        rq->nr_running = 0;
+        rq->nr_idleprio = 0;
+        rq->clock = 0;
+        rq->nr_switches = 0;
+        rq->nr_migrations = 0;
+        rq->info = (struct sched_info){ 0 };
+    }
+    
+    pid_hash_init(&task_pids);
+    task_cache = kmem_cache_create("task_struct", sizeof(struct task_struct),
+                                   __alignof__(struct task_struct), 0);
+    if (!task_cache) {
+        printk(KERN_ERR "SCHED: Failed to create task cache\n");
+    }
+    
+    /* The boot CPU's run queue; the code calling us is its idle task */
+    runqueues[0].current = &init_task;
+    runqueues[0].idle = &init_task;
+    runqueues[0].online = true;
+    fpsimd_init_cpu(&init_task.fpsimd);
+    
+    printk(KERN_INFO "SCHED: Scheduler initialized\n");
+}
+
+void sched_init_secondary(unsigned int cpu)
+{
+    if (cpu == 0 || cpu >= MAX_CPUS) {
+        return;
+    }
+    
+    struct task_struct *idle = &idle_tasks[cpu];
+    struct rq *rq = &runqueues[cpu];
+    
+    idle->state = TASK_RUNNING;
+    idle->prio = PRIO_DEFAULT;
+    idle->static_prio = PRIO_DEFAULT;
+    idle->cpu = cpu;
+    idle->flags = PF_KTHREAD | PF_IDLE;
+    snprintf(idle->comm, TASK_COMM_LEN, "swapper/%u", cpu);
+    
+    rq->current = idle;
+    rq->idle = idle;
+    fpsimd_init_cpu(&idle->fpsimd);
+    
+    /* Visible to select_task_rq() and steal_task() from here on */
+    __atomic_store_n(&rq->online, true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&nr_cpus_online, 1, __ATOMIC_SEQ_CST);
+}
+
+void schedule(void)
+{
+    __schedule(false);
+}
+
+void schedule_tail(void)
+{
+    finish_task_switch();
+}
+
+void sched_tick(void)
+{
+    struct rq *rq = this_rq();
+    
+    spin_lock(&rq->lock);
+    rq->clock++;
+    
+    /* A throttle that lifts lets waiting real-time tasks back in */
+    if (rq->rt_bw.throttled &&
+        !rt_bandwidth_account(&rq->rt_bw, arch_timer_get_ticks(), 0) &&
+        rq->rt.nr_running) {
+        rq->need_resched = true;
+    }
+    
+    if (rq->current != rq->idle && rq->current->rt.on_rq) {
+        if (update_curr_rt(rq)) {
+            rq->need_resched = true;
+        }
+    } else if (rq->cfs.curr) {
+        fair_update_curr(&rq->cfs);
+        if (fair_check_preempt_tick(&rq->cfs)) {
+            rq->need_resched = true;
+        }
+    } else {
+        /* Idle or idle-priority: give way to anything else queued */
+        unsigned int others = rq->nr_running;
+        if (rq->current != rq->idle && others) {
+            others--;
+        }
+        if (others) {
+            rq->need_resched = true;
+        }
+    }
+    
+    spin_unlock(&rq->lock);
+}
+
+bool sched_cpu_idle(void)
+{
+    struct rq *rq = this_rq();
+    return rq->current == rq->idle && !rq->need_resched &&
+           !__atomic_load_n(&rq->nr_running, __ATOMIC_ACQUIRE);
+}
+
+bool task_curr(struct task_struct *task)
+{
+    uint32_t cpu = task->cpu;
+    return cpu < MAX_CPUS &&
+           __atomic_load_n(&runqueues[cpu].current, __ATOMIC_RELAXED) == task;
+}
+
+bool sched_cpu_online(unsigned int cpu)
+{
+    return cpu < MAX_CPUS &&
+           __atomic_load_n(&runqueues[cpu].online, __ATOMIC_ACQUIRE);
+}
+
+bool need_resched(void)
+{
+    return this_rq()->need_resched;
+}
+
+uint64_t sched_nr_switches(void)
+{
+    uint64_t total = 0;
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        total += __atomic_load_n(&runqueues[cpu].nr_switches, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+void sched_irq_exit(void)
+{
+    if (this_rq()->need_resched) {
+        __schedule(true);
+    }
 }
 
 int wake_up_process(struct task_struct *task)
@@ -172,30 +683,59 @@ int wake_up_process(struct task_struct *task)
         return 0;
     }
     
+    unsigned long flags = arch_irq_save();
+    struct rq *rq = task_rq_lock(task);
+    
     if (task->state == TASK_RUNNING) {
+        spin_unlock(&rq->lock);
+        arch_irq_restore(flags);
         return 0;  /* Already running */
     }
+    if (task->state == TASK_ZOMBIE || task->state == TASK_DEAD) {
+        spin_unlock(&rq->lock);
+        arch_irq_restore(flags);
+        return 0;  /* Exited; found by PID before it went */
+    }
     
-    /* Make runnable */
+    /* Make runnable; a task that has not yet slept is still queued */
+    if (task_on_rq(task)) {
+        task->state = TASK_RUNNING;
+        spin_unlock(&rq->lock);
+        arch_irq_restore(flags);
+        return 1;
+    }
+    
+    /* Claim the wakeup so nobody else queues it, then place it */
     task->state = TASK_RUNNING;
-    enqueue_task(task);
+    if (!task_is_rt(task)) {
+        task->se.vruntime -= rq->cfs.min_vruntime;
+    }
+    spin_unlock(&rq->lock);
+    activate_task(task, select_task_rq(task), ENQUEUE_WAKEUP);
     
+    arch_irq_restore(flags);
     return 1;
 }
 
-struct task_struct *create_task(void (*entry)(void *), void *arg, uint32_t flags)
+/* Create a kernel task, not yet queued; a PF_PERCPU one goes on @cpu */
+static struct task_struct *new_task(void (*entry)(void *), void *arg,
+                                    uint32_t flags, unsigned int cpu)
 {
     struct task_struct *task = alloc_task();
     if (!task) {
         printk(KERN_ERR "SCHED: Failed to allocate task\n");
         return NULL;
     }
+    if (flags & PF_PERCPU) {
+        task->cpu = cpu;
+    }
     
     /* Allocate kernel stack */
     #define KERNEL_STACK_SIZE   (16 * 1024)  /* 16KB */
     void *stack = alloc_stack(KERNEL_STACK_SIZE);
     if (!stack) {
         printk(KERN_ERR "SCHED: Failed to allocate stack\n");
+        release_task(task);
         return NULL;
     }
     
@@ -204,17 +744,24 @@ struct task_struct *create_task(void (*entry)(void *), void *arg, uint32_t flags
     task->prio = PRIO_DEFAULT;
     task->static_prio = PRIO_DEFAULT;
     task->nice = 0;
-    task->pid = next_pid++;
+    task->se.weight = sched_nice_to_weight(0);
     task->tgid = task->pid;
     task->flags = flags;
     task->stack = stack;
     task->stack_size = KERNEL_STACK_SIZE;
-    task->parent = runqueue.current;
+    task->parent = get_current();
     
     /* Set up initial CPU context */
     task->cpu_context.sp = (uint64_t)stack + KERNEL_STACK_SIZE;
+#ifdef ARCH_ARM64
+    /* The trampoline calls entry(arg) with IRQs on and exits on return */
+    task->cpu_context.pc = (uint64_t)task_entry_wrapper;
+    task->cpu_context.x19 = (uint64_t)entry;
+    task->cpu_context.x20 = (uint64_t)arg;
+#else
     task->cpu_context.pc = (uint64_t)entry;
     task->cpu_context.x19 = (uint64_t)arg;  /* Pass arg in callee-saved register */
+#endif
     
     /* Copy name from parent or use default */
     for (int i = 0; i < TASK_COMM_LEN - 1; i++) {
@@ -224,29 +771,70 @@ struct task_struct *create_task(void (*entry)(void *), void *arg, uint32_t flags
     
     printk(KERN_INFO "SCHED: Created task %d '%s'\n", task->pid, task->comm);
     
-    /* Add to run queue */
-    enqueue_task(task);
-    
     return task;
 }
 
+void wake_up_new_task(struct task_struct *task)
+{
+    /* Add to the least loaded run queue */
+    unsigned long irq = arch_irq_save();
+    activate_task(task, select_task_rq(task), ENQUEUE_INITIAL);
+    arch_irq_restore(irq);
+}
+
+/* Create a kernel task and queue it */
+static struct task_struct *spawn_task(void (*entry)(void *), void *arg,
+                                      uint32_t flags, unsigned int cpu)
+{
+    struct task_struct *task = new_task(entry, arg, flags, cpu);
+    if (task) {
+        wake_up_new_task(task);
+    }
+    return task;
+}
+
+struct task_struct *create_task(void (*entry)(void *), void *arg, uint32_t flags)
+{
+    return spawn_task(entry, arg, flags & ~PF_PERCPU, 0);
+}
+
+struct task_struct *create_task_stopped(void (*entry)(void *), void *arg,
+                                        uint32_t flags)
+{
+    return new_task(entry, arg, flags & ~PF_PERCPU, 0);
+}
+
+void free_task_stopped(struct task_struct *task)
+{
+    release_task(task);
+}
+
+struct task_struct *create_task_on(void (*entry)(void *), void *arg,
+                                   uint32_t flags, unsigned int cpu)
+{
+    if (cpu >= MAX_CPUS) {
+        return NULL;
+    }
+    return spawn_task(entry, arg, flags | PF_PERCPU, cpu);
+}
+
 void exit_task(int code)
 {
-    struct task_struct *current = runqueue.current;
+    struct task_struct *current = get_current();
     
     printk(KERN_INFO "SCHED: Task %d exiting with code %d\n", current->pid, code);
     
     current->exit_code = code;
-    current->state = TASK_ZOMBIE;
     current->flags |= PF_EXITING;
-    
-    /* Remove from run queue */
-    dequeue_task(current);
+    current->state = TASK_ZOMBIE;
     
     /* TODO: Notify parent */
     /* TODO: Reparent children */
     
-    /* Schedule another task */
+    /*
+     * Schedule another task; not running, so it leaves the run queue,
+     * and whatever runs next reaps it (finish_task_switch())
+     */
     schedule();
     
     /* Should never reach here */
@@ -265,7 +853,7 @@ void exit_task(int code)
 
 pid_t create_thread(void (*entry)(void *), void *arg, void *stack, uint32_t clone_flags)
 {
-    struct task_struct *parent = runqueue.current;
+    struct task_struct *parent = get_current();
     struct task_struct *task = alloc_task();
     
     if (!task) {
@@ -278,7 +866,9 @@ pid_t create_thread(void (*entry)(void *), void *arg, void *stack, uint32_t clon
     task->prio = parent->prio;
     task->static_prio = parent->static_prio;
     task->nice = parent->nice;
-    task->pid = next_pid++;
+    task->se.weight = sched_nice_to_weight(parent->nice);
+    task->policy = parent->policy;
+    task->rt_priority = parent->rt_priority;
     task->tgid = (clone_flags & CLONE_THREAD) ? parent->tgid : task->pid;
     task->flags = PF_THREAD;
     task->parent = parent;
@@ -292,16 +882,23 @@ pid_t create_thread(void (*entry)(void *), void *arg, void *stack, uint32_t clon
     }
     task->comm[i] = '\0';
     
-    /* Share memory if CLONE_VM is set */
+    /* Share memory if CLONE_VM is set, otherwise copy-on-write */
     if (clone_flags & CLONE_VM) {
         task->mm = parent->mm;
         task->active_mm = parent->active_mm;
         if (task->mm) {
-            task->mm->users.counter++;
+            atomic_inc(&task->mm->users);
+        }
+    } else if (parent->mm) {
+        task->mm = vmm_dup_address_space(parent->mm);
+        if (!task->mm) {
+            printk(KERN_ERR "SCHED: Failed to copy address space\n");
+            release_task(task);
+            return -1;
         }
+        task->active_mm = task->mm;
     } else {
-        /* Would need to copy address space - not implemented */
-        task->mm = parent->mm;
+        task->mm = NULL;
         task->active_mm = parent->active_mm;
     }
     
@@ -315,39 +912,251 @@ pid_t create_thread(void (*entry)(void *), void *arg, void *stack, uint32_t clon
         task->stack = alloc_stack(KERNEL_STACK_SIZE);
         if (!task->stack) {
             printk(KERN_ERR "SCHED: Failed to allocate thread stack\n");
+            vmm_destroy_address_space(task->mm);
+            release_task(task);
             return -1;
         }
         task->stack_size = KERNEL_STACK_SIZE;
         task->cpu_context.sp = (uint64_t)task->stack + KERNEL_STACK_SIZE;
     }
     
+#ifdef ARCH_ARM64
+    task->cpu_context.pc = (uint64_t)task_entry_wrapper;
+    task->cpu_context.x19 = (uint64_t)entry;
+    task->cpu_context.x20 = (uint64_t)arg;
+#else
     task->cpu_context.pc = (uint64_t)entry;
     task->cpu_context.x19 = (uint64_t)arg;
+#endif
     
     printk(KERN_INFO "SCHED: Created thread %d (tgid=%d) for '%s'\n", 
            task->pid, task->tgid, parent->comm);
     
-    /* Add to run queue */
-    enqueue_task(task);
+    /* Add to the least loaded run queue */
+    unsigned long irq = arch_irq_save();
+    activate_task(task, select_task_rq(task), ENQUEUE_INITIAL);
+    arch_irq_restore(irq);
     
     return task->pid;
 }
 
+void sched_set_nice(struct task_struct *task, int nice)
+{
+    if (!task || (task->flags & PF_IDLE)) {
+        return;
+    }
+    if (nice < NICE_MIN) {
+        nice = NICE_MIN;
+    } else if (nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
+    
+    unsigned long flags = arch_irq_save();
+    struct rq *rq = task_rq_lock(task);
+    
+    task->nice = nice;
+    task->static_prio = nice;
+    task->prio = nice;
+    
+    /* Idle-priority and real-time tasks keep their weight but do not use it */
+    bool fair = task_on_rq(task) && !(task->flags & PF_IDLEPRIO) &&
+                !task->rt.on_rq;
+    fair_reweight(fair ? &rq->cfs : NULL, &task->se, sched_nice_to_weight(nice));
+    
+    spin_unlock(&rq->lock);
+    arch_irq_restore(flags);
+}
+
+/*
+ * Set what decides @task's class and priority (rq locked). A queued task
+ * is requeued by its new priority, the running one at the head of its
+ * FIFO. A sleeper's vruntime is converted on changing class, since the
+ * fair class leaves a sleeper's absolute and the others keep it relative.
+ *
+ * Return: True if @task's CPU should reschedule
+ */
+static bool change_task_prio(struct rq *rq, struct task_struct *task,
+                             int policy, int rt_priority, int pi_prio)
+{
+    bool running = rq->current == task;
+    bool queued = task_on_rq(task);
+    bool was_rt = task_is_rt(task);
+    int old_prio = task_rt_prio(task);
+    
+    if (running) {
+        update_curr_rt(rq);
+    }
+    if (queued) {
+        dequeue_task(rq, task, 0);
+    }
+    
+    task->policy = policy;
+    task->rt_priority = rt_priority;
+    task->pi_prio = pi_prio;
+    
+    if (queued) {
+        enqueue_task(rq, task, running ? ENQUEUE_HEAD : 0);
+        if (running && task->rt.on_rq) {
+            task->rt.exec_start = arch_timer_get_ticks();
+        }
+    } else if (task->state != TASK_RUNNING && was_rt != task_is_rt(task)) {
+        if (was_rt) {
+            task->se.vruntime += rq->cfs.min_vruntime;
+        } else {
+            task->se.vruntime -= rq->cfs.min_vruntime;
+        }
+    }
+    
+    bool kick = false;
+    if (running) {
+        kick = was_rt != task_is_rt(task) || task_rt_prio(task) < old_prio;
+    } else if (queued) {
+        kick = check_preempt(rq, task);
+    }
+    if (kick) {
+        rq->need_resched = true;
+    }
+    return kick;
+}
+
+int sched_setscheduler(struct task_struct *task, int policy, int prio)
+{
+    if (!task || (task->flags & (PF_IDLE | PF_IDLEPRIO))) {
+        return -1;  /* EPERM */
+    }
+    if (policy == SCHED_NORMAL) {
+        if (prio != 0) {
+            return -22;  /* EINVAL */
+        }
+    } else if ((policy != SCHED_FIFO && policy != SCHED_RR) ||
+               prio < 1 || prio >= MAX_RT_PRIO) {
+        return -22;  /* EINVAL */
+    }
+    
+    unsigned long flags = arch_irq_save();
+    struct rq *rq = task_rq_lock(task);
+    bool kick = change_task_prio(rq, task, policy, prio, task->pi_prio);
+    unsigned int cpu = rq->cpu;
+    spin_unlock(&rq->lock);
+    
+    if (kick) {
+        smp_send_reschedule(cpu);
+    }
+    arch_irq_restore(flags);
+    return 0;
+}
+
+void sched_pi_boost(struct task_struct *task, int prio)
+{
+    unsigned long flags = arch_irq_save();
+    struct rq *rq = task_rq_lock(task);
+    
+    /* Under the lock, so sched_pi_setprio() either sees it or comes after */
+    task->pi_seq++;
+    bool kick = false;
+    if (prio > task->pi_prio) {
+        kick = change_task_prio(rq, task, task->policy, task->rt_priority, prio);
+    }
+    unsigned int cpu = rq->cpu;
+    spin_unlock(&rq->lock);
+    
+    if (kick) {
+        smp_send_reschedule(cpu);
+    }
+    arch_irq_restore(flags);
+}
+
+bool sched_pi_setprio(struct task_struct *task, int prio, unsigned int seq)
+{
+    unsigned long flags = arch_irq_save();
+    struct rq *rq = task_rq_lock(task);
+    
+    if (task->pi_seq != seq) {
+        spin_unlock(&rq->lock);
+        arch_irq_restore(flags);
+        return false;
+    }
+    
+    bool kick = false;
+    if (prio != task->pi_prio) {
+        kick = change_task_prio(rq, task, task->policy, task->rt_priority, prio);
+    }
+    unsigned int cpu = rq->cpu;
+    spin_unlock(&rq->lock);
+    
+    if (kick) {
+        smp_send_reschedule(cpu);
+    }
+    arch_irq_restore(flags);
+    return true;
+}
+
+/* Fill the next struct sched_stat, if there is room, and count the task */
+struct task_stats_walk {
+    struct sched_stat *out;
+    int max;
+    int count;
+    uint64_t now;
+};
+
+static void task_stat_one(struct pid_node *node, void *arg)
+{
+    struct task_stats_walk *walk = arg;
+    struct task_struct *task = container_of(node, struct task_struct, pid_node);
+    
+    if (walk->out && walk->count < walk->max) {
+        struct sched_stat *st = &walk->out[walk->count];
+        st->pid = task->pid;
+        snprintf(st->comm, sizeof(st->comm), "%s", task->comm);
+        st->state = task->state == TASK_RUNNING ? 'R' :
+                    task->state == TASK_ZOMBIE ? 'Z' : 'S';
+        st->policy = task->policy;
+        st->prio = task->policy == SCHED_NORMAL ? task->nice : task->rt_priority;
+        st->cpu = task->cpu;
+        st->start_time = task->start_time;
+        sched_info_snapshot(&st->info, &task->sched_info, walk->now,
+                            task_curr(task));
+    }
+    walk->count++;
+}
+
+int sched_task_stats(struct sched_stat *out, int max)
+{
+    struct task_stats_walk walk = {
+        .out = out, .max = max, .count = 0, .now = arch_timer_get_ticks(),
+    };
+    pid_hash_for_each(&task_pids, task_stat_one, &walk);
+    return walk.count;
+}
+
+bool sched_cpu_stats(unsigned int cpu, struct sched_info *out)
+{
+    if (!sched_cpu_online(cpu)) {
+        return false;
+    }
+    
+    struct rq *rq = &runqueues[cpu];
+    uint64_t now = arch_timer_get_ticks();
+    struct task_struct *curr = __atomic_load_n(&rq->current, __ATOMIC_RELAXED);
+    
+    /* The running task's current run counts as busy too */
+    *out = rq->info;
+    if (curr != rq->idle && curr->sched_info.last_arrival) {
+        out->run_time += now - curr->sched_info.last_arrival;
+    }
+    return true;
+}
+
 struct task_struct *get_task_by_pid(pid_t pid)
 {
     /* Check init task */
     if (init_task.pid == pid) {
+        get_task_struct(&init_task);
         return &init_task;
     }
     
-    /* Search task pool */
-    for (int i = 0; i < task_pool_index; i++) {
-        if (task_pool[i].pid == pid && task_pool[i].state != TASK_DEAD) {
-            return &task_pool[i];
-        }
-    }
-    
-    return NULL;
+    struct pid_node *node = pid_hash_find(&task_pids, pid, task_get_node);
+    return node ? container_of(node, struct task_struct, pid_node) : NULL;
 }
 
 int sched_kill_task(pid_t pid)
@@ -360,27 +1169,34 @@ int sched_kill_task(pid_t pid)
     
     /* Can't kill init or idle */
     if (task->pid == 0 || (task->flags & PF_IDLE)) {
+        put_task_struct(task);
         return -1;  /* EPERM - Operation not permitted */
     }
     
     /* Mark for termination */
     printk(KERN_INFO "SCHED: Killing task %d '%s'\n", pid, task->comm);
     
-    task->flags |= PF_EXITING;
-    task->pending_signals |= (1ULL << 9);  /* SIGKILL */
+    /* The task may be updating these itself */
+    __atomic_or_fetch(&task->flags, PF_EXITING, __ATOMIC_RELAXED);
+    __atomic_or_fetch(&task->pending_signals, 1ULL << 9,  /* SIGKILL */
+                      __ATOMIC_RELAXED);
     
     /* If sleeping, wake it up */
     if (task->state == TASK_INTERRUPTIBLE || task->state == TASK_UNINTERRUPTIBLE) {
-        task->state = TASK_RUNNING;
-        enqueue_task(task);
+        wake_up_process(task);
     }
     
+    put_task_struct(task);
     return 0;
 }
 
 struct task_struct *get_current(void)
 {
-    return runqueue.current;
+    /* Not migrated between reading the CPU and its current task */
+    unsigned long flags = arch_irq_save();
+    struct task_struct *current = this_rq()->current;
+    arch_irq_restore(flags);
+    return current;
 }
 
 void context_switch(struct task_struct *prev, struct task_struct *next)
@@ -391,8 +1207,225 @@ void context_switch(struct task_struct *prev, struct task_struct *next)
     }
     next->active_mm = next->mm ? next->mm : prev->active_mm;
     
+    /* FP/SIMD registers follow lazily, when next first uses them */
+    fpsimd_switch(&next->fpsimd);
+    
     /* Switch CPU context */
-    cpu_switch_to(prev, next);
+    cpu_switch_to(&prev->cpu_context, &next->cpu_context);
+}
+
+/* ===================================================================== */
+/* SMP throughput benchmark */
+/* ===================================================================== */
+
+#define BENCH_WORK          (1UL << 24)     /* Loop iterations per task */
+#define BENCH_TIMEOUT_MS    60000
+
+static volatile unsigned int bench_done;
+
+static void bench_worker(void *arg)
+{
+    (void)arg;
+    volatile uint64_t sum = 0;
+    for (uint64_t i = 0; i < BENCH_WORK; i++) {
+        sum += i;
+    }
+    __atomic_add_fetch(&bench_done, 1, __ATOMIC_RELEASE);
+}
+
+/* Run @n workers to completion; returns elapsed ms, 0 on failure */
+static uint64_t bench_run(unsigned int n)
+{
+    bench_done = 0;
+    uint64_t start = arch_timer_get_ms();
+    
+    for (unsigned int i = 0; i < n; i++) {
+        if (!create_task(bench_worker, NULL, PF_KTHREAD)) {
+            return 0;
+        }
+    }
+    
+    /* Yield so workers left on this CPU (single CPU) still get to run */
+    while (__atomic_load_n(&bench_done, __ATOMIC_ACQUIRE) < n) {
+        if (arch_timer_get_ms() - start > BENCH_TIMEOUT_MS) {
+            return 0;
+        }
+        schedule();
+    }
+    
+    uint64_t elapsed = arch_timer_get_ms() - start;
+    return elapsed ? elapsed : 1;
+}
+
+int smp_bench(char *buf, size_t size)
+{
+    int len = 0;
+
+    /* CPUs that take scheduler tasks: the secondaries, or just CPU0 */
+    unsigned int workers = nr_cpus_online > 1 ? nr_cpus_online - 1 : 1;
+    
+    REPORT_OUT("SMP bench: %u CPU(s) online, %u take tasks\n",
+               nr_cpus_online, workers);
+    
+    uint64_t one = bench_run(1);
+    uint64_t all = workers > 1 ? bench_run(workers) : one;
+    if (!one || !all) {
+        REPORT_OUT("  workers did not finish\n");
+        return len;
+    }
+    
+    /* Speedup = work done per ms with all workers vs one, x100 */
+    uint64_t speedup = one * workers * 100 / all;
+    REPORT_OUT("  1 task: %llu ms, %u tasks: %llu ms, speedup %llu.%02llux\n",
+               (unsigned long long)one, workers, (unsigned long long)all,
+               (unsigned long long)(speedup / 100),
+               (unsigned long long)(speedup % 100));
+    
+    REPORT_OUT("  cpu  queued  switches  migrations\n");
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct rq *rq = &runqueues[cpu];
+        if (!rq->online) {
+            continue;
+        }
+        REPORT_OUT("  %3u  %6u  %8llu  %10llu\n", cpu, rq->nr_running,
+                   (unsigned long long)rq->nr_switches,
+                   (unsigned long long)rq->nr_migrations);
+    }
+
+    return len;
+}
+
+/* ===================================================================== */
+/* Wakeup latency test */
+/* ===================================================================== */
+
+#define CYCLIC_LOOPS        500
+#define CYCLIC_INTERVAL_US  1000
+#define CYCLIC_RT_PRIO      80
+#define CYCLIC_TIMEOUT_MS   30000
+
+struct cyclic_thread {
+    const char *name;
+    int policy;
+    int prio;
+    unsigned int loops;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t total_ns;
+    volatile bool done;
+};
+
+/* Static: a thread that outlives a timed-out test still has somewhere to write */
+static struct cyclic_thread cyclic_threads[2];
+static volatile bool cyclic_stop;
+static volatile unsigned int cyclic_hogs;
+
+static void cyclic_hog(void *arg)
+{
+    (void)arg;
+    volatile uint64_t spins = 0;
+    while (!__atomic_load_n(&cyclic_stop, __ATOMIC_ACQUIRE)) {
+        spins++;
+    }
+    __atomic_sub_fetch(&cyclic_hogs, 1, __ATOMIC_RELEASE);
+}
+
+/* Sleep to each interval in turn and record how late the wakeup ran */
+static void cyclic_measure(void *arg)
+{
+    struct cyclic_thread *t = arg;
+    
+    sched_setscheduler(get_current(), t->policy, t->prio);
+    
+    uint64_t interval = ns_to_ticks(CYCLIC_INTERVAL_US * 1000ULL);
+    uint64_t next = arch_timer_get_ticks();
+    for (unsigned int i = 0; i < CYCLIC_LOOPS; i++) {
+        next += interval;
+        hrtimer_sleep_until(next);
+        
+        uint64_t now = arch_timer_get_ticks();
+        uint64_t late = now > next ? ticks_to_ns(now - next) : 0;
+        if (late < t->min_ns) {
+            t->min_ns = late;
+        }
+        if (late > t->max_ns) {
+            t->max_ns = late;
+        }
+        t->total_ns += late;
+        t->loops++;
+    }
+    __atomic_store_n(&t->done, true, __ATOMIC_RELEASE);
+}
+
+int cyclictest(char *buf, size_t size)
+{
+    int len = 0;
+
+    if (__atomic_load_n(&cyclic_hogs, __ATOMIC_ACQUIRE)) {
+        REPORT_OUT("cyclictest: previous run still stopping\n");
+        return len;
+    }
+    
+    /* One busy task per CPU that takes scheduler tasks */
+    unsigned int hogs = nr_cpus_online > 1 ? nr_cpus_online - 1 : 1;
+    cyclic_stop = false;
+    for (unsigned int i = 0; i < hogs; i++) {
+        __atomic_add_fetch(&cyclic_hogs, 1, __ATOMIC_RELEASE);
+        if (!create_task(cyclic_hog, NULL, PF_KTHREAD)) {
+            __atomic_sub_fetch(&cyclic_hogs, 1, __ATOMIC_RELEASE);
+        }
+    }
+    
+    static const struct { const char *name; int policy; int prio; } kinds[2] = {
+        { "SCHED_FIFO", SCHED_FIFO, CYCLIC_RT_PRIO },
+        { "SCHED_NORMAL", SCHED_NORMAL, 0 },
+    };
+    for (unsigned int i = 0; i < 2; i++) {
+        struct cyclic_thread *t = &cyclic_threads[i];
+        t->name = kinds[i].name;
+        t->policy = kinds[i].policy;
+        t->prio = kinds[i].prio;
+        t->loops = 0;
+        t->min_ns = ~0ULL;
+        t->max_ns = 0;
+        t->total_ns = 0;
+        t->done = !create_task(cyclic_measure, t, PF_KTHREAD);
+    }
+    
+    REPORT_OUT("cyclictest: %u loops of %u us, %u busy task(s)\n",
+               CYCLIC_LOOPS, CYCLIC_INTERVAL_US, hogs);
+    
+    /* Yield so tasks left on this CPU (single CPU) still get to run */
+    uint64_t start = arch_timer_get_ms();
+    while (!cyclic_threads[0].done || !cyclic_threads[1].done) {
+        if (arch_timer_get_ms() - start > CYCLIC_TIMEOUT_MS) {
+            REPORT_OUT("  timed out\n");
+            break;
+        }
+        schedule();
+    }
+    __atomic_store_n(&cyclic_stop, true, __ATOMIC_RELEASE);
+    
+    REPORT_OUT("  %-12s %4s %6s %8s %8s %8s  (us)\n", "policy", "prio",
+               "loops", "min", "avg", "max");
+    for (unsigned int i = 0; i < 2; i++) {
+        struct cyclic_thread *t = &cyclic_threads[i];
+        uint64_t n = t->loops ? t->loops : 1;
+        REPORT_OUT("  %-12s %4d %6u %8llu %8llu %8llu\n", t->name, t->prio,
+                   t->loops,
+                   (unsigned long long)(t->loops ? t->min_ns / 1000 : 0),
+                   (unsigned long long)(t->total_ns / n / 1000),
+                   (unsigned long long)(t->max_ns / 1000));
+    }
+    
+    uint64_t throttled = 0;
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        throttled += runqueues[cpu].rt_bw.nr_throttled;
+    }
+    REPORT_OUT("  RT throttled periods since boot: %llu\n",
+               (unsigned long long)throttled);
+
+    return len;
 }
 
 /* ===================================================================== */
@@ -400,7 +1433,7 @@ void context_switch(struct task_struct *prev, struct task_struct *next)
 /* ===================================================================== */
 
 /* Placeholder - actual implementation is in assembly */
-void __attribute__((weak)) cpu_switch_to(struct task_struct *prev, struct task_struct *next)
+void __attribute__((weak)) cpu_switch_to(struct cpu_context *prev, struct cpu_context *next)
 {
     (void)prev;
     (void)next;
@@ -0,0 +1,295 @@
+/*
+ * UnixOS Kernel - Softirqs and Tasklets
+ *
+ * Each CPU keeps a pending mask and runs it from irq_exit(). A pass that
+ * keeps finding more work, or runs past its time budget, stops and arms
+ * a short timer to carry on, so a flood of softirqs cannot keep IRQs
+ * masked for long, and leftovers still run on a CPU whose tick is off.
+ */
+
+#include "sched/softirq.h"
+#include "arch/arch.h"
+#include "printk.h"
+#include "sched/hrtimer.h"
+#include "sched/sched.h"
+
+#define MAX_SOFTIRQ_RESTART 10
+#define SOFTIRQ_BUDGET_NS   (2 * NSEC_PER_MSEC)
+#define SOFTIRQ_RESUME_NS   (100 * 1000ULL)   /* Leftovers run 100us later */
+
+struct softirq_cpu {
+    uint32_t pending;
+    uint64_t raised_at[NR_SOFTIRQS];          /* When each pending bit was set */
+    unsigned int hardirq;                     /* irq_enter() depth */
+    bool active;                              /* Running softirqs */
+    struct tasklet_struct *head[NR_SOFTIRQS]; /* Tasklets per vector */
+    struct tasklet_struct **tail[NR_SOFTIRQS];
+    struct hrtimer resume;
+};
+
+static struct softirq_cpu softirq_cpus[MAX_CPUS];
+static void (*softirq_vec[NR_SOFTIRQS])(void);
+static struct defer_stats softirq_stats[NR_SOFTIRQS];
+
+static const char *const softirq_names[NR_SOFTIRQS] = {
+    [HI_SOFTIRQ] = "HI",
+    [TASKLET_SOFTIRQ] = "TASKLET",
+};
+
+static inline struct softirq_cpu *this_softirq_cpu(void)
+{
+    uint32_t cpu = arch_cpu_id();
+    return &softirq_cpus[cpu < MAX_CPUS ? cpu : 0];
+}
+
+/* ===================================================================== */
+/* Statistics */
+/* ===================================================================== */
+
+static inline void atomic_max(uint64_t *max, uint64_t val)
+{
+    uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (val > old &&
+           !__atomic_compare_exchange_n(max, &old, val, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void defer_stats_account(struct defer_stats *stats, uint64_t wait_ns,
+                         uint64_t run_ns)
+{
+    __atomic_add_fetch(&stats->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->wait_total_ns, wait_ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->run_total_ns, run_ns, __ATOMIC_RELAXED);
+    atomic_max(&stats->wait_max_ns, wait_ns);
+    atomic_max(&stats->run_max_ns, run_ns);
+}
+
+/* ===================================================================== */
+/* Softirqs */
+/* ===================================================================== */
+
+/* Run pending softirqs (IRQs masked, not already running them) */
+static void do_softirq(struct softirq_cpu *sc)
+{
+    uint64_t start = ktime_get_ns();
+
+    sc->active = true;
+    for (int pass = 0; sc->pending; pass++) {
+        if (pass == MAX_SOFTIRQ_RESTART ||
+            ktime_get_ns() - start >= SOFTIRQ_BUDGET_NS) {
+            hrtimer_start(&sc->resume, arch_timer_get_ticks() +
+                                       ns_to_ticks(SOFTIRQ_RESUME_NS));
+            break;
+        }
+
+        uint32_t pending = sc->pending;
+        sc->pending = 0;
+        while (pending) {
+            unsigned int nr = __builtin_ctz(pending);
+            pending &= pending - 1;
+
+            uint64_t raised = sc->raised_at[nr];
+            uint64_t t0 = ktime_get_ns();
+            if (softirq_vec[nr]) {
+                softirq_vec[nr]();
+            }
+            uint64_t t1 = ktime_get_ns();
+            defer_stats_account(&softirq_stats[nr], t0 - raised, t1 - t0);
+        }
+    }
+    sc->active = false;
+}
+
+/* Mark @nr pending; run it now unless an interrupt is in progress */
+static void raise_softirq_irqoff(struct softirq_cpu *sc, unsigned int nr)
+{
+    if (!(sc->pending & (1U << nr))) {
+        sc->pending |= 1U << nr;
+        sc->raised_at[nr] = ktime_get_ns();
+    }
+    if (!sc->hardirq && !sc->active) {
+        do_softirq(sc);
+    }
+}
+
+/* Nothing to do: the interrupt it raises runs the leftovers on exit */
+static enum hrtimer_restart softirq_resume(struct hrtimer *timer)
+{
+    (void)timer;
+    return HRTIMER_NORESTART;
+}
+
+void open_softirq(unsigned int nr, void (*action)(void))
+{
+    if (nr < NR_SOFTIRQS) {
+        softirq_vec[nr] = action;
+    }
+}
+
+void raise_softirq(unsigned int nr)
+{
+    if (nr >= NR_SOFTIRQS) {
+        return;
+    }
+
+    unsigned long flags = arch_irq_save();
+    raise_softirq_irqoff(this_softirq_cpu(), nr);
+    arch_irq_restore(flags);
+}
+
+void irq_enter(void)
+{
+    this_softirq_cpu()->hardirq++;
+}
+
+void irq_exit(void)
+{
+    struct softirq_cpu *sc = this_softirq_cpu();
+
+    if (--sc->hardirq == 0 && !sc->active && sc->pending) {
+        do_softirq(sc);
+    }
+}
+
+bool in_interrupt(void)
+{
+    unsigned long flags = arch_irq_save();
+    struct softirq_cpu *sc = this_softirq_cpu();
+    bool ret = sc->hardirq || sc->active;
+    arch_irq_restore(flags);
+    return ret;
+}
+
+/* ===================================================================== */
+/* Tasklets */
+/* ===================================================================== */
+
+#define TASKLET_SCHED (1UL << TASKLET_STATE_SCHED)
+#define TASKLET_RUN   (1UL << TASKLET_STATE_RUN)
+
+void tasklet_init(struct tasklet_struct *t, void (*func)(void *data),
+                  void *data)
+{
+    t->next = NULL;
+    t->state = 0;
+    t->func = func;
+    t->data = data;
+}
+
+static void __tasklet_schedule(struct tasklet_struct *t, unsigned int nr)
+{
+    if (__atomic_fetch_or(&t->state, TASKLET_SCHED, __ATOMIC_ACQ_REL) &
+        TASKLET_SCHED) {
+        return;
+    }
+
+    unsigned long flags = arch_irq_save();
+    struct softirq_cpu *sc = this_softirq_cpu();
+    t->next = NULL;
+    *sc->tail[nr] = t;
+    sc->tail[nr] = &t->next;
+    raise_softirq_irqoff(sc, nr);
+    arch_irq_restore(flags);
+}
+
+void tasklet_schedule(struct tasklet_struct *t)
+{
+    __tasklet_schedule(t, TASKLET_SOFTIRQ);
+}
+
+void tasklet_hi_schedule(struct tasklet_struct *t)
+{
+    __tasklet_schedule(t, HI_SOFTIRQ);
+}
+
+/*
+ * Run this CPU's tasklets for @nr. One still running on another CPU,
+ * rescheduled from its own function, goes back on the list for the
+ * next pass rather than running twice at once.
+ */
+static void tasklet_action_common(unsigned int nr)
+{
+    struct softirq_cpu *sc = this_softirq_cpu();
+    struct tasklet_struct *list = sc->head[nr];
+
+    sc->head[nr] = NULL;
+    sc->tail[nr] = &sc->head[nr];
+
+    while (list) {
+        struct tasklet_struct *t = list;
+        list = list->next;
+
+        if (__atomic_fetch_or(&t->state, TASKLET_RUN, __ATOMIC_ACQUIRE) &
+            TASKLET_RUN) {
+            t->next = NULL;
+            *sc->tail[nr] = t;
+            sc->tail[nr] = &t->next;
+            sc->pending |= 1U << nr;
+            continue;
+        }
+
+        /* Cleared first, so scheduling it from func runs it again */
+        __atomic_fetch_and(&t->state, ~TASKLET_SCHED, __ATOMIC_ACQ_REL);
+        t->func(t->data);
+        __atomic_fetch_and(&t->state, ~TASKLET_RUN, __ATOMIC_RELEASE);
+    }
+}
+
+static void tasklet_hi_action(void)
+{
+    tasklet_action_common(HI_SOFTIRQ);
+}
+
+static void tasklet_action(void)
+{
+    tasklet_action_common(TASKLET_SOFTIRQ);
+}
+
+void tasklet_kill(struct tasklet_struct *t)
+{
+    while (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) &
+           (TASKLET_SCHED | TASKLET_RUN)) {
+        schedule();
+    }
+}
+
+/* ===================================================================== */
+/* Setup and reporting */
+/* ===================================================================== */
+
+void softirq_init(void)
+{
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct softirq_cpu *sc = &softirq_cpus[cpu];
+        for (unsigned int nr = 0; nr < NR_SOFTIRQS; nr++) {
+            sc->head[nr] = NULL;
+            sc->tail[nr] = &sc->head[nr];
+        }
+        hrtimer_init(&sc->resume, softirq_resume);
+    }
+
+    open_softirq(HI_SOFTIRQ, tasklet_hi_action);
+    open_softirq(TASKLET_SOFTIRQ, tasklet_action);
+}
+
+int softirq_report(char *buf, size_t size)
+{
+    int len = 0;
+
+    REPORT_OUT("%-10s %9s %9s %8s %8s %8s  (us)\n", "softirq", "runs",
+               "wait avg", "max", "run avg", "max");
+    for (unsigned int nr = 0; nr < NR_SOFTIRQS; nr++) {
+        struct defer_stats *s = &softirq_stats[nr];
+        uint64_t n = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+        uint64_t div = n ? n : 1;
+        REPORT_OUT("%-10s %9llu %9llu %8llu %8llu %8llu\n",
+                   softirq_names[nr], (unsigned long long)n,
+                   (unsigned long long)(s->wait_total_ns / div / 1000),
+                   (unsigned long long)(s->wait_max_ns / 1000),
+                   (unsigned long long)(s->run_total_ns / div / 1000),
+                   (unsigned long long)(s->run_max_ns / 1000));
+    }
+
+    return len;
+}
@@ -0,0 +1,322 @@
+/*
+ * UnixOS Kernel - Scheduler Statistics
+ *
+ * The counters are updated under whatever serializes the entity's
+ * switches: its run queue lock for tasks, the boot CPU with interrupts
+ * off for processes and the compositor (a wakeup from another CPU only
+ * stamps when the wait began). Reports copy them without locks, so a
+ * line may be a switch out of date.
+ */
+
+#include "sched/stats.h"
+#include "arch/arch.h"
+#include "mm/kmalloc.h"
+#include "printk.h"
+#include "sched/hrtimer.h"
+#include "sched/rt.h"
+
+#define TOP_MAX_ROWS 20
+
+/* ===================================================================== */
+/* Accounting */
+/* ===================================================================== */
+
+/* Histogram bucket for a latency of @ticks */
+static unsigned int hist_bucket(uint64_t ticks)
+{
+    uint64_t us = ticks_to_ns(ticks) / 1000;
+    if (!us) {
+        return 0;
+    }
+    unsigned int b = 64 - __builtin_clzll(us);
+    return b < SCHED_HIST_BUCKETS ? b : SCHED_HIST_BUCKETS - 1;
+}
+
+void sched_info_queued(struct sched_info *si, uint64_t now, bool wakeup)
+{
+    if (si->last_queued) {
+        return;
+    }
+    si->last_queued = now;
+    si->woken = wakeup;
+}
+
+static void account_delay(struct sched_info *si, uint64_t delay, bool woken)
+{
+    si->run_delay += delay;
+    if (woken) {
+        si->wakeup_hist[hist_bucket(delay)]++;
+        si->wakeups++;
+        if (delay > si->wakeup_max) {
+            si->wakeup_max = delay;
+        }
+    }
+}
+
+static void account_depart(struct sched_info *si, uint64_t ran, bool voluntary)
+{
+    si->run_time += ran;
+    if (voluntary) {
+        si->nvcsw++;
+    } else {
+        si->nivcsw++;
+    }
+}
+
+void sched_info_arrive(struct sched_info *si, struct sched_info *cpu,
+                       uint64_t now)
+{
+    if (si->last_queued) {
+        uint64_t delay = now - si->last_queued;
+        bool woken = si->woken;
+        si->last_queued = 0;
+        si->woken = false;
+
+        account_delay(si, delay, woken);
+        if (cpu) {
+            account_delay(cpu, delay, woken);
+        }
+    }
+
+    si->last_arrival = now;
+    si->pcount++;
+    if (cpu) {
+        cpu->pcount++;
+    }
+}
+
+uint64_t sched_info_depart(struct sched_info *si, struct sched_info *cpu,
+                           uint64_t now, bool voluntary)
+{
+    uint64_t ran = si->last_arrival ? now - si->last_arrival : 0;
+    si->last_arrival = 0;
+
+    account_depart(si, ran, voluntary);
+    if (cpu) {
+        account_depart(cpu, ran, voluntary);
+    }
+    return ran;
+}
+
+void sched_info_snapshot(struct sched_info *dst, const struct sched_info *si,
+                         uint64_t now, bool running)
+{
+    *dst = *si;
+    if (running && dst->last_arrival) {
+        dst->run_time += now - dst->last_arrival;
+    }
+    /* Still waiting: count the wait so far, which is what starves */
+    if (dst->last_queued) {
+        dst->run_delay += now - dst->last_queued;
+    }
+}
+
+/* ===================================================================== */
+/* Reports */
+/* ===================================================================== */
+
+/* Everything that runs; *@count entries, the compositor first */
+static struct sched_stat *collect(int *count)
+{
+    /* Room for a few created while we look */
+    int max = sched_task_stats(NULL, 0) + process_sched_stats(NULL, 0) + 8;
+    struct sched_stat *stats = kmalloc(max * sizeof(*stats));
+    if (!stats) {
+        return NULL;
+    }
+
+    int n = process_sched_stats(stats, max);
+    if (n > max) {
+        n = max;
+    }
+    int t = sched_task_stats(stats + n, max - n);
+    n += t < max - n ? t : max - n;
+
+    *count = n;
+    return stats;
+}
+
+static uint64_t to_us(uint64_t ticks)
+{
+    return ticks_to_ns(ticks) / 1000;
+}
+
+static uint64_t to_ms(uint64_t ticks)
+{
+    return ticks_to_ns(ticks) / 1000000;
+}
+
+/* Format the non-empty buckets of @si's histogram */
+static int format_hist(const struct sched_info *si, char *buf, size_t size)
+{
+    int len = 0;
+
+    for (unsigned int b = 0; b < SCHED_HIST_BUCKETS && (size_t)len < size; b++) {
+        if (!si->wakeup_hist[b]) {
+            continue;
+        }
+        char range[24];
+        if (b == 0) {
+            snprintf(range, sizeof(range), "<1");
+        } else if (b == SCHED_HIST_BUCKETS - 1) {
+            snprintf(range, sizeof(range), ">=%u", 1U << (b - 1));
+        } else {
+            snprintf(range, sizeof(range), "%u-%u", 1U << (b - 1), 1U << b);
+        }
+        len += snprintf(buf + len, size - len, "  %-12s us %10u\n", range,
+                        si->wakeup_hist[b]);
+    }
+    return len;
+}
+
+int schedstat_read(pid_t pid, char *buf, size_t size)
+{
+    int n;
+    struct sched_stat *stats = collect(&n);
+    if (!stats) {
+        return -12;  /* ENOMEM */
+    }
+
+    struct sched_stat *st = NULL;
+    for (int i = 0; i < n && !st; i++) {
+        if (stats[i].pid == pid) {
+            st = &stats[i];
+        }
+    }
+    if (!st) {
+        kfree(stats);
+        return -3;  /* ESRCH */
+    }
+
+    struct sched_info *si = &st->info;
+    int len = snprintf(buf, size, "%llu %llu %llu\n",
+                       (unsigned long long)ticks_to_ns(si->run_time),
+                       (unsigned long long)ticks_to_ns(si->run_delay),
+                       (unsigned long long)si->pcount);
+    if ((size_t)len < size) {
+        len += snprintf(buf + len, size - len,
+                        "nvcsw %llu nivcsw %llu wakeups %llu max_us %llu\n",
+                        (unsigned long long)si->nvcsw,
+                        (unsigned long long)si->nivcsw,
+                        (unsigned long long)si->wakeups,
+                        (unsigned long long)to_us(si->wakeup_max));
+    }
+    if ((size_t)len < size) {
+        len += format_hist(si, buf + len, size - len);
+    }
+
+    kfree(stats);
+    return len;
+}
+
+/* Tenths of a percent of @part in @whole */
+static uint64_t permille(uint64_t part, uint64_t whole)
+{
+    return whole ? part * 1000 / whole : 0;
+}
+
+int sched_top(char *buf, size_t size)
+{
+    int len = 0;
+
+    uint64_t now = arch_timer_get_ticks();
+    struct sched_info si;
+
+#define REPORT_CPU(name, s) do { \
+        uint64_t busy = permille((s)->run_time, now); \
+        REPORT_OUT("%-6s %4llu.%llu %9llu %9llu %9llu %9llu\n", (name), \
+                   (unsigned long long)(busy / 10), \
+                   (unsigned long long)(busy % 10), \
+                   (unsigned long long)to_ms((s)->run_delay), \
+                   (unsigned long long)((s)->nvcsw + (s)->nivcsw), \
+                   (unsigned long long)((s)->pcount ? \
+                       to_us((s)->run_delay) / (s)->pcount : 0), \
+                   (unsigned long long)to_us((s)->wakeup_max)); \
+    } while (0)
+
+    /* CPUs: busy share since boot and what waited on them */
+    REPORT_OUT("%-6s %6s %9s %9s %9s %9s\n", "cpu", "busy%", "wait ms",
+               "switches", "wait avg", "max us");
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!sched_cpu_stats(cpu, &si)) {
+            continue;
+        }
+        char name[8];
+        snprintf(name, sizeof(name), "cpu%u", cpu);
+        REPORT_CPU(name, &si);
+    }
+    process_cpu_stats(&si);
+    REPORT_CPU("procs", &si);
+
+    int n;
+    struct sched_stat *stats = collect(&n);
+    if (!stats) {
+        REPORT_OUT("top: out of memory\n");
+        return len;
+    }
+
+    /* By CPU time, most first; a selection sort of indices is plenty */
+    int rows = n < TOP_MAX_ROWS ? n : TOP_MAX_ROWS;
+    int order[TOP_MAX_ROWS];
+    for (int r = 0; r < rows; r++) {
+        int best = -1;
+        for (int i = 0; i < n; i++) {
+            bool taken = false;
+            for (int j = 0; j < r; j++) {
+                taken |= order[j] == i;
+            }
+            if (!taken && (best < 0 ||
+                           stats[i].info.run_time > stats[best].info.run_time)) {
+                best = i;
+            }
+        }
+        order[r] = best;
+    }
+
+    REPORT_OUT("\n%5s %s %-4s %3s %3s %6s %8s %8s %7s %7s %7s %7s %s\n",
+               "PID", "S", "POL", "PRI", "CPU", "%CPU", "run ms", "wait ms",
+               "avg us", "max us", "vcsw", "ivcsw", "COMMAND");
+    for (int r = 0; r < rows; r++) {
+        struct sched_stat *st = &stats[order[r]];
+        struct sched_info *s = &st->info;
+        uint64_t cpu_pm = permille(s->run_time, now - st->start_time);
+        char cpu_col[8];
+        if (st->cpu < 0) {
+            snprintf(cpu_col, sizeof(cpu_col), "-");
+        } else {
+            snprintf(cpu_col, sizeof(cpu_col), "%d", st->cpu);
+        }
+        const char *pol = st->policy == SCHED_FIFO ? "FF" :
+                          st->policy == SCHED_RR ? "RR" : "TS";
+
+        REPORT_OUT("%5d %c %-4s %3d %3s %4llu.%llu %8llu %8llu %7llu %7llu %7llu %7llu %s\n",
+                   st->pid, st->state, pol, st->prio, cpu_col,
+                   (unsigned long long)(cpu_pm / 10),
+                   (unsigned long long)(cpu_pm % 10),
+                   (unsigned long long)to_ms(s->run_time),
+                   (unsigned long long)to_ms(s->run_delay),
+                   (unsigned long long)(s->pcount ? to_us(s->run_delay) / s->pcount : 0),
+                   (unsigned long long)to_us(s->wakeup_max),
+                   (unsigned long long)s->nvcsw,
+                   (unsigned long long)s->nivcsw, st->comm);
+    }
+    if (n > rows) {
+        REPORT_OUT("(%d more)\n", n - rows);
+    }
+
+    /* What the compositor waits for is the point of all this */
+    if (n && stats[0].pid == 0 && stats[0].info.wakeups) {
+        char hist[SCHED_HIST_BUCKETS * 40];
+        REPORT_OUT("\nCompositor wakeup latency:\n");
+        format_hist(&stats[0].info, hist, sizeof(hist));
+        printk(KERN_INFO "%s", hist);
+        if (buf && (size_t)len < size) {
+            len += snprintf(buf + len, size - len, "%s", hist);
+        }
+    }
+
+#undef REPORT_CPU
+
+    kfree(stats);
+    return len;
+}
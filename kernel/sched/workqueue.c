@@ -0,0 +1,339 @@
+/*
+ * UnixOS Kernel - Workqueues
+ *
+ * One pool per CPU: a FIFO of work under a spinlock, and the worker
+ * thread that drains it. The pool's lock also covers which item its
+ * worker is running, which is how queue_work() keeps an item that is
+ * running from starting on a second worker.
+ */
+
+#include "sched/workqueue.h"
+#include "arch/arch.h"
+#include "mm/kmalloc.h"
+#include "printk.h"
+#include "sched/sched.h"
+#include "sync/wait.h"
+
+#define WORK_PENDING (1UL << WORK_STATE_PENDING)
+
+struct worker_pool {
+    spinlock_t lock;
+    unsigned int cpu;
+    struct work_struct *head;           /* Queued work, oldest first */
+    struct work_struct **tail;
+    struct work_struct *current_work;   /* Being run by the worker */
+    struct task_struct *worker;
+    wait_queue_head_t wait;             /* Worker sleeps here when idle */
+};
+
+static struct worker_pool pools[MAX_CPUS];
+static unsigned int next_pool;          /* Round robin for the boot CPU */
+
+static struct workqueue_struct system_workqueue = { .name = "events" };
+struct workqueue_struct *system_wq = &system_workqueue;
+
+/* Every workqueue, newest first; they are never freed */
+static struct workqueue_struct *workqueues = &system_workqueue;
+static DEFINE_SPINLOCK(workqueues_lock);
+
+/* ===================================================================== */
+/* Queueing */
+/* ===================================================================== */
+
+/*
+ * Pool for work queued on this CPU. The boot CPU's worker only runs when
+ * the desktop loop yields, so its work is spread over the others.
+ */
+static struct worker_pool *select_pool(void)
+{
+    uint32_t cpu = arch_cpu_id();
+    if (cpu != 0 && cpu < MAX_CPUS && pools[cpu].worker) {
+        return &pools[cpu];
+    }
+
+    for (unsigned int i = 1; i < MAX_CPUS; i++) {
+        unsigned int n = __atomic_fetch_add(&next_pool, 1, __ATOMIC_RELAXED);
+        struct worker_pool *pool = &pools[1 + n % (MAX_CPUS - 1)];
+        if (pool->worker) {
+            return pool;
+        }
+    }
+    return &pools[0];
+}
+
+/* Put @work, already marked pending, on a pool and wake its worker */
+static void __queue_work(struct worker_pool *target, struct workqueue_struct *wq,
+                         struct work_struct *work)
+{
+#ifndef ARCH_ARM64
+    /* No kernel thread switching here - work runs when queued */
+    if (!in_interrupt()) {
+        __atomic_fetch_and(&work->state, ~WORK_PENDING, __ATOMIC_ACQ_REL);
+        uint64_t t0 = ktime_get_ns();
+        work->func(work);
+        defer_stats_account(&wq->stats, 0, ktime_get_ns() - t0);
+        return;
+    }
+#endif
+
+    unsigned long flags = arch_irq_save();
+    struct worker_pool *pool = work->pool;
+
+    /* Still running: queue behind itself rather than on another worker */
+    if (pool) {
+        spin_lock(&pool->lock);
+        if (pool->current_work == work) {
+            goto insert;
+        }
+        spin_unlock(&pool->lock);
+    }
+
+    pool = target ? target : select_pool();
+    spin_lock(&pool->lock);
+
+insert:
+    work->next = NULL;
+    work->wq = wq;
+    work->pool = pool;
+    work->queued_at = ktime_get_ns();
+    *pool->tail = work;
+    pool->tail = &work->next;
+    spin_unlock(&pool->lock);
+
+    wake_up(&pool->wait);
+    arch_irq_restore(flags);
+}
+
+static inline bool test_and_set_pending(struct work_struct *work)
+{
+    return __atomic_fetch_or(&work->state, WORK_PENDING, __ATOMIC_ACQ_REL) &
+           WORK_PENDING;
+}
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+    if (test_and_set_pending(work)) {
+        return false;
+    }
+    __queue_work(NULL, wq, work);
+    return true;
+}
+
+bool queue_work_on(unsigned int cpu, struct workqueue_struct *wq,
+                   struct work_struct *work)
+{
+    if (cpu >= MAX_CPUS || !sched_cpu_online(cpu)) {
+        return queue_work(wq, work);
+    }
+    if (test_and_set_pending(work)) {
+        return false;
+    }
+    __queue_work(&pools[cpu], wq, work);
+    return true;
+}
+
+bool cancel_work(struct work_struct *work)
+{
+    if (!(__atomic_load_n(&work->state, __ATOMIC_ACQUIRE) & WORK_PENDING)) {
+        return false;
+    }
+
+    struct worker_pool *pool = work->pool;
+    if (!pool) {
+        return false;
+    }
+
+    bool found = false;
+    uint64_t flags = spin_lock_irqsave(&pool->lock);
+    for (struct work_struct **link = &pool->head; *link; link = &(*link)->next) {
+        if (*link == work) {
+            *link = work->next;
+            if (pool->tail == &work->next) {
+                pool->tail = link;
+            }
+            __atomic_fetch_and(&work->state, ~WORK_PENDING, __ATOMIC_ACQ_REL);
+            found = true;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+    return found;
+}
+
+/* ===================================================================== */
+/* Delayed work */
+/* ===================================================================== */
+
+static enum hrtimer_restart delayed_work_timer_fn(struct hrtimer *timer)
+{
+    struct delayed_work *dwork = container_of(timer, struct delayed_work, timer);
+    __queue_work(NULL, dwork->wq, &dwork->work);
+    return HRTIMER_NORESTART;
+}
+
+void init_delayed_work(struct delayed_work *dwork,
+                       void (*func)(struct work_struct *work))
+{
+    INIT_WORK(&dwork->work, func);
+    hrtimer_init(&dwork->timer, delayed_work_timer_fn);
+    dwork->wq = NULL;
+}
+
+bool queue_delayed_work(struct workqueue_struct *wq,
+                        struct delayed_work *dwork, uint64_t delay_ns)
+{
+    if (test_and_set_pending(&dwork->work)) {
+        return false;
+    }
+
+    if (!delay_ns) {
+        __queue_work(NULL, wq, &dwork->work);
+    } else {
+        dwork->wq = wq;
+        hrtimer_start(&dwork->timer,
+                      arch_timer_get_ticks() + ns_to_ticks(delay_ns));
+    }
+    return true;
+}
+
+bool cancel_delayed_work(struct delayed_work *dwork)
+{
+    if (hrtimer_cancel(&dwork->timer)) {
+        __atomic_fetch_and(&dwork->work.state, ~WORK_PENDING, __ATOMIC_ACQ_REL);
+        return true;
+    }
+    return cancel_work(&dwork->work);
+}
+
+/* ===================================================================== */
+/* Workers */
+/* ===================================================================== */
+
+/* Take the oldest work off @pool and mark it running, or NULL */
+static struct work_struct *dequeue_work(struct worker_pool *pool)
+{
+    uint64_t flags = spin_lock_irqsave(&pool->lock);
+    struct work_struct *work = pool->head;
+    if (work) {
+        pool->head = work->next;
+        if (!pool->head) {
+            pool->tail = &pool->head;
+        }
+        pool->current_work = work;
+        /* From here queueing it again runs it once more, after this run */
+        __atomic_fetch_and(&work->state, ~WORK_PENDING, __ATOMIC_ACQ_REL);
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+    return work;
+}
+
+static void worker_thread(void *arg)
+{
+    struct worker_pool *pool = arg;
+    struct wait_queue_entry wait;
+
+    init_wait_entry(&wait, 0);
+    for (;;) {
+        prepare_to_wait(&pool->wait, &wait, TASK_UNINTERRUPTIBLE);
+        if (!__atomic_load_n(&pool->head, __ATOMIC_ACQUIRE)) {
+            wait_sleep(&wait);
+        }
+        finish_wait(&pool->wait, &wait);
+
+        struct work_struct *work;
+        while ((work = dequeue_work(pool))) {
+            /* The item may be freed by its function; copy what we need */
+            struct workqueue_struct *wq = work->wq;
+            uint64_t queued = work->queued_at;
+
+            uint64_t t0 = ktime_get_ns();
+            work->func(work);
+            uint64_t t1 = ktime_get_ns();
+            defer_stats_account(&wq->stats, t0 - queued, t1 - t0);
+
+            uint64_t flags = spin_lock_irqsave(&pool->lock);
+            pool->current_work = NULL;
+            spin_unlock_irqrestore(&pool->lock, flags);
+        }
+    }
+}
+
+/* ===================================================================== */
+/* Setup and reporting */
+/* ===================================================================== */
+
+struct workqueue_struct *alloc_workqueue(const char *name)
+{
+    struct workqueue_struct *wq = kzalloc(sizeof(*wq), GFP_KERNEL);
+    if (!wq) {
+        return NULL;
+    }
+    wq->name = name;
+
+    uint64_t flags = spin_lock_irqsave(&workqueues_lock);
+    wq->next = workqueues;
+    __atomic_store_n(&workqueues, wq, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&workqueues_lock, flags);
+    return wq;
+}
+
+void workqueue_init(void)
+{
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct worker_pool *pool = &pools[cpu];
+        spin_lock_init(&pool->lock);
+        pool->cpu = cpu;
+        pool->head = NULL;
+        pool->tail = &pool->head;
+        pool->current_work = NULL;
+        pool->worker = NULL;
+        init_waitqueue_head(&pool->wait);
+    }
+
+#ifdef ARCH_ARM64
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!sched_cpu_online(cpu)) {
+            continue;
+        }
+
+        struct task_struct *task = create_task_on(worker_thread, &pools[cpu],
+                                                  PF_KTHREAD, cpu);
+        if (!task) {
+            printk(KERN_ERR "WQ: Failed to start worker for CPU %u\n", cpu);
+            continue;
+        }
+        snprintf(task->comm, TASK_COMM_LEN, "kworker/%u", cpu);
+        __atomic_store_n(&pools[cpu].worker, task, __ATOMIC_RELEASE);
+    }
+#endif
+}
+
+int workqueue_report(char *buf, size_t size)
+{
+    int len = 0;
+
+    REPORT_OUT("%-10s %9s %9s %8s %8s %8s  (us)\n", "workqueue", "runs",
+               "wait avg", "max", "run avg", "max");
+
+    for (struct workqueue_struct *wq = __atomic_load_n(&workqueues, __ATOMIC_ACQUIRE);
+         wq; wq = wq->next) {
+        struct defer_stats *s = &wq->stats;
+        uint64_t n = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+        uint64_t div = n ? n : 1;
+        REPORT_OUT("%-10s %9llu %9llu %8llu %8llu %8llu\n",
+                   wq->name, (unsigned long long)n,
+                   (unsigned long long)(s->wait_total_ns / div / 1000),
+                   (unsigned long long)(s->wait_max_ns / 1000),
+                   (unsigned long long)(s->run_total_ns / div / 1000),
+                   (unsigned long long)(s->run_max_ns / 1000));
+    }
+
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct task_struct *worker = pools[cpu].worker;
+        if (worker) {
+            REPORT_OUT("kworker/%u: pid %d\n", cpu, worker->pid);
+        }
+    }
+
+    return len;
+}
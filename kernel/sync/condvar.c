@@ -0,0 +1,37 @@
+/*
+ * vib-OS Kernel - Condition Variables
+ */
+
+#include "../include/sync/condvar.h"
+
+void cond_init(struct condvar *cv) { init_waitqueue_head(&cv->wait); }
+
+static int cond_wait_state(struct condvar *cv, struct mutex *lock, int state) {
+  struct wait_queue_entry wait;
+  int ret = 0;
+
+  init_wait_entry(&wait, WQ_FLAG_EXCLUSIVE);
+  prepare_to_wait(&cv->wait, &wait, state);
+  mutex_unlock(lock);
+
+  if (state == TASK_INTERRUPTIBLE && wait_signal_pending(&wait))
+    ret = -4; /* EINTR */
+  else
+    wait_sleep(&wait);
+
+  finish_wait(&cv->wait, &wait);
+  mutex_lock(lock);
+  return ret;
+}
+
+void cond_wait(struct condvar *cv, struct mutex *lock) {
+  cond_wait_state(cv, lock, TASK_UNINTERRUPTIBLE);
+}
+
+int cond_wait_interruptible(struct condvar *cv, struct mutex *lock) {
+  return cond_wait_state(cv, lock, TASK_INTERRUPTIBLE);
+}
+
+void cond_signal(struct condvar *cv) { wake_up(&cv->wait); }
+
+void cond_broadcast(struct condvar *cv) { wake_up_all(&cv->wait); }
@@ -0,0 +1,224 @@
+/*
+ * vib-OS Kernel - Mutexes
+ *
+ * Priority inheritance: a waiter records its priority in the mutex and
+ * boosts the owner under the mutex's queue lock, which the owner also
+ * takes on a contended unlock, so a boost is never applied after the
+ * owner has let go. On unlock the owner drops back to the highest
+ * priority lent through the mutexes it still holds.
+ */
+
+#include "../include/sync/mutex.h"
+
+#define MUTEX_PI_DEPTH 8 /* Owners boosted along a chain of waiting owners */
+
+void mutex_init(struct mutex *lock) {
+  lock->locked = 0;
+  lock->owner = NULL;
+  lock->pi_prio = 0;
+  lock->pi_next = NULL;
+  init_waitqueue_head(&lock->wait);
+}
+
+/* ===================================================================== */
+/* Priority inheritance */
+/* ===================================================================== */
+
+/* Only the owner walks or changes its held list */
+static void pi_hold(struct task_struct *self, struct mutex *lock) {
+  lock->pi_next = self->pi_held;
+  self->pi_held = lock;
+}
+
+static void pi_release(struct task_struct *self, struct mutex *lock) {
+  for (struct mutex **link = &self->pi_held; *link; link = &(*link)->pi_next) {
+    if (*link == lock) {
+      *link = lock->pi_next;
+      break;
+    }
+  }
+  lock->pi_next = NULL;
+}
+
+/*
+ * Lend @prio to the owner of @lock, and on to the owner of the mutex
+ * that owner waits for, and so on. Each step holds only that mutex's
+ * queue lock.
+ */
+static void mutex_pi_boost(struct mutex *lock, int prio) {
+  for (int depth = 0; lock && depth < MUTEX_PI_DEPTH; depth++) {
+    uint64_t flags = spin_lock_irqsave(&lock->wait.lock);
+    if (prio > lock->pi_prio)
+      __atomic_store_n(&lock->pi_prio, prio, __ATOMIC_RELAXED);
+
+    struct task_struct *owner = mutex_is_locked(lock) ? lock->owner : NULL;
+    struct mutex *next = NULL;
+    if (owner && task_rt_prio(owner) < prio) {
+      sched_pi_boost(owner, prio);
+      next = __atomic_load_n(&owner->pi_blocked_on, __ATOMIC_RELAXED);
+    }
+    spin_unlock_irqrestore(&lock->wait.lock, flags);
+    lock = next;
+  }
+}
+
+/* Take on the priority of tasks already waiting for a mutex just acquired */
+static void mutex_pi_inherit(struct task_struct *self, struct mutex *lock) {
+  int prio = 0;
+
+  uint64_t flags = spin_lock_irqsave(&lock->wait.lock);
+  for (struct list_head *pos = lock->wait.head.next; pos != &lock->wait.head;
+       pos = pos->next) {
+    struct wait_queue_entry *wait =
+        container_of(pos, struct wait_queue_entry, entry);
+    if (wait->task && wait->task != self && task_rt_prio(wait->task) > prio)
+      prio = task_rt_prio(wait->task);
+  }
+  if (prio > lock->pi_prio)
+    __atomic_store_n(&lock->pi_prio, prio, __ATOMIC_RELAXED);
+  if (prio > task_rt_prio(self))
+    sched_pi_boost(self, prio);
+  spin_unlock_irqrestore(&lock->wait.lock, flags);
+}
+
+/*
+ * Drop back to what the mutexes still held call for. A boost racing with
+ * this bumps pi_seq, and sched_pi_setprio() then refuses, so go again.
+ */
+static void mutex_pi_restore(struct task_struct *self) {
+  unsigned int seq;
+  int prio;
+
+  do {
+    seq = __atomic_load_n(&self->pi_seq, __ATOMIC_ACQUIRE);
+    prio = 0;
+    for (struct mutex *m = self->pi_held; m; m = m->pi_next) {
+      int p = __atomic_load_n(&m->pi_prio, __ATOMIC_RELAXED);
+      if (p > prio)
+        prio = p;
+    }
+  } while (!sched_pi_setprio(self, prio, seq));
+}
+
+/* ===================================================================== */
+/* Locking */
+/* ===================================================================== */
+
+bool mutex_trylock(struct mutex *lock) {
+  int unlocked = 0;
+  if (!__atomic_compare_exchange_n(&lock->locked, &unlocked, 1, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return false;
+
+  struct task_struct *self = wait_current_task();
+  lock->owner = self;
+  if (self) {
+    pi_hold(self, lock);
+
+    /*
+     * Pairs with the barrier in prepare_to_wait(): a waiter that looked
+     * before we were owner, and so boosted nobody, is seen queued here
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (waitqueue_active(&lock->wait))
+      mutex_pi_inherit(self, lock);
+  }
+  return true;
+}
+
+/*
+ * Optimistic spinning: while the owner runs on another CPU it is making
+ * progress towards the unlock. Stop once it is preempted or sleeps, or
+ * when this CPU has something better to do.
+ */
+static bool mutex_spin_on_owner(struct mutex *lock) {
+  struct task_struct *self = wait_current_task();
+
+  for (;;) {
+    if (mutex_trylock(lock))
+      return true;
+
+    struct task_struct *owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+    if (!owner || owner == self || !task_curr(owner) || need_resched())
+      return false;
+
+    while (__atomic_load_n(&lock->owner, __ATOMIC_RELAXED) == owner &&
+           mutex_is_locked(lock) && task_curr(owner) && !need_resched()) {
+#ifdef ARCH_ARM64
+      asm volatile("yield");
+#elif defined(ARCH_X86_64) || defined(ARCH_X86)
+      asm volatile("pause");
+#endif
+    }
+  }
+}
+
+/* Sleep until the mutex is ours, lending the owner our priority meanwhile */
+static int mutex_lock_slowpath(struct mutex *lock, int state) {
+  struct task_struct *self = wait_current_task();
+  struct wait_queue_entry wait;
+  int ret = 0;
+
+  init_wait_entry(&wait, WQ_FLAG_EXCLUSIVE);
+  for (;;) {
+    prepare_to_wait(&lock->wait, &wait, state);
+    if (mutex_trylock(lock))
+      break;
+    if (state == TASK_INTERRUPTIBLE && wait_signal_pending(&wait)) {
+      ret = -4; /* EINTR */
+      break;
+    }
+
+    if (self) {
+      __atomic_store_n(&self->pi_blocked_on, lock, __ATOMIC_RELAXED);
+      if (task_rt_prio(self))
+        mutex_pi_boost(lock, task_rt_prio(self));
+    }
+    wait_sleep(&wait);
+  }
+
+  if (self)
+    __atomic_store_n(&self->pi_blocked_on, NULL, __ATOMIC_RELAXED);
+  finish_wait(&lock->wait, &wait);
+  return ret;
+}
+
+void mutex_lock(struct mutex *lock) {
+  if (mutex_spin_on_owner(lock))
+    return;
+  mutex_lock_slowpath(lock, TASK_UNINTERRUPTIBLE);
+}
+
+int mutex_lock_interruptible(struct mutex *lock) {
+  if (mutex_spin_on_owner(lock))
+    return 0;
+
+  int ret = mutex_lock_slowpath(lock, TASK_INTERRUPTIBLE);
+
+  /* A wakeup meant for us would be lost; pass it on */
+  if (ret && !mutex_is_locked(lock))
+    wake_up(&lock->wait);
+  return ret;
+}
+
+void mutex_unlock(struct mutex *lock) {
+  struct task_struct *self = lock->owner;
+  if (self)
+    pi_release(self, lock);
+
+  lock->owner = NULL;
+  __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+
+  /* Pairs with the barrier in prepare_to_wait() */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (waitqueue_active(&lock->wait)) {
+    /* Waits out any boost in progress; the next owner starts afresh */
+    uint64_t flags = spin_lock_irqsave(&lock->wait.lock);
+    __atomic_store_n(&lock->pi_prio, 0, __ATOMIC_RELAXED);
+    spin_unlock_irqrestore(&lock->wait.lock, flags);
+    wake_up(&lock->wait);
+  }
+
+  if (self && __atomic_load_n(&self->pi_prio, __ATOMIC_RELAXED))
+    mutex_pi_restore(self);
+}
@@ -0,0 +1,42 @@
+/*
+ * vib-OS Kernel - Counting Semaphores
+ */
+
+#include "../include/sync/semaphore.h"
+
+void sema_init(struct semaphore *sem, int count) {
+  sem->count = count;
+  init_waitqueue_head(&sem->wait);
+}
+
+bool down_trylock(struct semaphore *sem) {
+  int count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+  while (count > 0) {
+    if (__atomic_compare_exchange_n(&sem->count, &count, count - 1, true,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return true;
+  }
+  return false;
+}
+
+void down(struct semaphore *sem) {
+  wait_event_exclusive(&sem->wait, down_trylock(sem));
+}
+
+int down_interruptible(struct semaphore *sem) {
+  int ret = wait_event_interruptible_exclusive(&sem->wait, down_trylock(sem));
+
+  /* A wakeup meant for us would be lost; pass it on */
+  if (ret && __atomic_load_n(&sem->count, __ATOMIC_RELAXED) > 0)
+    wake_up(&sem->wait);
+  return ret;
+}
+
+void up(struct semaphore *sem) {
+  __atomic_add_fetch(&sem->count, 1, __ATOMIC_RELEASE);
+
+  /* Pairs with the barrier in prepare_to_wait() */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (waitqueue_active(&sem->wait))
+    wake_up(&sem->wait);
+}
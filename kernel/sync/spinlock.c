@@ -1,148 +1,166 @@
 /*
  * vib-OS Kernel - Spinlock Implementation
  *
- * Architecture-specific spinlock implementations using atomic operations.
- * Provides mutual exclusion for multiprocessor and interrupt safety.
+ * Ticket and MCS locks on the compiler's atomics. Waiting is the only
+ * architecture-specific part: on ARM64 a waiter sleeps in WFE with the
+ * word it watches in its exclusive monitor, so the releasing store wakes
+ * it; on x86 it spins with PAUSE.
  */
 
 #include "../include/sync/spinlock.h"
+#include "../include/arch/arch.h"
+#include "../include/printk.h"
+#include "../include/sched/hrtimer.h"
 
-/* Initialize a spinlock */
-void spin_lock_init(spinlock_t *lock) {
-  lock->lock = 0;
-#ifdef DEBUG_SPINLOCK
-  lock->name = NULL;
-  lock->held_by_cpu = -1;
+#define LOCKSTAT_TOP 20
+
+/* ===================================================================== */
+/* Waiting */
+/* ===================================================================== */
+
+static inline void cpu_relax(void) {
+#ifdef ARCH_ARM64
+  asm volatile("yield" ::: "memory");
+#elif defined(ARCH_X86_64) || defined(ARCH_X86)
+  asm volatile("pause" ::: "memory");
 #endif
 }
 
+/* Wait until the halfword at @p reads @val */
+static inline void wait_u16_eq(uint16_t *p, uint16_t val) {
 #ifdef ARCH_ARM64
-/*
- * ARM64 spinlock using Load-Exclusive/Store-Exclusive
- * LDAXR provides acquire semantics, STXR provides release semantics
- */
-void spin_lock(spinlock_t *lock) {
   uint32_t tmp;
-  asm volatile("   sevl\n"                   /* Set event locally */
-               "1: wfe\n"                    /* Wait for event (power saving) */
-               "2: ldaxr   %w0, [%1]\n"      /* Load exclusive with acquire */
-               "   cbnz    %w0, 1b\n"        /* If locked, wait for event */
-               "   stxr    %w0, %w2, [%1]\n" /* Try to acquire */
-               "   cbnz    %w0, 2b\n"        /* If failed, retry load */
+  asm volatile("   sevl\n"
+               "1: wfe\n"
+               "   ldaxrh  %w0, [%1]\n"
+               "   cmp     %w0, %w2\n"
+               "   b.ne    1b\n"
                : "=&r"(tmp)
-               : "r"(&lock->lock), "r"(1)
-               : "memory");
+               : "r"(p), "r"((uint32_t)val)
+               : "memory", "cc");
+#else
+  while (__atomic_load_n(p, __ATOMIC_ACQUIRE) != val)
+    cpu_relax();
+#endif
 }
 
-void spin_unlock(spinlock_t *lock) {
-  asm volatile("stlr wzr, [%0]" /* Store release (0) - release lock */
-               :
-               : "r"(&lock->lock)
+/* Wait until the word at @p reads nonzero */
+static inline void wait_u32_set(uint32_t *p) {
+#ifdef ARCH_ARM64
+  uint32_t tmp;
+  asm volatile("   sevl\n"
+               "1: wfe\n"
+               "   ldaxr   %w0, [%1]\n"
+               "   cbz     %w0, 1b\n"
+               : "=&r"(tmp)
+               : "r"(p)
                : "memory");
+#else
+  while (!__atomic_load_n(p, __ATOMIC_ACQUIRE))
+    cpu_relax();
+#endif
 }
 
-int spin_trylock(spinlock_t *lock) {
-  uint32_t tmp, result;
-  asm volatile("   ldaxr   %w0, [%2]\n"      /* Load exclusive with acquire */
-               "   cbnz    %w0, 1f\n"        /* If already locked, fail */
-               "   stxr    %w0, %w3, [%2]\n" /* Try to acquire */
-               "   cbz     %w0, 2f\n"        /* If succeeded, return 1 */
-               "1: mov     %w1, #0\n"        /* Failure path */
-               "   b       3f\n"
-               "2: mov     %w1, #1\n" /* Success path */
-               "3:\n"
-               : "=&r"(tmp), "=r"(result)
-               : "r"(&lock->lock), "r"(1)
-               : "memory");
-  return result;
-}
+/* ===================================================================== */
+/* Contention statistics */
+/* ===================================================================== */
 
-#elif defined(ARCH_X86_64)
-/*
- * x86_64 spinlock using XCHG (implicit lock prefix)
- */
-void spin_lock(spinlock_t *lock) {
-  while (1) {
-    /* Spin on read first to avoid cache line bouncing */
-    while (lock->lock) {
-      asm volatile("pause" ::: "memory");
-    }
+#ifdef DEBUG_SPINLOCK
 
-    /* Try to acquire */
-    uint32_t expected = 0;
-    uint32_t desired = 1;
-    uint32_t old;
-    asm volatile("lock cmpxchgl %2, %1"
-                 : "=a"(old), "+m"(lock->lock)
-                 : "r"(desired), "0"(expected)
-                 : "memory", "cc");
-    if (old == 0) {
-      return; /* Acquired */
-    }
+/* Locks set up by SPINLOCK_INIT, which names no class */
+static struct lock_class unnamed_class = {.name = "(SPINLOCK_INIT)",
+                                          .file = ""};
+
+/* Classes that have been acquired, newest first */
+static struct lock_class *lock_classes;
+
+static void lockstat_account(struct lock_class *class, bool contended,
+                             uint64_t spin) {
+  if (!class)
+    class = &unnamed_class;
+
+  if (!__atomic_exchange_n(&class->registered, 1, __ATOMIC_RELAXED)) {
+    struct lock_class *head = __atomic_load_n(&lock_classes, __ATOMIC_RELAXED);
+    do {
+      class->next = head;
+    } while (!__atomic_compare_exchange_n(&lock_classes, &head, class, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
   }
-}
 
-void spin_unlock(spinlock_t *lock) {
-  asm volatile("movl $0, %0" : "=m"(lock->lock) : : "memory");
+  __atomic_add_fetch(&class->acquisitions, 1, __ATOMIC_RELAXED);
+  if (!contended)
+    return;
+
+  __atomic_add_fetch(&class->contended, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&class->spin_total, spin, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&class->spin_max, __ATOMIC_RELAXED);
+  while (spin > max &&
+         !__atomic_compare_exchange_n(&class->spin_max, &max, spin, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
 }
 
-int spin_trylock(spinlock_t *lock) {
-  uint32_t old;
-  asm volatile("lock xchgl %0, %1"
-               : "=r"(old), "+m"(lock->lock)
-               : "0"(1)
-               : "memory");
-  return old == 0;
+#endif /* DEBUG_SPINLOCK */
+
+/* ===================================================================== */
+/* Ticket locks */
+/* ===================================================================== */
+
+#ifdef DEBUG_SPINLOCK
+void __spin_lock_init(spinlock_t *lock, struct lock_class *class) {
+  lock->val = 0;
+  lock->class = class;
+  lock->held_by_cpu = -1;
 }
+#else
+void spin_lock_init(spinlock_t *lock) { lock->val = 0; }
+#endif
 
-#elif defined(ARCH_X86)
-/*
- * x86 32-bit spinlock
- */
 void spin_lock(spinlock_t *lock) {
-  while (1) {
-    while (lock->lock) {
-      asm volatile("pause" ::: "memory");
-    }
+  /* Take a ticket; the lock is ours when the owner field reaches it */
+  uint32_t old = __atomic_fetch_add(&lock->val, 1U << 16, __ATOMIC_ACQUIRE);
+  uint16_t ticket = old >> 16;
+  bool contended = (uint16_t)old != ticket;
 
-    uint32_t old;
-    asm volatile("lock xchgl %0, %1"
-                 : "=r"(old), "+m"(lock->lock)
-                 : "0"(1)
-                 : "memory");
-    if (old == 0) {
-      return;
-    }
+#ifdef DEBUG_SPINLOCK
+  uint64_t spin = 0;
+  if (contended) {
+    uint64_t start = arch_timer_get_ticks();
+    wait_u16_eq(&lock->tickets.owner, ticket);
+    spin = arch_timer_get_ticks() - start;
   }
+  lock->held_by_cpu = arch_cpu_id();
+  lockstat_account(lock->class, contended, spin);
+#else
+  if (contended)
+    wait_u16_eq(&lock->tickets.owner, ticket);
+#endif
 }
 
 void spin_unlock(spinlock_t *lock) {
-  asm volatile("movl $0, %0" : "=m"(lock->lock) : : "memory");
+#ifdef DEBUG_SPINLOCK
+  lock->held_by_cpu = -1;
+#endif
+  /* Only the holder writes the owner field, so no read-modify-write */
+  uint16_t owner = __atomic_load_n(&lock->tickets.owner, __ATOMIC_RELAXED);
+  __atomic_store_n(&lock->tickets.owner, (uint16_t)(owner + 1),
+                   __ATOMIC_RELEASE);
 }
 
 int spin_trylock(spinlock_t *lock) {
-  uint32_t old;
-  asm volatile("lock xchgl %0, %1"
-               : "=r"(old), "+m"(lock->lock)
-               : "0"(1)
-               : "memory");
-  return old == 0;
-}
+  uint32_t old = __atomic_load_n(&lock->val, __ATOMIC_RELAXED);
+  if ((uint16_t)old != (uint16_t)(old >> 16))
+    return 0;
+  if (!__atomic_compare_exchange_n(&lock->val, &old, old + (1U << 16), false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
 
-#else
-/* Fallback for unsupported architectures - not safe for SMP! */
-void spin_lock(spinlock_t *lock) {
-  while (__sync_lock_test_and_set(&lock->lock, 1)) {
-    /* spin */
-  }
-}
-
-void spin_unlock(spinlock_t *lock) { __sync_lock_release(&lock->lock); }
-
-int spin_trylock(spinlock_t *lock) {
-  return __sync_lock_test_and_set(&lock->lock, 1) == 0;
-}
+#ifdef DEBUG_SPINLOCK
+  lock->held_by_cpu = arch_cpu_id();
+  lockstat_account(lock->class, false, 0);
 #endif
+  return 1;
+}
 
 /*
  * IRQ-safe spinlock variants
@@ -160,3 +178,170 @@ void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
   spin_unlock(lock);
   arch_irq_restore_local(flags);
 }
+
+/* ===================================================================== */
+/* MCS locks */
+/* ===================================================================== */
+
+void mcs_spin_lock(mcs_lock_t *lock, struct mcs_node *node) {
+  node->next = NULL;
+  node->locked = 0;
+
+  /* Join the queue; with nobody ahead the lock is ours */
+  struct mcs_node *prev = __atomic_exchange_n(&lock->tail, node,
+                                              __ATOMIC_ACQ_REL);
+#ifdef DEBUG_SPINLOCK
+  uint64_t spin = 0;
+  if (prev) {
+    uint64_t start = arch_timer_get_ticks();
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    wait_u32_set(&node->locked);
+    spin = arch_timer_get_ticks() - start;
+  }
+  lockstat_account(lock->class, prev != NULL, spin);
+#else
+  if (prev) {
+    /* Spin on our own node until the one ahead hands over */
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    wait_u32_set(&node->locked);
+  }
+#endif
+}
+
+void mcs_spin_unlock(mcs_lock_t *lock, struct mcs_node *node) {
+  struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+  if (!next) {
+    /* Still the tail: nobody is waiting */
+    struct mcs_node *expected = node;
+    if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return;
+
+    /* Someone has joined but not yet linked in behind us */
+    while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+      cpu_relax();
+  }
+
+  __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+}
+
+int mcs_spin_trylock(mcs_lock_t *lock, struct mcs_node *node) {
+  struct mcs_node *expected = NULL;
+
+  node->next = NULL;
+  node->locked = 0;
+  if (!__atomic_compare_exchange_n(&lock->tail, &expected, node, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
+
+#ifdef DEBUG_SPINLOCK
+  lockstat_account(lock->class, false, 0);
+#endif
+  return 1;
+}
+
+uint64_t mcs_spin_lock_irqsave(mcs_lock_t *lock, struct mcs_node *node) {
+  uint64_t flags = arch_irq_save_local();
+  mcs_spin_lock(lock, node);
+  return flags;
+}
+
+void mcs_spin_unlock_irqrestore(mcs_lock_t *lock, struct mcs_node *node,
+                                uint64_t flags) {
+  mcs_spin_unlock(lock, node);
+  arch_irq_restore_local(flags);
+}
+
+/* ===================================================================== */
+/* Reports */
+/* ===================================================================== */
+
+#ifdef DEBUG_SPINLOCK
+
+/* Final path component of @path */
+static const char *base_name(const char *path) {
+  const char *base = path;
+  for (; *path; path++) {
+    if (*path == '/')
+      base = path + 1;
+  }
+  return base;
+}
+
+int lockstat_report(char *buf, size_t size) {
+  int len = 0;
+
+  /* Most time spent waiting first; a selection over the list is plenty */
+  struct lock_class *top[LOCKSTAT_TOP];
+  int rows = 0, classes = 0;
+  struct lock_class *head = __atomic_load_n(&lock_classes, __ATOMIC_ACQUIRE);
+
+  for (struct lock_class *c = head; c; c = c->next)
+    classes++;
+  while (rows < LOCKSTAT_TOP) {
+    struct lock_class *best = NULL;
+    for (struct lock_class *c = head; c; c = c->next) {
+      bool taken = false;
+      for (int i = 0; i < rows; i++)
+        taken |= top[i] == c;
+      if (!taken && (!best || c->spin_total > best->spin_total ||
+                     (c->spin_total == best->spin_total &&
+                      c->acquisitions > best->acquisitions)))
+        best = c;
+    }
+    if (!best)
+      break;
+    top[rows++] = best;
+  }
+
+  REPORT_OUT("%-28s %10s %9s %5s %9s %9s %9s\n", "lock", "acquired",
+             "contended", "%", "wait ms", "avg ns", "max us");
+  for (int i = 0; i < rows; i++) {
+    struct lock_class *c = top[i];
+    uint64_t acq = c->acquisitions, cont = c->contended;
+    uint64_t pm = acq ? cont * 1000 / acq : 0;
+    char name[64];
+
+    if (*c->file)
+      snprintf(name, sizeof(name), "%s (%s)", c->name, base_name(c->file));
+    else
+      snprintf(name, sizeof(name), "%s", c->name);
+
+    REPORT_OUT("%-28s %10llu %9llu %3llu.%llu %9llu %9llu %9llu\n", name,
+               (unsigned long long)acq, (unsigned long long)cont,
+               (unsigned long long)(pm / 10), (unsigned long long)(pm % 10),
+               (unsigned long long)(ticks_to_ns(c->spin_total) / 1000000),
+               (unsigned long long)(cont ? ticks_to_ns(c->spin_total) / cont
+                                         : 0),
+               (unsigned long long)(ticks_to_ns(c->spin_max) / 1000));
+  }
+  if (classes > rows)
+    REPORT_OUT("(%d more)\n", classes - rows);
+
+  return len;
+}
+
+void lockstat_reset(void) {
+  struct lock_class *head = __atomic_load_n(&lock_classes, __ATOMIC_ACQUIRE);
+
+  for (struct lock_class *c = head; c; c = c->next) {
+    __atomic_store_n(&c->acquisitions, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->contended, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->spin_total, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->spin_max, 0, __ATOMIC_RELAXED);
+  }
+}
+
+#else
+
+int lockstat_report(char *buf, size_t size) {
+  const char *msg = "Lock statistics need a build with LOCK_STAT=1\n";
+
+  printk(KERN_INFO "%s", msg);
+  return buf ? snprintf(buf, size, "%s", msg) : 0;
+}
+
+void lockstat_reset(void) {}
+
+#endif /* DEBUG_SPINLOCK */
@@ -0,0 +1,258 @@
+/*
+ * vib-OS Kernel - Wait Queues
+ *
+ * Sleeping and waking for the three kinds of waiting context described
+ * in wait.h. The queue lock is IRQ-safe, so interrupt handlers may wake
+ * waiters.
+ */
+
+#include "../include/sync/wait.h"
+#include "../include/arch/arch.h"
+#include "../core/process.h"
+
+/* ===================================================================== */
+/* List helpers */
+/* ===================================================================== */
+
+static inline void wait_list_add(struct list_head *entry,
+                                 struct list_head *prev,
+                                 struct list_head *next) {
+  next->prev = entry;
+  entry->next = next;
+  entry->prev = prev;
+  prev->next = entry;
+}
+
+static inline void wait_list_del(struct list_head *entry) {
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+  entry->next = entry->prev = entry;
+}
+
+/* ===================================================================== */
+/* Waiting */
+/* ===================================================================== */
+
+void init_waitqueue_head(wait_queue_head_t *wq) {
+  spin_lock_init(&wq->lock);
+  wq->head.next = wq->head.prev = &wq->head;
+}
+
+struct task_struct *wait_current_task(void) {
+  /* User processes run on the boot CPU beside its idle task */
+  if (arch_cpu_id() == 0 && process_current())
+    return NULL;
+
+  struct task_struct *task = get_current();
+  return (task && !(task->flags & PF_IDLE)) ? task : NULL;
+}
+
+void init_wait_entry(struct wait_queue_entry *wait, unsigned int flags) {
+  wait->entry.next = wait->entry.prev = &wait->entry;
+  wait->cpu = arch_cpu_id();
+  wait->proc = (wait->cpu == 0) ? process_current() : NULL;
+  wait->task = wait->proc ? NULL : wait_current_task();
+  wait->flags = flags;
+  wait->key = 0;
+  wait->head = NULL;
+  wait->queued = false;
+}
+
+/*
+ * Lock the queue @wait is on, or @wq if it is on none. Only a holder of
+ * that queue's lock can dequeue or requeue it, so retry if it moved
+ * before we got the lock.
+ */
+static wait_queue_head_t *lock_wait_queue(struct wait_queue_entry *wait,
+                                          wait_queue_head_t *wq,
+                                          uint64_t *flags) {
+  for (;;) {
+    wait_queue_head_t *head = __atomic_load_n(&wait->queued, __ATOMIC_ACQUIRE)
+                                  ? __atomic_load_n(&wait->head, __ATOMIC_RELAXED)
+                                  : wq;
+    *flags = spin_lock_irqsave(&head->lock);
+    if ((wait->queued ? wait->head : wq) == head)
+      return head;
+    spin_unlock_irqrestore(&head->lock, *flags);
+  }
+}
+
+/* Mark the context behind @wait asleep (its queue locked) */
+static void set_sleeping(struct wait_queue_entry *wait, int state) {
+  if (wait->task)
+    wait->task->state = state;
+  else if (wait->proc)
+    wait->proc->state = PROC_STATE_BLOCKED;
+}
+
+void prepare_to_wait(wait_queue_head_t *wq, struct wait_queue_entry *wait,
+                     int state) {
+  uint64_t flags;
+  wait_queue_head_t *head = lock_wait_queue(wait, wq, &flags);
+
+  if (!wait->queued) {
+    if (wait->flags & WQ_FLAG_EXCLUSIVE)
+      wait_list_add(&wait->entry, head->head.prev, &head->head);
+    else
+      wait_list_add(&wait->entry, &head->head, head->head.next);
+    wait->head = head;
+    wait->queued = true;
+  }
+
+  set_sleeping(wait, state);
+  spin_unlock_irqrestore(&head->lock, flags);
+
+  /* Queued and asleep before the caller reads the condition */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+bool wait_rearm(struct wait_queue_entry *wait, int state) {
+  if (!__atomic_load_n(&wait->queued, __ATOMIC_ACQUIRE))
+    return false;
+
+  uint64_t flags;
+  wait_queue_head_t *head = lock_wait_queue(wait, wait->head, &flags);
+  bool queued = wait->queued;
+  if (queued)
+    set_sleeping(wait, state);
+  spin_unlock_irqrestore(&head->lock, flags);
+  return queued;
+}
+
+bool finish_wait(wait_queue_head_t *wq, struct wait_queue_entry *wait) {
+  if (wait->task) {
+    wait->task->state = TASK_RUNNING;
+  } else if (wait->proc) {
+    unsigned long flags = arch_irq_save();
+    wait->proc->state = PROC_STATE_RUNNING;
+    arch_irq_restore(flags);
+  }
+
+  /* A waker dequeues what it wakes; only a timeout or signal leaves us on */
+  bool woken = true;
+  if (__atomic_load_n(&wait->queued, __ATOMIC_ACQUIRE)) {
+    uint64_t flags;
+    wait_queue_head_t *head = lock_wait_queue(wait, wq, &flags);
+    if (wait->queued) {
+      wait_list_del(&wait->entry);
+      wait->queued = false;
+      woken = false;
+    }
+    spin_unlock_irqrestore(&head->lock, flags);
+  }
+  return woken;
+}
+
+void wait_sleep(struct wait_queue_entry *wait) {
+  if (wait->task) {
+    schedule();
+  } else if (wait->proc) {
+    process_block();
+  } else {
+    /*
+     * Cannot block: run whatever is queued on this CPU, then wait in wfi
+     * unless that already woke us. The waker's IPI or the tick ends it.
+     */
+    schedule();
+    if (__atomic_load_n(&wait->queued, __ATOMIC_ACQUIRE))
+      arch_idle();
+  }
+}
+
+bool wait_signal_pending(struct wait_queue_entry *wait) {
+  struct task_struct *task = wait->task;
+  return task && (task->pending_signals & ~task->blocked_signals) != 0;
+}
+
+/* ===================================================================== */
+/* Waking */
+/* ===================================================================== */
+
+void wait_wake(struct wait_queue_entry *wait) {
+  if (wait->task)
+    wake_up_process(wait->task);
+  else if (wait->proc)
+    process_wake(wait->proc);
+  else
+    smp_send_reschedule(wait->cpu);
+}
+
+/* Dequeue and wake @wait (queue locked) */
+static void wake_entry(struct wait_queue_entry *wait) {
+  wait_list_del(&wait->entry);
+  wait_wake(wait);
+
+  /* The waiter may return and drop its entry once it sees queued clear */
+  __atomic_store_n(&wait->queued, false, __ATOMIC_RELEASE);
+}
+
+void __wake_up(wait_queue_head_t *wq, int nr_exclusive) {
+  uint64_t flags = spin_lock_irqsave(&wq->lock);
+
+  struct list_head *pos = wq->head.next;
+  while (pos != &wq->head) {
+    struct wait_queue_entry *wait =
+        container_of(pos, struct wait_queue_entry, entry);
+    pos = pos->next;
+
+    bool exclusive = wait->flags & WQ_FLAG_EXCLUSIVE;
+    wake_entry(wait);
+
+    if (exclusive && --nr_exclusive == 0)
+      break;
+  }
+
+  spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+int __wake_up_key(wait_queue_head_t *wq, uint64_t key, int nr) {
+  int woken = 0;
+  uint64_t flags = spin_lock_irqsave(&wq->lock);
+
+  struct list_head *pos = wq->head.next;
+  while (pos != &wq->head && woken < nr) {
+    struct wait_queue_entry *wait =
+        container_of(pos, struct wait_queue_entry, entry);
+    pos = pos->next;
+
+    if (wait->key == key) {
+      wake_entry(wait);
+      woken++;
+    }
+  }
+
+  spin_unlock_irqrestore(&wq->lock, flags);
+  return woken;
+}
+
+int wait_requeue_key(wait_queue_head_t *from, uint64_t key,
+                     wait_queue_head_t *to, uint64_t new_key, int nr) {
+  int moved = 0;
+
+  /* Lock in address order so two requeues the opposite way cannot deadlock */
+  wait_queue_head_t *first = from < to ? from : to;
+  wait_queue_head_t *second = from < to ? to : from;
+  uint64_t flags = spin_lock_irqsave(&first->lock);
+  if (second != first)
+    spin_lock(&second->lock);
+
+  struct list_head *pos = from->head.next;
+  while (pos != &from->head && moved < nr) {
+    struct wait_queue_entry *wait =
+        container_of(pos, struct wait_queue_entry, entry);
+    pos = pos->next;
+
+    if (wait->key == key) {
+      wait_list_del(&wait->entry);
+      wait_list_add(&wait->entry, to->head.prev, &to->head);
+      wait->key = new_key;
+      wait->head = to;
+      moved++;
+    }
+  }
+
+  if (second != first)
+    spin_unlock(&second->lock);
+  spin_unlock_irqrestore(&first->lock, flags);
+  return moved;
+}
@@ -4,11 +4,16 @@
 
 #include "syscall/syscall.h"
 #include "arch/arch.h"
+#include "arch/fpsimd.h"
 #include "drivers/uart.h"
 #include "fs/vfs.h"
+#include "ipc/futex.h"
 #include "mm/kmalloc.h"
+#include "mm/mmap.h"
 #include "printk.h"
+#include "sched/hrtimer.h"
 #include "sched/sched.h"
+#include "../core/process.h"
 
 /* ===================================================================== */
 /* File Descriptor Table */
@@ -335,8 +340,6 @@ static long sys_gettid(uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3,
 #define USER_HEAP_START 0x10000000UL /* 256MB mark */
 #define USER_HEAP_SIZE 0x04000000UL  /* 64MB heap */
 static uint64_t user_brk_current = USER_HEAP_START;
-static uint64_t user_mmap_current =
-    USER_HEAP_START + USER_HEAP_SIZE / 2; /* mmap from middle */
 
 static long sys_brk(uint64_t brk, uint64_t a1, uint64_t a2, uint64_t a3,
                     uint64_t a4, uint64_t a5) {
@@ -362,52 +365,77 @@ static long sys_brk(uint64_t brk, uint64_t a1, uint64_t a2, uint64_t a3,
   return user_brk_current;
 }
 
+/*
+ * Address space for memory syscalls - programs without one use the kernel's.
+ * Processes get none: they run on whichever task the boot CPU was in and
+ * have no mm of their own, so their mappings would land in the shared one,
+ * outlive them, and be open to every other process's munmap and mprotect.
+ */
+static struct mm_struct *current_mm(void) {
+  if (process_current()) {
+    return NULL;
+  }
+  struct task_struct *task = get_current();
+  return (task && task->mm) ? task->mm : vmm_kernel_mm();
+}
+
 static long sys_mmap(uint64_t addr, uint64_t len, uint64_t prot, uint64_t flags,
                      uint64_t fd, uint64_t offset) {
-  (void)addr;
-  (void)prot;
-  (void)offset;
-
-/* Only support anonymous mappings for now */
-#define MAP_ANONYMOUS 0x20
-  if (!(flags & MAP_ANONYMOUS) || (int64_t)fd != -1) {
-    printk(KERN_DEBUG "sys_mmap: only anonymous mappings supported\n");
+  struct mm_struct *mm = current_mm();
+  struct file *file = NULL;
+
+  if (!mm) {
     return -ENOSYS;
   }
-
-/* Align len to page size */
-#define PAGE_SIZE 4096UL
-  len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-
-  /* Check bounds */
-  if (user_mmap_current + len > USER_HEAP_START + USER_HEAP_SIZE) {
-    printk(KERN_WARNING "sys_mmap: out of memory\n");
-    return -ENOMEM;
+  if (!(flags & MAP_ANONYMOUS)) {
+    file = get_file((int)fd);
+    if (!file) {
+      return -EBADF;
+    }
   }
 
-  /* Allocate from mmap region */
-  uint64_t result = user_mmap_current;
-  user_mmap_current += len;
-
-  /* Zero the memory */
-  uint8_t *p = (uint8_t *)result;
-  for (size_t i = 0; i < len; i++)
-    p[i] = 0;
-
-  return result;
+  return do_mmap(mm, addr, len, (int)prot, (int)flags, file, offset);
 }
 
 static long sys_munmap(uint64_t addr, uint64_t len, uint64_t a2, uint64_t a3,
                        uint64_t a4, uint64_t a5) {
-  (void)addr;
-  (void)len;
   (void)a2;
   (void)a3;
   (void)a4;
   (void)a5;
 
-  /* For now, just no-op munmap - memory is not reclaimed */
-  return 0;
+  struct mm_struct *mm = current_mm();
+  if (!mm) {
+    return -ENOSYS;
+  }
+  return do_munmap(mm, addr, len);
+}
+
+static long sys_mprotect(uint64_t addr, uint64_t len, uint64_t prot,
+                         uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  struct mm_struct *mm = current_mm();
+  if (!mm) {
+    return -ENOSYS;
+  }
+  return do_mprotect(mm, addr, len, (int)prot);
+}
+
+static long sys_msync(uint64_t addr, uint64_t len, uint64_t flags, uint64_t a3,
+                      uint64_t a4, uint64_t a5) {
+  (void)flags; /* Writeback is always synchronous */
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  struct mm_struct *mm = current_mm();
+  if (!mm) {
+    return -ENOSYS;
+  }
+  return do_msync(mm, addr, len);
 }
 
 static long sys_clone(uint64_t flags, uint64_t stack, uint64_t ptid,
@@ -419,7 +447,10 @@ static long sys_clone(uint64_t flags, uint64_t stack, uint64_t ptid,
   (void)ctid;
   (void)a5;
 
-  /* Stub - not implemented */
+  /*
+   * Callers are processes, which do_fork() cannot copy: it forks scheduler
+   * tasks, and a process has no mm or kernel stack of its own to duplicate
+   */
   return -ENOSYS;
 }
 
@@ -588,20 +619,248 @@ static long sys_sched_yield(uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3,
   return 0;
 }
 
+/* Only PRIO_PROCESS is supported; who = 0 means the caller */
+#define PRIO_PROCESS 0
+
+/* Returns the task with a reference; put_task_struct() it when done */
+static struct task_struct *prio_target(uint64_t who) {
+  if (who)
+    return get_task_by_pid((pid_t)who);
+  struct task_struct *task = get_current();
+  get_task_struct(task);
+  return task;
+}
+
+static long sys_setpriority(uint64_t which, uint64_t who, uint64_t niceval,
+                            uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (which != PRIO_PROCESS)
+    return -EINVAL;
+  struct task_struct *task = prio_target(who);
+  if (!task)
+    return -ESRCH;
+
+  sched_set_nice(task, (int)niceval);
+  put_task_struct(task);
+  return 0;
+}
+
+/* Returns 20 - nice (1..40), as the raw Linux syscall does */
+static long sys_getpriority(uint64_t which, uint64_t who, uint64_t a2,
+                            uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (which != PRIO_PROCESS)
+    return -EINVAL;
+  struct task_struct *task = prio_target(who);
+  if (!task)
+    return -ESRCH;
+
+  int nice = task->nice;
+  put_task_struct(task);
+  return 20 - nice;
+}
+
+/* struct sched_param: only the priority */
+struct sched_param {
+  int sched_priority;
+};
+
+static long sys_sched_setscheduler(uint64_t pid, uint64_t policy, uint64_t param,
+                                   uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (!param)
+    return -EFAULT;
+  struct task_struct *task = prio_target(pid);
+  if (!task)
+    return -ESRCH;
+
+  long ret = sched_setscheduler(
+      task, (int)policy, ((const struct sched_param *)param)->sched_priority);
+  put_task_struct(task);
+  return ret;
+}
+
+static long sys_sched_getscheduler(uint64_t pid, uint64_t a1, uint64_t a2,
+                                   uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a1;
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  struct task_struct *task = prio_target(pid);
+  if (!task)
+    return -ESRCH;
+
+  int policy = task->policy;
+  put_task_struct(task);
+  return policy;
+}
+
+static long sys_sched_get_priority_max(uint64_t policy, uint64_t a1,
+                                       uint64_t a2, uint64_t a3, uint64_t a4,
+                                       uint64_t a5) {
+  (void)a1;
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (policy == SCHED_FIFO || policy == SCHED_RR)
+    return MAX_RT_PRIO - 1;
+  return policy == SCHED_NORMAL ? 0 : -EINVAL;
+}
+
+static long sys_sched_get_priority_min(uint64_t policy, uint64_t a1,
+                                       uint64_t a2, uint64_t a3, uint64_t a4,
+                                       uint64_t a5) {
+  (void)a1;
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (policy == SCHED_FIFO || policy == SCHED_RR)
+    return 1;
+  return policy == SCHED_NORMAL ? 0 : -EINVAL;
+}
+
+/* There is no wall clock: every clock counts from boot */
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#define CLOCK_MONOTONIC_RAW 4
+#define CLOCK_BOOTTIME 7
+
+#define TIMER_ABSTIME 1
+
+static bool clock_valid(uint64_t clockid) {
+  return clockid == CLOCK_REALTIME || clockid == CLOCK_MONOTONIC ||
+         clockid == CLOCK_MONOTONIC_RAW || clockid == CLOCK_BOOTTIME;
+}
+
+static long timespec_to_ns(const struct timespec *ts, uint64_t *ns) {
+  if (!ts)
+    return -EFAULT;
+  if (ts->tv_sec < 0 || ts->tv_nsec < 0 || ts->tv_nsec >= (long)NSEC_PER_SEC)
+    return -EINVAL;
+  *ns = (uint64_t)ts->tv_sec * NSEC_PER_SEC + (uint64_t)ts->tv_nsec;
+  return 0;
+}
+
+static void ns_to_timespec(uint64_t ns, struct timespec *ts) {
+  ts->tv_sec = (time_t)(ns / NSEC_PER_SEC);
+  ts->tv_nsec = (long)(ns % NSEC_PER_SEC);
+}
+
 static long sys_nanosleep(uint64_t req, uint64_t rem, uint64_t a2, uint64_t a3,
                           uint64_t a4, uint64_t a5) {
-  (void)rem;
   (void)a2;
   (void)a3;
   (void)a4;
   (void)a5;
 
-  /* Stub - sleep not implemented */
-  (void)req;
+  uint64_t ns, left;
+  long ret = timespec_to_ns((const struct timespec *)req, &ns);
+  if (ret)
+    return ret;
+
+  ret = hrtimer_nanosleep(ns, &left);
+  if (ret == -EINTR && rem)
+    ns_to_timespec(left, (struct timespec *)rem);
+  return ret;
+}
+
+static long sys_clock_nanosleep(uint64_t clockid, uint64_t flags, uint64_t req,
+                                uint64_t rem, uint64_t a4, uint64_t a5) {
+  (void)a4;
+  (void)a5;
+
+  if (!clock_valid(clockid))
+    return -EINVAL;
+
+  uint64_t ns;
+  long ret = timespec_to_ns((const struct timespec *)req, &ns);
+  if (ret)
+    return ret;
+
+  /* Absolute sleeps are not affected by how long the call took to get here */
+  if (flags & TIMER_ABSTIME)
+    return hrtimer_sleep_until(ns_to_ticks(ns));
+
+  uint64_t left;
+  ret = hrtimer_nanosleep(ns, &left);
+  if (ret == -EINTR && rem)
+    ns_to_timespec(left, (struct timespec *)rem);
+  return ret;
+}
+
+static long sys_clock_gettime(uint64_t clockid, uint64_t tp, uint64_t a2,
+                              uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (!clock_valid(clockid))
+    return -EINVAL;
+  if (!tp)
+    return -EFAULT;
+
+  ns_to_timespec(ktime_get_ns(), (struct timespec *)tp);
+  return 0;
+}
+
+static long sys_clock_getres(uint64_t clockid, uint64_t res, uint64_t a2,
+                             uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (!clock_valid(clockid))
+    return -EINVAL;
 
+  /* One counter tick, rounded up to a nanosecond */
+  uint64_t freq = arch_timer_get_frequency();
+  uint64_t tick = freq ? (NSEC_PER_SEC + freq - 1) / freq : 1;
+  if (res)
+    ns_to_timespec(tick, (struct timespec *)res);
   return 0;
 }
 
+static long sys_futex(uint64_t uaddr, uint64_t op, uint64_t val, uint64_t arg,
+                      uint64_t uaddr2, uint64_t val3) {
+  uint64_t expires = 0;
+  uint32_t val2 = (uint32_t)arg;
+
+  /* FUTEX_WAIT takes a relative timeout where the others take a count */
+  if (((int)op & FUTEX_CMD_MASK) == FUTEX_WAIT) {
+    val2 = 0;
+    if (arg) {
+      uint64_t ns;
+      long ret = timespec_to_ns((const struct timespec *)arg, &ns);
+      if (ret)
+        return ret;
+      expires = arch_timer_get_ticks() + ns_to_ticks(ns);
+      if (!expires)
+        expires = 1;
+    }
+  }
+
+  return do_futex((uint32_t *)uaddr, (int)op, (uint32_t)val, expires,
+                  (uint32_t *)uaddr2, val2, (uint32_t)val3);
+}
+
 static long sys_not_implemented(uint64_t a0, uint64_t a1, uint64_t a2,
                                 uint64_t a3, uint64_t a4, uint64_t a5) {
   (void)a0;
@@ -645,6 +904,8 @@ static long sys_sound_play(uint64_t data, uint64_t samples, uint64_t channels,
 void syscall_init(void) {
   printk(KERN_INFO "SYSCALL: Initializing system call table\n");
 
+  futex_init();
+
   /* Initialize all to not implemented */
   for (int i = 0; i < NR_syscalls; i++) {
     syscall_table[i] = sys_not_implemented;
@@ -668,11 +929,23 @@ void syscall_init(void) {
   syscall_table[SYS_brk] = sys_brk;
   syscall_table[SYS_mmap] = sys_mmap;
   syscall_table[SYS_munmap] = sys_munmap;
+  syscall_table[SYS_mprotect] = sys_mprotect;
+  syscall_table[SYS_msync] = sys_msync;
   syscall_table[SYS_clone] = sys_clone;
   syscall_table[SYS_execve] = sys_execve;
   syscall_table[SYS_uname] = sys_uname;
   syscall_table[SYS_sched_yield] = sys_sched_yield;
+  syscall_table[SYS_setpriority] = sys_setpriority;
+  syscall_table[SYS_getpriority] = sys_getpriority;
+  syscall_table[SYS_sched_setscheduler] = sys_sched_setscheduler;
+  syscall_table[SYS_sched_getscheduler] = sys_sched_getscheduler;
+  syscall_table[SYS_sched_get_priority_max] = sys_sched_get_priority_max;
+  syscall_table[SYS_sched_get_priority_min] = sys_sched_get_priority_min;
   syscall_table[SYS_nanosleep] = sys_nanosleep;
+  syscall_table[SYS_clock_nanosleep] = sys_clock_nanosleep;
+  syscall_table[SYS_clock_gettime] = sys_clock_gettime;
+  syscall_table[SYS_clock_getres] = sys_clock_getres;
+  syscall_table[SYS_futex] = sys_futex;
 
   printk(KERN_INFO "SYSCALL: System call table initialized\n");
 }
@@ -723,6 +996,10 @@ void handle_sync_exception(struct pt_regs *regs) {
 #endif
 
   switch (ec) {
+  case 0x07: /* FP/SIMD access while disabled in CPACR_EL1 */
+    fpsimd_trap();
+    break;
+
   case 0x15: /* SVC instruction from AArch64 */
     /* System call - handled separately */
     break;
@@ -740,6 +1017,19 @@ void handle_sync_exception(struct pt_regs *regs) {
 #ifdef ARCH_ARM64
     uint64_t far;
     asm volatile("mrs %0, far_el1" : "=r"(far));
+
+    /*
+     * Translation (DFSC 0x04-0x07) and permission (0x0D-0x0F) faults on
+     * mapped areas are demand paging or copy-on-write. WnR is ISS bit 6.
+     */
+    uint32_t dfsc = iss & 0x3F;
+    if ((dfsc >= 0x04 && dfsc <= 0x07) || (dfsc >= 0x0D && dfsc <= 0x0F)) {
+      struct mm_struct *mm = current_mm();
+      if (mm && handle_mm_fault(mm, far, (iss & (1U << 6)) != 0) == 0) {
+        break;
+      }
+    }
+
     printk(KERN_EMERG "Data abort at PC=0x%llx, FAR=0x%llx\n",
            (unsigned long long)arch_context_get_pc(regs),
            (unsigned long long)far);
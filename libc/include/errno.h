@@ -49,5 +49,7 @@ extern int errno;
 #define ELOOP           40  /* Too many symbolic links */
 #define EWOULDBLOCK     EAGAIN
 #define ENOMSG          42  /* No message of desired type */
+#define EOVERFLOW       75  /* Value too large for defined data type */
+#define ETIMEDOUT       110 /* Connection timed out */
 
 #endif /* _ERRNO_H */
@@ -0,0 +1,60 @@
+/*
+ * Vib-OS libc - pthread.h
+ *
+ * Mutexes and condition variables on the futex syscall. Taking a free
+ * mutex, releasing one nobody waits for, and signalling a condition
+ * nobody waits on are single atomic instructions; only contention
+ * enters the kernel.
+ */
+
+#ifndef _PTHREAD_H
+#define _PTHREAD_H
+
+#include <sys/types.h>
+
+/* Mutex types; every mutex is a normal (non-recursive) one */
+#define PTHREAD_MUTEX_NORMAL        0
+#define PTHREAD_MUTEX_DEFAULT       PTHREAD_MUTEX_NORMAL
+
+#define PTHREAD_PROCESS_PRIVATE     0
+#define PTHREAD_PROCESS_SHARED      1
+
+typedef struct {
+    volatile int __lock;    /* 0 unlocked, 1 locked, 2 locked with waiters */
+} pthread_mutex_t;
+
+typedef struct {
+    int __type;
+} pthread_mutexattr_t;
+
+typedef struct {
+    volatile int __seq;             /* Bumped by every signal */
+    pthread_mutex_t *__mutex;       /* Mutex of the last waiter */
+} pthread_cond_t;
+
+typedef struct {
+    int __pshared;
+} pthread_condattr_t;
+
+#define PTHREAD_MUTEX_INITIALIZER   { 0 }
+#define PTHREAD_COND_INITIALIZER    { 0, 0 }
+
+int pthread_mutexattr_init(pthread_mutexattr_t *attr);
+int pthread_mutexattr_destroy(pthread_mutexattr_t *attr);
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
+int pthread_mutex_destroy(pthread_mutex_t *mutex);
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+int pthread_mutex_trylock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+int pthread_condattr_init(pthread_condattr_t *attr);
+int pthread_condattr_destroy(pthread_condattr_t *attr);
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
+int pthread_cond_destroy(pthread_cond_t *cond);
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int pthread_cond_signal(pthread_cond_t *cond);
+int pthread_cond_broadcast(pthread_cond_t *cond);
+
+#endif /* _PTHREAD_H */
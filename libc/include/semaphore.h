@@ -0,0 +1,22 @@
+/*
+ * Vib-OS libc - semaphore.h
+ */
+
+#ifndef _SEMAPHORE_H
+#define _SEMAPHORE_H
+
+#define SEM_VALUE_MAX   0x7fffffff
+
+typedef struct {
+    volatile int __value;
+    volatile int __waiters;     /* Threads in, or entering, the kernel */
+} sem_t;
+
+int sem_init(sem_t *sem, int pshared, unsigned int value);
+int sem_destroy(sem_t *sem);
+int sem_wait(sem_t *sem);
+int sem_trywait(sem_t *sem);
+int sem_post(sem_t *sem);
+int sem_getvalue(sem_t *sem, int *sval);
+
+#endif /* _SEMAPHORE_H */
@@ -0,0 +1,268 @@
+/*
+ * UnixOS - Minimal C Library Implementation
+ * Mutexes, Condition Variables and Semaphores
+ *
+ * The mutex is the three-state futex lock from Drepper's "Futexes Are
+ * Tricky": unlock only makes a syscall when the lock word says someone
+ * may be asleep on it.
+ */
+
+#include "../include/pthread.h"
+#include "../include/semaphore.h"
+#include "../include/errno.h"
+
+#define FUTEX_WAIT          0
+#define FUTEX_WAKE          1
+#define FUTEX_CMP_REQUEUE   4
+#define FUTEX_PRIVATE_FLAG  128
+
+#define INT_MAX             0x7fffffff
+
+/* Spins on a held mutex before sleeping: holders rarely keep it long */
+#define MUTEX_SPINS         100
+
+/* From syscall.c */
+long __futex(volatile int *uaddr, int op, int val, const void *timeout,
+             volatile int *uaddr2, int val3);
+
+static inline int futex_wait(volatile int *addr, int val)
+{
+    return (int)__futex(addr, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, val, 0, 0, 0);
+}
+
+static inline void futex_wake(volatile int *addr, int nr)
+{
+    __futex(addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, nr, 0, 0, 0);
+}
+
+static inline int cas(volatile int *addr, int expected, int desired)
+{
+    __atomic_compare_exchange_n(addr, &expected, desired, 0,
+                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    return expected;
+}
+
+/* ===================================================================== */
+/* Mutexes */
+/* ===================================================================== */
+
+int pthread_mutexattr_init(pthread_mutexattr_t *attr)
+{
+    attr->__type = PTHREAD_MUTEX_NORMAL;
+    return 0;
+}
+
+int pthread_mutexattr_destroy(pthread_mutexattr_t *attr)
+{
+    (void)attr;
+    return 0;
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
+{
+    (void)attr;
+    mutex->__lock = 0;
+    return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+    return mutex->__lock ? EBUSY : 0;
+}
+
+/* Sleep until the lock is ours, leaving it marked contended */
+static void mutex_lock_slow(pthread_mutex_t *mutex)
+{
+    while (__atomic_exchange_n(&mutex->__lock, 2, __ATOMIC_ACQUIRE) != 0) {
+        futex_wait(&mutex->__lock, 2);
+    }
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    if (cas(&mutex->__lock, 0, 1) == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < MUTEX_SPINS; i++) {
+        if (mutex->__lock == 0 && cas(&mutex->__lock, 0, 1) == 0) {
+            return 0;
+        }
+        __asm__ volatile("yield");
+    }
+
+    mutex_lock_slow(mutex);
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    return cas(&mutex->__lock, 0, 1) == 0 ? 0 : EBUSY;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    if (__atomic_exchange_n(&mutex->__lock, 0, __ATOMIC_RELEASE) == 2) {
+        futex_wake(&mutex->__lock, 1);
+    }
+    return 0;
+}
+
+/* ===================================================================== */
+/* Condition variables */
+/* ===================================================================== */
+
+int pthread_condattr_init(pthread_condattr_t *attr)
+{
+    attr->__pshared = PTHREAD_PROCESS_PRIVATE;
+    return 0;
+}
+
+int pthread_condattr_destroy(pthread_condattr_t *attr)
+{
+    (void)attr;
+    return 0;
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+    (void)attr;
+    cond->__seq = 0;
+    cond->__mutex = 0;
+    return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    (void)cond;
+    return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    int seq = __atomic_load_n(&cond->__seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&cond->__mutex, mutex, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(mutex);
+
+    /* A signal after the read above changes __seq, so this returns at once */
+    futex_wait(&cond->__seq, seq);
+
+    /*
+     * Relock as contended: a broadcast may have moved other waiters onto
+     * the mutex, and they must be woken when we unlock it.
+     */
+    mutex_lock_slow(mutex);
+    return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    __atomic_fetch_add(&cond->__seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&cond->__seq, 1);
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    pthread_mutex_t *mutex = __atomic_load_n(&cond->__mutex, __ATOMIC_RELAXED);
+    int seq = __atomic_add_fetch(&cond->__seq, 1, __ATOMIC_SEQ_CST);
+
+    if (!mutex) {
+        return 0;   /* Never waited on */
+    }
+
+    /*
+     * Wake one waiter and move the rest onto the mutex, so they run one
+     * at a time as it is released instead of all fighting for it now.
+     * The woken one relocks as contended, which keeps the chain going.
+     */
+    if (__futex(&cond->__seq, FUTEX_CMP_REQUEUE | FUTEX_PRIVATE_FLAG, 1,
+                (const void *)(long)INT_MAX, &mutex->__lock, seq) < 0) {
+        futex_wake(&cond->__seq, INT_MAX);
+    }
+    return 0;
+}
+
+/* ===================================================================== */
+/* Semaphores */
+/* ===================================================================== */
+
+int sem_init(sem_t *sem, int pshared, unsigned int value)
+{
+    (void)pshared;  /* Futex keys are physical, so sharing needs nothing */
+
+    if (value > SEM_VALUE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    sem->__value = (int)value;
+    sem->__waiters = 0;
+    return 0;
+}
+
+int sem_destroy(sem_t *sem)
+{
+    (void)sem;
+    return 0;
+}
+
+int sem_trywait(sem_t *sem)
+{
+    int val = __atomic_load_n(&sem->__value, __ATOMIC_RELAXED);
+
+    while (val > 0) {
+        if (__atomic_compare_exchange_n(&sem->__value, &val, val - 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+int sem_wait(sem_t *sem)
+{
+    if (sem_trywait(sem) == 0) {
+        return 0;
+    }
+
+    /* Counted before rechecking, so sem_post sees us or we see its post */
+    __atomic_fetch_add(&sem->__waiters, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        if (sem_trywait(sem) == 0) {
+            break;
+        }
+        if (futex_wait(&sem->__value, 0) == -EINTR) {
+            __atomic_fetch_sub(&sem->__waiters, 1, __ATOMIC_RELAXED);
+            errno = EINTR;
+            return -1;
+        }
+    }
+    __atomic_fetch_sub(&sem->__waiters, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int sem_post(sem_t *sem)
+{
+    int val = __atomic_load_n(&sem->__value, __ATOMIC_RELAXED);
+
+    do {
+        if (val == SEM_VALUE_MAX) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&sem->__value, &val, val + 1, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    if (__atomic_load_n(&sem->__waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake(&sem->__value, 1);
+    }
+    return 0;
+}
+
+int sem_getvalue(sem_t *sem, int *sval)
+{
+    *sval = __atomic_load_n(&sem->__value, __ATOMIC_RELAXED);
+    return 0;
+}
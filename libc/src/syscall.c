@@ -44,6 +44,7 @@
 #define __NR_faccessat      48
 #define __NR_exit           93
 #define __NR_exit_group     94
+#define __NR_futex          98
 #define __NR_nanosleep      101
 #define __NR_kill           129
 #define __NR_tgkill         131
@@ -498,3 +499,15 @@ int usleep(unsigned int usec)
     
     return __syscall_ret(__syscall2(__NR_nanosleep, (long)&ts, 0));
 }
+
+/* ===================================================================== */
+/* Synchronization */
+/* ===================================================================== */
+
+/* Raw futex call for pthread.c: returns the kernel's -errno, not -1 */
+long __futex(volatile int *uaddr, int op, int val, const void *timeout,
+             volatile int *uaddr2, int val3)
+{
+    return __syscall6(__NR_futex, (long)uaddr, op, val, (long)timeout,
+                      (long)uaddr2, val3);
+}
@@ -22,6 +22,7 @@ kapi_t *doom_kapi = 0;
 
 /* Start time for DG_GetTicksMs */
 static uint64_t start_ticks = 0;
+static uint64_t start_ns = 0;
 
 /* Screen positioning - calculated at runtime to center on any resolution */
 static int screen_offset_x = 0;
@@ -176,6 +177,8 @@ static void poll_mouse(void) {
 void DG_Init(void) {
     /* Record start time */
     start_ticks = doom_kapi->get_uptime_ticks();
+    if (doom_kapi->get_time_ns)
+        start_ns = doom_kapi->get_time_ns();
 
     /* Force 2x scaling for fullscreen effect */
     int fb_w = doom_kapi->fb_width;
@@ -251,7 +254,11 @@ void DG_SleepMs(uint32_t ms) {
 }
 
 uint32_t DG_GetTicksMs(void) {
-    /* VibeOS ticks are 10ms each (100Hz timer) */
+    /* Millisecond-exact time keeps the 35Hz game tic steady */
+    if (doom_kapi->get_time_ns)
+        return (uint32_t)((doom_kapi->get_time_ns() - start_ns) / 1000000);
+
+    /* Older kernels: VibeOS ticks are 10ms each (100Hz timer) */
     uint64_t now = doom_kapi->get_uptime_ticks();
     return (uint32_t)((now - start_ticks) * 10);
 }
@@ -213,6 +213,15 @@ typedef struct kapi {
 
     /* Input Polling (Direct) */
     void (*input_poll)(void);
+
+    // Scheduling
+    int (*set_nice)(int pid, int nice);  // Nice -20..19 for a process (pid 0 = caller)
+
+    // Precise time
+    uint64_t (*get_time_ns)(void);       // Nanoseconds since boot
+
+    // Real-time scheduling
+    int (*set_scheduler)(int pid, int policy, int priority);  // SCHED_*, 1..99 for RT
 } kapi_t;
 
 // TTF glyph info (returned by ttf_get_glyph)
@@ -247,6 +256,11 @@ typedef struct {
 #define WIN_EVENT_UNFOCUS    7
 #define WIN_EVENT_RESIZE     8
 
+// Scheduling policies (set_scheduler)
+#define SCHED_NORMAL 0
+#define SCHED_FIFO   1
+#define SCHED_RR     2
+
 // Mouse button masks
 #define MOUSE_BTN_LEFT   0x01
 #define MOUSE_BTN_RIGHT  0x02